@@ -0,0 +1,214 @@
+#include "admission.h"
+
+// Takes the admission state to set up and its three limits (0 for none) as
+// @param and initializes it with nothing admitted.
+void init_admission(Admission* adm, int maxConnections, int maxHandshakes,
+        int maxPerAddress) {
+    pthread_mutex_init(&adm->lock, NULL);
+    adm->maxConnections = maxConnections;
+    adm->maxHandshakes = maxHandshakes;
+    adm->maxPerAddress = maxPerAddress;
+    adm->shift = ADMISSION_MIN_SHIFT;
+    adm->addrs = maxPerAddress > 0 ?
+            calloc(1 << adm->shift, sizeof(AddrCount)) : NULL;
+    adm->noOfAddrs = 0;
+    adm->connections = 0;
+    adm->handshakes = 0;
+    adm->addresses = 0;
+    memset(adm->rejected, 0, sizeof(adm->rejected));
+    adm->backoffs = 0;
+}
+
+// Takes an AdmitVerdict as @param and returns its name, the reason sent in
+// the "BUSY:" frame and reported by the admin socket.
+const char* admit_verdict_name(int verdict) {
+    const char* names[] = {"ok", "connections", "handshakes", "address"};
+    return names[verdict];
+}
+
+// Takes the admission state and an address as @param and returns the slot
+// the address hashes to (Fibonacci hashing, the top bits of the product).
+size_t admission_home(Admission* adm, uint32_t addr) {
+    return (uint32_t) (addr * 2654435769u) >> (32 - adm->shift);
+}
+
+// Takes the admission state and an address as @param. Returns the address's
+// slot, or the free slot it would go in. Called with the lock held.
+AddrCount* admission_slot(Admission* adm, uint32_t addr) {
+    size_t mask = ((size_t) 1 << adm->shift) - 1;
+    size_t idx = admission_home(adm, addr);
+    while (adm->addrs[idx].addr != 0 && adm->addrs[idx].addr != addr) {
+        idx = (idx + 1) & mask;
+    }
+    return &adm->addrs[idx];
+}
+
+// Takes the admission state as @param and doubles its address table,
+// reinserting every address. Called with the lock held.
+void admission_grow(Admission* adm) {
+    AddrCount* old = adm->addrs;
+    size_t oldSlots = (size_t) 1 << adm->shift;
+    adm->shift += 1;
+    adm->addrs = calloc((size_t) 1 << adm->shift, sizeof(AddrCount));
+    for (size_t idx = 0; idx < oldSlots; idx++) {
+        if (old[idx].addr != 0) {
+            *admission_slot(adm, old[idx].addr) = old[idx];
+        }
+    }
+    free(old);
+}
+
+// Takes the admission state and the slot of an address with no connections
+// left as @param and frees the slot, moving back the entries after it that
+// probed past it so that no lookup stops short. Called with the lock held.
+void admission_remove(Admission* adm, AddrCount* slot) {
+    size_t mask = ((size_t) 1 << adm->shift) - 1;
+    size_t hole = slot - adm->addrs;
+    size_t idx = (hole + 1) & mask;
+    while (adm->addrs[idx].addr != 0) {
+        size_t home = admission_home(adm, adm->addrs[idx].addr);
+        // The entry may fill the hole if the hole is on its probe path
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            adm->addrs[hole] = adm->addrs[idx];
+            hole = idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+    adm->addrs[hole].addr = 0;
+    adm->addrs[hole].count = 0;
+    adm->noOfAddrs -= 1;
+}
+
+// Takes the admission state and the address of a connection just accepted
+// (0 for a local socket, which has no per address limit) as @param. Counts
+// the connection as admitted and handshaking and returns ADMIT_OK, unless
+// it would break a limit: then the refusal is counted and its reason
+// returned, and nothing else is.
+AdmitVerdict admit_connection(Admission* adm, uint32_t addr) {
+    AdmitVerdict verdict = ADMIT_OK;
+    pthread_mutex_lock(&adm->lock);
+    AddrCount* slot = NULL;
+    if (adm->addrs != NULL && addr != 0) {
+        slot = admission_slot(adm, addr);
+    }
+    if (adm->maxConnections > 0 &&
+            adm->connections >= adm->maxConnections) {
+        verdict = ADMIT_CONNECTIONS;
+    } else if (adm->maxHandshakes > 0 &&
+            adm->handshakes >= adm->maxHandshakes) {
+        verdict = ADMIT_HANDSHAKES;
+    } else if (slot != NULL &&
+            slot->count >= (uint32_t) adm->maxPerAddress) {
+        verdict = ADMIT_ADDRESS;
+    }
+    if (verdict != ADMIT_OK) {
+        adm->rejected[verdict] += 1;
+        pthread_mutex_unlock(&adm->lock);
+        return verdict;
+    }
+    if (slot != NULL && slot->addr == 0) {
+        if ((adm->noOfAddrs + 1) * 4 > ((size_t) 3 << adm->shift)) {
+            admission_grow(adm); // kept at most three quarters full
+            slot = admission_slot(adm, addr);
+        }
+        slot->addr = addr;
+        adm->noOfAddrs += 1;
+    }
+    if (slot != NULL) {
+        slot->count += 1;
+    }
+    adm->connections += 1;
+    adm->handshakes += 1;
+    adm->addresses = adm->noOfAddrs;
+    pthread_mutex_unlock(&adm->lock);
+    return ADMIT_OK;
+}
+
+// Takes the admission state as @param. Called once an admitted connection
+// has entered the chat, it no longer counts as a handshake.
+void admission_entered(Admission* adm) {
+    pthread_mutex_lock(&adm->lock);
+    adm->handshakes -= 1;
+    pthread_mutex_unlock(&adm->lock);
+}
+
+// Takes the admission state, the address an admitted connection came from
+// and whether it was still handshaking as @param. Called as the connection
+// closes, it no longer counts against any limit.
+void release_admission(Admission* adm, uint32_t addr, bool handshaking) {
+    pthread_mutex_lock(&adm->lock);
+    if (adm->addrs != NULL && addr != 0) {
+        AddrCount* slot = admission_slot(adm, addr);
+        if (slot->addr != 0 && --slot->count == 0) {
+            admission_remove(adm, slot);
+        }
+    }
+    adm->connections -= 1;
+    if (handshaking) {
+        adm->handshakes -= 1;
+    }
+    adm->addresses = adm->noOfAddrs;
+    pthread_mutex_unlock(&adm->lock);
+}
+
+// Takes a connection refused admission and the reason as @param. Sends it
+// "BUSY:reason" without waiting (a new socket's buffer takes it whole),
+// reads what it may already have sent, so that closing does not reset the
+// connection before the frame is read, and closes it.
+void reject_connection(int fd, AdmitVerdict verdict) {
+    char frame[32];
+    int len = snprintf(frame, sizeof(frame), "BUSY:%s\n",
+            admit_verdict_name(verdict));
+    send(fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    char discard[256];
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+}
+
+// Takes the errno of a failed accept as @param. Returns true if the
+// listener should carry on: the connection went away before it was taken,
+// the call was interrupted, or the process or system is out of descriptors
+// or memory for now. Any other error is a broken listener.
+bool accept_error_transient(int error) {
+    switch (error) {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+        case ECONNABORTED:
+        case EINTR:
+        case EPROTO:
+        case EPERM:
+        case ENOTCONN:
+        case ENETDOWN:
+        case ENONET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case ENETUNREACH:
+        case EOPNOTSUPP:
+        case EAGAIN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Takes the admission state, the errno of a transient accept failure and
+// the current backoff in milliseconds (0 after a successful accept) as
+// @param. Out of descriptors or memory, waits the backoff out, leaving the
+// connections queued in the listen backlog, and returns the next backoff,
+// doubled up to ACCEPT_BACKOFF_MAX. Other failures only concern the one
+// connection, they are retried at once and the backoff is returned as is.
+int accept_backoff(Admission* adm, int error, int delay) {
+    if (error != EMFILE && error != ENFILE && error != ENOBUFS &&
+            error != ENOMEM) {
+        return delay;
+    }
+    delay = delay < ACCEPT_BACKOFF_MIN ? ACCEPT_BACKOFF_MIN : delay;
+    __atomic_add_fetch(&adm->backoffs, 1, __ATOMIC_RELAXED);
+    struct timespec wait = {delay / 1000, (delay % 1000) * 1000000L};
+    nanosleep(&wait, NULL);
+    return delay * 2 > ACCEPT_BACKOFF_MAX ? ACCEPT_BACKOFF_MAX : delay * 2;
+}
@@ -0,0 +1,72 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define ADMISSION_MIN_SHIFT 6       // the address table starts at 64 slots
+#define ACCEPT_BACKOFF_MIN 1        // milliseconds, first wait out of fds
+#define ACCEPT_BACKOFF_MAX 1000     // milliseconds, the longest wait
+
+// What admission decided about a new connection. Each refusal is answered
+// with "BUSY:reason", the reasons being the names below.
+typedef enum AdmitVerdict {
+    ADMIT_OK,
+    ADMIT_CONNECTIONS,  // as many connections as CHAT_MAX_CONNECTIONS
+    ADMIT_HANDSHAKES,   // as many still entering as CHAT_MAX_HANDSHAKES
+    ADMIT_ADDRESS,      // as many from its address as CHAT_MAX_PER_IP
+    NO_OF_ADMIT_VERDICTS
+} AdmitVerdict;
+
+// Connections held from one IPv4 address, 8 bytes a slot
+typedef struct AddrCount {
+    uint32_t addr;                 // network order, 0 marks a free slot
+    uint32_t count;
+} AddrCount;
+
+// Limits checked as connections are accepted, before they cost a thread or
+// any memory. A connection counts as a handshake from its accept until its
+// client enters the chat (or its proxy starts carrying sessions), and
+// against its address until it closes. Addresses are kept in an open
+// addressing table, with linear probing and backward shift deletion, that
+// only holds those with connections open. A limit of 0 is no limit; with
+// no per address limit the table is not kept at all.
+typedef struct Admission {
+    pthread_mutex_t lock;
+    int maxConnections;
+    int maxHandshakes;
+    int maxPerAddress;
+    AddrCount* addrs;
+    size_t noOfAddrs;
+    int shift;                     // the table has 1 << shift slots
+    // Read by the admin socket without the lock
+    long connections;              // gauge: connections admitted and open
+    long handshakes;               // gauge: of those, not entered yet
+    long addresses;                // gauge: addresses with connections
+    unsigned long rejected[NO_OF_ADMIT_VERDICTS]; // by reason
+    unsigned long backoffs;        // accept failures waited out
+} Admission;
+
+void init_admission(Admission* adm, int maxConnections, int maxHandshakes,
+        int maxPerAddress);
+const char* admit_verdict_name(int verdict);
+size_t admission_home(Admission* adm, uint32_t addr);
+AddrCount* admission_slot(Admission* adm, uint32_t addr);
+void admission_grow(Admission* adm);
+void admission_remove(Admission* adm, AddrCount* slot);
+AdmitVerdict admit_connection(Admission* adm, uint32_t addr);
+void admission_entered(Admission* adm);
+void release_admission(Admission* adm, uint32_t addr, bool handshaking);
+void reject_connection(int fd, AdmitVerdict verdict);
+bool accept_error_transient(int error);
+int accept_backoff(Admission* adm, int error, int delay);
+
+#endif
@@ -0,0 +1,142 @@
+#include "affinity.h"
+
+// Takes a list of CPUs such as "2,4-7" and the list to fill as @param.
+// Stores the CPUs in the order given, ranges in ascending order. Returns
+// false, with the list left empty, if the spec is malformed, empty or names
+// a CPU beyond CPU_SETSIZE.
+bool parse_cpu_list(const char* spec, CpuList* list) {
+    list->cpus = NULL;
+    list->noOfCpus = 0;
+    CPU_ZERO(&list->all);
+    const char* pos = spec;
+    while (*pos != '\0') {
+        char* end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos) {
+            break;
+        }
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos) {
+                break;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            break;
+        }
+        list->cpus = realloc(list->cpus,
+                sizeof(int) * (list->noOfCpus + last - first + 1));
+        for (long cpu = first; cpu <= last; cpu++) {
+            list->cpus[list->noOfCpus++] = cpu;
+            CPU_SET(cpu, &list->all);
+        }
+        if (*end == '\0') {
+            return true;
+        }
+        if (*end != ',') {
+            break;
+        }
+        pos = end + 1;
+    }
+    free(list->cpus);
+    list->cpus = NULL;
+    list->noOfCpus = 0;
+    CPU_ZERO(&list->all);
+    return false;
+}
+
+// Takes a thread, a CPU list and the thread's slot in it as @param and
+// pins the thread to the slot's CPU, wrapping around the list. Returns
+// false if the list is empty or the CPU cannot be used.
+bool pin_thread_to_cpu(pthread_t thread, const CpuList* list, int slot) {
+    if (list->noOfCpus == 0) {
+        return false;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(list->cpus[slot % list->noOfCpus], &cpus);
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus) == 0;
+}
+
+// Takes a thread, a CPU list and the first slot not given to a thread of
+// its own as @param and confines the thread to the CPUs from that slot on,
+// or to every CPU of the list if there are none. Threads it starts
+// afterwards inherit that. Returns false if the list is empty or none of
+// the CPUs can be used.
+bool pin_thread_to_rest(pthread_t thread, const CpuList* list, int slot) {
+    if (list->noOfCpus == 0) {
+        return false;
+    }
+    cpu_set_t cpus = list->all;
+    if (slot < list->noOfCpus) {
+        CPU_ZERO(&cpus);
+        for (int idx = slot; idx < list->noOfCpus; idx++) {
+            CPU_SET(list->cpus[idx], &cpus);
+        }
+    }
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpus) == 0;
+}
+
+// Takes a CPU as @param. Returns the NUMA node it belongs to, as sysfs
+// shows it, else returns -1 if that is not known.
+int cpu_numa_node(int cpu) {
+    char path[CPU_PATH_MAX];
+    snprintf(path, CPU_PATH_MAX, "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent* entry;
+    while (node < 0 && (entry = readdir(dir)) != NULL) {
+        char* end;
+        if (!strncmp(entry->d_name, "node", strlen("node"))) {
+            long found = strtol(entry->d_name + strlen("node"), &end, 10);
+            node = *end == '\0' ? found : -1;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Takes a NUMA node as @param and has the calling thread, and the threads
+// it starts afterwards, allocate memory on that node while it has any to
+// spare. Returns false if the kernel refused.
+bool prefer_numa_node(int node) {
+    if (node < 0 || node >= CPU_NODE_MAX) {
+        return false;
+    }
+    unsigned long mask = 1UL << node;
+    // The kernel reads one bit fewer than the count it is given
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+            CPU_NODE_MAX + 1) == 0;
+}
+
+// Returns the current time of the monotonic clock in nanoseconds.
+long spin_clock_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Takes where the deadline of a spin is kept, 0 before it starts, and how
+// long to spin for as @param. Returns true while the waiter should poll
+// again rather than sleep, yielding the CPU in between so that a waiter
+// sharing its core does not hold back the thread it waits for. Returns
+// false once the time is up, or at once if spinNanos is 0.
+bool keep_spinning(long* until, long spinNanos) {
+    if (spinNanos <= 0) {
+        return false;
+    }
+    long now = spin_clock_nanos();
+    if (*until == 0) {
+        *until = now + spinNanos;
+    }
+    if (now >= *until) {
+        return false;
+    }
+    sched_yield();
+    return true;
+}
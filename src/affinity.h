@@ -0,0 +1,38 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define CPU_NODE_MAX 64             // NUMA nodes a preference can name
+#define CPU_PATH_MAX 64
+
+// CPUs the server's threads are placed on, in the order they were listed.
+// Threads that each want a core of their own take them in turn by slot.
+typedef struct CpuList {
+    int* cpus;
+    int noOfCpus;
+    cpu_set_t all;                 // every CPU of the list
+} CpuList;
+
+bool parse_cpu_list(const char* spec, CpuList* list);
+bool pin_thread_to_cpu(pthread_t thread, const CpuList* list, int slot);
+bool pin_thread_to_rest(pthread_t thread, const CpuList* list, int slot);
+int cpu_numa_node(int cpu);
+bool prefer_numa_node(int node);
+long spin_clock_nanos(void);
+bool keep_spinning(long* until, long spinNanos);
+
+#endif
@@ -0,0 +1,249 @@
+#include "auth.h"
+
+#define SIP_ROTL(x, bits) (((x) << (bits)) | ((x) >> (64 - (bits))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+// Takes a 128 bit key (two words), the bytes to hash and their length as
+// @param. Returns their SipHash-2-4 digest.
+uint64_t siphash(const uint64_t* key, const char* data, size_t len) {
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t whole = len - len % 8;
+    for (size_t idx = 0; idx < whole; idx += 8) {
+        uint64_t word = 0;
+        for (int byte = 7; byte >= 0; byte--) {
+            word = (word << 8) | bytes[idx + byte];
+        }
+        v3 ^= word;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= word;
+    }
+    uint64_t last = (uint64_t) len << 56;
+    for (size_t idx = whole; idx < len; idx++) {
+        last |= (uint64_t) bytes[idx] << (8 * (idx - whole));
+    }
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (int round = 0; round < 4; round++) {
+        SIP_ROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Takes the number of secrets the table is to hold as @param. Returns an
+// empty table with room for them at most half full and a fresh salt.
+AuthTable* new_auth_table(size_t count) {
+    AuthTable* table = malloc(sizeof(AuthTable));
+    table->capacity = AUTH_MIN_CAPACITY;
+    while (table->capacity < count * 2) {
+        table->capacity *= 2;
+    }
+    table->slots = calloc(table->capacity, sizeof(AuthSlot));
+    table->count = 0;
+    if (getrandom(table->salt, sizeof(table->salt), 0) !=
+            sizeof(table->salt)) {
+        // No entropy source: digests are still not the secrets themselves
+        for (int idx = 0; idx < AUTH_KEY_WORDS; idx++) {
+            table->salt[idx] = ((uint64_t) rand() << 32) ^ rand() ^
+                    (uintptr_t) table;
+        }
+    }
+    return table;
+}
+
+// Takes a table as @param and deallocates it.
+void free_auth_table(AuthTable* table) {
+    free(table->slots);
+    free(table);
+}
+
+// Takes a table, a secret and its length and where to store the digest as
+// @param. Stores the secret's salted 128 bit digest.
+void auth_digest(AuthTable* table, const char* secret, size_t len,
+        uint64_t* digest) {
+    digest[0] = siphash(table->salt, secret, len);
+    digest[1] = siphash(table->salt + 2, secret, len);
+}
+
+// Takes two digests as @param. Returns true if they are the same, taking
+// as long whichever bits differ.
+bool auth_digest_equal(const uint64_t* digest1, const uint64_t* digest2) {
+    volatile uint64_t diff = (digest1[0] ^ digest2[0]) |
+            (digest1[1] ^ digest2[1]);
+    return diff == 0;
+}
+
+// Takes a table, a secret and its length as @param and adds the secret's
+// digest, unless it is there already. The table must have room for it.
+void auth_table_add(AuthTable* table, const char* secret, size_t len) {
+    uint64_t digest[2];
+    auth_digest(table, secret, len, digest);
+    size_t mask = table->capacity - 1;
+    size_t slot = digest[0] & mask;
+    while (table->slots[slot].used) {
+        if (auth_digest_equal(table->slots[slot].digest, digest)) {
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+    memcpy(table->slots[slot].digest, digest, sizeof(digest));
+    table->slots[slot].used = true;
+    table->count += 1;
+}
+
+// Takes a table, a secret and its length as @param. Returns true if the
+// secret is one of the table's. Only digests are compared, each in
+// constant time, and the slots probed depend on the salted digest alone.
+bool auth_table_contains(AuthTable* table, const char* secret, size_t len) {
+    uint64_t digest[2];
+    auth_digest(table, secret, len, digest);
+    size_t mask = table->capacity - 1;
+    size_t slot = digest[0] & mask;
+    bool found = false;
+    while (table->slots[slot].used) {
+        found |= auth_digest_equal(table->slots[slot].digest, digest);
+        slot = (slot + 1) & mask;
+    }
+    return found;
+}
+
+// Takes the path of an authfile as @param and maps it into memory to load
+// its secrets, one per line, without copying them. Returns the table, else
+// returns NULL if the file cannot be read.
+AuthTable* load_auth_table(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t size = info.st_size;
+    const char* data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        madvise((void*) data, size, MADV_SEQUENTIAL);
+    } else {
+        close(fd);
+    }
+    size_t lines = 0;
+    for (const char* pos = data; pos != NULL && pos < data + size;
+            lines++) {
+        pos = memchr(pos, '\n', data + size - pos);
+        pos = pos != NULL ? pos + 1 : NULL;
+    }
+    AuthTable* table = new_auth_table(lines);
+    size_t start = 0;
+    while (start < size) {
+        const char* newline = memchr(data + start, '\n', size - start);
+        size_t end = newline != NULL ? (size_t) (newline - data) : size;
+        if (end > start) {
+            auth_table_add(table, data + start, end - start);
+        }
+        start = end + 1;
+    }
+    if (table->count == 0) {
+        auth_table_add(table, "", 0);
+    }
+    if (size > 0) {
+        munmap((void*) data, size);
+    }
+    return table;
+}
+
+// Takes a store and the path of the authfile as @param and loads the file
+// into it. Returns true on success, else returns false.
+bool init_auth_store(AuthStore* store, const char* path) {
+    memset(store, 0, sizeof(AuthStore));
+    pthread_mutex_init(&store->reloadLock, NULL);
+    store->path = strdup(path);
+    store->table = load_auth_table(path);
+    return store->table != NULL;
+}
+
+// Takes a store as @param and enters a lookup, counting it under the
+// current epoch. Returns the epoch, to be passed to auth_leave.
+unsigned int auth_enter(AuthStore* store) {
+    while (1) {
+        unsigned int epoch = __atomic_load_n(&store->epoch,
+                __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&store->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return epoch;
+        }
+        // A reload flipped the epoch meanwhile, its wait must not see us
+        __atomic_sub_fetch(&store->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Takes a store and the epoch auth_enter returned as @param and leaves the
+// lookup.
+void auth_leave(AuthStore* store, unsigned int epoch) {
+    __atomic_sub_fetch(&store->readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+// Takes a store and the secret a client answered AUTH: with as @param.
+// Returns true if the secret is in the table in use. Never waits on a
+// reload.
+bool auth_check(AuthStore* store, const char* secret) {
+    unsigned int epoch = auth_enter(store);
+    AuthTable* table = __atomic_load_n(&store->table, __ATOMIC_ACQUIRE);
+    bool found = auth_table_contains(table, secret, strlen(secret));
+    auth_leave(store, epoch);
+    if (!found) {
+        __atomic_add_fetch(&store->rejected, 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+// Takes a store as @param and loads its authfile again, swapping the new
+// table in for lookups that start from now on. The old table is freed once
+// the lookups that may still use it are done. Returns true on success,
+// else returns false and keeps the table in use.
+bool auth_reload(AuthStore* store) {
+    pthread_mutex_lock(&store->reloadLock);
+    AuthTable* table = load_auth_table(store->path);
+    if (table == NULL) {
+        __atomic_add_fetch(&store->reloadFailures, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&store->reloadLock);
+        return false;
+    }
+    AuthTable* old = __atomic_exchange_n(&store->table, table,
+            __ATOMIC_SEQ_CST);
+    unsigned int epoch = __atomic_add_fetch(&store->epoch, 1,
+            __ATOMIC_SEQ_CST) - 1;
+    while (__atomic_load_n(&store->readers[epoch & 1], __ATOMIC_ACQUIRE) >
+            0) {
+        sched_yield();
+    }
+    free_auth_table(old);
+    __atomic_add_fetch(&store->reloads, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&store->reloadLock);
+    return true;
+}
+
+// Takes a store as @param. Returns the number of secrets in the table in
+// use.
+size_t auth_credentials(AuthStore* store) {
+    unsigned int epoch = auth_enter(store);
+    size_t count = __atomic_load_n(&store->table, __ATOMIC_ACQUIRE)->count;
+    auth_leave(store, epoch);
+    return count;
+}
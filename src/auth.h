@@ -0,0 +1,71 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#define AUTH_MIN_CAPACITY 16
+#define AUTH_KEY_WORDS 4             // two 128 bit SipHash keys
+
+// The authfile holds one secret per line, any of which admits a client.
+// Secrets are not kept: each is stored as a 128 bit digest keyed with a
+// salt drawn afresh for every load, in an open addressed table found by
+// the digest itself. A file without any secret admits the empty one.
+typedef struct AuthSlot {
+    uint64_t digest[2];
+    bool used;
+} AuthSlot;
+
+// One load of the authfile
+typedef struct AuthTable {
+    uint64_t salt[AUTH_KEY_WORDS];
+    AuthSlot* slots;
+    size_t capacity;             // a power of two
+    size_t count;
+} AuthTable;
+
+// The table in use and what it takes to swap it. Lookups never lock: a
+// reload builds a new table, swaps the pointer in and flips the epoch,
+// then frees the old table once the lookups counted under the old epoch
+// are done.
+typedef struct AuthStore {
+    AuthTable* table;
+    unsigned int epoch;
+    long readers[2];             // lookups in flight, per epoch parity
+    pthread_mutex_t reloadLock;  // one reload at a time
+    char* path;
+    unsigned long reloads;
+    unsigned long reloadFailures;
+    unsigned long rejected;      // AUTH: answers matching no secret
+} AuthStore;
+
+uint64_t siphash(const uint64_t* key, const char* data, size_t len);
+AuthTable* new_auth_table(size_t count);
+void free_auth_table(AuthTable* table);
+void auth_digest(AuthTable* table, const char* secret, size_t len,
+        uint64_t* digest);
+bool auth_digest_equal(const uint64_t* digest1, const uint64_t* digest2);
+void auth_table_add(AuthTable* table, const char* secret, size_t len);
+bool auth_table_contains(AuthTable* table, const char* secret, size_t len);
+AuthTable* load_auth_table(const char* path);
+bool init_auth_store(AuthStore* store, const char* path);
+unsigned int auth_enter(AuthStore* store);
+void auth_leave(AuthStore* store, unsigned int epoch);
+bool auth_check(AuthStore* store, const char* secret);
+bool auth_reload(AuthStore* store);
+size_t auth_credentials(AuthStore* store);
+
+#endif
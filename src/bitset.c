@@ -0,0 +1,111 @@
+#include "bitset.h"
+
+// Takes a bitset as @param and makes it empty.
+void init_bitset(Bitset* set) {
+    set->words = NULL;
+    set->noOfWords = 0;
+}
+
+// Takes a bitset as @param and deallocates its words, leaving it empty.
+void free_bitset(Bitset* set) {
+    free(set->words);
+    init_bitset(set);
+}
+
+// Takes a bitset and a bit as @param and sets the bit, growing the set if
+// needed. Returns true if the bit was clear.
+bool bitset_set(Bitset* set, size_t bit) {
+    size_t word = bit / BITSET_WORD_BITS;
+    if (word >= set->noOfWords) {
+        size_t noOfWords = set->noOfWords ? set->noOfWords * 2 : 1;
+        while (noOfWords <= word) {
+            noOfWords *= 2;
+        }
+        set->words = realloc(set->words, sizeof(unsigned long) * noOfWords);
+        memset(set->words + set->noOfWords, 0,
+                sizeof(unsigned long) * (noOfWords - set->noOfWords));
+        set->noOfWords = noOfWords;
+    }
+    unsigned long mask = 1UL << (bit % BITSET_WORD_BITS);
+    bool wasClear = !(set->words[word] & mask);
+    set->words[word] |= mask;
+    return wasClear;
+}
+
+// Takes a bitset and a bit as @param and clears the bit. Returns true if
+// the bit was set.
+bool bitset_clear(Bitset* set, size_t bit) {
+    if (!bitset_test(set, bit)) {
+        return false;
+    }
+    set->words[bit / BITSET_WORD_BITS] &= ~(1UL << (bit % BITSET_WORD_BITS));
+    return true;
+}
+
+// Takes a bitset and a bit as @param and returns true if the bit is set.
+bool bitset_test(const Bitset* set, size_t bit) {
+    size_t word = bit / BITSET_WORD_BITS;
+    return word < set->noOfWords &&
+            (set->words[word] >> (bit % BITSET_WORD_BITS)) & 1;
+}
+
+// Takes two bitsets as @param and returns true if any bit is set in both.
+bool bitset_intersects(const Bitset* set1, const Bitset* set2) {
+    size_t noOfWords = set1->noOfWords < set2->noOfWords ?
+            set1->noOfWords : set2->noOfWords;
+    for (size_t idx = 0; idx < noOfWords; idx++) {
+        if (set1->words[idx] & set2->words[idx]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes a bitset as @param and returns true if no bit is set.
+bool bitset_is_empty(const Bitset* set) {
+    for (size_t idx = 0; idx < set->noOfWords; idx++) {
+        if (set->words[idx]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Takes a bitset as @param and clears every bit, keeping its words.
+void bitset_clear_all(Bitset* set) {
+    memset(set->words, 0, sizeof(unsigned long) * set->noOfWords);
+}
+
+// Takes a bitset to overwrite and one to copy as @param and makes the
+// first a copy of the second with words of its own.
+void bitset_copy(Bitset* dest, const Bitset* src) {
+    dest->noOfWords = src->noOfWords;
+    dest->words = malloc(sizeof(unsigned long) * (src->noOfWords + 1));
+    memcpy(dest->words, src->words, sizeof(unsigned long) * src->noOfWords);
+}
+
+// Takes an id pool as @param and makes every id available.
+void init_id_pool(IdPool* pool) {
+    pool->free = NULL;
+    pool->noOfFree = 0;
+    pool->freeCap = 0;
+    pool->next = 0;
+}
+
+// Takes an id pool as @param and returns an id not in use, the last one
+// released if any.
+int id_pool_take(IdPool* pool) {
+    if (pool->noOfFree > 0) {
+        return pool->free[--pool->noOfFree];
+    }
+    return pool->next++;
+}
+
+// Takes an id pool and an id taken from it as @param and releases the id.
+void id_pool_give(IdPool* pool, int id) {
+    if (pool->noOfFree == pool->freeCap) {
+        pool->freeCap = pool->freeCap ? pool->freeCap * 2 : 64;
+        pool->free = realloc(pool->free, sizeof(int) * pool->freeCap);
+    }
+    pool->free[pool->noOfFree++] = id;
+}
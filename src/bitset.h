@@ -0,0 +1,39 @@
+#ifndef BITSET_H
+#define BITSET_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define BITSET_WORD_BITS (sizeof(unsigned long) * 8)
+
+// Growable set of small integers, one bit each. A bit past the end is
+// clear, so sets of different lengths compare as if padded with zeros.
+typedef struct Bitset {
+    unsigned long* words;
+    size_t noOfWords;
+} Bitset;
+
+// Hands out small dense ids, reusing released ones first, so bitsets over
+// them stay as short as the largest number of ids in use at once
+typedef struct IdPool {
+    int* free;               // released ids, a stack
+    int noOfFree;
+    int freeCap;
+    int next;                // lowest id never handed out
+} IdPool;
+
+void init_bitset(Bitset* set);
+void free_bitset(Bitset* set);
+bool bitset_set(Bitset* set, size_t bit);
+bool bitset_clear(Bitset* set, size_t bit);
+bool bitset_test(const Bitset* set, size_t bit);
+bool bitset_intersects(const Bitset* set1, const Bitset* set2);
+bool bitset_is_empty(const Bitset* set);
+void bitset_clear_all(Bitset* set);
+void bitset_copy(Bitset* dest, const Bitset* src);
+void init_id_pool(IdPool* pool);
+int id_pool_take(IdPool* pool);
+void id_pool_give(IdPool* pool, int id);
+
+#endif
@@ -0,0 +1,46 @@
+#include "bufpool.h"
+
+// Takes the pool to set up, the size of its buffers and how many spare
+// buffers it keeps as @param and initializes it empty.
+void init_buffer_pool(BufferPool* pool, size_t size, size_t maxSpare) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->spare = malloc(sizeof(char*) * (maxSpare ? maxSpare : 1));
+    pool->noOfSpare = 0;
+    pool->maxSpare = maxSpare;
+    pool->size = size;
+    pool->taken = 0;
+    pool->spareBytes = 0;
+    pool->reused = 0;
+    pool->allocated = 0;
+}
+
+// Takes a pool as @param. Returns one of its spare buffers, or a newly
+// allocated one if it has none. The buffer is pool->size bytes long.
+char* buffer_pool_take(BufferPool* pool) {
+    char* buf = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->noOfSpare > 0) {
+        buf = pool->spare[--pool->noOfSpare];
+        pool->spareBytes -= pool->size;
+        pool->reused += 1;
+    } else {
+        pool->allocated += 1;
+    }
+    pool->taken += 1;
+    pthread_mutex_unlock(&pool->lock);
+    return buf != NULL ? buf : malloc(pool->size);
+}
+
+// Takes a pool and a buffer taken from it as @param. Keeps the buffer as a
+// spare, or frees it if the pool already has enough of them.
+void buffer_pool_give(BufferPool* pool, char* buf) {
+    pthread_mutex_lock(&pool->lock);
+    pool->taken -= 1;
+    if (pool->noOfSpare < pool->maxSpare) {
+        pool->spare[pool->noOfSpare++] = buf;
+        pool->spareBytes += pool->size;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buf);
+}
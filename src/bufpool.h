@@ -0,0 +1,29 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Buffers of one size shared by every connection. A connection takes one
+// when it has something to read and gives it back once it goes idle, so
+// memory follows the connections that are active rather than all of them.
+// Up to maxSpare given back buffers are kept for reuse, the rest are freed.
+typedef struct BufferPool {
+    pthread_mutex_t lock;
+    char** spare;                  // stack of buffers ready for reuse
+    size_t noOfSpare;
+    size_t maxSpare;
+    size_t size;                   // bytes in each buffer
+    // Read by the admin socket without the lock
+    long taken;                    // gauge: buffers connections are using
+    long spareBytes;               // gauge: bytes held in spare buffers
+    unsigned long reused;          // takes served from the spares
+    unsigned long allocated;       // takes that had to allocate
+} BufferPool;
+
+void init_buffer_pool(BufferPool* pool, size_t size, size_t maxSpare);
+char* buffer_pool_take(BufferPool* pool);
+void buffer_pool_give(BufferPool* pool, char* buf);
+
+#endif
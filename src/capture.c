@@ -0,0 +1,136 @@
+#include "capture.h"
+
+// Returns the current time of the monotonic clock in nanoseconds.
+unsigned long capture_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+// Takes the path of the capture file as @param, creates the file and
+// writes its header. Returns the capture, else returns NULL if the file
+// cannot be created.
+Capture* open_capture(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return NULL;
+    }
+    Capture* capture = malloc(sizeof(Capture));
+    capture->file = file;
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), file);
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->startedAt = capture->lastAt = capture_now();
+    capture->records = 0;
+    return capture;
+}
+
+// Takes a capture, the id of the connection a line came in on and the line
+// (or NULL if the connection closed) as @param and appends a record of it.
+// The secret in an "AUTH:" or "RESUME:" answer is left out.
+void capture_line(Capture* capture, unsigned long connId, const char* line) {
+    size_t len = 0;
+    if (line != NULL) {
+        len = strlen(line);
+        if (!strncmp(line, "AUTH:", strlen("AUTH:"))) {
+            len = strlen("AUTH:");
+        } else if (!strncmp(line, "RESUME:", strlen("RESUME:"))) {
+            len = strlen("RESUME:");
+        }
+    }
+    pthread_mutex_lock(&capture->lock);
+    unsigned long now = capture_now();
+    write_varint(capture->file, now - capture->lastAt);
+    write_varint(capture->file, connId);
+    write_varint(capture->file, line != NULL ? len + 1 : 0);
+    fwrite(line, 1, len, capture->file);
+    capture->lastAt = now;
+    capture->records++;
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Takes a capture (or NULL) as @param and writes out its buffered records.
+void flush_capture(Capture* capture) {
+    if (capture != NULL) {
+        pthread_mutex_lock(&capture->lock);
+        fflush(capture->file);
+        pthread_mutex_unlock(&capture->lock);
+    }
+}
+
+// Takes a file and a value as @param and writes the value as a LEB128
+// varint: seven bits per byte, low bits first, the top bit set on every
+// byte but the last.
+void write_varint(FILE* file, unsigned long value) {
+    while (value >= 0x80) {
+        fputc((value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc(value, file);
+}
+
+// Takes a file and where to store the value as @param and reads a LEB128
+// varint. Returns true on success, else returns false at the end of the
+// file or on a malformed varint.
+bool read_varint(FILE* file, unsigned long* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return false;
+        }
+        *value |= (unsigned long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes the path of a capture file and where to store the number of
+// records as @param and reads every record into memory, stopping at the
+// first incomplete one, as left by a server that was killed mid-write.
+// Returns the records, else returns NULL if the file is not a capture.
+CaptureRecord* load_capture(const char* path, size_t* noOfRecords) {
+    FILE* file = fopen(path, "rb");
+    char magic[sizeof(CAPTURE_MAGIC)] = {0};
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), file) !=
+            strlen(CAPTURE_MAGIC) || strcmp(magic, CAPTURE_MAGIC)) {
+        fclose(file);
+        return NULL;
+    }
+    size_t capacity = 1024;
+    CaptureRecord* records = malloc(sizeof(CaptureRecord) * capacity);
+    unsigned long nanos = 0;
+    unsigned long delta;
+    unsigned long lenPlusOne;
+    *noOfRecords = 0;
+    CaptureRecord rec;
+    while (read_varint(file, &delta) && read_varint(file, &rec.connId) &&
+            read_varint(file, &lenPlusOne) &&
+            lenPlusOne <= CAPTURE_MAX_LINE) {
+        nanos += delta;
+        rec.nanos = nanos;
+        rec.line = NULL;
+        rec.len = 0;
+        if (lenPlusOne > 0) {
+            rec.len = lenPlusOne - 1;
+            rec.line = malloc(rec.len + 1);
+            if (fread(rec.line, 1, rec.len, file) != rec.len) {
+                free(rec.line);
+                break;
+            }
+            rec.line[rec.len] = '\0';
+        }
+        if (*noOfRecords == capacity) {
+            capacity *= 2;
+            records = realloc(records, sizeof(CaptureRecord) * capacity);
+        }
+        records[(*noOfRecords)++] = rec;
+    }
+    fclose(file);
+    return records;
+}
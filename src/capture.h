@@ -0,0 +1,43 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+#define CAPTURE_MAX_LINE (1 << 24)
+
+// A capture file is CAPTURE_MAGIC followed by one record per line a client
+// sent: the nanoseconds since the previous record, the connection id and
+// the line's length plus one, each as a LEB128 varint, then the line
+// without its newline. A length of 0 records the connection closing.
+typedef struct CaptureRecord {
+    unsigned long nanos;      // since the capture started
+    unsigned long connId;
+    char* line;               // NULL when the connection closed
+    size_t len;
+} CaptureRecord;
+
+// Structure to store a capture being written by the client threads
+typedef struct Capture {
+    FILE* file;
+    pthread_mutex_t lock;
+    unsigned long startedAt;
+    unsigned long lastAt;     // time of the previous record
+    unsigned long records;
+} Capture;
+
+unsigned long capture_now(void);
+Capture* open_capture(const char* path);
+void capture_line(Capture* capture, unsigned long connId, const char* line);
+void flush_capture(Capture* capture);
+void write_varint(FILE* file, unsigned long value);
+bool read_varint(FILE* file, unsigned long* value);
+CaptureRecord* load_capture(const char* path, size_t* noOfRecords);
+
+#endif
@@ -0,0 +1,601 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include "parser.h"
+#include "errors.h"
+#include "transport.h"
+#include "msgformat.h"
+
+#define BENCH_READ_SIZE 65536
+#define BENCH_MAX_EVENTS 256
+#define QUIET_MILLI_SECS 1000
+#define LINE_SIZE 256
+#define LATENCY_WINDOW 64  // messages in flight in the throughput phase
+#define FORMAT_NAME "chatter42" // sender of the format scenario's frames
+#define SOAK_TICK_MILLI_SECS 100
+#define SOAK_SPEAKERS 4    // one in this many clients says something a tick
+#define SOAK_SUBSYSTEMS 4  // as listed by the server's "tracked" stats
+#define SOAK_SLACK_BYTES 1024 // growth a subsystem may show
+
+// Handshake state of a simulated chatter
+typedef enum BenchState {
+    BENCH_CONNECTING,
+    BENCH_HANDSHAKE,
+    BENCH_ENTERED
+} BenchState;
+
+// Structure to store one simulated chatter and what it has received
+typedef struct BenchClient {
+    int fd;
+    int id;
+    BenchState state;
+    int noOfOk;
+    char* inBuf;
+    size_t inLen;
+    size_t inCap;
+    char* token;
+    unsigned long lastSeq;
+    bool resumeTried;
+} BenchClient;
+
+// Structure to store the whole simulation and its counters
+typedef struct Bench {
+    int epollFd;
+    struct sockaddr_in addr;
+    char* authStr;
+    const char* caps;
+    BenchClient* clients;
+    int noOfClients;
+    int entered;
+    unsigned long frames; // lines received by all clients
+    unsigned long bytes;
+    unsigned long delivered; // MSG: lines received by entered clients
+    unsigned long target;    // deliveries the fanout scenario waits for
+    long doneAt;
+} Bench;
+
+// Returns the current time in milliseconds.
+long now_millis(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+// Prints the usage of the benchmark and terminates the program.
+void bench_usage_error(void) {
+    fprintf(stderr, "Usage: chatbench storm port authfile clients [caps]\n"
+            "       chatbench fanout port authfile clients messages [caps]\n"
+            "       chatbench soak port authfile clients seconds\n"
+            "       chatbench latency address authfile rounds\n"
+            "       chatbench format rounds\n");
+    exit(USAGE_ERR_CODE);
+}
+
+// Takes the simulation, a client and a line as @param and writes the line
+// to the client's socket. Lines are short, so a partial write means the
+// server has stopped reading and is treated as a communications error.
+void bench_send(BenchClient* client, const char* line) {
+    size_t len = strlen(line);
+    if (write(client->fd, line, len) != (ssize_t) len) {
+        communications_error();
+    }
+}
+
+// Takes the simulation and a client as @param and starts a non-blocking
+// connection for the client, announcing its capabilities once connected.
+void bench_connect(Bench* bench, BenchClient* client) {
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    client->state = BENCH_CONNECTING;
+    client->noOfOk = 0;
+    client->inLen = 0;
+    client->resumeTried = false;
+    if (connect(client->fd, (struct sockaddr*) &bench->addr,
+            sizeof(bench->addr)) < 0 && errno != EINPROGRESS) {
+        communications_error();
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = client;
+    epoll_ctl(bench->epollFd, EPOLL_CTL_ADD, client->fd, &event);
+}
+
+// Takes the simulation, a client and a line received from the server as
+// @param and moves the client through AUTH:/WHO:/NAME: or RESUME:.
+void bench_handle_line(Bench* bench, BenchClient* client, char* line) {
+    char out[LINE_SIZE];
+    if (!strncmp(line, "SEQ:", strlen("SEQ:"))) {
+        char* frame;
+        client->lastSeq = strtoul(line + strlen("SEQ:"), &frame, 10);
+        line = frame + 1;
+    }
+    if (!strncmp(line, "TOKEN:", strlen("TOKEN:"))) {
+        free(client->token);
+        client->token = strdup(line + strlen("TOKEN:"));
+    }
+    if (client->state == BENCH_ENTERED) {
+        if (!strncmp(line, "MSG:", strlen("MSG:")) &&
+                ++bench->delivered == bench->target) {
+            bench->doneAt = now_millis();
+        }
+        return;
+    }
+    if (is_match(line, "AUTH:")) {
+        if (client->token != NULL && !client->resumeTried) {
+            client->resumeTried = true;
+            snprintf(out, LINE_SIZE, "RESUME:%s:%lu\n", client->token,
+                    client->lastSeq);
+        } else {
+            snprintf(out, LINE_SIZE, "AUTH:%s\n",
+                    bench->authStr ? bench->authStr : EMPTY_STR);
+        }
+        bench_send(client, out);
+    } else if (is_match(line, "WHO:")) {
+        snprintf(out, LINE_SIZE, "NAME:bot%d\n", client->id);
+        bench_send(client, out);
+    } else if (is_match(line, "NAME_TAKEN:")) {
+        client->id += bench->noOfClients; // still held from before a drop
+    } else if (is_match(line, "OK:") && ++client->noOfOk == 2) {
+        client->state = BENCH_ENTERED;
+        bench->entered++;
+    } else if (is_match(line, "RESUMED:")) {
+        client->state = BENCH_ENTERED;
+        bench->entered++;
+    }
+}
+
+// Takes the simulation and a client as @param. Reads whatever the server
+// sent, counts the complete lines and their bytes and handles each line.
+void bench_read(Bench* bench, BenchClient* client) {
+    while (1) {
+        if (client->inCap - client->inLen < BENCH_READ_SIZE) {
+            client->inCap = client->inLen + BENCH_READ_SIZE;
+            client->inBuf = realloc(client->inBuf, client->inCap);
+        }
+        ssize_t got = read(client->fd, client->inBuf + client->inLen,
+                client->inCap - client->inLen);
+        if (got == 0) { // Server closed the connection
+            epoll_ctl(bench->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+        }
+        if (got <= 0) {
+            return;
+        }
+        client->inLen += got;
+        bench->bytes += got;
+        char* start = client->inBuf;
+        char* newline;
+        while ((newline = memchr(start, NEXT_LINE_CHAR,
+                client->inBuf + client->inLen - start)) != NULL) {
+            *newline = NULL_CHAR;
+            bench->frames++;
+            bench_handle_line(bench, client, start);
+            start = newline + 1;
+        }
+        client->inLen -= start - client->inBuf;
+        memmove(client->inBuf, start, client->inLen);
+    }
+}
+
+// Takes the simulation and the most milliseconds to wait as @param. Waits
+// for socket events and handles those that come. Returns how many came.
+int bench_poll(Bench* bench, int timeout) {
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    int ready = epoll_wait(bench->epollFd, events, BENCH_MAX_EVENTS,
+            timeout);
+    for (int idx = 0; idx < ready; idx++) {
+        BenchClient* client = events[idx].data.ptr;
+        if (client->state == BENCH_CONNECTING &&
+                (events[idx].events & EPOLLOUT)) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = client;
+            epoll_ctl(bench->epollFd, EPOLL_CTL_MOD, client->fd, &event);
+            client->state = BENCH_HANDSHAKE;
+            if (bench->caps != NULL) {
+                char out[LINE_SIZE];
+                snprintf(out, LINE_SIZE, "CAPS:%s\n", bench->caps);
+                bench_send(client, out);
+            }
+        }
+        if (events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            bench_read(bench, client);
+        }
+    }
+    return ready > 0 ? ready : 0;
+}
+
+// Takes the simulation as @param. Runs the event loop until every client
+// has entered the chat and the server has then been quiet for a second.
+void bench_run(Bench* bench) {
+    long lastActivity = now_millis();
+    while (bench->entered < bench->noOfClients ||
+            bench->delivered < bench->target ||
+            now_millis() - lastActivity < QUIET_MILLI_SECS) {
+        if (bench_poll(bench, QUIET_MILLI_SECS / 10) > 0) {
+            lastActivity = now_millis();
+        }
+    }
+}
+
+// Takes the simulation as @param, connects every client and waits for the
+// room to settle.
+void bench_connect_all(Bench* bench) {
+    bench->entered = 0;
+    for (int idx = 0; idx < bench->noOfClients; idx++) {
+        bench_connect(bench, &bench->clients[idx]);
+    }
+    bench_run(bench);
+}
+
+// Storm scenario: fills a room, then drops every connection at once and
+// reconnects them all, as after a network blip. Reports the frames and
+// bytes the server fanned out while the room recovered.
+void run_storm(Bench* bench) {
+    bench_connect_all(bench);
+    bench->frames = 0;
+    bench->bytes = 0;
+    long start = now_millis();
+    for (int idx = 0; idx < bench->noOfClients; idx++) {
+        close(bench->clients[idx].fd);
+    }
+    bench_connect_all(bench);
+    long elapsed = now_millis() - start - QUIET_MILLI_SECS;
+    printf("storm clients=%d caps=%s frames=%lu bytes=%lu "
+            "frames/client=%.1f millis=%ld\n", bench->noOfClients,
+            bench->caps ? bench->caps : "none", bench->frames, bench->bytes,
+            (double) bench->frames / bench->noOfClients, elapsed);
+}
+
+// Takes the server's admin socket path as @param and asks it for a JSON
+// snapshot. Returns the malloc'd snapshot, else returns NULL if the socket
+// cannot be reached.
+char* admin_json(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return NULL;
+    }
+    FILE* stream = fdopen(sock, "r+");
+    fprintf(stream, "json\n");
+    fflush(stream);
+    char* json = get_line(stream);
+    fclose(stream);
+    return json;
+}
+
+// Takes a JSON snapshot (or NULL) and a member's key, quotes and colon
+// included, as @param. Returns the number following the first occurrence
+// of the key, else returns 0.
+long json_number(const char* json, const char* key) {
+    const char* field = json ? strstr(json, key) : NULL;
+    return field ? strtol(field + strlen(key), NULL, 10) : 0;
+}
+
+// Takes the server's admin socket path as @param. Returns the number of
+// system calls the server has made writing broadcast frames, else returns
+// 0 if the socket cannot be reached.
+unsigned long admin_fanout_syscalls(const char* path) {
+    char* json = admin_json(path);
+    unsigned long syscalls = json_number(json, "\"fanout_syscalls\":");
+    free(json);
+    return syscalls;
+}
+
+// Fanout scenario: fills a room, then has the first client send a burst of
+// messages and waits until every client has received all of them. Reports
+// the delivery rate and, when CHAT_ADMIN_PATH points at the server's admin
+// socket, the system calls the server made per delivered message.
+void run_fanout(Bench* bench, int messages) {
+    bench_connect_all(bench);
+    const char* adminPath = getenv("CHAT_ADMIN_PATH");
+    unsigned long syscallsBefore = adminPath ?
+            admin_fanout_syscalls(adminPath) : 0;
+    bench->delivered = 0;
+    bench->target = (unsigned long) messages * bench->noOfClients;
+    long start = now_millis();
+    char out[LINE_SIZE];
+    for (int idx = 0; idx < messages; idx++) {
+        snprintf(out, LINE_SIZE, "SAY:message %d\n", idx);
+        bench_send(&bench->clients[0], out);
+    }
+    bench_run(bench);
+    long elapsed = bench->doneAt - start;
+    printf("fanout clients=%d caps=%s messages=%d delivered=%lu millis=%ld "
+            "msgs/s=%.0f", bench->noOfClients,
+            bench->caps ? bench->caps : "none", messages, bench->delivered,
+            elapsed, elapsed ? bench->delivered * 1000.0 / elapsed : 0.0);
+    if (adminPath != NULL) {
+        unsigned long syscalls = admin_fanout_syscalls(adminPath) -
+                syscallsBefore;
+        printf(" syscalls/msg=%.3f",
+                (double) syscalls / bench->delivered);
+    }
+    printf("\n");
+}
+
+// Takes the simulation and the number of the tick as @param. Has a share
+// of the entered clients say something, one ask for the list, one send a
+// line that is not a command and one drop its connection and enter again.
+void soak_tick(Bench* bench, int tick) {
+    char out[LINE_SIZE];
+    const char* others[] = {"LIST:\n", "BOGUS:soak\n", "no command\n",
+            "LEAVE:not yet\n"};
+    for (int idx = 0; idx < bench->noOfClients; idx++) {
+        BenchClient* client = &bench->clients[idx];
+        if (client->state != BENCH_ENTERED) {
+            continue;
+        }
+        int turn = (idx + tick) % bench->noOfClients;
+        if (turn == 0) {
+            close(client->fd);
+            bench->entered--;
+            bench_connect(bench, client);
+        } else if (turn <= 4) {
+            bench_send(client, others[turn - 1]);
+        } else if ((idx + tick) % SOAK_SPEAKERS == 0) {
+            snprintf(out, LINE_SIZE, "SAY:soak %d from %d\n", tick, idx);
+            bench_send(client, out);
+        }
+    }
+}
+
+// Soak scenario: fills a room and keeps it under steady load for a number
+// of seconds, see soak_tick. Once a second takes the heap use the server
+// tracks per subsystem from its admin socket, CHAT_ADMIN_PATH. The first
+// quarter of the run warms up; a subsystem that holds more than
+// SOAK_SLACK_BYTES over its highest sample of the second quarter at every
+// sample of the last quarter has grown. Returns 0 if none has, else 1.
+int run_soak(Bench* bench, int seconds) {
+    const char* adminPath = getenv("CHAT_ADMIN_PATH");
+    const char* names[] = {"parser", "roster", "fanout", "handshake"};
+    if (adminPath == NULL || seconds < 8) {
+        bench_usage_error();
+    }
+    bench_connect_all(bench);
+    long (*samples)[SOAK_SUBSYSTEMS] = calloc(seconds,
+            sizeof(long[SOAK_SUBSYSTEMS]));
+    long start = now_millis();
+    long nextTick = start;
+    int tick = 0;
+    for (int sample = 0; sample < seconds; ) {
+        long now = now_millis();
+        if (now >= nextTick) {
+            soak_tick(bench, tick++);
+            nextTick += SOAK_TICK_MILLI_SECS;
+        }
+        if (now - start >= (sample + 1) * 1000L) {
+            char* json = admin_json(adminPath);
+            if (json == NULL) {
+                communications_error();
+            }
+            for (int sub = 0; sub < SOAK_SUBSYSTEMS; sub++) {
+                char key[LINE_SIZE];
+                snprintf(key, LINE_SIZE, "\"%s\":{\"live\":", names[sub]);
+                samples[sample][sub] = json_number(json, key);
+            }
+            free(json);
+            sample++;
+        }
+        bench_poll(bench, SOAK_TICK_MILLI_SECS / 10);
+    }
+    int quarter = seconds / 4;
+    bool grew = false;
+    for (int sub = 0; sub < SOAK_SUBSYSTEMS; sub++) {
+        long early = 0;
+        long late = LONG_MAX;
+        for (int idx = quarter; idx < 2 * quarter; idx++) {
+            early = samples[idx][sub] > early ? samples[idx][sub] : early;
+        }
+        for (int idx = seconds - quarter; idx < seconds; idx++) {
+            late = samples[idx][sub] < late ? samples[idx][sub] : late;
+        }
+        bool subGrew = late > early + SOAK_SLACK_BYTES;
+        printf("soak %s early=%ld late=%ld%s\n", names[sub], early, late,
+                subGrew ? " GREW" : "");
+        grew |= subGrew;
+    }
+    printf("soak clients=%d seconds=%d ticks=%d delivered=%lu result=%s\n",
+            bench->noOfClients, seconds, tick, bench->delivered,
+            grew ? "grew" : "steady");
+    free(samples);
+    return grew;
+}
+
+// Returns the current time of the monotonic clock in nanoseconds.
+long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Takes two pointers to round trip times as @param and compares them, for
+// sorting.
+int compare_nanos(const void* nanos1, const void* nanos2) {
+    long diff = *(const long*) nanos1 - *(const long*) nanos2;
+    return (diff > 0) - (diff < 0);
+}
+
+// Takes the stream from the server as @param and reads lines until the
+// server echoes one of our own messages. Returns the line, else generates
+// a communications error if the server hangs up. The returned value should
+// be freed later.
+char* latency_read_echo(FILE* rdEnd) {
+    char* line;
+    while ((line = get_line(rdEnd)) != NULL) {
+        if (!strncmp(line, "MSG:bench:", strlen("MSG:bench:"))) {
+            return line;
+        }
+        free(line);
+    }
+    communications_error();
+    return NULL;
+}
+
+// Latency scenario: a single chatter enters over the given transport (a
+// TCP port, a Unix socket path or "shm:" and a path), then times rounds of
+// one message echoed back to it by the server and reports the distribution
+// of the round trips, from the median to the worst, followed by the rate
+// of echoes with LATENCY_WINDOW messages kept in flight. Run with
+// CHAT_RATE_LIMIT=0 on the server, and again with its low-latency settings
+// to compare.
+void run_latency(const char* address, char* authStr, int rounds) {
+    FILE* rdEnd;
+    FILE* wrEnd;
+    if (!open_server_streams(address, &rdEnd, &wrEnd)) {
+        communications_error();
+    }
+    char* line;
+    bool named = false;
+    while ((line = get_line(rdEnd)) != NULL &&
+            !(named && is_match(line, "OK:"))) {
+        if (is_match(line, "AUTH:")) {
+            fprintf(wrEnd, "AUTH:%s\n", authStr);
+        } else if (is_match(line, "WHO:")) {
+            fprintf(wrEnd, "NAME:bench\n");
+            named = true;
+        } else if (is_match(line, "NAME_TAKEN:")) {
+            communications_error();
+        }
+        fflush(wrEnd);
+        free(line);
+    }
+    if (line == NULL) {
+        communications_error();
+    }
+    free(line);
+
+    long* nanos = malloc(sizeof(long) * rounds);
+    for (int idx = 0; idx < rounds; idx++) {
+        long start = now_nanos();
+        fprintf(wrEnd, "SAY:%d\n", idx);
+        fflush(wrEnd);
+        free(latency_read_echo(rdEnd));
+        nanos[idx] = now_nanos() - start;
+    }
+    qsort(nanos, rounds, sizeof(long), compare_nanos);
+    printf("latency address=%s rounds=%d p50_us=%.1f p90_us=%.1f "
+            "p99_us=%.1f p999_us=%.1f max_us=%.1f\n", address, rounds,
+            nanos[rounds / 2] / 1000.0, nanos[(int) (rounds * 0.9)] / 1000.0,
+            nanos[(int) (rounds * 0.99)] / 1000.0,
+            nanos[(int) (rounds * 0.999)] / 1000.0,
+            nanos[rounds - 1] / 1000.0);
+
+    long start = now_nanos();
+    int sent = 0;
+    for (int received = 0; received < rounds; received++) {
+        while (sent < rounds && sent - received < LATENCY_WINDOW) {
+            fprintf(wrEnd, "SAY:%d\n", sent++);
+        }
+        fflush(wrEnd);
+        free(latency_read_echo(rdEnd));
+    }
+    long elapsed = now_nanos() - start;
+    printf("throughput address=%s messages=%d msgs/s=%.0f\n", address,
+            rounds, rounds * 1e9 / elapsed);
+    free(nanos);
+    fclose(wrEnd);
+    fclose(rdEnd);
+}
+
+// Takes a name and a message as @param and returns the "MSG:name:message"
+// frame built as the server used to: measuring every string and sprintf-ing
+// them on each message.
+char* sprintf_msg_frame(const char* name, const char* msg) {
+    int msgLen = strlen("MSG::\n") + strlen(name) + strlen(msg);
+    char* format = malloc(sizeof(char) * msgLen + 1);
+    sprintf(format, "MSG:%s:%s\n", name, msg);
+    return format;
+}
+
+// Format scenario: times building "MSG:" frames with sprintf as the server
+// used to, against gathering them from an interned "MSG:name:" prefix as
+// it does now, for a few message lengths. Reports the nanoseconds each
+// frame took either way.
+void run_format(int rounds) {
+    size_t lengths[] = {16, 128, 1024};
+    char prefix[LINE_SIZE];
+    size_t prefixLen = build_msg_prefix(prefix, FORMAT_NAME,
+            strlen(FORMAT_NAME));
+    volatile char sink = 0; // keeps the frames from being optimized out
+    for (size_t idx = 0; idx < sizeof(lengths) / sizeof(size_t); idx++) {
+        char* text = malloc(lengths[idx] + 1);
+        memset(text, 'x', lengths[idx]);
+        text[lengths[idx]] = NULL_CHAR;
+        long start = now_nanos();
+        for (int round = 0; round < rounds; round++) {
+            char* frame = sprintf_msg_frame(FORMAT_NAME, text);
+            sink ^= frame[prefixLen];
+            free(frame);
+        }
+        long sprintfNanos = now_nanos() - start;
+        start = now_nanos();
+        for (int round = 0; round < rounds; round++) {
+            size_t len;
+            char* frame = msg_frame(prefix, prefixLen, text, &len);
+            sink ^= frame[prefixLen];
+            free(frame);
+        }
+        long internedNanos = now_nanos() - start;
+        printf("format text=%zu rounds=%d sprintf ns/frame=%.1f "
+                "interned ns/frame=%.1f\n", lengths[idx], rounds,
+                (double) sprintfNanos / rounds,
+                (double) internedNanos / rounds);
+        free(text);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && is_match(argv[1], "format") && atoi(argv[2]) > 0) {
+        run_format(atoi(argv[2]));
+        return 0;
+    }
+    if (argc == 5 && is_match(argv[1], "latency") && atoi(argv[4]) > 0) {
+        run_latency(argv[2], get_auth_string(argv[3]), atoi(argv[4]));
+        return 0;
+    }
+    if (argc < 2) {
+        bench_usage_error();
+    }
+    bool fanout = is_match(argv[1], "fanout");
+    bool soak = is_match(argv[1], "soak");
+    if (argc < 5 + (fanout || soak) || argc > 6 + fanout ||
+            (!fanout && !soak && !is_match(argv[1], "storm"))) {
+        bench_usage_error();
+    }
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons(atoi(argv[2]));
+    bench.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bench.authStr = get_auth_string(argv[3]);
+    bench.noOfClients = atoi(argv[4]);
+    bench.caps = argc == 6 + fanout && !soak ? argv[5 + fanout] : NULL;
+    if (bench.noOfClients <= 0) {
+        bench_usage_error();
+    }
+    bench.clients = calloc(bench.noOfClients, sizeof(BenchClient));
+    for (int idx = 0; idx < bench.noOfClients; idx++) {
+        bench.clients[idx].id = idx;
+    }
+    bench.epollFd = epoll_create1(0);
+    if (soak) {
+        return run_soak(&bench, atoi(argv[5]));
+    }
+    if (fanout) {
+        run_fanout(&bench, atoi(argv[5]));
+    } else {
+        run_storm(&bench);
+    }
+    return 0;
+}
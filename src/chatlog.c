@@ -0,0 +1,413 @@
+#include "chatlog.h"
+
+// Takes the directory to keep the log in, the size a segment is closed at
+// and how many segments to keep as @param. Loads the segments already
+// there and starts a new one for the writer thread, which the caller
+// starts. Returns the log, else returns NULL if the directory is unusable.
+ChatLog* open_chat_log(const char* dir, off_t segmentSize, int maxSegments) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    DIR* dirStream = opendir(dir);
+    if (dirStream == NULL) {
+        return NULL;
+    }
+    ChatLog* log = calloc(1, sizeof(ChatLog));
+    init_mpsc_queue(&log->queue);
+    pthread_mutex_init(&log->lock, NULL);
+    log->dir = strdup(dir);
+    log->segmentSize = segmentSize;
+    log->maxSegments = maxSegments > 0 ? maxSegments : 1;
+    log->logFd = log->idxFd = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dirStream)) != NULL) {
+        unsigned long id;
+        char ext[8];
+        if (sscanf(entry->d_name, "%lu.%7s", &id, ext) == 2 &&
+                strcmp(ext, "idx") == 0) {
+            chatlog_load_segment(log, id);
+        }
+    }
+    closedir(dirStream);
+    qsort(log->segments, log->noOfSegments, sizeof(LogSegment),
+            compare_log_segments);
+    unsigned long nextId = 1;
+    if (log->noOfSegments > 0) {
+        LogSegment* newest = &log->segments[log->noOfSegments - 1];
+        nextId = newest->id + 1;
+        for (int idx = 0; idx < log->noOfSegments; idx++) {
+            LogSegment* segment = &log->segments[idx];
+            if (segment->noOfMarks > 0 &&
+                    segment->marks[segment->noOfMarks - 1].at > log->lastAt) {
+                log->lastAt = segment->marks[segment->noOfMarks - 1].at;
+            }
+        }
+    }
+    if (!chatlog_open_segment(log, nextId)) {
+        return NULL;
+    }
+    return log;
+}
+
+// Takes the log, a segment's id, the extension of one of its files and
+// where to store the file's path as @param, with room for
+// CHATLOG_PATH_MAX bytes, and stores the path.
+void chatlog_path(ChatLog* log, unsigned long id, const char* ext,
+        char* path) {
+    snprintf(path, CHATLOG_PATH_MAX, "%s/%012lu.%s", log->dir, id, ext);
+}
+
+// Takes the log and the id of a segment a previous run left as @param and
+// adds it to the log with its index. A message the run was cut off in the
+// middle of is left out. Returns true on success, else returns false.
+bool chatlog_load_segment(ChatLog* log, unsigned long id) {
+    char path[CHATLOG_PATH_MAX];
+    chatlog_path(log, id, "log", path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    char tail[4096];
+    off_t size = info.st_size;
+    off_t from = size > (off_t) sizeof(tail) ? size - sizeof(tail) : 0;
+    ssize_t got = pread(fd, tail, size - from, from);
+    close(fd);
+    while (got > 0 && tail[got - 1] != '\n') {
+        got--;
+    }
+    if (got > 0 || from == 0) {
+        size = from + (got > 0 ? got : 0);
+    }
+    chatlog_path(log, id, "idx", path);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    log->segments = realloc(log->segments,
+            sizeof(LogSegment) * (log->noOfSegments + 1));
+    LogSegment* segment = &log->segments[log->noOfSegments++];
+    memset(segment, 0, sizeof(LogSegment));
+    segment->id = id;
+    segment->size = size;
+    segment->marksCap = info.st_size / sizeof(LogMark) + CHATLOG_MIN_MARKS;
+    segment->marks = malloc(sizeof(LogMark) * segment->marksCap);
+    size_t done = 0;
+    size_t want = info.st_size - info.st_size % sizeof(LogMark);
+    while (done < want) {
+        got = read(fd, (char*) segment->marks + done, want - done);
+        if (got <= 0) {
+            break;
+        }
+        done += got;
+    }
+    close(fd);
+    segment->noOfMarks = done / sizeof(LogMark);
+    while (segment->noOfMarks > 0 &&
+            segment->marks[segment->noOfMarks - 1].offset >= size) {
+        segment->noOfMarks--;
+    }
+    log->bytes += size;
+    log->noOfFiles += 1;
+    return true;
+}
+
+// Comparison function for qsort, takes two segments as @param. Returns
+// their order by id.
+int compare_log_segments(const void* seg1, const void* seg2) {
+    unsigned long id1 = ((const LogSegment*) seg1)->id;
+    unsigned long id2 = ((const LogSegment*) seg2)->id;
+    return (id1 > id2) - (id1 < id2);
+}
+
+// Takes the log and the id of a new segment as @param. Creates the
+// segment's files for the writer to append to and deletes the oldest
+// segments beyond the limit. Returns true on success, else returns false
+// and leaves the writer on the segment it had.
+bool chatlog_open_segment(ChatLog* log, unsigned long id) {
+    char path[CHATLOG_PATH_MAX];
+    chatlog_path(log, id, "log", path);
+    int logFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+            O_CLOEXEC, 0644);
+    chatlog_path(log, id, "idx", path);
+    int idxFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+            O_CLOEXEC, 0644);
+    if (logFd < 0 || idxFd < 0) {
+        if (logFd >= 0) {
+            close(logFd);
+        }
+        if (idxFd >= 0) {
+            close(idxFd);
+        }
+        return false;
+    }
+    if (log->logFd >= 0) {
+        close(log->logFd);
+        close(log->idxFd);
+    }
+    log->logFd = logFd;
+    log->idxFd = idxFd;
+    pthread_mutex_lock(&log->lock);
+    log->segments = realloc(log->segments,
+            sizeof(LogSegment) * (log->noOfSegments + 1));
+    LogSegment* segment = &log->segments[log->noOfSegments++];
+    memset(segment, 0, sizeof(LogSegment));
+    segment->id = id;
+    segment->marksCap = CHATLOG_MIN_MARKS;
+    segment->marks = malloc(sizeof(LogMark) * segment->marksCap);
+    log->noOfFiles += 1;
+    while (log->noOfSegments > log->maxSegments) {
+        // Lookups opened what they read, so the files can go at once
+        LogSegment* oldest = &log->segments[0];
+        chatlog_path(log, oldest->id, "log", path);
+        unlink(path);
+        chatlog_path(log, oldest->id, "idx", path);
+        unlink(path);
+        log->bytes -= oldest->size;
+        log->noOfFiles -= 1;
+        free(oldest->marks);
+        memmove(oldest, oldest + 1,
+                sizeof(LogSegment) * (log->noOfSegments - 1));
+        log->noOfSegments--;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return true;
+}
+
+// Takes the log and the "MSG:" frame of a message a client said as @param
+// and queues the message for the writer thread. Never blocks.
+void chatlog_append(ChatLog* log, const char* frame) {
+    size_t len = strlen(frame);
+    LogItem* item = malloc(sizeof(LogItem) + len + 1);
+    item->at = time(NULL);
+    item->len = len;
+    memcpy(item->data, frame, len + 1);
+    mpsc_push(&log->queue, &item->node);
+}
+
+// Writer thread function, takes a pointer to the ChatLog struct as @param.
+// Sleeps until messages are queued, then appends them to the newest
+// segment, many per system call, marking in the index the first message of
+// every second and of every segment, and one message every
+// CHATLOG_MARK_BYTES in between. Moves on to a new segment before one would
+// grow past the segment size.
+void* chatlog_writer(void* arg) {
+    ChatLog* log = arg;
+    LogItem* items[CHATLOG_IOV_MAX];
+    LogMark marks[CHATLOG_IOV_MAX];
+    while (1) {
+        MpscNode* node = mpsc_pop_wait(&log->queue);
+        // Only this thread grows the newest segment, no lock to read it
+        LogSegment* newest = &log->segments[log->noOfSegments - 1];
+        off_t size = newest->size;
+        int count = 0;
+        int noOfMarks = 0;
+        while (node != NULL) {
+            LogItem* item = (LogItem*) node;
+            if (size > 0 && size + (off_t) item->len > log->segmentSize) {
+                chatlog_write_batch(log, items, count, marks, noOfMarks);
+                count = noOfMarks = 0;
+                newest = &log->segments[log->noOfSegments - 1];
+                if (chatlog_open_segment(log, newest->id + 1)) {
+                    newest = &log->segments[log->noOfSegments - 1];
+                }
+                size = newest->size;
+            }
+            // Marks stay ascending even if the clock is set back
+            time_t at = item->at > log->lastAt ? item->at : log->lastAt;
+            if (size == 0 || at > log->lastAt ||
+                    size - log->lastOffset >= CHATLOG_MARK_BYTES) {
+                marks[noOfMarks].at = at;
+                marks[noOfMarks++].offset = size;
+                log->lastAt = at;
+                log->lastOffset = size;
+            }
+            items[count++] = item;
+            size += item->len;
+            if (count == CHATLOG_IOV_MAX) {
+                chatlog_write_batch(log, items, count, marks, noOfMarks);
+                count = noOfMarks = 0;
+            }
+            node = mpsc_pop(&log->queue);
+        }
+        chatlog_write_batch(log, items, count, marks, noOfMarks);
+    }
+    return NULL;
+}
+
+// Takes the log, queued messages and their count, and the index entries
+// for them and their count as @param. Appends the messages to the newest
+// segment, then the entries to its index, and only then lets lookups see
+// them. A batch the disk does not take is cut off the file again and
+// dropped. Frees the messages.
+void chatlog_write_batch(ChatLog* log, LogItem** items, int count,
+        LogMark* marks, int noOfMarks) {
+    struct iovec iov[CHATLOG_IOV_MAX];
+    size_t total = 0;
+    for (int idx = 0; idx < count; idx++) {
+        iov[idx].iov_base = items[idx]->data;
+        iov[idx].iov_len = items[idx]->len;
+        total += items[idx]->len;
+    }
+    LogSegment* newest = &log->segments[log->noOfSegments - 1];
+    size_t written = 0;
+    int first = 0;
+    while (first < count) {
+        ssize_t got = writev(log->logFd, iov + first, count - first);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            break;
+        }
+        written += got;
+        while (first < count && (size_t) got >= iov[first].iov_len) {
+            got -= iov[first++].iov_len;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char*) iov[first].iov_base + got;
+            iov[first].iov_len -= got;
+        }
+    }
+    if (written < total) {
+        ftruncate(log->logFd, newest->size);
+        noOfMarks = 0;
+        total = 0;
+    } else if (noOfMarks > 0) {
+        // A lost entry only costs the next run the second it marks
+        write(log->idxFd, marks, sizeof(LogMark) * noOfMarks);
+    }
+    pthread_mutex_lock(&log->lock);
+    newest = &log->segments[log->noOfSegments - 1];
+    chatlog_add_marks(newest, marks, noOfMarks);
+    newest->size += total;
+    log->bytes += total;
+    pthread_mutex_unlock(&log->lock);
+    for (int idx = 0; idx < count; idx++) {
+        free(items[idx]);
+    }
+}
+
+// Takes a segment, new index entries and their count as @param and adds
+// the entries to the segment's. Caller holds the log's lock.
+void chatlog_add_marks(LogSegment* segment, LogMark* marks, int noOfMarks) {
+    if (segment->noOfMarks + noOfMarks > segment->marksCap) {
+        while (segment->noOfMarks + noOfMarks > segment->marksCap) {
+            segment->marksCap *= 2;
+        }
+        segment->marks = realloc(segment->marks,
+                sizeof(LogMark) * segment->marksCap);
+    }
+    memcpy(segment->marks + segment->noOfMarks, marks,
+            sizeof(LogMark) * noOfMarks);
+    segment->noOfMarks += noOfMarks;
+}
+
+// Takes a segment and a time as @param. Returns the first of its index
+// entries at or after the time, or the number of entries if none is.
+size_t chatlog_first_mark(LogSegment* segment, time_t since) {
+    size_t low = 0;
+    size_t high = segment->noOfMarks;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (segment->marks[mid].at < since) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Takes the log, a time and where to store the number of ranges found as
+// @param. Finds, through the segments' indexes, where the messages said
+// since the time start. Returns the ranges of the segments that hold
+// them, oldest first, each cut into frames of about CHATLOG_CHUNK bytes
+// where an index entry points. The ranges' files are opened under the lock,
+// so they stay readable even if their segments are deleted meanwhile.
+LogRange* chatlog_find(ChatLog* log, time_t since, int* noOfRanges) {
+    pthread_mutex_lock(&log->lock);
+    LogRange* ranges = calloc(log->noOfSegments + 1, sizeof(LogRange));
+    int count = 0;
+    for (int idx = 0; idx < log->noOfSegments; idx++) {
+        LogSegment* segment = &log->segments[idx];
+        size_t first = chatlog_first_mark(segment, since);
+        if (first == segment->noOfMarks ||
+                segment->marks[first].offset >= segment->size) {
+            continue;
+        }
+        char path[CHATLOG_PATH_MAX];
+        chatlog_path(log, segment->id, "log", path);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        LogRange* range = &ranges[count++];
+        range->fd = fd;
+        range->cuts = malloc(sizeof(off_t) *
+                (segment->noOfMarks - first + 1));
+        range->cuts[0] = segment->marks[first].offset;
+        range->noOfCuts = 1;
+        for (size_t mark = first + 1; mark < segment->noOfMarks; mark++) {
+            off_t offset = segment->marks[mark].offset;
+            if (offset - range->cuts[range->noOfCuts - 1] >= CHATLOG_CHUNK &&
+                    offset < segment->size) {
+                range->cuts[range->noOfCuts++] = offset;
+            }
+        }
+        range->cuts[range->noOfCuts++] = segment->size;
+    }
+    pthread_mutex_unlock(&log->lock);
+    __atomic_add_fetch(&log->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&log->sentBytes, log_ranges_bytes(ranges, count),
+            __ATOMIC_RELAXED);
+    *noOfRanges = count;
+    return ranges;
+}
+
+// Takes ranges of the log and their count as @param. Returns how many
+// bytes they span.
+off_t log_ranges_bytes(LogRange* ranges, int noOfRanges) {
+    off_t bytes = 0;
+    for (int idx = 0; idx < noOfRanges; idx++) {
+        bytes += ranges[idx].cuts[ranges[idx].noOfCuts - 1] -
+                ranges[idx].cuts[0];
+    }
+    return bytes;
+}
+
+// Takes a range of the log and a stream as @param. Reads the range a chunk
+// at a time and writes it to the stream, for clients whose output does not
+// go straight to a socket. Closes the range's file.
+void chatlog_copy_range(LogRange* range, FILE* out) {
+    char* buffer = malloc(CHATLOG_CHUNK);
+    off_t offset = range->cuts[0];
+    off_t end = range->cuts[range->noOfCuts - 1];
+    while (offset < end) {
+        size_t want = end - offset < CHATLOG_CHUNK ? end - offset :
+                CHATLOG_CHUNK;
+        ssize_t got = pread(range->fd, buffer, want, offset);
+        if (got <= 0) {
+            break;
+        }
+        fwrite(buffer, 1, got, out);
+        offset += got;
+    }
+    fflush(out);
+    free(buffer);
+    close(range->fd);
+}
+
+// Takes ranges of the log and their count as @param and deallocates them.
+// Their files are left open, for whoever sends them to close.
+void free_log_ranges(LogRange* ranges, int noOfRanges) {
+    for (int idx = 0; idx < noOfRanges; idx++) {
+        free(ranges[idx].cuts);
+    }
+    free(ranges);
+}
@@ -0,0 +1,106 @@
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "mpscqueue.h"
+
+#define CHATLOG_IOV_MAX 64          // messages written per system call
+#define CHATLOG_MARK_BYTES (32 << 10) // most bytes between index entries
+#define CHATLOG_CHUNK (64 << 10)    // bytes of history sent per file frame
+#define CHATLOG_MIN_MARKS 64
+#define CHATLOG_PATH_MAX 4096
+
+// A chat message waiting for the writer thread, already in the "MSG:"
+// format clients are sent
+typedef struct LogItem {
+    MpscNode node;
+    time_t at;
+    size_t len;
+    char data[];
+} LogItem;
+
+// Entry of a segment's sparse index: where the first message said in a
+// second starts, or one CHATLOG_MARK_BYTES on from the entry before. Stored
+// as is in the segment's ".idx" file.
+typedef struct LogMark {
+    int64_t at;
+    int64_t offset;
+} LogMark;
+
+// One file of the log, "<id>.log", and its index, "<id>.idx". Only the
+// writer appends to the newest segment; size and marks cover what it has
+// written out, so a range found from them can be read at once.
+typedef struct LogSegment {
+    unsigned long id;
+    off_t size;
+    LogMark* marks;                // ascending in time and offset
+    size_t noOfMarks;
+    size_t marksCap;
+} LogSegment;
+
+// Every message said, appended to a directory of segment files by a
+// thread of its own and handed over to it through a lock-free queue. A
+// segment is closed once it would grow past segmentSize and the oldest are
+// deleted beyond maxSegments. The lock guards the segment list, which
+// lookups take a snapshot of before they read the files themselves.
+typedef struct ChatLog {
+    MpscQueue queue;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    char* dir;
+    off_t segmentSize;
+    int maxSegments;
+    LogSegment* segments;          // oldest first, the newest is written to
+    int noOfSegments;
+    int logFd;                     // the newest segment, writer only
+    int idxFd;
+    time_t lastAt;                 // second of the newest mark
+    off_t lastOffset;              // and where it is in the newest segment
+    // Read by the admin socket without the lock
+    long bytes;                    // gauge: size of all segments
+    long noOfFiles;                // gauge: segments on disk
+    unsigned long requests;        // HISTORY: commands served
+    unsigned long sentBytes;       // history sent to clients
+} ChatLog;
+
+// Part of a segment to send: an open descriptor of its file and the
+// offsets cutting the part into frames that end on message boundaries
+typedef struct LogRange {
+    int fd;
+    off_t* cuts;
+    int noOfCuts;
+} LogRange;
+
+ChatLog* open_chat_log(const char* dir, off_t segmentSize, int maxSegments);
+void chatlog_path(ChatLog* log, unsigned long id, const char* ext,
+        char* path);
+bool chatlog_load_segment(ChatLog* log, unsigned long id);
+int compare_log_segments(const void* seg1, const void* seg2);
+bool chatlog_open_segment(ChatLog* log, unsigned long id);
+void chatlog_append(ChatLog* log, const char* frame);
+void* chatlog_writer(void* arg);
+void chatlog_write_batch(ChatLog* log, LogItem** items, int count,
+        LogMark* marks, int noOfMarks);
+void chatlog_add_marks(LogSegment* segment, LogMark* marks, int noOfMarks);
+size_t chatlog_first_mark(LogSegment* segment, time_t since);
+LogRange* chatlog_find(ChatLog* log, time_t since, int* noOfRanges);
+off_t log_ranges_bytes(LogRange* ranges, int noOfRanges);
+void chatlog_copy_range(LogRange* range, FILE* out);
+void free_log_ranges(LogRange* ranges, int noOfRanges);
+
+#endif
@@ -0,0 +1,723 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include "parser.h"
+#include "errors.h"
+#include "config.h"
+#include "transport.h"
+#include "mux.h"
+#include "auth.h"
+
+#define PROXY_READ_SIZE 65536       // read at a time from an upstream
+#define PROXY_USER_READ_SIZE 512    // and from a user
+#define PROXY_MAX_EVENTS 256
+#define PROXY_MAX_OUTPUT (4 << 20)  // output a slow user may fall behind by
+#define PROXY_DEFAULT_UPSTREAMS 2
+#define PROXY_DEFAULT_PORT "0"
+
+// What a connection of the proxy is
+typedef enum ProxyConnKind {
+    PROXY_LISTENER,
+    PROXY_UPSTREAM,
+    PROXY_USER
+} ProxyConnKind;
+
+// Where a user is in the handshake the proxy does on the server's behalf
+typedef enum UserState {
+    USER_AUTH,      // sent AUTH:, waiting for the answer
+    USER_NAME,      // sent WHO:, names go to the server
+    USER_CHAT,      // the server said OK:, lines go to the server
+    USER_LEAVING,   // sent LEAVE:, closed once the server confirms
+    USER_GONE       // disconnected, its session id awaits "CLOSED:"
+} UserState;
+
+// Structure to store one non-blocking connection, user or upstream, with
+// the input not yet split into lines and the output the socket has not
+// taken yet
+typedef struct ProxyConn {
+    ProxyConnKind kind;
+    int fd;
+    char* in;
+    size_t inLen;
+    size_t inCap;
+    char* out;
+    size_t outStart;
+    size_t outLen;
+    size_t outCap;
+    bool waitingOut;          // registered for EPOLLOUT
+} ProxyConn;
+
+// Structure to store one end user, carried as a session of an upstream
+typedef struct ProxyUser {
+    ProxyConn conn;           // must stay the first member
+    UserState state;
+    unsigned int sid;
+    struct Upstream* upstream;
+    char* caps;               // "CAPS:" lines sent ahead of AUTH:
+    bool resumeTried;
+    bool opened;              // the server has heard of the session
+} ProxyUser;
+
+// Structure to store one connection to the server and the users it carries
+typedef struct Upstream {
+    ProxyConn conn;           // must stay the first member
+    ProxyUser** users;        // by session id
+    unsigned int capacity;
+    unsigned int* freeSids;   // ids the server has confirmed closed
+    unsigned int noOfFree;
+    unsigned int nextSid;
+    int noOfUsers;
+} Upstream;
+
+// Structure to store the whole proxy
+typedef struct Proxy {
+    int epollFd;
+    ProxyConn listener;
+    char* authStr;            // the proxy's own, sent upstream
+    AuthTable* secrets;       // any of which admits a user
+    const char* address;
+    Upstream* upstreams;
+    int noOfUpstreams;
+    size_t maxLine;           // CHAT_MAX_LINE of a framed line, 0 for none
+    ProxyUser** dead;         // freed once the current events are handled
+    int noOfDead;
+    int deadCap;
+} Proxy;
+
+// Prints the usage of the proxy and terminates the program.
+void proxy_usage_error(void) {
+    fprintf(stderr, "Usage: chatproxy authfile address [port [upstreams]]\n");
+    exit(USAGE_ERR_CODE);
+}
+
+// CONNECTIONS---------------------------------------------------------------
+
+// Takes the proxy, a connection, its kind and its socket as @param. Sets
+// the socket non-blocking and starts watching it for input.
+void proxy_watch(Proxy* proxy, ProxyConn* conn, ProxyConnKind kind, int fd) {
+    memset(conn, 0, sizeof(ProxyConn));
+    conn->kind = kind;
+    conn->fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+    epoll_ctl(proxy->epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Takes the proxy and a connection as @param, stops watching it, closes
+// its socket and deallocates its buffers.
+void proxy_unwatch(Proxy* proxy, ProxyConn* conn) {
+    epoll_ctl(proxy->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    conn->in = conn->out = NULL;
+    conn->fd = -1;
+}
+
+// Takes the proxy, a connection and whether it has output waiting as
+// @param and watches the socket for room to write only while it has.
+void proxy_want_output(Proxy* proxy, ProxyConn* conn, bool waiting) {
+    if (conn->waitingOut != waiting) {
+        struct epoll_event ev = {EPOLLIN | (waiting ? EPOLLOUT : 0),
+                {.ptr = conn}};
+        epoll_ctl(proxy->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->waitingOut = waiting;
+    }
+}
+
+// Takes the proxy and a connection as @param and writes as much of its
+// waiting output as the socket takes. Returns false if the socket failed.
+bool proxy_flush(Proxy* proxy, ProxyConn* conn) {
+    while (conn->outLen > 0) {
+        ssize_t written = write(conn->fd, conn->out + conn->outStart,
+                conn->outLen);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        conn->outStart += written;
+        conn->outLen -= written;
+    }
+    if (conn->outLen == 0) {
+        conn->outStart = 0;
+    }
+    proxy_want_output(proxy, conn, conn->outLen > 0);
+    return true;
+}
+
+// Takes the proxy, a connection and the pieces of one line as @param.
+// Writes the line straight to the socket if nothing is waiting ahead of
+// it, else queues it. Returns false if the socket failed or a user fell
+// more than PROXY_MAX_OUTPUT behind.
+bool proxy_send(Proxy* proxy, ProxyConn* conn, struct iovec* iov,
+        int iovCnt) {
+    size_t total = 0;
+    for (int idx = 0; idx < iovCnt; idx++) {
+        total += iov[idx].iov_len;
+    }
+    size_t skip = 0;
+    if (conn->outLen == 0) {
+        ssize_t written = writev(conn->fd, iov, iovCnt);
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR) {
+            return false;
+        }
+        skip = written > 0 ? written : 0;
+        if (skip == total) {
+            return true;
+        }
+    }
+    if (conn->kind == PROXY_USER && conn->outLen + total > PROXY_MAX_OUTPUT) {
+        return false;
+    }
+    if (conn->outStart + conn->outLen + total > conn->outCap) {
+        memmove(conn->out, conn->out + conn->outStart, conn->outLen);
+        conn->outStart = 0;
+        if (conn->outLen + total > conn->outCap) {
+            conn->outCap = (conn->outLen + total) * 2;
+            conn->out = realloc(conn->out, conn->outCap);
+        }
+    }
+    for (int idx = 0; idx < iovCnt; idx++) {
+        size_t len = iov[idx].iov_len;
+        size_t from = skip < len ? skip : len;
+        skip -= from;
+        memcpy(conn->out + conn->outStart + conn->outLen,
+                (char*) iov[idx].iov_base + from, len - from);
+        conn->outLen += len - from;
+    }
+    proxy_want_output(proxy, conn, true);
+    return true;
+}
+
+// Takes a connection as @param and reads what its socket has. Returns the
+// number of bytes read, 0 at EOF, else -1 if nothing is there yet or the
+// read failed (errno tells which).
+ssize_t proxy_read(ProxyConn* conn) {
+    size_t chunk = conn->kind == PROXY_USER ? PROXY_USER_READ_SIZE :
+            PROXY_READ_SIZE;
+    if (conn->inCap - conn->inLen < chunk) {
+        conn->inCap = conn->inLen + chunk;
+        conn->in = realloc(conn->in, conn->inCap);
+    }
+    return read(conn->fd, conn->in + conn->inLen, conn->inCap - conn->inLen);
+}
+
+// Takes a connection as @param and returns the next complete line of its
+// input without the newline, in place, else returns NULL. *consumed counts
+// the input taken; the caller drops it once done with the lines.
+char* proxy_next_line(ProxyConn* conn, size_t* consumed) {
+    char* start = conn->in + *consumed;
+    char* newline = memchr(start, '\n', conn->inLen - *consumed);
+    if (newline == NULL) {
+        return NULL;
+    }
+    *newline = NULL_CHAR;
+    *consumed = newline + 1 - conn->in;
+    return start;
+}
+
+// Takes a connection and the input its lines were taken from as @param and
+// keeps just what follows the last complete line.
+void proxy_drop_input(ProxyConn* conn, size_t consumed) {
+    memmove(conn->in, conn->in + consumed, conn->inLen - consumed);
+    conn->inLen -= consumed;
+}
+
+// Takes the proxy, a connection and a line without its newline as @param
+// and sends the line. Returns false as proxy_send does.
+bool proxy_send_line(Proxy* proxy, ProxyConn* conn, const char* line,
+        size_t len) {
+    struct iovec iov[2] = {{(char*) line, len}, {"\n", 1}};
+    return proxy_send(proxy, conn, iov, 2);
+}
+
+// UPSTREAMS-----------------------------------------------------------------
+
+// Takes a socket during the upstream handshake as @param and reads one
+// line a byte at a time, so nothing after it is read ahead. Returns the
+// malloc'd line without its newline, else returns NULL on EOF.
+char* proxy_read_handshake_line(int fd) {
+    size_t len = 0;
+    size_t cap = 64;
+    char* line = malloc(cap);
+    char byte;
+    while (read(fd, &byte, 1) == 1) {
+        if (byte == '\n') {
+            line[len] = NULL_CHAR;
+            return line;
+        }
+        if (len + 1 == cap) {
+            cap *= 2;
+            line = realloc(line, cap);
+        }
+        line[len++] = byte;
+    }
+    free(line);
+    return NULL;
+}
+
+// Takes the proxy and an upstream as @param. Connects it to the server and
+// authenticates it as a carrier of sessions with "CAPS:mux". Returns true
+// on success, else returns false.
+bool connect_upstream(Proxy* proxy, Upstream* upstream) {
+    int fd = open_server_socket(proxy->address);
+    if (fd < 0) {
+        return false;
+    }
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    char* challenge = proxy_read_handshake_line(fd);
+    bool ok = challenge != NULL && is_match(challenge, "AUTH:");
+    free(challenge);
+    if (ok) {
+        dprintf(fd, "CAPS:mux\nAUTH:%s\n", proxy->authStr);
+        char* answer = proxy_read_handshake_line(fd);
+        ok = answer != NULL && is_match(answer, "OK:");
+        free(answer);
+    }
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+    proxy_watch(proxy, &upstream->conn, PROXY_UPSTREAM, fd);
+    return true;
+}
+
+// Takes an upstream as @param and returns a session id for a new user:
+// one the server has confirmed closed, else the next unused one.
+unsigned int allocate_sid(Upstream* upstream) {
+    if (upstream->noOfFree > 0) {
+        return upstream->freeSids[--upstream->noOfFree];
+    }
+    unsigned int sid = upstream->nextSid++;
+    if (sid >= upstream->capacity) {
+        upstream->capacity = upstream->capacity ? upstream->capacity * 2 :
+                64;
+        upstream->users = realloc(upstream->users,
+                sizeof(ProxyUser*) * upstream->capacity);
+        upstream->freeSids = realloc(upstream->freeSids,
+                sizeof(unsigned int) * upstream->capacity);
+    }
+    return sid;
+}
+
+// Takes the proxy, an upstream and the id of a session the server has
+// closed as @param and lets the id be used again. Its user is deallocated
+// after the current batch of events, some of which may still name it.
+void release_sid(Proxy* proxy, Upstream* upstream, unsigned int sid) {
+    if (proxy->noOfDead == proxy->deadCap) {
+        proxy->deadCap = proxy->deadCap ? proxy->deadCap * 2 : 64;
+        proxy->dead = realloc(proxy->dead,
+                sizeof(ProxyUser*) * proxy->deadCap);
+    }
+    proxy->dead[proxy->noOfDead++] = upstream->users[sid];
+    upstream->users[sid] = NULL;
+    upstream->freeSids[upstream->noOfFree++] = sid;
+    upstream->noOfUsers -= 1;
+}
+
+// Takes the proxy, a user and a line for its session as @param and sends
+// "S:sid:line" on the user's upstream.
+void send_session_line(Proxy* proxy, ProxyUser* user, const char* line) {
+    char prefix[MUX_SID_SIZE + 4];
+    int prefixLen = snprintf(prefix, sizeof(prefix), "%s%u:",
+            MUX_SESSION_PREFIX, user->sid);
+    struct iovec iov[3] = {{prefix, prefixLen}, {(char*) line, strlen(line)},
+            {"\n", 1}};
+    user->opened = true;
+    proxy_send(proxy, &user->upstream->conn, iov, 3);
+}
+
+// USERS---------------------------------------------------------------------
+
+// Takes the proxy and a user as @param. Returns the longest line the user
+// may send, which leaves room for its "S:sid:" prefix within the server's
+// CHAT_MAX_LINE, else returns 0 if there is no limit.
+size_t user_line_max(Proxy* proxy, ProxyUser* user) {
+    char prefix[MUX_SID_SIZE + 4];
+    size_t prefixLen = snprintf(prefix, sizeof(prefix), "%s%u:",
+            MUX_SESSION_PREFIX, user->sid);
+    if (proxy->maxLine == 0) {
+        return 0;
+    }
+    return proxy->maxLine > prefixLen ? proxy->maxLine - prefixLen : 1;
+}
+
+// Takes the proxy and a user as @param and disconnects the user. A session
+// the server has heard of is left with "LEAVE:" (unless sent already) and
+// its id held until the server answers "CLOSED:"; else the id is free at
+// once.
+void drop_user(Proxy* proxy, ProxyUser* user) {
+    if (user->state == USER_GONE) {
+        return;
+    }
+    bool leaveSent = user->state == USER_LEAVING;
+    proxy_unwatch(proxy, &user->conn);
+    free(user->caps);
+    user->caps = NULL;
+    user->state = USER_GONE;
+    if (!user->opened) {
+        release_sid(proxy, user->upstream, user->sid);
+    } else if (!leaveSent) {
+        send_session_line(proxy, user, "LEAVE:");
+    }
+}
+
+// Takes the proxy and a user's socket as @param. Gives the user a session
+// on the upstream carrying the fewest users and challenges it with AUTH:,
+// as the server would.
+void accept_user(Proxy* proxy, int fd) {
+    Upstream* upstream = &proxy->upstreams[0];
+    for (int idx = 1; idx < proxy->noOfUpstreams; idx++) {
+        if (proxy->upstreams[idx].noOfUsers < upstream->noOfUsers) {
+            upstream = &proxy->upstreams[idx];
+        }
+    }
+    ProxyUser* user = calloc(1, sizeof(ProxyUser));
+    user->sid = allocate_sid(upstream);
+    user->upstream = upstream;
+    user->state = USER_AUTH;
+    upstream->users[user->sid] = user;
+    upstream->noOfUsers += 1;
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    proxy_watch(proxy, &user->conn, PROXY_USER, fd);
+    proxy_send_line(proxy, &user->conn, "AUTH:", strlen("AUTH:"));
+}
+
+// Takes the proxy, a user still authenticating and a line it sent as
+// @param. Records "CAPS:" lines for its session and checks its "AUTH:"
+// answer against the secrets of the authfile; a RESUME: gets one fresh
+// challenge, since sessions cannot be resumed through the proxy. Returns
+// false if the user is to be dropped, as when its caps outgrow a line.
+bool authenticate_user(Proxy* proxy, ProxyUser* user, char* line) {
+    char* args;
+    strtok_r(line, COLON, &args);
+    if (is_match(line, "CAPS")) {
+        size_t len = user->caps ? strlen(user->caps) : 0;
+        size_t maxLine = user_line_max(proxy, user);
+        if (maxLine > 0 && strlen("CAPS:") + len + strlen(args) + 1 >
+                maxLine) {
+            return false;
+        }
+        user->caps = realloc(user->caps, len + strlen(args) + 2);
+        sprintf(user->caps + len, "%s%s", len ? "," : "", args);
+        return true;
+    }
+    if (is_match(line, "RESUME") && !user->resumeTried) {
+        user->resumeTried = true;
+        return proxy_send_line(proxy, &user->conn, "AUTH:",
+                strlen("AUTH:"));
+    }
+    if (!is_match(line, "AUTH") || !auth_table_contains(proxy->secrets,
+            args, strlen(args))) {
+        return false;
+    }
+    user->state = USER_NAME;
+    return proxy_send_line(proxy, &user->conn, "OK:\nWHO:",
+            strlen("OK:\nWHO:"));
+}
+
+// Takes the proxy, a user and a line it sent as @param. Authenticates the
+// user locally, then hands its "NAME:" lines and once it is in the chat
+// every line to its session on the server. Returns false if the user is to
+// be dropped.
+bool handle_user_line(Proxy* proxy, ProxyUser* user, char* line) {
+    switch (user->state) {
+        case USER_AUTH:
+            return authenticate_user(proxy, user, line);
+        case USER_NAME:
+            if (strncmp(line, "NAME:", strlen("NAME:"))) {
+                return false;
+            }
+            if (!user->opened && user->caps != NULL) {
+                char* caps = malloc(strlen(user->caps) + strlen("CAPS:") + 1);
+                sprintf(caps, "CAPS:%s", user->caps);
+                send_session_line(proxy, user, caps);
+                free(caps);
+            }
+            send_session_line(proxy, user, line);
+            return true;
+        case USER_CHAT:
+            send_session_line(proxy, user, line);
+            if (is_match(line, "LEAVE:")) {
+                user->state = USER_LEAVING;
+            }
+            return true;
+        case USER_LEAVING:
+        case USER_GONE:
+            break;
+    }
+    return true;
+}
+
+// Takes the proxy and a user whose socket has input as @param and handles
+// each complete line, dropping the user at EOF, when a line says so or
+// when a line, complete or not, would not fit the server's CHAT_MAX_LINE.
+void read_user(Proxy* proxy, ProxyUser* user) {
+    ssize_t got = proxy_read(&user->conn);
+    if (got <= 0) {
+        if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+            drop_user(proxy, user);
+        }
+        return;
+    }
+    user->conn.inLen += got;
+    size_t maxLine = user_line_max(proxy, user);
+    size_t consumed = 0;
+    char* line;
+    while (user->state != USER_GONE &&
+            (line = proxy_next_line(&user->conn, &consumed)) != NULL) {
+        if ((maxLine > 0 && strlen(line) > maxLine) ||
+                !handle_user_line(proxy, user, line)) {
+            drop_user(proxy, user);
+        }
+    }
+    if (user->state != USER_GONE && maxLine > 0 &&
+            user->conn.inLen - consumed > maxLine) {
+        drop_user(proxy, user);
+    }
+    if (user->state != USER_GONE) {
+        proxy_drop_input(&user->conn, consumed);
+    }
+}
+
+// DEMULTIPLEXING------------------------------------------------------------
+
+// Takes the proxy, a user and a frame from the server without its newline
+// as @param and writes the frame to the user, dropping a user that fell
+// too far behind.
+void deliver(Proxy* proxy, ProxyUser* user, const char* frame, size_t len) {
+    if (user != NULL && user->state == USER_CHAT &&
+            !proxy_send_line(proxy, &user->conn, frame, len)) {
+        drop_user(proxy, user);
+    }
+}
+
+// Takes the proxy, an upstream and an "S:sid:line" from the server as
+// @param and hands the line to the session's user. "CLOSED:" frees the
+// session id, "OK:" lets the user in and "KICK:" is passed on before the
+// user is dropped.
+void handle_session_frame(Proxy* proxy, Upstream* upstream, char* frame) {
+    unsigned int sid;
+    char* line;
+    if (!mux_parse_session(frame, &sid, &line) || sid >= upstream->nextSid ||
+            upstream->users[sid] == NULL) {
+        return;
+    }
+    ProxyUser* user = upstream->users[sid];
+    if (is_match(line, "CLOSED:")) {
+        if (user->state != USER_GONE) {
+            user->state = USER_LEAVING; // the server has left it already
+        }
+        drop_user(proxy, user);
+        release_sid(proxy, upstream, sid);
+        return;
+    }
+    if (user->state == USER_GONE || user->state == USER_LEAVING) {
+        return;
+    }
+    if (user->state == USER_NAME && !strncmp(line, "OK:", strlen("OK:"))) {
+        user->state = USER_CHAT;
+    }
+    if (!proxy_send_line(proxy, &user->conn, line, strlen(line))) {
+        drop_user(proxy, user);
+    } else if (is_match(line, "KICK:")) {
+        proxy_flush(proxy, &user->conn);
+        drop_user(proxy, user);
+    }
+}
+
+// Takes the proxy, an upstream and a "B:recipients:frame" from the server
+// as @param and writes the frame to every user listed, or to every user in
+// the chat for "*".
+void handle_broadcast_frame(Proxy* proxy, Upstream* upstream, char* frame) {
+    char* list = frame + strlen(MUX_BROADCAST_PREFIX);
+    char* body = strchr(list, COLON_ASCII);
+    if (body == NULL) {
+        return;
+    }
+    *body++ = NULL_CHAR;
+    size_t len = strlen(body);
+    if (is_match(list, MUX_ALL_SESSIONS)) {
+        for (unsigned int sid = 0; sid < upstream->nextSid; sid++) {
+            deliver(proxy, upstream->users[sid], body, len);
+        }
+        return;
+    }
+    char* end;
+    while (*list != NULL_CHAR) {
+        unsigned long sid = strtoul(list, &end, 10);
+        if (end == list) {
+            break;
+        }
+        if (sid < upstream->nextSid) {
+            deliver(proxy, upstream->users[sid], body, len);
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+// Takes the proxy and an upstream whose connection to the server closed as
+// @param. Drops every user it carried, the server has already let them go,
+// and connects it again, else exits.
+void reconnect_upstream(Proxy* proxy, Upstream* upstream) {
+    proxy_unwatch(proxy, &upstream->conn);
+    for (unsigned int sid = 0; sid < upstream->nextSid; sid++) {
+        ProxyUser* user = upstream->users[sid];
+        if (user != NULL) {
+            user->opened = false;
+            if (user->state != USER_GONE) {
+                drop_user(proxy, user);
+            } else {
+                release_sid(proxy, upstream, sid);
+            }
+        }
+    }
+    upstream->noOfFree = 0;
+    upstream->nextSid = 0;
+    if (!connect_upstream(proxy, upstream)) {
+        communications_error();
+    }
+}
+
+// Takes the proxy and an upstream whose socket has input as @param and
+// demultiplexes each complete frame to the users it is for.
+void read_upstream(Proxy* proxy, Upstream* upstream) {
+    ssize_t got = proxy_read(&upstream->conn);
+    if (got <= 0) {
+        if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+            reconnect_upstream(proxy, upstream);
+        }
+        return;
+    }
+    upstream->conn.inLen += got;
+    size_t consumed = 0;
+    char* frame;
+    while ((frame = proxy_next_line(&upstream->conn, &consumed)) != NULL) {
+        if (!strncmp(frame, MUX_BROADCAST_PREFIX,
+                strlen(MUX_BROADCAST_PREFIX))) {
+            handle_broadcast_frame(proxy, upstream, frame);
+        } else {
+            handle_session_frame(proxy, upstream, frame);
+        }
+    }
+    proxy_drop_input(&upstream->conn, consumed);
+}
+
+// EVENT LOOP----------------------------------------------------------------
+
+// Takes the port to listen on ("0" for any free one) as @param. Listens on
+// it and prints the port on stderr, as the server does. Returns the
+// listening socket, or exits on failure.
+int proxy_listen(const char* port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(port));
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int optVal = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int));
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 ||
+            getsockname(fd, (struct sockaddr*) &addr, &len) < 0) {
+        communications_error();
+    }
+    fprintf(stderr, "%u\n", ntohs(addr.sin_port));
+    return fd;
+}
+
+// Takes the proxy as @param and accepts every user waiting on the
+// listening socket.
+void accept_users(Proxy* proxy) {
+    int fd;
+    while ((fd = accept(proxy->listener.fd, NULL, NULL)) >= 0) {
+        accept_user(proxy, fd);
+    }
+}
+
+// Takes the proxy as @param and serves users and upstreams forever.
+void run_proxy(Proxy* proxy) {
+    struct epoll_event events[PROXY_MAX_EVENTS];
+    while (1) {
+        int noOfEvents = epoll_wait(proxy->epollFd, events,
+                PROXY_MAX_EVENTS, -1);
+        for (int idx = 0; idx < noOfEvents; idx++) {
+            ProxyConn* conn = events[idx].data.ptr;
+            if (conn->kind == PROXY_LISTENER) {
+                accept_users(proxy);
+                continue;
+            }
+            if (conn->fd < 0) {
+                continue; // dropped by an earlier event of this batch
+            }
+            if ((events[idx].events & EPOLLOUT) && !proxy_flush(proxy,
+                    conn)) {
+                if (conn->kind == PROXY_USER) {
+                    drop_user(proxy, (ProxyUser*) conn);
+                } else {
+                    reconnect_upstream(proxy, (Upstream*) conn);
+                }
+                continue;
+            }
+            if (events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (conn->kind == PROXY_USER) {
+                    read_user(proxy, (ProxyUser*) conn);
+                } else {
+                    read_upstream(proxy, (Upstream*) conn);
+                }
+            }
+        }
+        for (int idx = 0; idx < proxy->noOfDead; idx++) {
+            free(proxy->dead[idx]);
+        }
+        proxy->noOfDead = 0;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 5) {
+        proxy_usage_error();
+    }
+    Proxy proxy;
+    memset(&proxy, 0, sizeof(Proxy));
+    FILE* authFile = fopen(argv[1], "r");
+    if (authFile == NULL) {
+        proxy_usage_error();
+    }
+    fclose(authFile);
+    proxy.authStr = get_auth_string(argv[1]);
+    proxy.secrets = load_auth_table(argv[1]);
+    proxy.address = argv[2];
+    proxy.maxLine = env_long(ENV_MAX_LINE, DEFAULT_MAX_LINE);
+    proxy.noOfUpstreams = argc > 4 ? atoi(argv[4]) : PROXY_DEFAULT_UPSTREAMS;
+    if (proxy.noOfUpstreams < 1) {
+        proxy_usage_error();
+    }
+    signal(SIGPIPE, SIG_IGN);
+    proxy.epollFd = epoll_create1(0);
+    proxy.upstreams = calloc(proxy.noOfUpstreams, sizeof(Upstream));
+    for (int idx = 0; idx < proxy.noOfUpstreams; idx++) {
+        if (!connect_upstream(&proxy, &proxy.upstreams[idx])) {
+            communications_error();
+        }
+    }
+    proxy_watch(&proxy, &proxy.listener, PROXY_LISTENER,
+            proxy_listen(argc > 3 ? argv[3] : PROXY_DEFAULT_PORT));
+    run_proxy(&proxy);
+    return 0;
+}
@@ -0,0 +1,499 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <time.h>
+#include "parser.h"
+#include "errors.h"
+#include "transport.h"
+#include "capture.h"
+#include "compress.h"
+
+#define REPLAY_READ_SIZE 65536
+#define REPLAY_MAX_EVENTS 256
+#define REPLAY_QUIET_MILLI_SECS 1000
+#define REPLAY_LINE_SIZE 256
+
+// Handshake state of a replayed connection
+typedef enum ReplayState {
+    REPLAY_HANDSHAKE,
+    REPLAY_ENTERED,
+    REPLAY_CLOSED
+} ReplayState;
+
+// Structure to store one captured connection being replayed: the captured
+// lines due to be sent on it and the send times of its SAY: lines the
+// server has not echoed back yet.
+typedef struct ReplayConn {
+    unsigned long connId;
+    int fd;
+    ReplayState state;
+    int noOfOk;
+    int authAsked;            // AUTH: challenges not answered yet
+    int whoAsked;             // WHO: prompts not answered yet
+    int namesTaken;           // NAME_TAKEN: replies to the current base
+    char* base;               // name the capture asked for
+    char* name;               // name last asked for or given
+    size_t* pending;          // records due but not sent yet
+    size_t pendingHead;
+    size_t pendingLen;
+    size_t pendingCap;
+    long* says;               // send times of SAY: lines awaiting their echo
+    size_t saysHead;
+    size_t saysLen;
+    size_t saysCap;
+    char* inBuf;
+    size_t inLen;
+    size_t inCap;
+} ReplayConn;
+
+// Structure to store the whole replay and its counters
+typedef struct Replay {
+    int epollFd;
+    const char* address;
+    char* authStr;
+    double speed;             // 0 replays as fast as possible
+    CaptureRecord* records;
+    size_t noOfRecords;
+    int* connOf;              // index into conns of each record
+    ReplayConn* conns;
+    int noOfConns;
+    int open;                 // connections not closed yet
+    unsigned long sent;       // lines sent
+    unsigned long delivered;  // MSG: lines received
+    long lastDeliveryAt;
+    long* latencies;          // SAY: to echo round trips
+    size_t noOfLatencies;
+    size_t latenciesCap;
+} Replay;
+
+// Prints the usage of the replay tool and terminates the program.
+void replay_usage_error(void) {
+    fprintf(stderr, "Usage: chatreplay capturefile address authfile "
+            "[speed|max]\n");
+    exit(USAGE_ERR_CODE);
+}
+
+// Returns the current time of the monotonic clock in nanoseconds.
+long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Takes two pointers to round trip times as @param and compares them, for
+// sorting.
+int compare_nanos(const void* nanos1, const void* nanos2) {
+    long diff = *(const long*) nanos1 - *(const long*) nanos2;
+    return (diff > 0) - (diff < 0);
+}
+
+// Takes two pointers to connection ids as @param and compares them, for
+// sorting and searching.
+int compare_conn_ids(const void* id1, const void* id2) {
+    unsigned long a = *(const unsigned long*) id1;
+    unsigned long b = *(const unsigned long*) id2;
+    return (a > b) - (a < b);
+}
+
+// Takes the replay as @param and gives each distinct connection id in the
+// capture a ReplayConn, noting for each record which one it belongs to.
+void index_connections(Replay* replay) {
+    unsigned long* ids = malloc(sizeof(unsigned long) *
+            (replay->noOfRecords + 1));
+    for (size_t idx = 0; idx < replay->noOfRecords; idx++) {
+        ids[idx] = replay->records[idx].connId;
+    }
+    qsort(ids, replay->noOfRecords, sizeof(unsigned long), compare_conn_ids);
+    size_t noOfIds = 0;
+    for (size_t idx = 0; idx < replay->noOfRecords; idx++) {
+        if (noOfIds == 0 || ids[noOfIds - 1] != ids[idx]) {
+            ids[noOfIds++] = ids[idx];
+        }
+    }
+    replay->noOfConns = noOfIds;
+    replay->conns = calloc(noOfIds + 1, sizeof(ReplayConn));
+    for (size_t idx = 0; idx < noOfIds; idx++) {
+        replay->conns[idx].connId = ids[idx];
+        replay->conns[idx].fd = -1;
+    }
+    replay->connOf = malloc(sizeof(int) * (replay->noOfRecords + 1));
+    for (size_t idx = 0; idx < replay->noOfRecords; idx++) {
+        unsigned long* found = bsearch(&replay->records[idx].connId, ids,
+                noOfIds, sizeof(unsigned long), compare_conn_ids);
+        replay->connOf[idx] = found - ids;
+    }
+    free(ids);
+}
+
+// Takes a connection, a line and its length as @param and writes the line to the
+// connection's socket, waiting for room if the server is slow to read.
+void replay_send(ReplayConn* conn, const char* line, size_t len) {
+    while (len > 0) {
+        ssize_t put = write(conn->fd, line, len);
+        if (put < 0 && errno != EINTR) {
+            communications_error();
+        }
+        if (put > 0) {
+            line += put;
+            len -= put;
+        }
+    }
+}
+
+// Takes the replay and a connection as @param and closes the connection,
+// dropping whatever it still had to send.
+void replay_close(Replay* replay, ReplayConn* conn) {
+    if (conn->state == REPLAY_CLOSED) {
+        return;
+    }
+    epoll_ctl(replay->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->state = REPLAY_CLOSED;
+    conn->pendingLen = 0;
+    replay->open--;
+}
+
+// Takes the replay and a connection as @param and opens the connection to
+// the server.
+void replay_connect(Replay* replay, ReplayConn* conn) {
+    conn->fd = open_server_socket(replay->address);
+    if (conn->fd < 0) {
+        communications_error();
+    }
+    int noDelay = 1; // fails harmlessly on a Unix domain socket
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+            sizeof(noDelay));
+    conn->state = REPLAY_HANDSHAKE;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    epoll_ctl(replay->epollFd, EPOLL_CTL_ADD, conn->fd, &event);
+    replay->open++;
+}
+
+// Takes a connection as @param and records that it sent a SAY: line now,
+// for timing the server's echo of it.
+void replay_note_say(ReplayConn* conn) {
+    if (conn->saysLen == conn->saysCap) {
+        size_t cap = conn->saysCap ? conn->saysCap * 2 : 16;
+        long* says = malloc(sizeof(long) * cap);
+        for (size_t idx = 0; idx < conn->saysLen; idx++) {
+            says[idx] = conn->says[(conn->saysHead + idx) % conn->saysCap];
+        }
+        free(conn->says);
+        conn->says = says;
+        conn->saysHead = 0;
+        conn->saysCap = cap;
+    }
+    conn->says[(conn->saysHead + conn->saysLen++) % conn->saysCap] =
+            now_nanos();
+}
+
+// Takes the replay, a connection and the name to ask for as @param and
+// answers a WHO: prompt with it.
+void replay_send_name(Replay* replay, ReplayConn* conn, const char* name) {
+    char out[REPLAY_LINE_SIZE];
+    free(conn->name);
+    conn->name = strdup(name);
+    snprintf(out, REPLAY_LINE_SIZE, "NAME:%s\n", conn->name);
+    replay_send(conn, out, strlen(out));
+    conn->whoAsked--;
+}
+
+// Takes the replay and a connection as @param and answers a WHO: prompt
+// the capture has no "NAME:" line for: after NAME_TAKEN: the captured name
+// is retried with a number after it, and a connection that resumed its
+// session in the capture makes up a name.
+void replay_make_up_name(Replay* replay, ReplayConn* conn) {
+    char name[REPLAY_LINE_SIZE];
+    if (conn->base == NULL) {
+        snprintf(name, REPLAY_LINE_SIZE, "replay%lu", conn->connId);
+        conn->base = strdup(name);
+    }
+    if (conn->namesTaken > 0) {
+        snprintf(name, REPLAY_LINE_SIZE, "%s%d", conn->base,
+                conn->namesTaken);
+    } else {
+        snprintf(name, REPLAY_LINE_SIZE, "%s", conn->base);
+    }
+    replay_send_name(replay, conn, name);
+}
+
+// Takes the replay and a connection as @param and sends the connection's
+// due lines in capture order, as far as the handshake allows. Captured
+// "AUTH:" answers are sent with this replay's secret once the server has
+// asked, and "NAME:" answers once it has prompted with WHO:. Handshake
+// lines the replayed session does not need are skipped. Replaying as fast
+// as possible, connections are left open until the end.
+void replay_flush(Replay* replay, ReplayConn* conn) {
+    char out[REPLAY_LINE_SIZE];
+    while (conn->state != REPLAY_CLOSED) {
+        CaptureRecord* rec = conn->pendingLen > 0 ?
+                &replay->records[conn->pending[conn->pendingHead]] : NULL;
+        char* line = rec != NULL ? rec->line : NULL;
+        bool handshake = line != NULL && (!strncmp(line, "CAPS:",
+                strlen("CAPS:")) || !strncmp(line, "AUTH:", strlen("AUTH:"))
+                || !strncmp(line, "RESUME:", strlen("RESUME:")) ||
+                !strncmp(line, "NAME:", strlen("NAME:")));
+        if (conn->state == REPLAY_HANDSHAKE && conn->whoAsked > 0 &&
+                (line == NULL || strncmp(line, "NAME:", strlen("NAME:"))) &&
+                (conn->base != NULL || (rec != NULL && !handshake))) {
+            replay_make_up_name(replay, conn);
+            continue;
+        }
+        if (rec == NULL) {
+            return;
+        }
+        if (line == NULL) {
+            if (replay->speed > 0) {
+                replay_close(replay, conn);
+            }
+            return; // as fast as possible, it would close before delivery
+        }
+        if (!strncmp(line, "AUTH:", strlen("AUTH:")) ||
+                !strncmp(line, "RESUME:", strlen("RESUME:"))) {
+            if (conn->noOfOk == 0) {
+                if (conn->authAsked == 0) {
+                    return;
+                }
+                snprintf(out, REPLAY_LINE_SIZE, "AUTH:%s\n",
+                        replay->authStr ? replay->authStr : EMPTY_STR);
+                replay_send(conn, out, strlen(out));
+                conn->authAsked--;
+                replay->sent++;
+            }
+        } else if (!strncmp(line, "NAME:", strlen("NAME:"))) {
+            if (conn->state == REPLAY_HANDSHAKE) {
+                if (conn->whoAsked == 0) {
+                    return;
+                }
+                free(conn->base);
+                conn->base = strdup(line + strlen("NAME:"));
+                conn->namesTaken = 0;
+                replay_send_name(replay, conn, conn->base);
+                replay->sent++;
+            }
+        } else if (!handshake && conn->state != REPLAY_ENTERED) {
+            return;
+        } else {
+            if (!strncmp(line, "SAY:", strlen("SAY:"))) {
+                replay_note_say(conn);
+            }
+            line[rec->len] = NEXT_LINE_CHAR; // one write, not two segments
+            replay_send(conn, line, rec->len + 1);
+            line[rec->len] = NULL_CHAR;
+            replay->sent++;
+        }
+        conn->pendingHead++;
+        conn->pendingLen--;
+    }
+}
+
+// Takes the replay and the index of a record that has come due as @param
+// and queues it on its connection, opening the connection on its first
+// record.
+void replay_dispatch(Replay* replay, size_t recIdx) {
+    ReplayConn* conn = &replay->conns[replay->connOf[recIdx]];
+    if (conn->fd < 0) {
+        replay_connect(replay, conn);
+    }
+    if (conn->state == REPLAY_CLOSED) {
+        return;
+    }
+    if (conn->pendingLen == 0) {
+        conn->pendingHead = 0;
+    }
+    if (conn->pendingHead + conn->pendingLen == conn->pendingCap) {
+        conn->pendingCap = conn->pendingCap ? conn->pendingCap * 2 : 16;
+        conn->pending = realloc(conn->pending,
+                sizeof(size_t) * conn->pendingCap);
+    }
+    conn->pending[conn->pendingHead + conn->pendingLen++] = recIdx;
+    replay_flush(replay, conn);
+}
+
+// Takes the replay, a connection and a frame received on it as @param.
+// Counts deliveries, times the echo of the connection's own SAY: lines and
+// moves the handshake along.
+void replay_handle_line(Replay* replay, ReplayConn* conn, char* line) {
+    if (!strncmp(line, "SEQ:", strlen("SEQ:"))) {
+        char* frame;
+        strtoul(line + strlen("SEQ:"), &frame, 10);
+        line = frame + 1;
+    }
+    if (!strncmp(line, "MSG:", strlen("MSG:"))) {
+        replay->delivered++;
+        replay->lastDeliveryAt = now_nanos();
+        size_t nameLen = conn->name ? strlen(conn->name) : 0;
+        char* sender = line + strlen("MSG:");
+        if (conn->saysLen > 0 && !strncmp(sender, conn->name, nameLen) &&
+                sender[nameLen] == COLON_ASCII) {
+            if (replay->noOfLatencies == replay->latenciesCap) {
+                replay->latenciesCap = replay->latenciesCap ?
+                        replay->latenciesCap * 2 : 1024;
+                replay->latencies = realloc(replay->latencies,
+                        sizeof(long) * replay->latenciesCap);
+            }
+            replay->latencies[replay->noOfLatencies++] =
+                    replay->lastDeliveryAt - conn->says[conn->saysHead];
+            conn->saysHead = (conn->saysHead + 1) % conn->saysCap;
+            conn->saysLen--;
+        }
+    } else if (is_match(line, "AUTH:")) {
+        conn->authAsked++;
+    } else if (is_match(line, "WHO:")) {
+        conn->whoAsked++;
+    } else if (is_match(line, "NAME_TAKEN:")) {
+        conn->namesTaken++;
+    } else if (!strncmp(line, "OK:", strlen("OK:"))) {
+        if (line[strlen("OK:")] != NULL_CHAR) {
+            free(conn->name);
+            conn->name = strdup(line + strlen("OK:"));
+        }
+        if (++conn->noOfOk == 2) {
+            conn->state = REPLAY_ENTERED;
+        }
+    } else if (is_match(line, "KICK:")) {
+        replay_close(replay, conn);
+        return;
+    }
+    replay_flush(replay, conn);
+}
+
+// Takes the replay and a connection as @param. Reads whatever the server
+// sent and handles each complete frame, inflating compressed ones.
+void replay_read(Replay* replay, ReplayConn* conn) {
+    if (conn->inCap - conn->inLen < REPLAY_READ_SIZE) {
+        conn->inCap = conn->inLen + REPLAY_READ_SIZE;
+        conn->inBuf = realloc(conn->inBuf, conn->inCap);
+    }
+    ssize_t got = recv(conn->fd, conn->inBuf + conn->inLen,
+            conn->inCap - conn->inLen, MSG_DONTWAIT);
+    if (got == 0) { // Server closed the connection
+        replay_close(replay, conn);
+    }
+    if (got <= 0) {
+        return;
+    }
+    conn->inLen += got;
+    char* start = conn->inBuf;
+    char* end = conn->inBuf + conn->inLen;
+    char* newline;
+    while ((newline = memchr(start, NEXT_LINE_CHAR, end - start)) != NULL &&
+            conn->state != REPLAY_CLOSED) {
+        *newline = NULL_CHAR;
+        char* frame = start;
+        char* body = newline + 1;
+        if (!strncmp(frame, "SEQ:", strlen("SEQ:"))) {
+            frame = strchr(frame + strlen("SEQ:"), COLON_ASCII) + 1;
+        }
+        if (!strncmp(frame, ZFRAME_PREFIX, strlen(ZFRAME_PREFIX))) {
+            size_t zLen = strtoul(frame + strlen(ZFRAME_PREFIX), NULL, 10);
+            if ((size_t) (end - body) < zLen) {
+                *newline = NEXT_LINE_CHAR; // wait for the rest
+                break;
+            }
+            FILE* data = fmemopen(body, zLen, "r");
+            char* inflated = zframe_inflate(data, frame);
+            fclose(data);
+            if (inflated != NULL) {
+                replay_handle_line(replay, conn, inflated);
+                free(inflated);
+            }
+            body += zLen;
+        } else {
+            replay_handle_line(replay, conn, start);
+        }
+        start = body;
+    }
+    conn->inLen = end - start;
+    memmove(conn->inBuf, start, conn->inLen);
+}
+
+// Takes the replay, the index of the next record and when the replay
+// started as @param. Returns how many milliseconds until the record comes
+// due, else a tenth of the quiet period once every record has been sent.
+int replay_wait_millis(Replay* replay, size_t next, long startedAt) {
+    if (next == replay->noOfRecords) {
+        return REPLAY_QUIET_MILLI_SECS / 10;
+    }
+    long due = startedAt + (replay->records[next].nanos -
+            replay->records[0].nanos) / replay->speed;
+    long wait = (due - now_nanos()) / 1000000;
+    return wait > 0 ? wait : 0;
+}
+
+// Takes the replay as @param. Sends every captured line when it comes due,
+// scaled by the replay speed, and reads what the server sends back until
+// the capture is exhausted, every connection it closed is closed and the
+// server has been quiet for a second. Then prints the report.
+void run_replay(Replay* replay) {
+    struct epoll_event events[REPLAY_MAX_EVENTS];
+    long startedAt = now_nanos();
+    long lastActivity = startedAt;
+    size_t next = 0;
+    while (next < replay->noOfRecords || (replay->open > 0 &&
+            now_nanos() - lastActivity < REPLAY_QUIET_MILLI_SECS * 1000000L)) {
+        long now = now_nanos();
+        while (next < replay->noOfRecords && (replay->speed == 0 ||
+                startedAt + (replay->records[next].nanos -
+                replay->records[0].nanos) / replay->speed <= now)) {
+            replay_dispatch(replay, next++);
+            lastActivity = now;
+        }
+        int wait = replay->speed == 0 && next < replay->noOfRecords ? 0 :
+                replay_wait_millis(replay, next, startedAt);
+        int ready = epoll_wait(replay->epollFd, events, REPLAY_MAX_EVENTS,
+                wait);
+        for (int idx = 0; idx < ready; idx++) {
+            replay_read(replay, events[idx].data.ptr);
+            lastActivity = now_nanos();
+        }
+    }
+    long elapsed = (replay->lastDeliveryAt ? replay->lastDeliveryAt :
+            now_nanos()) - startedAt;
+    printf("replay conns=%d records=%zu sent=%lu delivered=%lu millis=%ld "
+            "msgs/s=%.0f\n", replay->noOfConns, replay->noOfRecords,
+            replay->sent, replay->delivered, elapsed / 1000000,
+            elapsed > 0 ? replay->delivered * 1e9 / elapsed : 0.0);
+    size_t count = replay->noOfLatencies;
+    if (count > 0) {
+        qsort(replay->latencies, count, sizeof(long), compare_nanos);
+        printf("latency echoes=%zu p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+                "max_us=%.1f\n", count,
+                replay->latencies[count / 2] / 1000.0,
+                replay->latencies[(size_t) (count * 0.9)] / 1000.0,
+                replay->latencies[(size_t) (count * 0.99)] / 1000.0,
+                replay->latencies[count - 1] / 1000.0);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4 || argc > 5) {
+        replay_usage_error();
+    }
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    replay.address = argv[2];
+    replay.authStr = get_auth_string(argv[3]);
+    replay.speed = 1;
+    if (argc == 5) {
+        char* end;
+        replay.speed = is_match(argv[4], "max") ? 0 : strtod(argv[4], &end);
+        if (!is_match(argv[4], "max") && (*end != NULL_CHAR ||
+                replay.speed <= 0)) {
+            replay_usage_error();
+        }
+    }
+    replay.records = load_capture(argv[1], &replay.noOfRecords);
+    if (replay.records == NULL || replay.noOfRecords == 0) {
+        replay_usage_error();
+    }
+    index_connections(&replay);
+    replay.epollFd = epoll_create1(0);
+    run_replay(&replay);
+    return 0;
+}
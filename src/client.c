@@ -4,72 +4,122 @@
 #include "checkargs.h"
 #include "servercommands.h"
 #include "errors.h"
+#include "transport.h"
+#include "compress.h"
 
 #define AUTH_OK 1
 #define CLIENT_ENTRY_OK 2
 #define THREE_HUNDRED_MILLI_SECS 300000
+#define TEN_MILLI_SECS 10000
+#define RECONNECT_ATTEMPTS 5
+#define CLIENT_CAPS "resume,presence,autoname,deflate,batch"
 
 // Function Prototypes- description in respective definition
-ServerIO* initialize_server_io(int fd[2], char** argv);
-int connect_to_server(const char* port);
-bool process_stdin_input(char* inputStr, FILE* wrEnd);
+ServerIO* initialize_server_io(char** argv);
+void connect_to_server(ServerIO* svr);
+void announce_caps(ServerIO* svr);
+bool reconnect_to_server(ServerIO* svr);
+bool process_stdin_input(char* inputStr, ServerIO* svr);
 bool process_server_input(char* svrInput, ServerIO* svr);
 void check_authorization(ServerIO* svr);
 void* stdin_read_thread(void* tempSvr);
 void* server_read_thread(void* tempSvr);
 
-// Takes an array of two file descriptors and the command line args as @param
-// initializes a pointer to the ServerIO struct and returns the variable.
-ServerIO* initialize_server_io(int fd[2], char** argv) {
+// Takes the command line args as @param initializes a pointer to the
+// ServerIO struct and returns the variable.
+ServerIO* initialize_server_io(char** argv) {
     ServerIO* svr = malloc(sizeof(ServerIO));
     svr->client = malloc(sizeof(ClientId));
-    svr->wrEnd = fdopen(fd[0], "w");
-    svr->rdEnd = fdopen(fd[1], "r");
+    svr->wrEnd = NULL;
+    svr->rdEnd = NULL;
+    pthread_mutex_init(&svr->wrLock, NULL);
     svr->noOfOk = 0; 
     svr->client->name = argv[1];
     svr->client->number = -1;
     svr->authStr = get_auth_string(argv[2]);
+    svr->port = argv[3];
+    svr->token = NULL;
+    svr->lastSeq = 0;
+    svr->resumeTried = false;
     return svr;
 }
 
-// Takes the port value as @param and attempts to connect to the port on
-// localhost and returns file descriptor on sucessful connection. Else,
-// generates a communications error and terminates the program.
-int connect_to_server(const char* port) {
-    struct addrinfo* addrInfo = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET; // IPv4
-    hints.ai_socktype = SOCK_STREAM;
-    int err;
-    if ((err = getaddrinfo("localhost", port, &hints, &addrInfo))) {
-        freeaddrinfo(addrInfo);
+// Takes the pointer to the ServerIO struct as @param and connects to the
+// server address given on the command line (a port on localhost, a Unix
+// socket path, or "shm:" and a path) and stores the connection's read and
+// write ends. Generates a communications error and terminates the program
+// on failure.
+void connect_to_server(ServerIO* svr) {
+    if (!open_server_streams(svr->port, &svr->rdEnd, &svr->wrEnd)) {
         communications_error();
     }
-    int fd = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
-    if (connect(fd, (struct sockaddr*)addrInfo->ai_addr, sizeof(struct sockaddr))) {
-        freeaddrinfo(addrInfo);
-        communications_error();
+}
+
+// Takes the pointer to the ServerIO struct as @param and tells the server
+// which protocol extensions this client understands. Sent ahead of the
+// AUTH: answer, servers read it before checking authentication.
+void announce_caps(ServerIO* svr) {
+    fprintf(svr->wrEnd, "CAPS:%s\n", CLIENT_CAPS);
+    fflush(svr->wrEnd);
+}
+
+// Takes the pointer to the ServerIO struct as @param. Called when the
+// connection to the server is lost after a resume token was received.
+// Reconnects, backing off between attempts, and replaces the connection's
+// read and write ends so the next AUTH: challenge is answered with RESUME:.
+// Returns true on success, else returns false.
+bool reconnect_to_server(ServerIO* svr) {
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS; attempt++) {
+        usleep(THREE_HUNDRED_MILLI_SECS << attempt);
+        FILE* rdEnd;
+        FILE* wrEnd;
+        if (!open_server_streams(svr->port, &rdEnd, &wrEnd)) {
+            continue;
+        }
+        pthread_mutex_lock(&svr->wrLock);
+        fclose(svr->wrEnd);
+        fclose(svr->rdEnd);
+        svr->wrEnd = wrEnd;
+        svr->rdEnd = rdEnd;
+        svr->noOfOk = 0;
+        svr->resumeTried = false;
+        announce_caps(svr);
+        pthread_mutex_unlock(&svr->wrLock);
+        return true;
     }
-    return fd;
+    return false;
 }
 
-// Takes the input string at stdin and the server's write end as @param. If
-// input str matches "*LEAVE:", exits the program with a status '0'. Else
-// formates the string and writes it to the server. Returns true on success,
-// else on a EOF on client stdin returns false.
-bool process_stdin_input(char* inputStr, FILE* wrEnd) {
+// Takes the input string at stdin and the pointer to the ServerIO struct as
+// @param. If input str matches "*LEAVE:", exits the program with a status
+// '0'. Else formates the string and writes it to the server, "@name text"
+// as a direct message to name, waiting while a lost connection is being
+// resumed. Returns true on success, else on a
+// EOF on client stdin returns false.
+bool process_stdin_input(char* inputStr, ServerIO* svr) {
     if (inputStr != NULL) {
+        pthread_mutex_lock(&svr->wrLock);
+        while (svr->noOfOk != CLIENT_ENTRY_OK) {
+            pthread_mutex_unlock(&svr->wrLock);
+            usleep(TEN_MILLI_SECS);
+            pthread_mutex_lock(&svr->wrLock);
+        }
         if (inputStr[0] == '*') {
-            fprintf(wrEnd, "%s\n", inputStr + 1);
-            fflush(wrEnd);
+            fprintf(svr->wrEnd, "%s\n", inputStr + 1);
+            fflush(svr->wrEnd);
             if (is_match(inputStr, "*LEAVE:")) {
                 exit(NORMAL_EXIT);
             }
+        } else if (inputStr[0] == '@' && strchr(inputStr, ' ') != NULL) {
+            char* text = strchr(inputStr, ' ');
+            fprintf(svr->wrEnd, "DM:%.*s:%s\n", (int) (text - inputStr - 1),
+                    inputStr + 1, text + 1);
+            fflush(svr->wrEnd);
         } else {
-            fprintf(wrEnd, "SAY:%s\n", inputStr);
-            fflush(wrEnd);
+            fprintf(svr->wrEnd, "SAY:%s\n", inputStr);
+            fflush(svr->wrEnd);
         }
+        pthread_mutex_unlock(&svr->wrLock);
     } else {
         return false; // EOF on stdin
     }
@@ -79,11 +129,15 @@ bool process_stdin_input(char* inputStr, FILE* wrEnd) {
 // Takes the input received from the server and the pointer to the ServerIO
 // struct as @param. If the input is not NULL, evaluates the command received
 // and returns true, else returns false if input is NULL- meaning, EOF on
-// server read or connection lost.
+// server read or connection lost- or if the server turned it away as busy.
 bool process_server_input(char* svrInput, ServerIO* svr) {
     if (svrInput != NULL) {
         switch (evaluate_server_input(svrInput)) {
             case 0: // AUTH:
+                if (svr->resumeTried && svr->token != NULL) {
+                    free(svr->token); // Session expired, enter afresh
+                    svr->token = NULL;
+                }
                 if (svr->noOfOk != CLIENT_ENTRY_OK) {
                     return_authorization_value(svr);
                     check_authorization(svr);
@@ -99,12 +153,17 @@ bool process_server_input(char* svrInput, ServerIO* svr) {
                     svr->client->number += 1;
                 }
                 break;
-            case 3: // OK:
+            case 3: // OK: or OK:name, the name the server settled on
+                if (svr->noOfOk == AUTH_OK &&
+                        svrInput[strlen("OK:")] != NULL_CHAR) {
+                    svr->client->name = strdup(svrInput + strlen("OK:"));
+                    svr->client->number = -1;
+                }
                 if (svr->noOfOk != CLIENT_ENTRY_OK) {
                     svr->noOfOk += 1;
                 }
                 break;
-            case 4: // ENTER:, LEAVE:, MSG:, LIST: 
+            case 4: // ENTER:, LEAVE:, MSG:, LIST:, PRESENCE:, DM:, FOUND:
                 if (svr->noOfOk == CLIENT_ENTRY_OK) {
                     display_to_stdout(svr->client, svrInput);
                 }
@@ -115,6 +174,48 @@ bool process_server_input(char* svrInput, ServerIO* svr) {
                     client_kicked();
                 }
                 break;
+            case 6: // TOKEN:token
+                free(svr->token);
+                svr->token = strdup(svrInput + strlen("TOKEN:"));
+                break;
+            case 7: { // SEQ:seq:frame, seq counts once the frame is read
+                char* frame;
+                strtok_r(svrInput, COLON, &frame);
+                unsigned long seq = strtoul(frame, &frame, 10);
+                if (*frame == COLON_ASCII &&
+                        !process_server_input(frame + 1, svr)) {
+                    return false;
+                }
+                svr->lastSeq = seq;
+                break;
+            }
+            case 8: // RESUMED:
+                svr->noOfOk = CLIENT_ENTRY_OK;
+                break;
+            case 9: { // Z:zlen:len and a compressed frame
+                char* frame = zframe_inflate(svr->rdEnd, svrInput);
+                if (frame == NULL) {
+                    return false;
+                }
+                bool processed = process_server_input(frame, svr);
+                free(frame);
+                return processed;
+            }
+            case 10: { // BATCH:bytes and that many bytes of frames
+                char* frames = read_batch(svr->rdEnd, svrInput);
+                if (frames == NULL) {
+                    return false;
+                }
+                if (svr->noOfOk == CLIENT_ENTRY_OK) {
+                    display_batch(frames);
+                }
+                free(frames);
+                break;
+            }
+            case 11: // BUSY:reason, the server turned the connection away
+                fprintf(stderr, "Server busy (%s)\n",
+                        svrInput + strlen("BUSY:"));
+                return false;
         }
     } else {
         return false; // EOF on server read, connection to server is lost
@@ -132,6 +233,7 @@ void check_authorization(ServerIO* svr) {
     char* nextCommand = is_authorized(svr->rdEnd);
     if (nextCommand) {
         process_server_input(nextCommand, svr);
+        free(nextCommand);
     } else {
         auth_error();
     }
@@ -145,7 +247,9 @@ void* stdin_read_thread(void* tempSvr) {
     while (1) {
         if (svr->noOfOk == 2) {
             char* inputStr = get_line(stdin);
-            if (!process_stdin_input(inputStr, svr->wrEnd)) {
+            bool processed = process_stdin_input(inputStr, svr);
+            free(inputStr);
+            if (!processed) {
                 usleep(THREE_HUNDRED_MILLI_SECS);
                 exit(NORMAL_EXIT);
             }
@@ -157,12 +261,16 @@ void* stdin_read_thread(void* tempSvr) {
 
 // Server read thread, takes the pointer to the ServerIO struct as @param and
 // reads and processes the input from the server until its read end returns
-// EOF, at which terminates the program throwing a communications error.
+// EOF. A client holding a resume token then reconnects and resumes its
+// session, else the program terminates throwing a communications error.
 void* server_read_thread(void* tempSvr) {
     ServerIO* svr = (ServerIO*) tempSvr;
     while (1) {
         char* svrInput = get_line(svr->rdEnd);
-        if (!process_server_input(svrInput, svr)) {
+        bool processed = process_server_input(svrInput, svr);
+        free(svrInput);
+        if (!processed && (svr->token == NULL ||
+                !reconnect_to_server(svr))) {
             free(svr);
             communications_error(); // If connection to server disconnects
         }
@@ -174,13 +282,10 @@ void* server_read_thread(void* tempSvr) {
 int main(int argc, char** argv) {
     check_client_args(argc, argv);
 
-    const char* port = argv[3];
     pthread_t tId[2]; // Thread to read client input from stdin
-    int fd[2];
-    fd[0] = connect_to_server(port);
-    fd[1] = dup(fd[0]);
-
-    ServerIO* svr = initialize_server_io(fd, argv);
+    ServerIO* svr = initialize_server_io(argv);
+    connect_to_server(svr);
+    announce_caps(svr);
     
     pthread_create(&tId[1], NULL, stdin_read_thread, svr);
     pthread_create(&tId[2], NULL, server_read_thread, svr);
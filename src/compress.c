@@ -0,0 +1,97 @@
+#include "compress.h"
+
+// Returns the CPU time used by the calling thread in nanoseconds.
+unsigned long thread_cpu_nanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+// Takes a frame, its length, where to store the compressed frame's length
+// and the stats to add to (or NULL) as @param. Deflates the frame on its
+// own with the preset dictionary. Returns the malloc'd compressed frame,
+// "Z:zlen:len\n" followed by zlen bytes of raw deflate data, else returns
+// NULL if compressing fails or would not make the frame smaller.
+char* zframe_compress(const char* frame, size_t len, size_t* zLen,
+        CompressStats* stats) {
+    unsigned long startedAt = thread_cpu_nanos();
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, ZFRAME_LEVEL, Z_DEFLATED, ZFRAME_WINDOW_BITS, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    deflateSetDictionary(&strm, (const Bytef*) ZFRAME_DICTIONARY,
+            strlen(ZFRAME_DICTIONARY));
+    size_t bound = deflateBound(&strm, len);
+    char* zFrame = malloc(ZFRAME_HEADER_SIZE + bound);
+    strm.next_in = (Bytef*) frame;
+    strm.avail_in = len;
+    strm.next_out = (Bytef*) zFrame + ZFRAME_HEADER_SIZE;
+    strm.avail_out = bound;
+    int status = deflate(&strm, Z_FINISH);
+    size_t dataLen = strm.total_out;
+    deflateEnd(&strm);
+    char header[ZFRAME_HEADER_SIZE];
+    int headerLen = snprintf(header, ZFRAME_HEADER_SIZE, "%s%zu:%zu\n",
+            ZFRAME_PREFIX, dataLen, len);
+    if (status != Z_STREAM_END || headerLen + dataLen >= len) {
+        free(zFrame);
+        return NULL;
+    }
+    memmove(zFrame + headerLen, zFrame + ZFRAME_HEADER_SIZE, dataLen);
+    memcpy(zFrame, header, headerLen);
+    *zLen = headerLen + dataLen;
+    if (stats != NULL) {
+        __atomic_add_fetch(&stats->frames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->nanos, thread_cpu_nanos() - startedAt,
+                __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->rawBytes, len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->zBytes, *zLen, __ATOMIC_RELAXED);
+    }
+    return zFrame;
+}
+
+// Takes the stream a "Z:zlen:len" header line was read from and that line
+// as @param. Reads the zlen bytes of deflate data that follow it and
+// inflates them. Returns the malloc'd frame without its trailing newline,
+// else returns NULL if the header or data is malformed.
+char* zframe_inflate(FILE* stream, char* header) {
+    char* end;
+    unsigned long dataLen = strtoul(header + strlen(ZFRAME_PREFIX), &end, 10);
+    if (*end != ':') {
+        return NULL;
+    }
+    unsigned long len = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || len == 0 || len > ZFRAME_MAX_LEN ||
+            dataLen > ZFRAME_MAX_LEN) {
+        return NULL;
+    }
+    char* data = malloc(dataLen);
+    char* frame = malloc(len + 1);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    bool inflated = false;
+    if (fread(data, 1, dataLen, stream) == dataLen &&
+            inflateInit2(&strm, ZFRAME_WINDOW_BITS) == Z_OK) {
+        inflateSetDictionary(&strm, (const Bytef*) ZFRAME_DICTIONARY,
+                strlen(ZFRAME_DICTIONARY));
+        strm.next_in = (Bytef*) data;
+        strm.avail_in = dataLen;
+        strm.next_out = (Bytef*) frame;
+        strm.avail_out = len;
+        inflated = inflate(&strm, Z_FINISH) == Z_STREAM_END &&
+                strm.total_out == len;
+        inflateEnd(&strm);
+    }
+    free(data);
+    if (!inflated) {
+        free(frame);
+        return NULL;
+    }
+    if (frame[len - 1] == '\n') {
+        len--;
+    }
+    frame[len] = '\0';
+    return frame;
+}
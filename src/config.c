@@ -0,0 +1,61 @@
+#include "config.h"
+
+// Takes the name of an environment variable and a default value as @param.
+// Returns the variable's value as a number if it is set to a non-negative
+// integer, else returns the default value.
+long env_long(const char* name, long defaultVal) {
+    char* value = getenv(name);
+    char* end;
+    if (value == NULL || *value == '\0') {
+        return defaultVal;
+    }
+    long result = strtol(value, &end, 10);
+    if (*end != '\0' || result < 0) {
+        return defaultVal;
+    }
+    return result;
+}
+
+// Reads the server settings from the environment, initializes the
+// ServerConfig struct variable and returns it.
+ServerConfig init_server_config(void) {
+    ServerConfig config;
+    config.resumeGrace = env_long(ENV_RESUME_GRACE, DEFAULT_RESUME_GRACE);
+    config.historyLen = env_long(ENV_HISTORY_LEN, DEFAULT_HISTORY_LEN);
+    config.presenceWindow = env_long(ENV_PRESENCE_WINDOW,
+            DEFAULT_PRESENCE_WINDOW);
+    config.handoffPath = getenv(ENV_HANDOFF_PATH);
+    config.takeover = config.handoffPath != NULL &&
+            env_long(ENV_TAKEOVER, 0) != 0;
+    config.adminPath = getenv(ENV_ADMIN_PATH);
+    config.unixPath = getenv(ENV_UNIX_PATH);
+    config.shmPath = getenv(ENV_SHM_PATH);
+    config.capturePath = getenv(ENV_CAPTURE_PATH);
+    config.fanoutShards = env_long(ENV_FANOUT_SHARDS, 0);
+    config.compressMin = env_long(ENV_COMPRESS_MIN, DEFAULT_COMPRESS_MIN);
+    config.outboxMax = env_long(ENV_OUTBOX_MAX, DEFAULT_OUTBOX_MAX);
+    config.sendBuffer = env_long(ENV_SEND_BUFFER, DEFAULT_SEND_BUFFER);
+    config.searchMax = env_long(ENV_SEARCH_MAX, DEFAULT_SEARCH_MAX);
+    config.searchRetention = env_long(ENV_SEARCH_RETENTION,
+            DEFAULT_SEARCH_RETENTION);
+    config.logDir = getenv(ENV_LOG_DIR);
+    config.logSegmentSize = env_long(ENV_LOG_SEGMENT_SIZE,
+            DEFAULT_LOG_SEGMENT_SIZE);
+    config.logSegments = env_long(ENV_LOG_SEGMENTS, DEFAULT_LOG_SEGMENTS);
+    config.idleAfter = env_long(ENV_IDLE_AFTER, DEFAULT_IDLE_AFTER);
+    config.spareBuffers = env_long(ENV_SPARE_BUFFERS,
+            DEFAULT_SPARE_BUFFERS);
+    config.cpus = getenv(ENV_CPUS);
+    config.spin = env_long(ENV_SPIN, 0);
+    config.busyPoll = env_long(ENV_BUSY_POLL, 0);
+    config.maxConnections = env_long(ENV_MAX_CONNECTIONS, 0);
+    config.maxHandshakes = env_long(ENV_MAX_HANDSHAKES, 0);
+    config.maxPerIp = env_long(ENV_MAX_PER_IP, 0);
+    config.maxLine = env_long(ENV_MAX_LINE, DEFAULT_MAX_LINE);
+    config.rateLimit = env_long(ENV_RATE_LIMIT, DEFAULT_RATE_LIMIT);
+    config.ioBackend = getenv(ENV_IO_BACKEND);
+    if (config.historyLen == 0) {
+        config.historyLen = 1;
+    }
+    return config;
+}
@@ -0,0 +1,91 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Environment variables that tune the server. Every setting is optional and
+// falls back to the default below, so "./server authfile [port]" keeps its
+// original behaviour.
+#define ENV_RESUME_GRACE "CHAT_RESUME_GRACE"
+#define ENV_HISTORY_LEN "CHAT_HISTORY_LEN"
+#define ENV_PRESENCE_WINDOW "CHAT_PRESENCE_WINDOW"
+#define ENV_HANDOFF_PATH "CHAT_HANDOFF_PATH"
+#define ENV_TAKEOVER "CHAT_TAKEOVER"
+#define ENV_ADMIN_PATH "CHAT_ADMIN_PATH"
+#define ENV_RATE_LIMIT "CHAT_RATE_LIMIT"
+#define ENV_IO_BACKEND "CHAT_IO_BACKEND"
+#define ENV_UNIX_PATH "CHAT_UNIX_PATH"
+#define ENV_SHM_PATH "CHAT_SHM_PATH"
+#define ENV_FANOUT_SHARDS "CHAT_FANOUT_SHARDS"
+#define ENV_COMPRESS_MIN "CHAT_COMPRESS_MIN"
+#define ENV_CAPTURE_PATH "CHAT_CAPTURE_PATH"
+#define ENV_OUTBOX_MAX "CHAT_OUTBOX_MAX"
+#define ENV_SEND_BUFFER "CHAT_SEND_BUFFER"
+#define ENV_SEARCH_MAX "CHAT_SEARCH_MAX"
+#define ENV_SEARCH_RETENTION "CHAT_SEARCH_RETENTION"
+#define ENV_LOG_DIR "CHAT_LOG_DIR"
+#define ENV_LOG_SEGMENT_SIZE "CHAT_LOG_SEGMENT_SIZE"
+#define ENV_LOG_SEGMENTS "CHAT_LOG_SEGMENTS"
+#define ENV_IDLE_AFTER "CHAT_IDLE_AFTER"
+#define ENV_SPARE_BUFFERS "CHAT_SPARE_BUFFERS"
+#define ENV_CPUS "CHAT_CPUS"
+#define ENV_SPIN "CHAT_SPIN"
+#define ENV_BUSY_POLL "CHAT_BUSY_POLL"
+#define ENV_MAX_CONNECTIONS "CHAT_MAX_CONNECTIONS"
+#define ENV_MAX_HANDSHAKES "CHAT_MAX_HANDSHAKES"
+#define ENV_MAX_PER_IP "CHAT_MAX_PER_IP"
+#define ENV_MAX_LINE "CHAT_MAX_LINE"
+
+#define DEFAULT_RESUME_GRACE 30     // seconds a dropped client is held for
+#define DEFAULT_HISTORY_LEN 1024    // broadcast frames kept for catch up
+#define DEFAULT_PRESENCE_WINDOW 250 // milliseconds presence changes coalesce
+#define DEFAULT_RATE_LIMIT 100      // milliseconds a client waits per command
+#define DEFAULT_COMPRESS_MIN 512    // bytes a broadcast needs to be compressed
+#define DEFAULT_OUTBOX_MAX (4 << 20) // bytes queued for a slow client
+#define DEFAULT_SEND_BUFFER (128 << 10) // kernel send buffer per client
+#define DEFAULT_SEARCH_MAX (16 << 20) // bytes the search index may take up
+#define DEFAULT_SEARCH_RETENTION 3600 // seconds messages stay searchable
+#define DEFAULT_LOG_SEGMENT_SIZE (64 << 20) // bytes a log file grows to
+#define DEFAULT_LOG_SEGMENTS 8       // log files kept, the oldest go first
+#define DEFAULT_IDLE_AFTER 30       // seconds before a quiet client parks
+#define DEFAULT_SPARE_BUFFERS 1024  // receive buffers kept for reuse
+#define DEFAULT_MAX_LINE (64 << 10) // bytes of the longest line a client sends
+
+// Structure to store the tunable server settings
+typedef struct ServerConfig {
+    int resumeGrace;
+    int historyLen;
+    int presenceWindow;
+    char* handoffPath;  // Unix socket a successor takes over through
+    bool takeover;      // take over from the server at handoffPath
+    char* adminPath;    // Unix socket serving metrics and admin commands
+    int rateLimit;      // changed at runtime through the admin socket
+    char* ioBackend;    // "uring" asks for io_uring, else threads
+    char* unixPath;     // extra Unix domain listener for local clients
+    char* shmPath;      // Unix socket local clients set up shared memory on
+    int fanoutShards;   // fan-out worker threads, 0 fans out inline
+    int compressMin;    // smallest frame sent compressed, 0 never does
+    char* capturePath;  // file every line clients send is recorded to
+    long outboxMax;     // backlog a client is cut off at, 0 for no limit
+    int sendBuffer;     // SO_SNDBUF of client sockets, 0 leaves the default
+    long searchMax;     // memory of the search index, 0 disables search
+    long searchRetention; // seconds a message is searchable, 0 for ever
+    char* logDir;       // directory every message is logged to, if set
+    long logSegmentSize; // size a log file is closed at
+    int logSegments;    // log files kept
+    int idleAfter;      // quiet seconds before a client parks, 0 never
+    long spareBuffers;  // receive buffers pooled beyond those in use
+    char* cpus;         // CPUs to place the threads on, e.g. "2,4-7"
+    int spin;           // microseconds waiters poll before sleeping
+    int busyPoll;       // SO_BUSY_POLL microseconds of client sockets
+    int maxConnections; // connections admitted at once, 0 for no limit
+    int maxHandshakes;  // of those, not entered yet, 0 for no limit
+    int maxPerIp;       // connections from one address, 0 for no limit
+    long maxLine;       // line a client is cut off at, 0 for no limit
+} ServerConfig;
+
+long env_long(const char* name, long defaultVal);
+ServerConfig init_server_config(void);
+
+#endif
@@ -0,0 +1,242 @@
+#include "fanout.h"
+
+// Takes the fan-out to set up, its number of shards (0 keeps fan-out on
+// the publishing thread), the I/O backend name for the workers, the caps
+// that get "SEQ:" prefixes, the caps that get compressed frames, the frames
+// counter, the compression stats, the CPUs to place the workers on (the
+// first is left to the sequencer) and how long they poll for frames
+// before sleeping as @param. Starts one worker per shard, pinned to the
+// listed CPUs, or else to the cores, in turn.
+void init_fanout(Fanout* fanout, int noOfShards, const char* ioBackend,
+        unsigned int seqCaps, unsigned int zipCaps, unsigned long* frames,
+        CompressStats* compress, MemCounters* counters, const CpuList* cpus,
+        long spinNanos) {
+    fanout->noOfShards = noOfShards > 0 ? noOfShards : 0;
+    fanout->shards = calloc(fanout->noOfShards + 1, sizeof(FanoutShard));
+    fanout->nextShard = 0;
+    fanout->nextPub = 1;
+    fanout->counters = counters;
+    long noOfCores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int idx = 0; idx < fanout->noOfShards; idx++) {
+        FanoutShard* shard = &fanout->shards[idx];
+        shard->id = idx;
+        pthread_mutex_init(&shard->lock, NULL);
+        init_spsc_queue(&shard->queue, FANOUT_QUEUE_SLOTS);
+        shard->queue.spinNanos = spinNanos;
+        init_io_backend(&shard->io, ioBackend);
+        shard->seqCaps = seqCaps;
+        shard->zipCaps = zipCaps;
+        shard->frames = frames;
+        shard->compress = compress;
+        shard->counters = counters;
+        pthread_create(&shard->thread, NULL, fanout_worker, shard);
+        pthread_detach(shard->thread);
+        if (pin_thread_to_cpu(shard->thread, cpus, idx + 1)) {
+            continue;
+        }
+        if (noOfCores > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(idx % noOfCores, &cpus);
+            pthread_setaffinity_np(shard->thread, sizeof(cpu_set_t), &cpus);
+        }
+    }
+}
+
+// Takes a frame and the counters it was allocated through as @param and
+// drops one shard's reference to it, freeing it after the last.
+void release_fanout_frame(FanoutFrame* frame, MemCounters* counters) {
+    if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        mem_free(counters, frame->data);
+        mem_free(counters, frame->zData);
+        free_bitset(&frame->skip);
+        mem_free(counters, frame);
+    }
+}
+
+// Takes a shard and a frame as @param and writes the frame to every member
+// it is meant for, sockets as one batch through the shard's I/O backend.
+// Members with a backlog get it queued on their outbox instead.
+void fanout_deliver(FanoutShard* shard, FanoutFrame* frame) {
+    int noOfSends = 0;
+    int noOfQueued = 0;
+    int noOfStreams = 0;
+    int noOfZipped = 0;
+    pthread_mutex_lock(&shard->lock);
+    for (ShardMember* member = shard->members; member != NULL;
+            member = member->next) {
+        if (frame->pub < member->joinPub ||
+                (member->caps & frame->needCaps) != frame->needCaps ||
+                (member->caps & frame->skipCaps) ||
+                (frame->skip.noOfWords > 0 &&
+                bitset_test(&frame->skip, member->id))) {
+            continue;
+        }
+        bool zipped = frame->zData != NULL && (member->caps & shard->zipCaps);
+        noOfZipped += zipped;
+        if (member->stream != NULL) {
+            if (member->caps & shard->seqCaps) {
+                fprintf(member->stream, "SEQ:%lu:", frame->seq);
+            }
+            fwrite(zipped ? frame->zData : frame->data, 1,
+                    zipped ? frame->zLen : frame->len, member->stream);
+            fflush(member->stream);
+            noOfStreams++;
+            continue;
+        }
+        if (noOfSends == shard->sendsCap) {
+            shard->sendsCap = shard->sendsCap ? shard->sendsCap * 2 : 64;
+            shard->sends = realloc(shard->sends,
+                    sizeof(IoSend) * shard->sendsCap);
+        }
+        IoSend* send = &shard->sends[noOfSends];
+        send->fd = member->fd;
+        send->outbox = member->outbox;
+        send->prefixLen = 0;
+        if (member->caps & shard->seqCaps) {
+            send->prefixLen = snprintf(send->prefix, IO_PREFIX_SIZE,
+                    "SEQ:%lu:", frame->seq);
+        }
+        send->data = zipped ? frame->zData : frame->data;
+        send->len = zipped ? frame->zLen : frame->len;
+        if (send->outbox != NULL && outbox_defer(send->outbox, OUTBOX_BULK,
+                send->prefix, send->prefixLen, send->data, send->len)) {
+            noOfQueued++;
+            continue;
+        }
+        noOfSends++;
+    }
+    io_send_batch(&shard->io, shard->sends, noOfSends);
+    pthread_mutex_unlock(&shard->lock);
+    metrics_add(shard->frames, noOfSends + noOfQueued + noOfStreams);
+    metrics_add(&shard->compress->savedBytes,
+            noOfZipped * (frame->len - frame->zLen));
+}
+
+// Fan-out worker thread function, takes a pointer to its FanoutShard as
+// @param. Delivers the frames published to the shard in order.
+void* fanout_worker(void* arg) {
+    FanoutShard* shard = arg;
+    while (1) {
+        FanoutFrame* frame = spsc_pop_wait(&shard->queue);
+        fanout_deliver(shard, frame);
+        __atomic_store_n(&shard->donePub, frame->pub, __ATOMIC_RELEASE);
+        release_fanout_frame(frame, shard->counters);
+    }
+    return NULL;
+}
+
+// Takes the fan-out, a client's dense id, socket and outbox (or NULL), the
+// stream to write to it through instead (or NULL) and its caps as @param.
+// Adds the client to the next shard; it gets the frames published from now
+// on. Called under the global lock. Returns the membership, else NULL if
+// fan-out is not sharded.
+ShardMember* fanout_attach(Fanout* fanout, int id, int fd, Outbox* outbox,
+        FILE* stream, unsigned int caps) {
+    if (fanout->noOfShards == 0) {
+        return NULL;
+    }
+    FanoutShard* shard = &fanout->shards[fanout->nextShard];
+    fanout->nextShard = (fanout->nextShard + 1) % fanout->noOfShards;
+    ShardMember* member = malloc(sizeof(ShardMember));
+    member->id = id;
+    member->fd = fd;
+    member->outbox = outbox;
+    member->stream = stream;
+    member->caps = caps;
+    member->joinPub = fanout->nextPub;
+    member->shard = shard;
+    member->prev = NULL;
+    pthread_mutex_lock(&shard->lock);
+    member->next = shard->members;
+    if (shard->members != NULL) {
+        shard->members->prev = member;
+    }
+    shard->members = member;
+    __atomic_add_fetch(&shard->noOfMembers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return member;
+}
+
+// Takes a membership as @param and removes it from its shard, waiting for
+// a delivery in progress, so the client's socket may be closed afterwards.
+void fanout_detach(ShardMember* member) {
+    FanoutShard* shard = member->shard;
+    pthread_mutex_lock(&shard->lock);
+    if (member->prev != NULL) {
+        member->prev->next = member->next;
+    } else {
+        shard->members = member->next;
+    }
+    if (member->next != NULL) {
+        member->next->prev = member->prev;
+    }
+    __atomic_sub_fetch(&shard->noOfMembers, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    free(member);
+}
+
+// Takes a membership (or NULL) as @param and keeps its shard from writing
+// to it, so that a reply written from another thread is not interleaved
+// with a frame.
+void fanout_lock_member(ShardMember* member) {
+    if (member != NULL) {
+        pthread_mutex_lock(&member->shard->lock);
+    }
+}
+
+// Takes a membership (or NULL) as @param and lets its shard write again.
+void fanout_unlock_member(ShardMember* member) {
+    if (member != NULL) {
+        pthread_mutex_unlock(&member->shard->lock);
+    }
+}
+
+// Takes the fan-out, a frame, its malloc'd compressed form (or NULL) and
+// that one's length, its sequence number, the caps recipients must and
+// must not have and the ids of recipients to skip (or NULL) as @param.
+// Copies the frame and the ids once, takes over the compressed frame, and
+// queues a reference to them on every shard. Called under the global lock.
+void fanout_publish(Fanout* fanout, const char* data, char* zData,
+        size_t zLen, unsigned long seq, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip) {
+    FanoutFrame* frame = mem_alloc(fanout->counters, sizeof(FanoutFrame));
+    frame->data = mem_strdup(fanout->counters, data);
+    frame->len = strlen(data);
+    frame->zData = zData;
+    mem_count_alloc(fanout->counters, zData); // the frame takes it over
+    frame->zLen = zLen;
+    frame->seq = seq;
+    frame->pub = fanout->nextPub++;
+    frame->needCaps = needCaps;
+    frame->skipCaps = skipCaps;
+    init_bitset(&frame->skip);
+    if (skip != NULL) {
+        bitset_copy(&frame->skip, skip);
+    }
+    frame->refs = fanout->noOfShards;
+    for (int idx = 0; idx < fanout->noOfShards; idx++) {
+        spsc_push(&fanout->shards[idx].queue, frame);
+    }
+}
+
+// Takes the fan-out as @param and waits until every shard has delivered
+// every frame published so far. Called under the global lock.
+void fanout_flush(Fanout* fanout) {
+    for (int idx = 0; idx < fanout->noOfShards; idx++) {
+        while (__atomic_load_n(&fanout->shards[idx].donePub,
+                __ATOMIC_ACQUIRE) + 1 < fanout->nextPub) {
+            usleep(FANOUT_FLUSH_MICRO_SECS);
+        }
+    }
+}
+
+// Takes the fan-out and where to add its counts as @param and adds the
+// system calls and sends made by the shards' I/O backends.
+void fanout_send_counts(Fanout* fanout, unsigned long* syscalls,
+        unsigned long* sends) {
+    for (int idx = 0; idx < fanout->noOfShards; idx++) {
+        *syscalls += metrics_get(&fanout->shards[idx].io.sendSyscalls);
+        *sends += metrics_get(&fanout->shards[idx].io.sends);
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "iobackend.h"
+#include "spscqueue.h"
+#include "metrics.h"
+#include "compress.h"
+#include "bitset.h"
+#include "memtrack.h"
+
+#define FANOUT_QUEUE_SLOTS 4096   // frames a shard can fall behind by
+#define FANOUT_FLUSH_MICRO_SECS 1000
+
+// One broadcast frame published to every shard. The last shard to deliver
+// it frees it.
+typedef struct FanoutFrame {
+    char* data;
+    size_t len;
+    char* zData;             // compressed "Z:" frame, or NULL
+    size_t zLen;
+    unsigned long seq;       // sequence number for the "SEQ:" prefix
+    unsigned long pub;       // publication number, orders frames and joins
+    unsigned int needCaps;   // caps a recipient must have
+    unsigned int skipCaps;   // caps a recipient must not have
+    Bitset skip;             // ids of recipients filtering it out
+    int refs;
+} FanoutFrame;
+
+// One attached client as seen by the shard that writes to it
+typedef struct ShardMember {
+    int id;                  // the client's dense id
+    int fd;
+    Outbox* outbox;          // queues what the socket does not take
+    FILE* stream;            // written through instead of fd if set
+    unsigned int caps;
+    unsigned long joinPub;   // frames published before it joined are skipped
+    struct FanoutShard* shard;
+    struct ShardMember* prev;
+    struct ShardMember* next;
+} ShardMember;
+
+// A fan-out worker and the clients it owns. The members list changes under
+// lock, which the worker holds while it delivers a frame, so a client is
+// never written to after it has been detached.
+typedef struct FanoutShard {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    ShardMember* members;
+    int noOfMembers;
+    SpscQueue queue;         // frames to deliver, pushed under the global lock
+    IoBackend io;
+    IoSend* sends;
+    int sendsCap;
+    unsigned long donePub;   // last frame delivered
+    unsigned int seqCaps;    // recipients with these get "SEQ:seq:" prefixes
+    unsigned int zipCaps;    // and with these the compressed frame, if any
+    unsigned long* frames;   // counter of frames written, shared by shards
+    CompressStats* compress; // where bytes saved by compression are added
+    MemCounters* counters;   // frames are counted here, if set
+} FanoutShard;
+
+// Structure to store the fan-out shards. Publishing and attaching are done
+// under the server's global lock, so each shard queue has one producer.
+typedef struct Fanout {
+    FanoutShard* shards;
+    int noOfShards;
+    int nextShard;           // shards are filled round robin
+    unsigned long nextPub;
+    MemCounters* counters;   // frames are counted here, if set
+} Fanout;
+
+void init_fanout(Fanout* fanout, int noOfShards, const char* ioBackend,
+        unsigned int seqCaps, unsigned int zipCaps, unsigned long* frames,
+        CompressStats* compress, MemCounters* counters, const CpuList* cpus,
+        long spinNanos);
+void release_fanout_frame(FanoutFrame* frame, MemCounters* counters);
+void fanout_deliver(FanoutShard* shard, FanoutFrame* frame);
+void* fanout_worker(void* arg);
+ShardMember* fanout_attach(Fanout* fanout, int id, int fd, Outbox* outbox,
+        FILE* stream, unsigned int caps);
+void fanout_detach(ShardMember* member);
+void fanout_lock_member(ShardMember* member);
+void fanout_unlock_member(ShardMember* member);
+void fanout_publish(Fanout* fanout, const char* data, char* zData,
+        size_t zLen, unsigned long seq, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip);
+void fanout_flush(Fanout* fanout);
+void fanout_send_counts(Fanout* fanout, unsigned long* syscalls,
+        unsigned long* sends);
+
+#endif
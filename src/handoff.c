@@ -0,0 +1,148 @@
+#include "handoff.h"
+
+// Takes the path of a Unix domain socket as @param and fills addr with it.
+// Returns false if the path does not fit.
+bool handoff_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// Takes a socket as @param and enlarges its buffers so that a whole roster
+// can be queued without the peer reading in between.
+void handoff_buffers(int sock) {
+    int size = HANDOFF_SOCKET_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int));
+}
+
+// Takes the path of the handoff socket as @param. Replaces any stale socket
+// file at the path and listens on it for a successor. Returns the
+// listening socket, else returns -1.
+int handoff_listen(const char* path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || !handoff_address(path, &addr)) {
+        return -1;
+    }
+    unlink(path);
+    handoff_buffers(sock);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Takes the path of the handoff socket as @param and connects to the
+// server listening on it. Returns the connected socket, else returns -1.
+int handoff_connect(const char* path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || !handoff_address(path, &addr)) {
+        return -1;
+    }
+    handoff_buffers(sock);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Takes the handoff socket, a record, its payload and a file descriptor to
+// pass (or -1) as @param. Sends them as a single message, the descriptor
+// as SCM_RIGHTS ancillary data. Returns true on success.
+bool handoff_send(int sock, HandoffRecord* rec, HandoffPayload* payload,
+        int fd) {
+    char* parts[3] = {payload->name, payload->token, payload->data};
+    unsigned int lens[3] = {rec->nameLen, rec->tokenLen, rec->dataLen};
+    struct iovec iov[4];
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(HandoffRecord);
+    for (int idx = 0; idx < 3; idx++) {
+        iov[idx + 1].iov_base = parts[idx];
+        iov[idx + 1].iov_len = lens[idx];
+    }
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 4;
+    if (fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, 0) >= 0;
+}
+
+// Takes the handoff socket and where to put the record, its payload and a
+// passed file descriptor as @param. Receives the next message, setting fd
+// to -1 if no descriptor came with it. Returns true on success, the
+// payload should be freed later.
+bool handoff_recv(int sock, HandoffRecord* rec, HandoffPayload* payload,
+        int* fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t size = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (size < (ssize_t) sizeof(HandoffRecord)) {
+        return false;
+    }
+    char* buf = malloc(size);
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != size) {
+        free(buf);
+        return false;
+    }
+    *fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    memcpy(rec, buf, sizeof(HandoffRecord));
+    char* part = buf + sizeof(HandoffRecord);
+    if (sizeof(HandoffRecord) + (size_t) rec->nameLen + rec->tokenLen +
+            rec->dataLen != (size_t) size) {
+        free(buf);
+        return false;
+    }
+    payload->name = strndup(part, rec->nameLen);
+    part += rec->nameLen;
+    payload->token = strndup(part, rec->tokenLen);
+    part += rec->tokenLen;
+    payload->data = malloc(rec->dataLen + 1);
+    memcpy(payload->data, part, rec->dataLen);
+    payload->data[rec->dataLen] = '\0';
+    free(buf);
+    return true;
+}
+
+// Takes a received payload as @param and deallocates its parts.
+void free_handoff_payload(HandoffPayload* payload) {
+    free(payload->name);
+    free(payload->token);
+    free(payload->data);
+}
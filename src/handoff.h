@@ -0,0 +1,61 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// Bumped whenever the records below change, a server only takes over from
+// a predecessor speaking the same version.
+#define HANDOFF_VERSION 2
+#define HANDOFF_SOCKET_BUFFER (4 * 1024 * 1024)
+#define HANDOFF_OUTPUT_CHUNK (64 * 1024) // output bytes sent per record
+
+// Kinds of record sent from a running server to its successor
+typedef enum HandoffType {
+    HANDOFF_HELLO,      // counts[0] holds HANDOFF_VERSION
+    HANDOFF_LISTEN,     // carries the listening socket
+    HANDOFF_COUNTS,     // server command counts, seq is the last history seq
+    HANDOFF_HISTORY,    // one history frame, with its seq and sign
+    HANDOFF_PRESENCE,   // one pending presence change, name and sign
+    HANDOFF_OUTPUT,     // part of the next client's unsent output
+    HANDOFF_CLIENT,     // one roster node, with its socket when attached
+    HANDOFF_END
+} HandoffType;
+
+// Fixed part of a handoff record. The name, token and data bytes follow it
+// in the same message, and a socket may travel with it via SCM_RIGHTS.
+typedef struct HandoffRecord {
+    int type;
+    int counts[6];
+    unsigned int caps;
+    long age;            // seconds a client has been detached, -1 if not
+    unsigned long seq;
+    char sign;
+    unsigned int nameLen;
+    unsigned int tokenLen;
+    unsigned int dataLen;
+} HandoffRecord;
+
+// Variable length parts of a record, received strings are NUL terminated
+typedef struct HandoffPayload {
+    char* name;
+    char* token;
+    char* data;
+} HandoffPayload;
+
+bool handoff_address(const char* path, struct sockaddr_un* addr);
+void handoff_buffers(int sock);
+int handoff_listen(const char* path);
+int handoff_connect(const char* path);
+bool handoff_send(int sock, HandoffRecord* rec, HandoffPayload* payload,
+        int fd);
+bool handoff_recv(int sock, HandoffRecord* rec, HandoffPayload* payload,
+        int* fd);
+void free_handoff_payload(HandoffPayload* payload);
+
+#endif
@@ -0,0 +1,73 @@
+#include "history.h"
+
+// Takes the number of frames to remember as @param, allocates an empty
+// History ring and returns it.
+History* init_history(size_t capacity) {
+    History* history = malloc(sizeof(History));
+    history->entries = calloc(capacity, sizeof(HistoryEntry));
+    history->capacity = capacity;
+    history->lastSeq = 0;
+    history->counters = NULL;
+    return history;
+}
+
+// Takes the history ring, a malloc'd broadcast frame and its presence sign
+// (0 for chat frames) as @param. Takes ownership of the frame and stores
+// it under the next sequence number, dropping the oldest frame once the
+// ring is full. Frames are counted as held from here on, if the ring has
+// counters. Returns the sequence number. Caller holds the lock.
+unsigned long history_append(History* history, char* frame,
+        char presenceSign) {
+    unsigned long seq = ++history->lastSeq;
+    HistoryEntry* slot = &history->entries[seq % history->capacity];
+    mem_free(history->counters, slot->frame);
+    mem_count_alloc(history->counters, frame);
+    slot->seq = seq;
+    slot->frame = frame;
+    slot->presenceSign = presenceSign;
+    return seq;
+}
+
+// Takes the history ring, the last sequence number a client has seen, the
+// client's write end and whether the client takes coalesced presence as
+// @param. Writes every remembered frame after afterSeq as "SEQ:seq:frame"
+// and returns the number of frames written. With coalescePresence the
+// ENTER:/LEAVE: frames are folded into one trailing PRESENCE: frame.
+// Frames that have already fallen out of the ring are skipped, the client
+// can spot the gap from the sequence numbers. Caller holds the lock.
+int history_replay(History* history, unsigned long afterSeq, FILE* wrEnd,
+        bool coalescePresence) {
+    PresenceDelta* delta = coalescePresence ? init_presence_delta() : NULL;
+    unsigned long seq = afterSeq + 1;
+    int count = 0;
+    if (history->lastSeq >= history->capacity &&
+            seq <= history->lastSeq - history->capacity) {
+        seq = history->lastSeq - history->capacity + 1;
+    }
+    for (; seq <= history->lastSeq; seq++) {
+        HistoryEntry* entry = &history->entries[seq % history->capacity];
+        if (entry->seq != seq || entry->frame == NULL) {
+            continue;
+        }
+        if (delta != NULL && entry->presenceSign != 0) {
+            char* name = strchr(entry->frame, COLON_ASCII) + 1;
+            name = strndup(name, strcspn(name, "\n"));
+            presence_add(delta, name, entry->presenceSign);
+            free(name);
+        } else {
+            fprintf(wrEnd, "SEQ:%lu:%s", seq, entry->frame);
+            count++;
+        }
+    }
+    if (delta != NULL) {
+        char* frame = presence_frame(delta);
+        if (frame != NULL) {
+            fprintf(wrEnd, "SEQ:%lu:%s", history->lastSeq, frame);
+            count++;
+        }
+        free(frame);
+        free_presence_delta(delta);
+    }
+    fflush(wrEnd);
+    return count;
+}
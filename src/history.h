@@ -0,0 +1,36 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "presence.h"
+#include "memtrack.h"
+
+// A broadcast frame together with the sequence number it was sent with.
+// For ENTER:/LEAVE: frames presenceSign is PRESENCE_ENTER/PRESENCE_LEAVE,
+// else it is 0.
+typedef struct HistoryEntry {
+    unsigned long seq;
+    char* frame;
+    char presenceSign;
+} HistoryEntry;
+
+// Ring buffer of the most recent broadcast frames. Sequence numbers start
+// at 1 and are handed out in broadcast order, so a client that knows the
+// last sequence number it saw can be sent exactly what it missed.
+typedef struct History {
+    HistoryEntry* entries;
+    size_t capacity;
+    unsigned long lastSeq;
+    MemCounters* counters;   // frames held are counted here, if set
+} History;
+
+History* init_history(size_t capacity);
+unsigned long history_append(History* history, char* frame,
+        char presenceSign);
+int history_replay(History* history, unsigned long afterSeq, FILE* wrEnd,
+        bool coalescePresence);
+
+#endif
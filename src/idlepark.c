@@ -0,0 +1,49 @@
+#include "idlepark.h"
+
+// Takes the parker to set up, the function handing woken connections back
+// and its argument as @param and starts the parker thread.
+void init_idle_parker(IdleParker* parker, IdleWake wake, void* arg) {
+    parker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    parker->wake = wake;
+    parker->arg = arg;
+    parker->parked = 0;
+    parker->parks = 0;
+    parker->wakes = 0;
+    pthread_create(&parker->thread, NULL, idle_parker_thread, parker);
+    pthread_detach(parker->thread);
+}
+
+// Takes the parker, a connection's socket, the connection and whether its
+// socket was watched before as @param, and watches the socket until it is
+// readable. The caller must leave the connection alone from then on, it
+// may be woken before this returns.
+void idle_park(IdleParker* parker, int fd, void* conn, bool* watched) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    int op = *watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    *watched = true;
+    __atomic_add_fetch(&parker->parked, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&parker->parks, 1, __ATOMIC_RELAXED);
+    epoll_ctl(parker->epollFd, op, fd, &event);
+}
+
+// Parker thread function, takes a pointer to the IdleParker struct as
+// @param. Waits for parked sockets to become readable and wakes their
+// connections.
+void* idle_parker_thread(void* arg) {
+    IdleParker* parker = arg;
+    struct epoll_event events[IDLE_EVENTS];
+    while (1) {
+        int ready = epoll_wait(parker->epollFd, events, IDLE_EVENTS, -1);
+        if (ready < 0 && errno != EINTR) {
+            return NULL;
+        }
+        for (int idx = 0; idx < ready; idx++) {
+            __atomic_sub_fetch(&parker->parked, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&parker->wakes, 1, __ATOMIC_RELAXED);
+            parker->wake(events[idx].data.ptr, parker->arg);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef IDLEPARK_H
+#define IDLEPARK_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define IDLE_EVENTS 64
+
+// Called by the parker thread with a parked connection that became
+// readable and the argument the parker was set up with
+typedef void (*IdleWake)(void* conn, void* arg);
+
+// Connections that have been quiet for a while give up their thread and
+// wait here instead: one thread watches all of their sockets through epoll
+// and hands each back through wake once it is readable or hung up on. A
+// socket is watched once per park, so a woken connection is not reported
+// again until it parks anew.
+typedef struct IdleParker {
+    int epollFd;
+    pthread_t thread;
+    IdleWake wake;
+    void* arg;
+    // Read by the admin socket
+    long parked;                   // gauge: connections without a thread
+    unsigned long parks;
+    unsigned long wakes;
+} IdleParker;
+
+void init_idle_parker(IdleParker* parker, IdleWake wake, void* arg);
+void idle_park(IdleParker* parker, int fd, void* conn, bool* watched);
+void* idle_parker_thread(void* arg);
+
+#endif
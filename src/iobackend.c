@@ -0,0 +1,236 @@
+#include "iobackend.h"
+
+// Takes the backend and the name asked for ("uring" or "threads") as
+// @param and sets the backend up. Falls back to the threaded backend when
+// io_uring cannot be set up or lacks the accept and send operations
+// (kernels before 5.6 cannot even be asked), so an unavailable io_uring is
+// never fatal.
+void init_io_backend(IoBackend* io, const char* name) {
+    memset(io, 0, sizeof(IoBackend));
+    io->kind = IO_THREADS;
+    io->sendRing.fd = io->acceptRing.fd = -1;
+    if (name == NULL || strcmp(name, "uring")) {
+        return;
+    }
+    if (uring_init(&io->sendRing, IO_RING_ENTRIES) &&
+            uring_init(&io->acceptRing, IO_ACCEPT_QUEUE) &&
+            uring_supports(&io->sendRing, IORING_OP_SEND) &&
+            uring_supports(&io->acceptRing, IORING_OP_ACCEPT)) {
+        io->kind = IO_URING;
+    } else {
+        uring_free(&io->sendRing);
+        uring_free(&io->acceptRing);
+    }
+}
+
+// Takes the backend as @param and returns its name.
+const char* io_backend_name(IoBackend* io) {
+    return io->kind == IO_URING ? "uring" : "threads";
+}
+
+// Takes the backend, the listening socket and where to store the peer's
+// address as @param and returns the next accepted connection, else a
+// negative value on failure, with errno set. The io_uring backend keeps one
+// multishot accept armed and hands out every socket it completes, so a
+// burst of connections is collected with one wait; the peer address is
+// then looked up separately, as a multishot accept has nowhere to put it.
+// Should the kernel turn the multishot flag down, single accepts are armed
+// one after the other instead.
+int io_accept(IoBackend* io, int listenFd, struct sockaddr* addr,
+        socklen_t* addrLen) {
+    if (io->kind == IO_THREADS) {
+        return accept(listenFd, addr, addrLen);
+    }
+    while (io->acceptLen == 0) {
+        // Completions that do not fit the queue stay in the ring
+        struct io_uring_cqe* cqe;
+        while (io->acceptLen < IO_ACCEPT_QUEUE &&
+                (cqe = uring_peek_cqe(&io->acceptRing)) != NULL) {
+            if (cqe->res == -EINVAL && !io->acceptSingle) {
+                // Kernels before 5.19 reject the multishot flag, from
+                // now on one accept is armed per connection
+                io->acceptSingle = true;
+                io->acceptArmed = false;
+                uring_cqe_seen(&io->acceptRing);
+                continue;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                io->acceptArmed = false; // rearmed on the next wait
+            }
+            int tail = (io->acceptHead + io->acceptLen) % IO_ACCEPT_QUEUE;
+            io->acceptQueue[tail] = cqe->res; // errors are handed out too
+            io->acceptLen += 1;
+            uring_cqe_seen(&io->acceptRing);
+        }
+        if (io->acceptLen > 0) {
+            break;
+        }
+        if (!io->acceptArmed) {
+            struct io_uring_sqe* sqe = uring_get_sqe(&io->acceptRing);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listenFd;
+            sqe->ioprio = io->acceptSingle ? 0 : IORING_ACCEPT_MULTISHOT;
+            io->acceptArmed = true;
+        }
+        if (uring_submit(&io->acceptRing, 1) < 0) {
+            return -1;
+        }
+    }
+    int fd = io->acceptQueue[io->acceptHead];
+    io->acceptHead = (io->acceptHead + 1) % IO_ACCEPT_QUEUE;
+    io->acceptLen -= 1;
+    if (fd < 0) {
+        errno = -fd;
+        return -1;
+    }
+    if (getpeername(fd, addr, addrLen) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Takes a socket, the bytes meant for it, how many of them have already
+// been sent and the system call counter as @param and writes the rest,
+// giving up on the socket at the first error.
+void io_write_rest(int fd, const char* data, size_t len, size_t done,
+        unsigned long* syscalls) {
+    while (done < len) {
+        ssize_t got = write(fd, data + done, len - done);
+        *syscalls += 1;
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return;
+        }
+        done += got;
+    }
+}
+
+// Takes the backend and a batch of sends as @param and writes every one,
+// returning once all are done. Failed recipients are skipped, their own
+// threads notice the broken connection. The threaded backend issues one
+// writev per recipient. The io_uring backend queues a send of the prefix
+// linked to a send of the shared frame for each recipient and submits the
+// whole batch with a single io_uring_enter (one per ring's worth).
+// Recipients with an outbox are never waited for: what their socket does
+// not take at once is queued on the outbox.
+void io_send_batch(IoBackend* io, IoSend* sends, int noOfSends) {
+    unsigned long syscalls = 0;
+    if (io->kind == IO_THREADS) {
+        for (int idx = 0; idx < noOfSends; idx++) {
+            IoSend* send = &sends[idx];
+            struct iovec iov[2] = {{send->prefix, send->prefixLen},
+                    {(void*) send->data, send->len}};
+            if (send->outbox != NULL) {
+                struct msghdr msg = {0};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = 2;
+                ssize_t got = sendmsg(send->fd, &msg,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+                syscalls += 1;
+                send->sent = got > 0 ? got : 0;
+                continue;
+            }
+            ssize_t got = writev(send->fd, iov, 2);
+            syscalls += 1;
+            if (got >= 0 && (size_t) got < send->prefixLen + send->len) {
+                size_t fromData = got > (ssize_t) send->prefixLen ?
+                        got - send->prefixLen : 0;
+                io_write_rest(send->fd, send->prefix, send->prefixLen,
+                        got < (ssize_t) send->prefixLen ? got :
+                        send->prefixLen, &syscalls);
+                io_write_rest(send->fd, send->data, send->len, fromData,
+                        &syscalls);
+            }
+        }
+    } else {
+        uring_send_batch(&io->sendRing, sends, noOfSends, &syscalls);
+    }
+    for (int idx = 0; idx < noOfSends; idx++) {
+        IoSend* send = &sends[idx];
+        if (send->outbox != NULL &&
+                send->sent < send->prefixLen + send->len) {
+            outbox_queue_rest(send->outbox, send->prefix, send->prefixLen,
+                    send->data, send->len, send->sent);
+        }
+    }
+    // Counted atomically, the admin socket reads them without the lock
+    __atomic_add_fetch(&io->sendSyscalls, syscalls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&io->sends, noOfSends, __ATOMIC_RELAXED);
+}
+
+// Takes the send ring, a batch of sends and the system call counter as
+// @param. Queues a send of each prefix linked to a send of the shared
+// frame and submits as many as the ring holds with one io_uring_enter,
+// waiting for all of them to complete. Sends to recipients with an outbox
+// do not wait for socket space and just count what they wrote.
+void uring_send_batch(Uring* ring, IoSend* sends, int noOfSends,
+        unsigned long* syscalls) {
+    int next = 0;
+    while (next < noOfSends) {
+        unsigned queued = 0;
+        while (next < noOfSends && queued + 2 <= ring->entries) {
+            IoSend* send = &sends[next];
+            unsigned int msgFlags = MSG_NOSIGNAL | (send->outbox != NULL ?
+                    MSG_DONTWAIT : MSG_WAITALL);
+            send->resend = false;
+            send->sent = 0;
+            if (send->prefixLen > 0) {
+                struct io_uring_sqe* sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = send->fd;
+                sqe->addr = (unsigned long) send->prefix;
+                sqe->len = send->prefixLen;
+                sqe->msg_flags = msgFlags;
+                sqe->flags = IOSQE_IO_LINK; // frame only after its prefix
+                sqe->user_data = next * 2;
+                queued++;
+            }
+            struct io_uring_sqe* sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = send->fd;
+            sqe->addr = (unsigned long) send->data;
+            sqe->len = send->len;
+            sqe->msg_flags = msgFlags;
+            sqe->user_data = next * 2 + 1;
+            queued++;
+            next++;
+        }
+        uring_submit(ring, queued);
+        *syscalls += 1;
+        while (queued > 0) {
+            struct io_uring_cqe* cqe = uring_peek_cqe(ring);
+            if (cqe == NULL) {
+                uring_submit(ring, 1); // interrupted before all completed
+                *syscalls += 1;
+                continue;
+            }
+            IoSend* send = &sends[cqe->user_data / 2];
+            bool isData = cqe->user_data % 2;
+            size_t len = isData ? send->len : send->prefixLen;
+            if (send->outbox != NULL) {
+                // A short prefix cancels its frame, so the bytes sent are
+                // always a leading part of prefix and frame
+                send->sent += cqe->res > 0 ? cqe->res : 0;
+            } else if (cqe->res >= 0 && (size_t) cqe->res < len) {
+                // Short send: finish it before the lock is released so no
+                // other frame can cut in. A short prefix breaks the link,
+                // so its frame comes back cancelled and is written here.
+                if (isData) {
+                    io_write_rest(send->fd, send->data, len, cqe->res,
+                            syscalls);
+                } else {
+                    io_write_rest(send->fd, send->prefix, len, cqe->res,
+                            syscalls);
+                    send->resend = true;
+                }
+            } else if (isData && cqe->res == -ECANCELED && send->resend) {
+                io_write_rest(send->fd, send->data, len, 0, syscalls);
+            }
+            uring_cqe_seen(ring);
+            queued--;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include "uring.h"
+#include "outbox.h"
+
+#define IO_PREFIX_SIZE 32
+#define IO_RING_ENTRIES 256
+#define IO_ACCEPT_QUEUE 64
+
+// How the server accepts connections and writes broadcast frames
+typedef enum IoBackendKind {
+    IO_THREADS,  // accept(2) and one writev(2) per recipient
+    IO_URING     // multishot accept and linked sends, one enter per batch
+} IoBackendKind;
+
+// One recipient of a broadcast: an optional per-recipient prefix (the
+// "SEQ:n:" of resuming clients) followed by the shared frame. A recipient
+// with an outbox is written without blocking, the rest going to its
+// outbox.
+typedef struct IoSend {
+    int fd;
+    char prefix[IO_PREFIX_SIZE];
+    size_t prefixLen;
+    const char* data;
+    size_t len;
+    bool resend;   // a short prefix cancelled the linked frame
+    Outbox* outbox;
+    size_t sent;   // bytes written to a recipient with an outbox
+} IoSend;
+
+// Structure to store the I/O backend and its system call counters. Sends
+// go through sendRing under the server's global lock; acceptRing belongs
+// to the accepting thread.
+typedef struct IoBackend {
+    IoBackendKind kind;
+    Uring sendRing;
+    Uring acceptRing;
+    bool acceptArmed;
+    bool acceptSingle;                // kernel without multishot accept
+    int acceptQueue[IO_ACCEPT_QUEUE]; // accepted sockets not yet handed out
+    int acceptHead;
+    int acceptLen;
+    unsigned long sendSyscalls;
+    unsigned long sends;              // recipients written to
+} IoBackend;
+
+void init_io_backend(IoBackend* io, const char* name);
+const char* io_backend_name(IoBackend* io);
+int io_accept(IoBackend* io, int listenFd, struct sockaddr* addr,
+        socklen_t* addrLen);
+void io_write_rest(int fd, const char* data, size_t len, size_t done,
+        unsigned long* syscalls);
+void io_send_batch(IoBackend* io, IoSend* sends, int noOfSends);
+void uring_send_batch(Uring* ring, IoSend* sends, int noOfSends,
+        unsigned long* syscalls);
+
+#endif
@@ -0,0 +1,178 @@
+#include "linereader.h"
+
+// Takes a reader and the file descriptor to read from as @param and
+// initializes the reader without a buffer.
+void init_line_reader(LineReader* reader, int fd) {
+    reader->fd = fd;
+    reader->shm = NULL;
+    reader->capacity = 0;
+    reader->buf = NULL;
+    reader->start = 0;
+    reader->end = 0;
+    reader->interrupted = false;
+    reader->maxLine = 0;
+    reader->overlong = false;
+    reader->skipping = false;
+    reader->pool = NULL;
+    reader->pooled = false;
+    reader->counters = NULL;
+}
+
+// Takes a reader as @param and deallocates its buffer, giving it back to
+// the pool it came from. The file descriptor is left open.
+void free_line_reader(LineReader* reader) {
+    if (reader->pooled) {
+        buffer_pool_give(reader->pool, reader->buf);
+    } else {
+        free(reader->buf);
+    }
+    reader->buf = NULL;
+    reader->pooled = false;
+    reader->capacity = 0;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+// Takes a reader and a number of bytes as @param and makes room for that
+// many more bytes after the ones it holds. A reader without a buffer takes
+// one from its pool; one that outgrows its pooled buffer moves to a larger
+// buffer of its own and gives the pooled one back.
+void line_reader_grow(LineReader* reader, size_t len) {
+    if (reader->buf == NULL && reader->pool != NULL) {
+        reader->buf = buffer_pool_take(reader->pool);
+        reader->capacity = reader->pool->size;
+        reader->pooled = true;
+    }
+    size_t capacity = reader->capacity ? reader->capacity : LINE_READER_SIZE;
+    while (capacity - reader->end < len) {
+        capacity *= 2;
+    }
+    if (reader->buf != NULL && capacity == reader->capacity) {
+        return;
+    }
+    if (reader->pooled) {
+        char* buf = malloc(sizeof(char) * capacity);
+        memcpy(buf, reader->buf, reader->end);
+        buffer_pool_give(reader->pool, reader->buf);
+        reader->buf = buf;
+        reader->pooled = false;
+    } else {
+        reader->buf = realloc(reader->buf, sizeof(char) * capacity);
+    }
+    reader->capacity = capacity;
+}
+
+// Takes a reader as @param and frees its buffer if it holds no bytes, so
+// that an idle connection costs none. Returns true if it did.
+bool line_reader_release(LineReader* reader) {
+    if (reader->start < reader->end) {
+        return false;
+    }
+    free_line_reader(reader);
+    return true;
+}
+
+// Takes a reader as @param. Returns true if a whole line is already
+// buffered, so read_line returns it without reading.
+bool line_reader_has_line(LineReader* reader) {
+    return reader->start < reader->end && memchr(reader->buf + reader->start,
+            '\n', reader->end - reader->start) != NULL;
+}
+
+// Takes a reader, some bytes and their length as @param and appends the
+// bytes to the reader's buffer, as if they had been read from its socket.
+void line_reader_prefill(LineReader* reader, char* data, size_t len) {
+    line_reader_grow(reader, len);
+    memcpy(reader->buf + reader->end, data, len);
+    reader->end += len;
+}
+
+// Takes a reader whose read_line gave up on an overlong line as @param.
+// Drops what it holds of that line and has read_line drop the rest as it
+// comes in, then carry on with the next line.
+void line_reader_skip_line(LineReader* reader) {
+    char* newline = memchr(reader->buf + reader->start, '\n',
+            reader->end - reader->start);
+    if (newline != NULL) {
+        reader->start = newline + 1 - reader->buf;
+    } else {
+        reader->start = reader->end = 0;
+        reader->skipping = true;
+    }
+    reader->overlong = false;
+}
+
+// Takes a reader as @param and returns the next line without its newline.
+// If EOF is reached part way through a line, the partial line is returned.
+// Returns NULL on EOF, on a read error, with overlong set once the line
+// runs past the reader's maxLine, so that the buffer stops growing, or,
+// with interrupted set, when a signal cuts the read short; the bytes of an
+// incomplete line stay in the buffer. The returned value should be freed
+// later, through the reader's counters.
+char* read_line(LineReader* reader) {
+    reader->interrupted = false;
+    if (reader->buf == NULL) {
+        line_reader_grow(reader, 1);
+    }
+    while (1) {
+        char* newline = memchr(reader->buf + reader->start, '\n',
+                reader->end - reader->start);
+        if (newline != NULL && reader->skipping) {
+            reader->start = newline + 1 - reader->buf;
+            reader->skipping = false;
+            continue;
+        }
+        if (newline != NULL) {
+            size_t len = newline - (reader->buf + reader->start);
+            if (reader->maxLine > 0 && len > reader->maxLine) {
+                reader->overlong = true;
+                return NULL;
+            }
+            char* line = mem_strndup(reader->counters,
+                    reader->buf + reader->start, len);
+            reader->start += len + 1;
+            return line;
+        }
+        if (reader->skipping) {
+            reader->start = reader->end = 0;
+        }
+        if (reader->start > 0) { // Move the incomplete line to the front
+            memmove(reader->buf, reader->buf + reader->start,
+                    reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->maxLine > 0 && reader->end > reader->maxLine) {
+            reader->overlong = true;
+            return NULL;
+        }
+        if (reader->end == reader->capacity) {
+            line_reader_grow(reader, 1);
+        }
+        ssize_t got = reader->shm ?
+                shm_ring_read(reader->shm, reader->buf + reader->end,
+                reader->capacity - reader->end) :
+                read(reader->fd, reader->buf + reader->end,
+                reader->capacity - reader->end);
+        if (got > 0) {
+            reader->end += got;
+        } else if (got < 0 && errno == EINTR) {
+            reader->interrupted = true;
+            return NULL;
+        } else if (got < 0 && errno == EAGAIN) {
+            // The socket is non-blocking for its outbox's sake
+            struct pollfd pollFd = {reader->fd, POLLIN, 0};
+            if (poll(&pollFd, 1, -1) < 0 && errno == EINTR) {
+                reader->interrupted = true;
+                return NULL;
+            }
+        } else if (got == 0 && reader->end > 0 && !reader->skipping) {
+            char* line = mem_strndup(reader->counters, reader->buf,
+                    reader->end);
+            reader->end = 0;
+            return line;
+        } else {
+            return NULL;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include "shmring.h"
+#include "bufpool.h"
+#include "memtrack.h"
+
+#define LINE_READER_SIZE 256
+
+// Buffered line reader over a socket, or over the incoming ring of a
+// shared memory channel. Unlike a FILE* stream the bytes read ahead of the
+// current line stay visible, so they can be handed to another process
+// along with the socket. The buffer is only there while the reader has
+// something to read: it comes from the pool, if the reader has one, and is
+// given back when the reader is released between lines.
+typedef struct LineReader {
+    int fd;
+    ShmChannel* shm;    // read from this channel instead of fd if set
+    char* buf;          // NULL until there is something to read
+    size_t start;       // first unconsumed byte
+    size_t end;         // one past the last byte read
+    size_t capacity;
+    bool interrupted;   // the last read_line was cut short by a signal
+    size_t maxLine;     // longest line read, 0 for no limit
+    bool overlong;      // the last read_line gave up on a longer one
+    bool skipping;      // dropping the rest of that line as it comes in
+    BufferPool* pool;   // buffers come from here, if set
+    bool pooled;        // buf was taken from the pool
+    MemCounters* counters; // lines are counted here, if set
+} LineReader;
+
+void init_line_reader(LineReader* reader, int fd);
+void free_line_reader(LineReader* reader);
+void line_reader_grow(LineReader* reader, size_t len);
+bool line_reader_release(LineReader* reader);
+bool line_reader_has_line(LineReader* reader);
+void line_reader_prefill(LineReader* reader, char* data, size_t len);
+void line_reader_skip_line(LineReader* reader);
+char* read_line(LineReader* reader);
+
+#endif
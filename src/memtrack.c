@@ -0,0 +1,121 @@
+#include "memtrack.h"
+
+// Takes a MemSubsystem as @param and returns its name as reported by the
+// stats output.
+const char* mem_subsystem_name(int subsystem) {
+    const char* names[] = {"parser", "roster", "fanout", "handshake"};
+    return names[subsystem];
+}
+
+// Takes an array of counters and its length as @param and zeroes them.
+void init_mem_counters(MemCounters* counters, int count) {
+    memset(counters, 0, sizeof(MemCounters) * count);
+}
+
+// Takes a subsystem's counters (or NULL) and a block just allocated for it
+// as @param and counts the block as held, raising the peak if need be.
+void mem_count_alloc(MemCounters* counters, void* ptr) {
+    if (counters == NULL || ptr == NULL) {
+        return;
+    }
+    long size = malloc_usable_size(ptr);
+    long live = __atomic_add_fetch(&counters->live, size, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&counters->peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&counters->peak,
+            &peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&counters->blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->allocs, 1, __ATOMIC_RELAXED);
+}
+
+// Takes a subsystem's counters (or NULL) and a block about to be freed or
+// reallocated as @param and counts the block as no longer held.
+void mem_count_free(MemCounters* counters, void* ptr) {
+    if (counters == NULL || ptr == NULL) {
+        return;
+    }
+    long size = malloc_usable_size(ptr);
+    __atomic_sub_fetch(&counters->live, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&counters->blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->frees, 1, __ATOMIC_RELAXED);
+}
+
+// Takes a subsystem's counters (or NULL, for an untracked block) and a size
+// as @param. Returns a block allocated as malloc does, counted as held.
+void* mem_alloc(MemCounters* counters, size_t size) {
+    void* ptr = malloc(size);
+    mem_count_alloc(counters, ptr);
+    return ptr;
+}
+
+// Takes a subsystem's counters (or NULL), a number of elements and their
+// size as @param. Returns a zeroed block allocated as calloc does, counted
+// as held.
+void* mem_calloc(MemCounters* counters, size_t count, size_t size) {
+    void* ptr = calloc(count, size);
+    mem_count_alloc(counters, ptr);
+    return ptr;
+}
+
+// Takes a subsystem's counters (or NULL), a block allocated through them
+// (or NULL) and its new size as @param. Returns the block resized as
+// realloc does, counted at its new size.
+void* mem_realloc(MemCounters* counters, void* ptr, size_t size) {
+    mem_count_free(counters, ptr);
+    ptr = realloc(ptr, size);
+    mem_count_alloc(counters, ptr);
+    return ptr;
+}
+
+// Takes a subsystem's counters (or NULL) and a string as @param. Returns a
+// copy of the string, counted as held.
+char* mem_strdup(MemCounters* counters, const char* str) {
+    char* copy = strdup(str);
+    mem_count_alloc(counters, copy);
+    return copy;
+}
+
+// Takes a subsystem's counters (or NULL), a string and the most bytes of it
+// to copy as @param. Returns a NUL terminated copy, counted as held.
+char* mem_strndup(MemCounters* counters, const char* str, size_t len) {
+    char* copy = strndup(str, len);
+    mem_count_alloc(counters, copy);
+    return copy;
+}
+
+// Takes a subsystem's counters (or NULL) and a block allocated through
+// them (or NULL) as @param and frees the block.
+void mem_free(MemCounters* counters, void* ptr) {
+    mem_count_free(counters, ptr);
+    free(ptr);
+}
+
+// Takes an array of counters, where to copy them and how many there are as
+// @param and copies each of them, field by field, without stopping the
+// threads updating them.
+void mem_snapshot(MemCounters* counters, MemCounters* snap, int count) {
+    for (int idx = 0; idx < count; idx++) {
+        snap[idx].live = __atomic_load_n(&counters[idx].live,
+                __ATOMIC_RELAXED);
+        snap[idx].peak = __atomic_load_n(&counters[idx].peak,
+                __ATOMIC_RELAXED);
+        snap[idx].blocks = __atomic_load_n(&counters[idx].blocks,
+                __ATOMIC_RELAXED);
+        snap[idx].allocs = __atomic_load_n(&counters[idx].allocs,
+                __ATOMIC_RELAXED);
+        snap[idx].frees = __atomic_load_n(&counters[idx].frees,
+                __ATOMIC_RELAXED);
+    }
+}
+
+// Takes the output stream and a snapshot of every subsystem's counters as
+// @param and writes one line per subsystem, in the form of the SIGHUP
+// statistics.
+void display_mem_counters(FILE* out, MemCounters* counters) {
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        fprintf(out, "%s:LIVE:%ld:PEAK:%ld:BLOCKS:%ld:ALLOCS:%lu:FREES:%lu"
+                "\n", mem_subsystem_name(idx), counters[idx].live,
+                counters[idx].peak, counters[idx].blocks,
+                counters[idx].allocs, counters[idx].frees);
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <malloc.h>
+
+// Parts of the server whose heap use is accounted on its own
+typedef enum MemSubsystem {
+    MEM_PARSER,       // lines read from clients, until they are handled
+    MEM_ROSTER,       // client list nodes, with their interned names
+    MEM_FANOUT,       // broadcast frames kept in the history, and batches
+    MEM_HANDSHAKE,    // connection state set up at accept, and its name
+    NO_OF_MEM_SUBSYSTEMS
+} MemSubsystem;
+
+// Heap use of one subsystem. Blocks are counted at the size the allocator
+// gave them (malloc_usable_size), so that a block freed through the
+// wrong counters or not at all shows up as drift. Updated with atomics,
+// each subsystem on a cache line of its own.
+typedef struct MemCounters {
+    long live __attribute__((aligned(64))); // gauge: bytes held
+    long peak;                     // gauge: most bytes held at once
+    long blocks;                   // gauge: allocations held
+    unsigned long allocs;          // allocations made
+    unsigned long frees;
+} MemCounters;
+
+const char* mem_subsystem_name(int subsystem);
+void init_mem_counters(MemCounters* counters, int count);
+void mem_count_alloc(MemCounters* counters, void* ptr);
+void mem_count_free(MemCounters* counters, void* ptr);
+void* mem_alloc(MemCounters* counters, size_t size);
+void* mem_calloc(MemCounters* counters, size_t count, size_t size);
+void* mem_realloc(MemCounters* counters, void* ptr, size_t size);
+char* mem_strdup(MemCounters* counters, const char* str);
+char* mem_strndup(MemCounters* counters, const char* str, size_t len);
+void mem_free(MemCounters* counters, void* ptr);
+void mem_snapshot(MemCounters* counters, MemCounters* snap, int count);
+void display_mem_counters(FILE* out, MemCounters* counters);
+
+#endif
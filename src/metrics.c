@@ -0,0 +1,165 @@
+#include "metrics.h"
+
+// Takes the metrics struct as @param and zeroes every counter, recording
+// the start time.
+void init_metrics(Metrics* metrics) {
+    Metrics empty = {0};
+    *metrics = empty;
+    metrics->startedAt = time(NULL);
+}
+
+// Returns the monotonic clock in nanoseconds.
+unsigned long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Takes a counter and an amount as @param and adds the amount atomically.
+void metrics_add(unsigned long* counter, unsigned long delta) {
+    __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+}
+
+// Takes a gauge and a signed amount as @param and adds it atomically.
+void metrics_gauge_add(long* gauge, long delta) {
+    __atomic_add_fetch(gauge, delta, __ATOMIC_RELAXED);
+}
+
+// Takes a counter and a value as @param and raises the counter to the
+// value if it is lower.
+void metrics_max(unsigned long* counter, unsigned long value) {
+    unsigned long seen = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(counter, &seen,
+            value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Takes a counter as @param and returns its current value.
+unsigned long metrics_get(unsigned long* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Takes a gauge as @param and returns its current value.
+long metrics_gauge_get(long* gauge) {
+    return __atomic_load_n(gauge, __ATOMIC_RELAXED);
+}
+
+// Takes one of the server's command counts as @param and increments it
+// atomically, since commands are counted outside the lock.
+void metrics_count(int* count) {
+    __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+}
+
+// Takes one of the server's command counts as @param and returns it.
+int metrics_count_get(int* count) {
+    return __atomic_load_n(count, __ATOMIC_RELAXED);
+}
+
+// Takes the output stream, a metric name, its Prometheus type and help
+// text as @param and writes the metric's HELP and TYPE lines.
+void prometheus_header(FILE* out, const char* name, const char* type,
+        const char* help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Takes the output stream, a metric name, its labels (or NULL) and its
+// value as @param and writes one Prometheus sample line.
+void prometheus_value(FILE* out, const char* name, const char* labels,
+        double value) {
+    if (labels != NULL) {
+        fprintf(out, "%s{%s} %.17g\n", name, labels, value);
+    } else {
+        fprintf(out, "%s %.17g\n", name, value);
+    }
+}
+
+// Takes the output stream and a string as @param and writes the string
+// with quotes, backslashes and newlines escaped, as both JSON strings and
+// Prometheus label values require.
+void write_escaped(FILE* out, const char* str) {
+    for (; str != NULL && *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+            fputc(*str, out);
+        } else if (*str == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*str, out);
+        }
+    }
+}
+
+// Takes a duration in nanoseconds as @param. Returns the histogram bucket
+// it is counted in: the first whose bound, 2^(index + HISTOGRAM_MIN_SHIFT)
+// nanoseconds, is not below it.
+int histogram_bucket(unsigned long nanos) {
+    if (nanos <= 1UL << HISTOGRAM_MIN_SHIFT) {
+        return 0;
+    }
+    int bits = 64 - __builtin_clzl(nanos - 1);
+    int bucket = bits - HISTOGRAM_MIN_SHIFT;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Takes a histogram and a duration in nanoseconds as @param and counts the
+// duration.
+void histogram_record(Histogram* hist, unsigned long nanos) {
+    metrics_add(&hist->buckets[histogram_bucket(nanos)], 1);
+    metrics_add(&hist->count, 1);
+    metrics_add(&hist->sumNanos, nanos);
+    metrics_max(&hist->maxNanos, nanos);
+}
+
+// Takes a histogram being recorded into and where to copy it as @param
+// and copies it. Counts recorded meanwhile may make the copy's total
+// differ from its buckets' by a few.
+void histogram_snapshot(Histogram* hist, Histogram* snap) {
+    for (int idx = 0; idx < HISTOGRAM_BUCKETS; idx++) {
+        snap->buckets[idx] = metrics_get(&hist->buckets[idx]);
+    }
+    snap->count = metrics_get(&hist->count);
+    snap->sumNanos = metrics_get(&hist->sumNanos);
+    snap->maxNanos = metrics_get(&hist->maxNanos);
+}
+
+// Takes a copy of a histogram and a quantile between 0 and 1 as @param.
+// Returns the bound of the bucket the quantile falls in, in nanoseconds,
+// capped at the longest duration recorded, or 0 if nothing was.
+unsigned long histogram_quantile(Histogram* snap, double quantile) {
+    unsigned long total = 0;
+    for (int idx = 0; idx < HISTOGRAM_BUCKETS; idx++) {
+        total += snap->buckets[idx];
+    }
+    unsigned long rank = quantile * total;
+    unsigned long seen = 0;
+    for (int idx = 0; idx < HISTOGRAM_BUCKETS && total > 0; idx++) {
+        seen += snap->buckets[idx];
+        if (seen > rank || seen == total) {
+            unsigned long bound = 1UL << (idx + HISTOGRAM_MIN_SHIFT);
+            return bound < snap->maxNanos ? bound : snap->maxNanos;
+        }
+    }
+    return 0;
+}
+
+// Takes the output stream, a metric name, the labels of this series (or
+// NULL) and a copy of a histogram as @param and writes the series'
+// cumulative buckets, sum and count in seconds, in the Prometheus text
+// exposition format. The metric's header is written by the caller.
+void write_prometheus_histogram(FILE* out, const char* name,
+        const char* labels, Histogram* snap) {
+    const char* sep = labels != NULL ? "," : "";
+    labels = labels != NULL ? labels : "";
+    unsigned long seen = 0;
+    for (int idx = 0; idx < HISTOGRAM_BUCKETS - 1; idx++) {
+        seen += snap->buckets[idx];
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, sep,
+                (double) (1UL << (idx + HISTOGRAM_MIN_SHIFT)) / 1e9, seen);
+    }
+    seen += snap->buckets[HISTOGRAM_BUCKETS - 1];
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+            seen);
+    fprintf(out, "%s_sum{%s} %.9g\n", name, labels,
+            snap->sumNanos / 1e9);
+    fprintf(out, "%s_count{%s} %lu\n", name, labels, seen);
+}
@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define HISTOGRAM_BUCKETS 24       // powers of two from 256 ns to 2 s
+#define HISTOGRAM_MIN_SHIFT 8      // the first bucket holds up to 2^8 ns
+
+// Counters kept outside the global lock. Fields are only touched through
+// the metrics_* functions, which use atomic operations, so they can be
+// read while client threads hold the lock.
+typedef struct Metrics {
+    time_t startedAt;
+    unsigned long accepted;      // connections accepted
+    unsigned long entered;       // clients that entered the chat
+    unsigned long resumed;       // sessions resumed with RESUME:
+    unsigned long frames;        // lines written to clients by broadcasts
+    unsigned long broadcasts;
+    unsigned long directMessages;
+    unsigned long filtered;      // MSG: frames not sent to clients that
+                                 // ignore the sender or its topics
+    long roster;                 // clients in the list, detached included
+    long detached;               // clients held for a resume
+    unsigned long sequenced;     // commands applied by the sequencer
+    unsigned long sequencerBatches; // lock acquisitions by the sequencer
+    long ingressDepth;           // commands queued for the sequencer
+    long carriers;               // proxy connections carrying sessions
+    long muxSessions;            // chatters in the chat through a proxy
+    unsigned long muxFrames;     // broadcasts written once per proxy
+    long batchClients;           // clients in the list with CAP_BATCH
+    unsigned long batches;       // BATCH: frames broadcast
+    unsigned long batchedFrames; // broadcasts sent inside them
+    unsigned long lockAcquired;
+    unsigned long lockWaitNanos;
+    unsigned long lockHoldNanos;
+    unsigned long lockMaxWaitNanos;
+} Metrics;
+
+// Durations counted in buckets of powers of two nanoseconds, the last
+// bucket also holding anything longer. Recording is a few relaxed atomic
+// adds, cheap enough to leave on; quantiles are read as a bucket's bound.
+typedef struct Histogram {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sumNanos;
+    unsigned long maxNanos;
+} Histogram;
+
+void init_metrics(Metrics* metrics);
+unsigned long now_nanos(void);
+void metrics_add(unsigned long* counter, unsigned long delta);
+void metrics_gauge_add(long* gauge, long delta);
+void metrics_max(unsigned long* counter, unsigned long value);
+unsigned long metrics_get(unsigned long* counter);
+long metrics_gauge_get(long* gauge);
+void metrics_count(int* count);
+int metrics_count_get(int* count);
+void prometheus_header(FILE* out, const char* name, const char* type,
+        const char* help);
+void prometheus_value(FILE* out, const char* name, const char* labels,
+        double value);
+void write_escaped(FILE* out, const char* str);
+int histogram_bucket(unsigned long nanos);
+void histogram_record(Histogram* hist, unsigned long nanos);
+void histogram_snapshot(Histogram* hist, Histogram* snap);
+unsigned long histogram_quantile(Histogram* snap, double quantile);
+void write_prometheus_histogram(FILE* out, const char* name,
+        const char* labels, Histogram* snap);
+
+#endif
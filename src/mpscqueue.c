@@ -0,0 +1,103 @@
+#include "mpscqueue.h"
+
+// Takes a queue as @param and initializes it empty.
+void init_mpsc_queue(MpscQueue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+    queue->sleeping = 0;
+    queue->spinNanos = 0;
+}
+
+// Takes a queue and a node as @param and appends the node; safe to call
+// from any number of threads at once. Wakes the consumer if it is asleep.
+void mpsc_push(MpscQueue* queue, MpscNode* node) {
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    MpscNode* prev = __atomic_exchange_n(&queue->head, node,
+            __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL,
+                NULL, 0);
+    }
+}
+
+// Takes a queue as @param and removes its oldest node. Consumer only.
+// Returns the node, else returns NULL if the queue is empty or the next
+// node's producer is still linking it in.
+MpscNode* mpsc_pop(MpscQueue* queue) {
+    MpscNode* tail = queue->tail;
+    MpscNode* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+// Takes a queue as @param and returns true if nothing has been pushed that
+// the consumer has not popped. Consumer only.
+bool mpsc_idle(MpscQueue* queue) {
+    return queue->tail == &queue->stub &&
+            __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == &queue->stub;
+}
+
+// Takes a queue as @param and removes its oldest node, spinning briefly,
+// or for spinNanos if set, and then sleeping while there is none. Consumer
+// only. Returns the node.
+MpscNode* mpsc_pop_wait(MpscQueue* queue) {
+    int spins = 0;
+    long until = 0;
+    while (1) {
+        MpscNode* node = mpsc_pop(queue);
+        if (node != NULL) {
+            return node;
+        }
+        if (!mpsc_idle(queue) || spins++ < MPSC_SPINS ||
+                keep_spinning(&until, queue->spinNanos)) {
+            continue; // a producer may be part way through a push
+        }
+        __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (mpsc_idle(queue)) {
+            syscall(SYS_futex, &queue->sleeping, FUTEX_WAIT_PRIVATE, 1,
+                    NULL, NULL, 0);
+        }
+        __atomic_store_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST);
+        spins = 0;
+        until = 0;
+    }
+}
+
+// Takes a flag as @param and sleeps until another thread sets it with
+// futex_set_wake.
+void futex_wait_set(unsigned int* flag) {
+    while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE)) {
+        syscall(SYS_futex, flag, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    }
+}
+
+// Takes a flag as @param, sets it and wakes the thread waiting on it. The
+// flag may live on the waiter's stack, which may already be reused by the
+// time of the wake; that is harmless as futex waiters re-check on waking.
+void futex_set_wake(unsigned int* flag) {
+    __atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, flag, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,39 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "affinity.h"
+
+#define MPSC_SPINS 100  // polls of an empty queue before the consumer sleeps
+
+// Link embedded as the first member of every queued item
+typedef struct MpscNode {
+    struct MpscNode* next;
+} MpscNode;
+
+// Intrusive lock-free queue with many producers and a single consumer.
+// Producers only swap head, the consumer alone walks from tail; a stub
+// node keeps the queue from ever being truly empty, so neither side has to
+// handle a NULL end. The consumer sleeps on a futex once it runs dry and
+// producers only wake it when it says it is asleep.
+typedef struct MpscQueue {
+    MpscNode* head __attribute__((aligned(64)));  // last pushed, producers
+    MpscNode* tail __attribute__((aligned(64)));  // next to pop, consumer
+    MpscNode stub;
+    unsigned int sleeping;                        // futex word
+    long spinNanos;          // polls this long before sleeping, if set
+} MpscQueue;
+
+void init_mpsc_queue(MpscQueue* queue);
+void mpsc_push(MpscQueue* queue, MpscNode* node);
+MpscNode* mpsc_pop(MpscQueue* queue);
+bool mpsc_idle(MpscQueue* queue);
+MpscNode* mpsc_pop_wait(MpscQueue* queue);
+void futex_wait_set(unsigned int* flag);
+void futex_set_wake(unsigned int* flag);
+
+#endif
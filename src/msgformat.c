@@ -0,0 +1,59 @@
+#include "msgformat.h"
+
+// Takes where to store the prefix, with room for the name and
+// MSG_PREFIX_EXTRA bytes, a client's name and its length as @param and
+// stores the "MSG:name:" prefix of its messages there, NUL terminated.
+// Returns the length of the prefix.
+size_t build_msg_prefix(char* prefix, const char* name, size_t nameLen) {
+    size_t cmdLen = strlen(MSG_CMD);
+    memcpy(prefix, MSG_CMD, cmdLen);
+    memcpy(prefix + cmdLen, name, nameLen);
+    prefix[cmdLen + nameLen] = ':';
+    prefix[cmdLen + nameLen + 1] = '\0';
+    return cmdLen + nameLen + 1;
+}
+
+// Takes the parts of a frame, their count and where to store the frame's
+// length as @param. Returns the malloc'd frame made of the parts one after
+// the other, NUL terminated, copied as they are without any formatting.
+char* gather_frame(const struct iovec* parts, int noOfParts, size_t* len) {
+    size_t frameLen = 0;
+    for (int idx = 0; idx < noOfParts; idx++) {
+        frameLen += parts[idx].iov_len;
+    }
+    char* frame = malloc(frameLen + 1);
+    char* pos = frame;
+    for (int idx = 0; idx < noOfParts; idx++) {
+        memcpy(pos, parts[idx].iov_base, parts[idx].iov_len);
+        pos += parts[idx].iov_len;
+    }
+    *pos = '\0';
+    *len = frameLen;
+    return frame;
+}
+
+// Takes a client's "MSG:name:" prefix, its length, a message the client
+// said and where to store the frame's length as @param. Returns the
+// malloc'd "MSG:name:message" frame, newline included.
+char* msg_frame(const char* prefix, size_t prefixLen, const char* text,
+        size_t* len) {
+    struct iovec parts[3] = {
+        {(void*) prefix, prefixLen},
+        {(void*) text, strlen(text)},
+        {"\n", 1}
+    };
+    return gather_frame(parts, 3, len);
+}
+
+// Takes a command taking a name, as ENTER_CMD or LEAVE_CMD, a client's
+// name, its length and where to store the frame's length as @param.
+// Returns the malloc'd "CMD:name" frame, newline included.
+char* name_frame(const char* cmd, const char* name, size_t nameLen,
+        size_t* len) {
+    struct iovec parts[3] = {
+        {(void*) cmd, strlen(cmd)},
+        {(void*) name, nameLen},
+        {"\n", 1}
+    };
+    return gather_frame(parts, 3, len);
+}
@@ -0,0 +1,20 @@
+#ifndef MSGFORMAT_H
+#define MSGFORMAT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define MSG_CMD "MSG:"
+#define ENTER_CMD "ENTER:"
+#define LEAVE_CMD "LEAVE:"
+#define MSG_PREFIX_EXTRA (sizeof(MSG_CMD) + 1) // "MSG:", ":" and NUL
+
+size_t build_msg_prefix(char* prefix, const char* name, size_t nameLen);
+char* gather_frame(const struct iovec* parts, int noOfParts, size_t* len);
+char* msg_frame(const char* prefix, size_t prefixLen, const char* text,
+        size_t* len);
+char* name_frame(const char* cmd, const char* name, size_t nameLen,
+        size_t* len);
+
+#endif
@@ -0,0 +1,213 @@
+#include "mux.h"
+
+// Takes the socket of a proxy that announced CAPS:mux as @param. Returns a
+// carrier for it with no sessions open.
+MuxCarrier* new_mux_carrier(int fd) {
+    MuxCarrier* carrier = calloc(1, sizeof(MuxCarrier));
+    carrier->fd = fd;
+    pthread_mutex_init(&carrier->writeLock, NULL);
+    return carrier;
+}
+
+// Takes a carrier whose sessions have all been closed as @param and
+// deallocates it. The socket is left to its owner.
+void free_mux_carrier(MuxCarrier* carrier) {
+    pthread_mutex_destroy(&carrier->writeLock);
+    free(carrier->sessions);
+    free(carrier->recipients);
+    free(carrier);
+}
+
+// Takes a socket and the buffers to write to it as @param and writes all
+// of them, carrying on after short writes and signals and waiting on a
+// full non-blocking socket. The buffers are consumed. Returns true on
+// success, else returns false.
+bool mux_write_all(int fd, struct iovec* iov, int iovCnt) {
+    while (iovCnt > 0) {
+        ssize_t written = writev(fd, iov, iovCnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pollFd = {fd, POLLOUT, 0};
+                poll(&pollFd, 1, -1);
+                continue;
+            }
+            return false;
+        }
+        while (iovCnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovCnt--;
+        }
+        if (iovCnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Takes a line a proxy sent, where to store its session id and where to
+// store the rest of the line as @param. Returns true if the line is an
+// "S:sid:rest" session line, else returns false.
+bool mux_parse_session(char* line, unsigned int* sid, char** rest) {
+    char* end;
+    if (strncmp(line, MUX_SESSION_PREFIX, strlen(MUX_SESSION_PREFIX))) {
+        return false;
+    }
+    line += strlen(MUX_SESSION_PREFIX);
+    unsigned long id = strtoul(line, &end, 10);
+    if (end == line || *end != ':' || id >= MUX_MAX_SESSIONS) {
+        return false;
+    }
+    *sid = id;
+    *rest = end + 1;
+    return true;
+}
+
+// Cookie write function of a session stream. Takes the session and the
+// bytes flushed from the stream as @param and writes them to the carrier,
+// each line prefixed with "S:sid:", in one go under the carrier's lock.
+// Always reports success: a dead carrier is noticed by its reader.
+ssize_t mux_session_write(void* cookie, const char* buf, size_t size) {
+    MuxSession* session = cookie;
+    MuxCarrier* carrier = session->carrier;
+    char prefix[MUX_SID_SIZE + 4];
+    int prefixLen = snprintf(prefix, sizeof(prefix), "%s%u:",
+            MUX_SESSION_PREFIX, session->sid);
+    size_t lines = 1;
+    for (size_t idx = 0; idx < size; idx++) {
+        lines += buf[idx] == '\n';
+    }
+    struct iovec* iov = malloc(sizeof(struct iovec) * lines * 2);
+    int iovCnt = 0;
+    size_t start = 0;
+    while (start < size) {
+        const char* newline = memchr(buf + start, '\n', size - start);
+        size_t end = newline != NULL ? newline - buf + 1 : size;
+        if (session->atLineStart) {
+            iov[iovCnt].iov_base = prefix;
+            iov[iovCnt++].iov_len = prefixLen;
+        }
+        iov[iovCnt].iov_base = (char*) buf + start;
+        iov[iovCnt++].iov_len = end - start;
+        session->atLineStart = newline != NULL;
+        start = end;
+    }
+    pthread_mutex_lock(&carrier->writeLock);
+    mux_write_all(carrier->fd, iov, iovCnt);
+    pthread_mutex_unlock(&carrier->writeLock);
+    free(iov);
+    return size;
+}
+
+// Takes a carrier and a session id as @param and opens the session,
+// growing the session table as needed. Returns the session, with a stream
+// that writes to it through the carrier.
+MuxSession* mux_open_session(MuxCarrier* carrier, unsigned int sid) {
+    if (sid >= carrier->capacity) {
+        unsigned int capacity = carrier->capacity ? carrier->capacity : 64;
+        while (capacity <= sid) {
+            capacity *= 2;
+        }
+        carrier->sessions = realloc(carrier->sessions,
+                sizeof(MuxSession*) * capacity);
+        memset(carrier->sessions + carrier->capacity, 0,
+                sizeof(MuxSession*) * (capacity - carrier->capacity));
+        carrier->capacity = capacity;
+    }
+    MuxSession* session = calloc(1, sizeof(MuxSession));
+    cookie_io_functions_t funcs = {NULL, mux_session_write, NULL, NULL};
+    session->sid = sid;
+    session->carrier = carrier;
+    session->atLineStart = true;
+    session->wrEnd = fopencookie(session, "w", funcs);
+    carrier->sessions[sid] = session;
+    return session;
+}
+
+// Takes a session that has left the chat as @param, removes it from its
+// carrier and deallocates it.
+void mux_close_session(MuxSession* session) {
+    session->carrier->sessions[session->sid] = NULL;
+    fclose(session->wrEnd);
+    free(session);
+}
+
+// Takes a session as @param and counts it in, from now on it is sent
+// broadcasts. Caller holds the server's global lock.
+void mux_session_entered(MuxSession* session) {
+    session->entered = true;
+    session->carrier->noOfEntered += 1;
+}
+
+// Takes a session as @param and counts it out, it is sent no more
+// broadcasts. Caller holds the server's global lock.
+void mux_session_left(MuxSession* session) {
+    if (session->entered) {
+        session->entered = false;
+        session->carrier->noOfEntered -= 1;
+    }
+}
+
+// Takes a session (or NULL), the CAP_* flags a recipient must have and
+// those it must not have and the client ids to skip (or NULL) as @param.
+// Returns true if the session is in the chat and gets the frame.
+bool mux_session_matches(MuxSession* session, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip) {
+    return session != NULL && session->entered &&
+            (session->caps & needCaps) == needCaps &&
+            !(session->caps & skipCaps) &&
+            (skip == NULL || !bitset_test(skip, session->clientId));
+}
+
+// Takes a carrier, a broadcast frame ending in a newline, its length, the
+// CAP_* flags a recipient must have and those it must not have and the
+// client ids to skip (or NULL) as @param. Writes the frame to the carrier
+// once, for every entered session it is meant for: as "B:*:frame" if that
+// is all of them, else with their ids listed. Caller holds the server's
+// global lock. Returns true if any session got the frame.
+bool mux_broadcast(MuxCarrier* carrier, const char* frame, size_t len,
+        unsigned int needCaps, unsigned int skipCaps, const Bitset* skip) {
+    int matching = carrier->noOfEntered;
+    if (needCaps != 0 || skipCaps != 0 || skip != NULL) {
+        matching = 0;
+        for (unsigned int sid = 0; sid < carrier->capacity; sid++) {
+            matching += mux_session_matches(carrier->sessions[sid],
+                    needCaps, skipCaps, skip);
+        }
+    }
+    if (matching == 0) {
+        return false;
+    }
+    size_t needed = strlen(MUX_BROADCAST_PREFIX) + 2 +
+            (size_t) matching * MUX_SID_SIZE;
+    if (needed > carrier->recipientsCap) {
+        carrier->recipientsCap = needed * 2;
+        carrier->recipients = realloc(carrier->recipients,
+                carrier->recipientsCap);
+    }
+    char* pos = carrier->recipients;
+    pos += sprintf(pos, "%s", MUX_BROADCAST_PREFIX);
+    if (matching == carrier->noOfEntered) {
+        pos += sprintf(pos, "%s,", MUX_ALL_SESSIONS);
+    } else {
+        for (unsigned int sid = 0; sid < carrier->capacity; sid++) {
+            if (mux_session_matches(carrier->sessions[sid], needCaps,
+                    skipCaps, skip)) {
+                pos += sprintf(pos, "%u,", sid);
+            }
+        }
+    }
+    pos[-1] = ':'; // the last comma ends the list
+    struct iovec iov[2] = {
+        {carrier->recipients, pos - carrier->recipients},
+        {(char*) frame, len}
+    };
+    pthread_mutex_lock(&carrier->writeLock);
+    mux_write_all(carrier->fd, iov, 2);
+    pthread_mutex_unlock(&carrier->writeLock);
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef MUX_H
+#define MUX_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include "bitset.h"
+
+// A proxy carries many chatters, its sessions, over one connection to the
+// server. Each line either way is prefixed with the session it belongs to,
+// "S:sid:line"; a broadcast is sent once per connection as
+// "B:sid,sid,...:frame", or "B:*:frame" when every session in the chat
+// gets it.
+#define MUX_SESSION_PREFIX "S:"
+#define MUX_BROADCAST_PREFIX "B:"
+#define MUX_ALL_SESSIONS "*"
+#define MUX_MAX_SESSIONS (1 << 20)
+#define MUX_SID_SIZE 16            // longest "sid," in a recipient list
+
+// One chatter carried by a proxy, as seen by the server
+typedef struct MuxSession {
+    unsigned int sid;
+    unsigned int caps;
+    bool entered;                  // in the chat, gets broadcasts
+    bool atLineStart;              // next byte written starts a line
+    int clientId;                  // dense id, once entered
+    struct MuxCarrier* carrier;
+    FILE* wrEnd;                   // writes "S:sid:" prefixed lines
+    struct ClientIO* io;
+    struct ClientList* node;       // once the session has a name
+} MuxSession;
+
+// One proxy connection and its sessions. Lines are written whole under
+// writeLock, so session replies never split a broadcast.
+typedef struct MuxCarrier {
+    int fd;
+    pthread_mutex_t writeLock;
+    MuxSession** sessions;         // by session id, NULL if not open
+    unsigned int capacity;
+    int noOfEntered;
+    char* recipients;              // "B:sid,...:" being built, under the
+    size_t recipientsCap;          // server's global lock
+    struct MuxCarrier* next;
+} MuxCarrier;
+
+MuxCarrier* new_mux_carrier(int fd);
+void free_mux_carrier(MuxCarrier* carrier);
+bool mux_write_all(int fd, struct iovec* iov, int iovCnt);
+bool mux_parse_session(char* line, unsigned int* sid, char** rest);
+ssize_t mux_session_write(void* cookie, const char* buf, size_t size);
+MuxSession* mux_open_session(MuxCarrier* carrier, unsigned int sid);
+void mux_close_session(MuxSession* session);
+void mux_session_entered(MuxSession* session);
+void mux_session_left(MuxSession* session);
+bool mux_session_matches(MuxSession* session, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip);
+bool mux_broadcast(MuxCarrier* carrier, const char* frame, size_t len,
+        unsigned int needCaps, unsigned int skipCaps, const Bitset* skip);
+
+#endif
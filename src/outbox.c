@@ -0,0 +1,539 @@
+#include "outbox.h"
+
+// Takes the outboxes to set up, the backlog allowed per connection (0 for
+// no limit) and the kernel send buffer size of the sockets (0 for the
+// default) as @param and starts the flusher thread.
+void init_outboxes(Outboxes* boxes, size_t maxBytes, int sendBuffer) {
+    memset(boxes, 0, sizeof(Outboxes));
+    boxes->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    boxes->maxBytes = maxBytes;
+    boxes->sendBuffer = sendBuffer;
+    pthread_mutex_init(&boxes->lock, NULL);
+    pthread_create(&boxes->thread, NULL, outbox_flusher, boxes);
+    pthread_detach(boxes->thread);
+}
+
+// Flusher thread function, takes a pointer to the Outboxes struct as
+// @param. Writes out the backlog of each socket that became writable,
+// watching it again if the socket fills up before the backlog is gone.
+// Frees the outboxes closed since the previous batch, none of which can
+// come up in a later one.
+void* outbox_flusher(void* arg) {
+    Outboxes* boxes = arg;
+    struct epoll_event events[OUTBOX_EVENTS];
+    while (1) {
+        int noOfEvents = epoll_wait(boxes->epollFd, events, OUTBOX_EVENTS,
+                OUTBOX_REAP_MILLI_SECS);
+        pthread_mutex_lock(&boxes->lock);
+        for (int idx = 0; idx < noOfEvents; idx++) {
+            Outbox* outbox = events[idx].data.ptr;
+            pthread_mutex_lock(&outbox->lock);
+            if (!outbox->closed && !outbox->held &&
+                    !outbox_flush(outbox) && !outbox->failed) {
+                outbox_watch(outbox);
+            }
+            pthread_mutex_unlock(&outbox->lock);
+        }
+        Outbox* closed = boxes->closed;
+        boxes->closed = NULL;
+        pthread_mutex_unlock(&boxes->lock);
+        while (closed != NULL) {
+            Outbox* next = closed->nextClosed;
+            free_outbox(closed);
+            closed = next;
+        }
+    }
+    return NULL;
+}
+
+// Takes the outboxes and a connected socket as @param. Makes the socket
+// non-blocking and bounds its kernel send buffer, whatever it holds is out
+// of reach of the priority lanes, and returns an empty outbox for it.
+Outbox* new_outbox(Outboxes* boxes, int fd) {
+    if (boxes->sendBuffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &boxes->sendBuffer,
+                sizeof(boxes->sendBuffer));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Outbox* outbox = calloc(1, sizeof(Outbox));
+    outbox->fd = fd;
+    outbox->owner = boxes;
+    pthread_mutex_init(&outbox->lock, NULL);
+    return outbox;
+}
+
+// Takes an outbox as @param. Returns a stream writing to it as control
+// frames; closing the stream closes the outbox and its socket.
+FILE* outbox_fopen(Outbox* outbox) {
+    cookie_io_functions_t funcs = {NULL, outbox_stream_write, NULL,
+            outbox_stream_close};
+    return fopencookie(outbox, "w", funcs);
+}
+
+// Cookie write function of an outbox stream. Takes the outbox and the
+// bytes flushed from the stream as @param and writes them as a control
+// frame. Always reports success: a broken socket is noticed by its reader.
+ssize_t outbox_stream_write(void* cookie, const char* buf, size_t size) {
+    outbox_write(cookie, OUTBOX_CONTROL, NULL, 0, buf, size);
+    return size;
+}
+
+// Cookie close function of an outbox stream. Takes the outbox as @param
+// and closes it. Returns 0.
+int outbox_stream_close(void* cookie) {
+    outbox_close(cookie);
+    return 0;
+}
+
+// Takes an outbox, a lane, a frame that is still to be written and
+// whether part of it was already written as @param. Queues the frame; a
+// frame started on the socket is finished before anything else. Marks the
+// outbox backlogged and has the flusher watch its socket, or cuts the
+// connection off if its backlog grows over the limit. Caller holds the
+// outbox's lock.
+void outbox_enqueue(Outbox* outbox, int lane, OutboxFrame* frame,
+        bool started) {
+    OutboxStats* stats = &outbox->owner->stats;
+    size_t bytes = outbox_frame_bytes(frame);
+    if (started) {
+        // Only a direct write starts a frame, and only without a backlog
+        outbox->current = frame;
+        outbox->currentDone = 0;
+    } else {
+        OutboxLane* queue = &outbox->lanes[lane];
+        if (queue->tail != NULL) {
+            queue->tail->next = frame;
+        } else {
+            queue->head = frame;
+        }
+        queue->tail = frame;
+        queue->frames += 1;
+        queue->bytes += bytes;
+        metrics_gauge_add(&stats->frames[lane], 1);
+        metrics_gauge_add(&stats->bytes[lane], bytes);
+        if (lane == OUTBOX_CONTROL &&
+                outbox->lanes[OUTBOX_BULK].frames > 0) {
+            metrics_add(&stats->preempted, 1);
+        }
+    }
+    metrics_add(&stats->queued[lane], 1);
+    outbox->bytes += bytes;
+    if (!outbox->backlogged) {
+        outbox->backlogged = true;
+        metrics_gauge_add(&stats->backlogged, 1);
+        outbox_watch(outbox);
+    }
+    if (outbox->owner->maxBytes > 0 &&
+            outbox->bytes > outbox->owner->maxBytes) {
+        metrics_add(&stats->overflows, 1);
+        outbox_fail(outbox);
+    }
+}
+
+// Takes an outbox, a lane, a frame's prefix and its length, the frame and
+// its length, and how many bytes of the two were already written as
+// @param and queues a copy of the rest. Caller holds the outbox's lock.
+void outbox_push(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len, size_t done) {
+    size_t total = prefixLen + len;
+    if (outbox->failed || done >= total) {
+        return;
+    }
+    OutboxFrame* frame = malloc(sizeof(OutboxFrame) + total - done);
+    frame->next = NULL;
+    frame->len = total - done;
+    frame->file = NULL;
+    if (done < prefixLen) {
+        memcpy(frame->data, prefix + done, prefixLen - done);
+        memcpy(frame->data + prefixLen - done, data, len);
+    } else {
+        memcpy(frame->data, data + done - prefixLen, total - done);
+    }
+    outbox_enqueue(outbox, lane, frame, done > 0);
+}
+
+// Takes a frame that was written or dropped as @param and deallocates it,
+// closing its file after the last frame sent from it.
+void free_outbox_frame(OutboxFrame* frame) {
+    if (frame->file != NULL && --frame->file->refs == 0) {
+        close(frame->file->fd);
+        free(frame->file);
+    }
+    free(frame);
+}
+
+// Takes a frame as @param. Returns the memory it holds on to: its length,
+// or 0 for a file range.
+size_t outbox_frame_bytes(OutboxFrame* frame) {
+    return frame->file == NULL ? frame->len : 0;
+}
+
+// Takes a backlogged outbox as @param and has the flusher write to it once
+// its socket is writable. Caller holds the outbox's lock.
+void outbox_watch(Outbox* outbox) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.ptr = outbox;
+    epoll_ctl(outbox->owner->epollFd,
+            outbox->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, outbox->fd,
+            &event);
+    outbox->watched = true;
+}
+
+// Takes an outbox as @param and drops everything queued on it for good.
+// Unless it is being closed, shuts its socket down so the connection's
+// thread sees it end. Caller holds the outbox's lock.
+void outbox_fail(Outbox* outbox) {
+    OutboxStats* stats = &outbox->owner->stats;
+    if (outbox->current != NULL) {
+        free_outbox_frame(outbox->current);
+    }
+    outbox->current = NULL;
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        OutboxLane* queue = &outbox->lanes[lane];
+        while (queue->head != NULL) {
+            OutboxFrame* frame = queue->head;
+            queue->head = frame->next;
+            free_outbox_frame(frame);
+        }
+        queue->tail = NULL;
+        metrics_gauge_add(&stats->frames[lane], -queue->frames);
+        metrics_gauge_add(&stats->bytes[lane], -queue->bytes);
+        queue->frames = 0;
+        queue->bytes = 0;
+    }
+    outbox->bytes = 0;
+    if (outbox->backlogged) {
+        outbox->backlogged = false;
+        metrics_gauge_add(&stats->backlogged, -1);
+    }
+    if (!outbox->failed && !outbox->closed) {
+        shutdown(outbox->fd, SHUT_RDWR);
+    }
+    outbox->failed = true;
+}
+
+// Takes an outbox and how many bytes of its backlog the socket took as
+// @param, in the order outbox_flush writes them, and drops those bytes. A
+// frame written in part becomes the current one. Caller holds the
+// outbox's lock.
+void outbox_consume(Outbox* outbox, size_t written) {
+    OutboxStats* stats = &outbox->owner->stats;
+    if (outbox->current != NULL) {
+        OutboxFrame* current = outbox->current;
+        size_t rest = current->len - outbox->currentDone;
+        size_t taken = written < rest ? written : rest;
+        outbox->currentDone += taken;
+        outbox->bytes -= current->file == NULL ? taken : 0;
+        written -= taken;
+        if (outbox->currentDone < current->len) {
+            return;
+        }
+        free_outbox_frame(current);
+        outbox->current = NULL;
+        outbox->currentDone = 0;
+    }
+    for (int lane = 0; lane < OUTBOX_LANES && written > 0; lane++) {
+        OutboxLane* queue = &outbox->lanes[lane];
+        while (written > 0 && queue->head != NULL) {
+            OutboxFrame* frame = queue->head;
+            queue->head = frame->next;
+            if (queue->head == NULL) {
+                queue->tail = NULL;
+            }
+            size_t bytes = outbox_frame_bytes(frame);
+            queue->frames -= 1;
+            queue->bytes -= bytes;
+            metrics_gauge_add(&stats->frames[lane], -1);
+            metrics_gauge_add(&stats->bytes[lane], -(long) bytes);
+            if (written < frame->len) {
+                outbox->current = frame;
+                outbox->currentDone = written;
+                outbox->bytes -= frame->file == NULL ? written : 0;
+                return;
+            }
+            written -= frame->len;
+            outbox->bytes -= bytes;
+            free_outbox_frame(frame);
+        }
+    }
+}
+
+// Takes an outbox, a lane, a frame's prefix and its length, and the frame
+// and its length as @param. Queues the frame if the outbox has a backlog,
+// or drops it if the connection failed. Returns false if the caller is to
+// write the frame to the socket itself, holding the lock that orders the
+// connection's writes.
+bool outbox_defer(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len) {
+    pthread_mutex_lock(&outbox->lock);
+    bool deferred = outbox->backlogged || outbox->failed || outbox->held;
+    if (outbox->backlogged || outbox->held) {
+        outbox_push(outbox, lane, prefix, prefixLen, data, len, 0);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    return deferred;
+}
+
+// Takes an outbox, a lane, a frame's prefix (or NULL) and its length, and
+// the frame and its length as @param. Writes the frame to the socket
+// without blocking if nothing is queued ahead of it, and queues whatever
+// the socket does not take. Caller holds the lock that orders the
+// connection's writes.
+void outbox_write(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len) {
+    pthread_mutex_lock(&outbox->lock);
+    if (!outbox->failed && (outbox->backlogged || outbox->held)) {
+        outbox_push(outbox, lane, prefix, prefixLen, data, len, 0);
+    } else if (!outbox->failed) {
+        struct iovec iov[2] = {{(char*) prefix, prefixLen},
+                {(char*) data, len}};
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t got;
+        do {
+            got = sendmsg(outbox->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            outbox_fail(outbox);
+        } else {
+            outbox_push(outbox, lane, prefix, prefixLen, data, len,
+                    got < 0 ? 0 : got);
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Takes an outbox, a broadcast frame's prefix and its length, the frame
+// and its length, and how many bytes of them a batched send wrote as
+// @param, and queues the rest as bulk.
+void outbox_queue_rest(Outbox* outbox, const char* prefix, size_t prefixLen,
+        const char* data, size_t len, size_t sent) {
+    pthread_mutex_lock(&outbox->lock);
+    outbox_push(outbox, OUTBOX_BULK, prefix, prefixLen, data, len, sent);
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Takes an outbox file frames are to be sent from, a lane, an open file
+// and the offsets that cut the part of it to send into frames, ascending,
+// as @param. Sends the frames from the file straight to the socket while
+// it takes them and queues the rest, closing the file after the last one.
+// Caller holds the lock that orders the connection's writes.
+void outbox_send_file(Outbox* outbox, int lane, int fd, const off_t* cuts,
+        int noOfCuts) {
+    OutboxFile* file = malloc(sizeof(OutboxFile));
+    file->fd = fd;
+    file->refs = 1; // until every frame is queued
+    pthread_mutex_lock(&outbox->lock);
+    for (int idx = 0; idx + 1 < noOfCuts && !outbox->failed; idx++) {
+        off_t offset = cuts[idx];
+        size_t len = cuts[idx + 1] - cuts[idx];
+        ssize_t got = 0;
+        if (!outbox->backlogged && !outbox->held) {
+            do {
+                got = sendfile(outbox->fd, fd, &offset, len);
+            } while (got < 0 && errno == EINTR);
+            if (got == 0 || (got < 0 && errno != EAGAIN)) {
+                outbox_fail(outbox); // a broken socket or a short file
+                break;
+            }
+            if (got == (ssize_t) len) {
+                continue;
+            }
+            len -= got > 0 ? got : 0;
+        }
+        OutboxFrame* frame = malloc(sizeof(OutboxFrame));
+        frame->next = NULL;
+        frame->len = len;
+        frame->file = file;
+        frame->offset = offset;
+        file->refs += 1;
+        outbox_enqueue(outbox, lane, frame, got > 0);
+    }
+    if (--file->refs == 0) {
+        close(fd);
+        free(file);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Takes an outbox and where to store how much of the frame was written as
+// @param. Returns the frame the backlog goes on with: the current one,
+// else the first control frame, else the first bulk one, else NULL.
+// Caller holds the outbox's lock.
+OutboxFrame* outbox_first(Outbox* outbox, size_t* done) {
+    *done = outbox->current != NULL ? outbox->currentDone : 0;
+    if (outbox->current != NULL) {
+        return outbox->current;
+    }
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        if (outbox->lanes[lane].head != NULL) {
+            return outbox->lanes[lane].head;
+        }
+    }
+    return NULL;
+}
+
+// Takes an outbox as @param and writes its backlog without blocking: the
+// current frame, then the control lane, then the bulk lane, many frames
+// per system call and file ranges one at a time. Caller holds the
+// outbox's lock. Returns true once nothing is queued, else returns false
+// if the socket is full or broke, or the outbox is held.
+bool outbox_flush(Outbox* outbox) {
+    if (outbox->held) {
+        return !outbox->backlogged;
+    }
+    while (outbox->backlogged) {
+        size_t done;
+        OutboxFrame* first = outbox_first(outbox, &done);
+        ssize_t got;
+        if (first->file != NULL) {
+            off_t offset = first->offset + done;
+            got = sendfile(outbox->fd, first->file->fd, &offset,
+                    first->len - done);
+            if (got == 0) {
+                outbox_fail(outbox); // the file is shorter than the frame
+                return false;
+            }
+        } else {
+            struct iovec iov[OUTBOX_IOV_MAX];
+            int iovCnt = 0;
+            iov[iovCnt].iov_base = first->data + done;
+            iov[iovCnt++].iov_len = first->len - done;
+            bool more = true;
+            for (int lane = 0; lane < OUTBOX_LANES && more; lane++) {
+                for (OutboxFrame* frame = outbox->lanes[lane].head;
+                        frame != NULL && more; frame = frame->next) {
+                    more = iovCnt < OUTBOX_IOV_MAX && frame->file == NULL;
+                    if (more && frame != first) {
+                        iov[iovCnt].iov_base = frame->data;
+                        iov[iovCnt++].iov_len = frame->len;
+                    }
+                }
+            }
+            struct msghdr msg = {0};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovCnt;
+            got = sendmsg(outbox->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                outbox_fail(outbox);
+            }
+            return false;
+        }
+        outbox_consume(outbox, got);
+        if (outbox->current == NULL &&
+                outbox->lanes[OUTBOX_CONTROL].head == NULL &&
+                outbox->lanes[OUTBOX_BULK].head == NULL) {
+            outbox->backlogged = false;
+            metrics_gauge_add(&outbox->owner->stats.backlogged, -1);
+        }
+    }
+    return true;
+}
+
+// Takes an outbox and how long to wait at most as @param and writes its
+// backlog, waiting for the socket to take it.
+void outbox_drain(Outbox* outbox, int milliSecs) {
+    unsigned long deadline = now_nanos() + milliSecs * 1000000UL;
+    while (1) {
+        pthread_mutex_lock(&outbox->lock);
+        bool done = outbox_flush(outbox) || outbox->failed;
+        pthread_mutex_unlock(&outbox->lock);
+        unsigned long now = now_nanos();
+        if (done || now >= deadline) {
+            return;
+        }
+        struct pollfd pollFd = {outbox->fd, POLLOUT, 0};
+        poll(&pollFd, 1, (deadline - now) / 1000000 + 1);
+    }
+}
+
+// Takes an outbox and where to store the length of its backlog as @param.
+// Holds the outbox: nothing more is written to its socket, and what it is
+// given is queued, until it is released. Returns a copy of the backlog in
+// the order it would have been written, file ranges read in, to be passed
+// on with the socket. The caller frees the copy.
+char* outbox_hold(Outbox* outbox, size_t* len) {
+    pthread_mutex_lock(&outbox->lock);
+    outbox->held = true;
+    size_t done = outbox->current != NULL ? outbox->currentDone : 0;
+    OutboxFrame* frame;
+    size_t total = outbox->current != NULL ? outbox->current->len - done : 0;
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        for (frame = outbox->lanes[lane].head; frame != NULL;
+                frame = frame->next) {
+            total += frame->len;
+        }
+    }
+    char* copy = malloc(total + 1);
+    *len = 0;
+    frame = outbox->current;
+    for (int lane = -1; lane < OUTBOX_LANES; lane++) {
+        if (lane >= 0) {
+            frame = outbox->lanes[lane].head;
+            done = 0;
+        }
+        for (; frame != NULL; frame = lane < 0 ? NULL : frame->next) {
+            size_t want = frame->len - done;
+            if (frame->file == NULL) {
+                memcpy(copy + *len, frame->data + done, want);
+            } else if (pread(frame->file->fd, copy + *len, want,
+                    frame->offset + done) != (ssize_t) want) {
+                pthread_mutex_unlock(&outbox->lock);
+                return copy; // a short file, the stream ends here
+            }
+            *len += want;
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    return copy;
+}
+
+// Takes an outbox held for a handoff that was abandoned as @param and has
+// the flusher write its backlog again.
+void outbox_release(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    outbox->held = false;
+    if (outbox->backlogged && !outbox->failed && !outbox->closed) {
+        outbox_watch(outbox);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+// Takes an outbox whose connection is done as @param. Gives its backlog,
+// a kick for instance, OUTBOX_LINGER_MILLI_SECS to go out, drops the rest
+// and closes the socket. The outbox is freed by the flusher.
+void outbox_close(Outbox* outbox) {
+    Outboxes* boxes = outbox->owner;
+    outbox_drain(outbox, OUTBOX_LINGER_MILLI_SECS);
+    pthread_mutex_lock(&boxes->lock);
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closed = true;
+    outbox_fail(outbox);
+    if (outbox->watched) {
+        epoll_ctl(boxes->epollFd, EPOLL_CTL_DEL, outbox->fd, NULL);
+    }
+    close(outbox->fd);
+    pthread_mutex_unlock(&outbox->lock);
+    outbox->nextClosed = boxes->closed;
+    boxes->closed = outbox;
+    pthread_mutex_unlock(&boxes->lock);
+}
+
+// Takes a closed outbox as @param and deallocates it.
+void free_outbox(Outbox* outbox) {
+    pthread_mutex_destroy(&outbox->lock);
+    free(outbox);
+}
+
+// Takes an outbox and a lane as @param and returns the bytes queued in the
+// lane, read without the outbox's lock.
+long outbox_lane_bytes(Outbox* outbox, int lane) {
+    return __atomic_load_n(&outbox->lanes[lane].bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,135 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "metrics.h"
+
+#define OUTBOX_CONTROL 0           // replies, kicks and DMs, written first
+#define OUTBOX_BULK 1              // broadcast frames
+#define OUTBOX_LANES 2
+#define OUTBOX_IOV_MAX 64          // queued frames written per system call
+#define OUTBOX_EVENTS 64
+#define OUTBOX_REAP_MILLI_SECS 1000
+#define OUTBOX_LINGER_MILLI_SECS 200 // last flush of a closing connection
+
+// A connection's output goes straight to its socket while the socket keeps
+// up. Once a write would block, the rest and every later frame are queued
+// in user space, in one lane per priority class, and the flusher thread
+// writes them when the socket drains. A frame is never interleaved with
+// another: one already started is finished first, then every queued
+// control frame goes ahead of the queued bulk ones. A frame can also be a
+// range of a file, sent with sendfile without passing through user space;
+// the sockets are non-blocking so that it never waits on a slow client.
+typedef struct OutboxFrame {
+    struct OutboxFrame* next;
+    size_t len;
+    struct OutboxFile* file;       // NULL unless the frame is a file range
+    off_t offset;
+    char data[];
+} OutboxFrame;
+
+// A file frames are sent from, closed with the last of them
+typedef struct OutboxFile {
+    int fd;
+    int refs;
+} OutboxFile;
+
+// Frames of one priority class, in the order they were queued
+typedef struct OutboxLane {
+    OutboxFrame* head;
+    OutboxFrame* tail;
+    long frames;
+    long bytes;
+} OutboxLane;
+
+// Counters over all outboxes, read by the admin socket without locks
+typedef struct OutboxStats {
+    long frames[OUTBOX_LANES];          // gauge: frames queued per lane
+    long bytes[OUTBOX_LANES];           // gauge: bytes queued per lane
+    long backlogged;                    // gauge: connections with a backlog
+    unsigned long queued[OUTBOX_LANES]; // frames that had to be queued
+    unsigned long preempted;            // control frames queued ahead of
+                                        // bulk ones
+    unsigned long overflows;            // connections cut off at maxBytes
+} OutboxStats;
+
+// The flusher thread and the outboxes it watches
+typedef struct Outboxes {
+    int epollFd;                 // backlogged sockets, until writable
+    pthread_t thread;
+    pthread_mutex_t lock;        // held by the flusher over each batch
+    struct Outbox* closed;       // freed by the flusher once unwatched
+    size_t maxBytes;             // backlog allowed per connection, 0 for
+                                 // no limit
+    int sendBuffer;              // SO_SNDBUF of the sockets, 0 for default
+    OutboxStats stats;
+} Outboxes;
+
+// One connection's output. Only the flusher writes to the socket while it
+// is backlogged, so whoever holds the lock order of a connection's writes
+// may write straight to it otherwise.
+typedef struct Outbox {
+    int fd;
+    pthread_mutex_t lock;
+    OutboxFrame* current;        // partly written, finished before the lanes
+    size_t currentDone;
+    OutboxLane lanes[OUTBOX_LANES];
+    size_t bytes;                // queued in memory, file ranges aside
+    bool backlogged;
+    bool watched;                // registered with the flusher's epoll
+    bool failed;                 // socket broken or backlog over the limit
+    bool closed;
+    bool held;                   // kept off the socket while handed over
+    Outboxes* owner;
+    struct Outbox* nextClosed;
+} Outbox;
+
+void init_outboxes(Outboxes* boxes, size_t maxBytes, int sendBuffer);
+void* outbox_flusher(void* arg);
+Outbox* new_outbox(Outboxes* boxes, int fd);
+FILE* outbox_fopen(Outbox* outbox);
+ssize_t outbox_stream_write(void* cookie, const char* buf, size_t size);
+int outbox_stream_close(void* cookie);
+void outbox_enqueue(Outbox* outbox, int lane, OutboxFrame* frame,
+        bool started);
+void outbox_push(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len, size_t done);
+void free_outbox_frame(OutboxFrame* frame);
+size_t outbox_frame_bytes(OutboxFrame* frame);
+void outbox_watch(Outbox* outbox);
+void outbox_fail(Outbox* outbox);
+void outbox_consume(Outbox* outbox, size_t written);
+bool outbox_defer(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len);
+void outbox_write(Outbox* outbox, int lane, const char* prefix,
+        size_t prefixLen, const char* data, size_t len);
+void outbox_queue_rest(Outbox* outbox, const char* prefix, size_t prefixLen,
+        const char* data, size_t len, size_t sent);
+void outbox_send_file(Outbox* outbox, int lane, int fd, const off_t* cuts,
+        int noOfCuts);
+OutboxFrame* outbox_first(Outbox* outbox, size_t* done);
+bool outbox_flush(Outbox* outbox);
+void outbox_drain(Outbox* outbox, int milliSecs);
+char* outbox_hold(Outbox* outbox, size_t* len);
+void outbox_release(Outbox* outbox);
+void outbox_close(Outbox* outbox);
+void free_outbox(Outbox* outbox);
+long outbox_lane_bytes(Outbox* outbox, int lane);
+
+#endif
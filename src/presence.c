@@ -0,0 +1,72 @@
+#include "presence.h"
+
+// Allocates an empty PresenceDelta and returns it.
+PresenceDelta* init_presence_delta(void) {
+    PresenceDelta* delta = malloc(sizeof(PresenceDelta));
+    delta->len = 0;
+    delta->capacity = STRMAP_MIN_CAPACITY;
+    delta->changes = malloc(sizeof(PresenceChange) * delta->capacity);
+    delta->index = strmap_new(delta->capacity);
+    return delta;
+}
+
+// Takes a delta as @param and deallocates it.
+void free_presence_delta(PresenceDelta* delta) {
+    for (size_t idx = 0; idx < delta->len; idx++) {
+        free(delta->changes[idx].name);
+    }
+    free(delta->changes);
+    strmap_free(delta->index);
+    free(delta);
+}
+
+// Takes the pending delta, a client name and whether it entered or left as
+// @param. Records the change, or cancels a pending opposite change for the
+// same name. Caller holds the lock.
+void presence_add(PresenceDelta* delta, char* name, char sign) {
+    PresenceChange* change = strmap_get(delta->index, name);
+    if (change != NULL) {
+        // Index values are offsets + 1 so that the first change is not NULL
+        change = &delta->changes[(size_t) change - 1];
+        change->sign = (change->sign == 0) ? sign : 0;
+        return;
+    }
+    if (delta->len == delta->capacity) {
+        delta->capacity *= 2;
+        delta->changes = realloc(delta->changes,
+                sizeof(PresenceChange) * delta->capacity);
+    }
+    delta->changes[delta->len].name = strdup(name);
+    delta->changes[delta->len].sign = sign;
+    delta->len++;
+    strmap_put(delta->index, name, (void*) delta->len);
+}
+
+// Takes the pending delta as @param. Returns the net changes as a
+// "PRESENCE:+name,-name\n" frame and empties the delta, else returns NULL
+// if nothing changed. Caller holds the lock.
+char* presence_frame(PresenceDelta* delta) {
+    size_t frameLen = strlen("PRESENCE:\n") + 1;
+    size_t idx;
+    for (idx = 0; idx < delta->len; idx++) {
+        frameLen += strlen(delta->changes[idx].name) + 2;
+    }
+    char* frame = malloc(sizeof(char) * frameLen);
+    char* end = frame + sprintf(frame, "PRESENCE:");
+    for (idx = 0; idx < delta->len; idx++) {
+        PresenceChange* change = &delta->changes[idx];
+        if (change->sign != 0) {
+            end += sprintf(end, "%s%c%s", (end[-1] == ':') ? "" : ",",
+                    change->sign, change->name);
+        }
+        free(change->name);
+    }
+    delta->len = 0;
+    strmap_clear(delta->index);
+    if (end[-1] == ':') {
+        free(frame);
+        return NULL;
+    }
+    sprintf(end, "\n");
+    return frame;
+}
@@ -0,0 +1,35 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "strmap.h"
+#include "parser.h"
+
+#define PRESENCE_ENTER '+'
+#define PRESENCE_LEAVE '-'
+
+// A pending roster change, sign is PRESENCE_ENTER, PRESENCE_LEAVE or 0 once
+// an enter and a leave of the same name have cancelled out
+typedef struct PresenceChange {
+    char* name;
+    char sign;
+} PresenceChange;
+
+// Roster changes collected during one coalescing window, in the order they
+// happened, with an index from name to change so that a client dropping
+// and coming back within the window nets out to nothing.
+typedef struct PresenceDelta {
+    PresenceChange* changes;
+    size_t len;
+    size_t capacity;
+    StrMap* index;
+} PresenceDelta;
+
+PresenceDelta* init_presence_delta(void);
+void free_presence_delta(PresenceDelta* delta);
+void presence_add(PresenceDelta* delta, char* name, char sign);
+char* presence_frame(PresenceDelta* delta);
+
+#endif
@@ -0,0 +1,315 @@
+#include "searchindex.h"
+
+// Takes the index to set up, the memory it may take up and how many
+// seconds messages stay searchable (0 for no limit) as @param and starts
+// the indexer thread.
+void init_search_index(SearchIndex* index, size_t maxBytes, long retention) {
+    memset(index, 0, sizeof(SearchIndex));
+    init_mpsc_queue(&index->queue);
+    pthread_mutex_init(&index->lock, NULL);
+    index->terms = strmap_new(STRMAP_MIN_CAPACITY);
+    index->docsCap = SEARCH_MIN_DOCS;
+    index->docs = calloc(index->docsCap, sizeof(SearchDoc));
+    index->maxBytes = maxBytes;
+    index->retention = retention;
+    pthread_create(&index->thread, NULL, search_indexer, index);
+    pthread_detach(index->thread);
+}
+
+// Takes the index, the name of a client and the message it said as @param
+// and queues the message for the indexer thread. Never blocks.
+void search_submit(SearchIndex* index, const char* name, const char* text) {
+    size_t nameLen = strlen(name);
+    size_t textLen = strlen(text);
+    SearchItem* item = malloc(sizeof(SearchItem) + nameLen + textLen + 2);
+    item->at = time(NULL);
+    item->nameLen = nameLen;
+    memcpy(item->data, name, nameLen + 1);
+    memcpy(item->data + nameLen + 1, text, textLen + 1);
+    mpsc_push(&index->queue, &item->node);
+}
+
+// Indexer thread function, takes a pointer to the SearchIndex struct as
+// @param. Sleeps until messages are queued, then indexes all of them under
+// one hold of the lock and evicts what no longer fits.
+void* search_indexer(void* arg) {
+    SearchIndex* index = arg;
+    while (1) {
+        MpscNode* node = mpsc_pop_wait(&index->queue);
+        pthread_mutex_lock(&index->lock);
+        while (node != NULL) {
+            search_add_doc(index, (SearchItem*) node);
+            free(node);
+            node = mpsc_pop(&index->queue);
+        }
+        search_evict(index, time(NULL));
+        pthread_mutex_unlock(&index->lock);
+    }
+    return NULL;
+}
+
+// Takes a position within a string and where to store a word as @param.
+// Stores the next run of letters and digits from the position on, lower
+// cased and cut to SEARCH_TERM_MAX bytes, and moves the position past it.
+// Returns the length of the word, or 0 if there is none left.
+size_t search_next_term(const char** pos, char* term) {
+    const char* str = *pos;
+    while (*str != '\0' && !isalnum((unsigned char) *str)) {
+        str++;
+    }
+    size_t len = 0;
+    while (isalnum((unsigned char) *str)) {
+        if (len < SEARCH_TERM_MAX) {
+            term[len++] = tolower((unsigned char) *str);
+        }
+        str++;
+    }
+    term[len] = '\0';
+    *pos = str;
+    return len;
+}
+
+// Takes a word's postings and the id of a newer document holding it as
+// @param and appends the id as a varint.
+void postings_append(SearchPostings* postings, unsigned long id) {
+    if (postings->len + 10 > postings->capacity) {
+        if (postings->start > postings->len / 2) {
+            memmove(postings->bytes, postings->bytes + postings->start,
+                    postings->len - postings->start);
+            postings->len -= postings->start;
+            postings->start = 0;
+        }
+        while (postings->len + 10 > postings->capacity) {
+            postings->capacity = postings->capacity ?
+                    postings->capacity * 2 : 16;
+        }
+        postings->bytes = realloc(postings->bytes, postings->capacity);
+    }
+    unsigned long delta = id - (postings->noOfDocs ? postings->lastId :
+            postings->base);
+    while (delta >= 0x80) {
+        postings->bytes[postings->len++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    postings->bytes[postings->len++] = delta;
+    postings->lastId = id;
+    postings->noOfDocs += 1;
+}
+
+// Takes a word's postings and the id of the oldest document in the index
+// as @param. Drops the document from the front of the postings if it is
+// there. Returns true if it was.
+bool postings_drop(SearchPostings* postings, unsigned long id) {
+    if (postings->noOfDocs == 0) {
+        return false;
+    }
+    size_t pos = postings->start;
+    unsigned long delta = 0;
+    int shift = 0;
+    while (postings->bytes[pos] & 0x80) {
+        delta |= (unsigned long) (postings->bytes[pos++] & 0x7f) << shift;
+        shift += 7;
+    }
+    delta |= (unsigned long) postings->bytes[pos++] << shift;
+    if (postings->base + delta != id) {
+        return false;
+    }
+    postings->base = id;
+    postings->start = pos;
+    postings->noOfDocs -= 1;
+    return true;
+}
+
+// Takes a word's postings and an array with room for all of its ids as
+// @param. Stores the ids, ascending. Returns how many there are.
+size_t postings_decode(SearchPostings* postings, unsigned long* ids) {
+    size_t count = 0;
+    unsigned long id = postings->base;
+    size_t pos = postings->start;
+    while (pos < postings->len) {
+        unsigned long delta = 0;
+        int shift = 0;
+        while (postings->bytes[pos] & 0x80) {
+            delta |= (unsigned long) (postings->bytes[pos++] & 0x7f) <<
+                    shift;
+            shift += 7;
+        }
+        delta |= (unsigned long) postings->bytes[pos++] << shift;
+        id += delta;
+        ids[count++] = id;
+    }
+    return count;
+}
+
+// Takes the index and a queued message as @param and adds the message as
+// the newest document, under every word of its text and its sender's name.
+// Caller holds the index's lock.
+void search_add_doc(SearchIndex* index, SearchItem* item) {
+    if (index->nextId - index->firstId == index->docsCap) {
+        size_t capacity = index->docsCap * 2;
+        SearchDoc* docs = calloc(capacity, sizeof(SearchDoc));
+        for (unsigned long id = index->firstId; id < index->nextId; id++) {
+            docs[id % capacity] = index->docs[id % index->docsCap];
+        }
+        free(index->docs);
+        index->docs = docs;
+        index->bytes += (capacity - index->docsCap) * sizeof(SearchDoc);
+        index->docsCap = capacity;
+    }
+    unsigned long id = index->nextId++;
+    SearchDoc* doc = &index->docs[id % index->docsCap];
+    size_t size = item->nameLen + strlen(item->data + item->nameLen + 1) + 2;
+    doc->at = item->at;
+    doc->name = malloc(size);
+    memcpy(doc->name, item->data, size);
+    doc->text = doc->name + item->nameLen + 1;
+    doc->bytes = size;
+    index->bytes += size;
+    char term[SEARCH_TERM_MAX + 1];
+    const char* pos = doc->name;
+    for (int part = 0; part < 2; part++) {
+        while (search_next_term(&pos, term) > 0) {
+            SearchPostings* postings = strmap_get(index->terms, term);
+            if (postings == NULL) {
+                postings = calloc(1, sizeof(SearchPostings));
+                strmap_put(index->terms, term, postings);
+                index->noOfTerms += 1;
+                index->bytes += sizeof(SearchPostings) + strlen(term) + 1;
+            } else if (postings->noOfDocs > 0 && postings->lastId == id) {
+                continue;
+            }
+            size_t capacity = postings->capacity;
+            postings_append(postings, id);
+            index->bytes += postings->capacity - capacity;
+        }
+        pos = doc->text;
+    }
+}
+
+// Takes the index as @param and evicts its oldest document, dropping it
+// from the postings of each of its words and the words no document holds
+// any more. Caller holds the index's lock.
+void search_evict_doc(SearchIndex* index) {
+    unsigned long id = index->firstId++;
+    SearchDoc* doc = &index->docs[id % index->docsCap];
+    char term[SEARCH_TERM_MAX + 1];
+    const char* pos = doc->name;
+    for (int part = 0; part < 2; part++) {
+        while (search_next_term(&pos, term) > 0) {
+            SearchPostings* postings = strmap_get(index->terms, term);
+            if (postings == NULL || !postings_drop(postings, id) ||
+                    postings->noOfDocs > 0) {
+                continue;
+            }
+            strmap_remove(index->terms, term);
+            index->noOfTerms -= 1;
+            index->bytes -= sizeof(SearchPostings) + strlen(term) + 1 +
+                    postings->capacity;
+            free(postings->bytes);
+            free(postings);
+        }
+        pos = doc->text;
+    }
+    index->bytes -= doc->bytes;
+    free(doc->name);
+    doc->name = doc->text = NULL;
+    index->evicted += 1;
+}
+
+// Takes the index and the current time as @param and evicts the oldest
+// documents while the index is over its memory budget or they are past
+// the retention period. Caller holds the index's lock.
+void search_evict(SearchIndex* index, time_t now) {
+    while (index->firstId < index->nextId) {
+        SearchDoc* doc = &index->docs[index->firstId % index->docsCap];
+        bool expired = index->retention > 0 &&
+                doc->at < now - index->retention;
+        if (!expired && (size_t) index->bytes <= index->maxBytes) {
+            break;
+        }
+        search_evict_doc(index);
+    }
+}
+
+// Takes ascending document ids and their count, and other ascending ids
+// and their count as @param. Keeps only the ids that are in both. Returns
+// how many are left.
+size_t search_intersect(unsigned long* ids, size_t count,
+        unsigned long* others, size_t noOfOthers) {
+    size_t kept = 0;
+    size_t other = 0;
+    for (size_t idx = 0; idx < count; idx++) {
+        while (other < noOfOthers && others[other] < ids[idx]) {
+            other++;
+        }
+        if (other < noOfOthers && others[other] == ids[idx]) {
+            ids[kept++] = ids[idx];
+        }
+    }
+    return kept;
+}
+
+// Takes the index and the words to look for as @param. Finds the messages
+// holding every word, either in their text or as the sender's name.
+// Returns a newly allocated reply listing the newest of them, oldest first,
+// as "FOUND:time:name:text" lines and ending with an empty "FOUND:" line.
+char* search_query(SearchIndex* index, const char* query) {
+    char terms[SEARCH_QUERY_TERMS][SEARCH_TERM_MAX + 1];
+    int noOfTerms = 0;
+    const char* pos = query;
+    while (noOfTerms < SEARCH_QUERY_TERMS &&
+            search_next_term(&pos, terms[noOfTerms]) > 0) {
+        noOfTerms++;
+    }
+    char* reply;
+    size_t replyLen;
+    FILE* out = open_memstream(&reply, &replyLen);
+    __atomic_add_fetch(&index->queries, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&index->lock);
+    search_evict(index, time(NULL));
+    SearchPostings* postings[SEARCH_QUERY_TERMS];
+    int rarest = 0;
+    for (int idx = 0; idx < noOfTerms; idx++) {
+        postings[idx] = strmap_get(index->terms, terms[idx]);
+        if (postings[idx] == NULL) {
+            noOfTerms = 0; // a word no message holds, nothing matches
+            break;
+        }
+        if (postings[idx]->noOfDocs < postings[rarest]->noOfDocs) {
+            rarest = idx;
+        }
+    }
+    if (noOfTerms > 0) {
+        unsigned long* ids = malloc(sizeof(unsigned long) *
+                postings[rarest]->noOfDocs);
+        size_t count = postings_decode(postings[rarest], ids);
+        for (int idx = 0; idx < noOfTerms && count > 0; idx++) {
+            if (idx == rarest) {
+                continue;
+            }
+            unsigned long* others = malloc(sizeof(unsigned long) *
+                    postings[idx]->noOfDocs);
+            size_t noOfOthers = postings_decode(postings[idx], others);
+            count = search_intersect(ids, count, others, noOfOthers);
+            free(others);
+        }
+        size_t first = count > SEARCH_MAX_RESULTS ?
+                count - SEARCH_MAX_RESULTS : 0;
+        for (size_t idx = first; idx < count; idx++) {
+            SearchDoc* doc = &index->docs[ids[idx] % index->docsCap];
+            fprintf(out, "FOUND:%ld:%s:%s\n", (long) doc->at, doc->name,
+                    doc->text);
+        }
+        free(ids);
+    }
+    pthread_mutex_unlock(&index->lock);
+    fprintf(out, "FOUND:\n");
+    fclose(out);
+    return reply;
+}
+
+// Takes the index as @param. Returns the number of messages it holds.
+long search_docs(SearchIndex* index) {
+    return __atomic_load_n(&index->nextId, __ATOMIC_RELAXED) -
+            __atomic_load_n(&index->firstId, __ATOMIC_RELAXED);
+}
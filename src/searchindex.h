@@ -0,0 +1,89 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include "mpscqueue.h"
+#include "strmap.h"
+
+#define SEARCH_TERM_MAX 32         // longer words are indexed cut short
+#define SEARCH_QUERY_TERMS 8       // words of a query beyond these ignored
+#define SEARCH_MAX_RESULTS 20      // newest matches sent back per query
+#define SEARCH_MIN_DOCS 64
+
+// A chat message waiting for the indexer thread
+typedef struct SearchItem {
+    MpscNode node;
+    time_t at;
+    size_t nameLen;
+    char data[];                   // "name\0text\0"
+} SearchItem;
+
+// A message in the index. Documents get consecutive ids in the order they
+// were said, and leave the index oldest first.
+typedef struct SearchDoc {
+    time_t at;
+    char* name;                    // one allocation with the text
+    char* text;
+    size_t bytes;
+} SearchDoc;
+
+// Ids of the documents holding one word, ascending, each stored as a
+// varint of its distance from the one before. The first is relative to
+// base, the id of the last document that held the word and has left.
+typedef struct SearchPostings {
+    unsigned char* bytes;
+    size_t start;                  // bytes before this were evicted
+    size_t len;
+    size_t capacity;
+    unsigned long base;
+    unsigned long lastId;          // newest document holding the word
+    size_t noOfDocs;
+} SearchPostings;
+
+// Inverted index over the recent chat, kept within a memory budget and a
+// retention period. Messages are handed over through a lock-free queue and
+// indexed by a thread of its own; the lock only keeps queries out while a
+// batch is applied.
+typedef struct SearchIndex {
+    MpscQueue queue;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    StrMap* terms;                 // word to its SearchPostings
+    SearchDoc* docs;               // ring, document id modulo capacity
+    size_t docsCap;
+    unsigned long firstId;         // oldest document still indexed
+    unsigned long nextId;
+    size_t maxBytes;               // oldest documents go beyond this
+    long retention;                // seconds, 0 for no limit
+    // Read by the admin socket without the lock
+    long bytes;                    // documents, postings and words
+    long noOfTerms;
+    unsigned long evicted;
+    unsigned long queries;
+} SearchIndex;
+
+void init_search_index(SearchIndex* index, size_t maxBytes, long retention);
+void search_submit(SearchIndex* index, const char* name, const char* text);
+void* search_indexer(void* arg);
+size_t search_next_term(const char** pos, char* term);
+void postings_append(SearchPostings* postings, unsigned long id);
+bool postings_drop(SearchPostings* postings, unsigned long id);
+size_t postings_decode(SearchPostings* postings, unsigned long* ids);
+void search_add_doc(SearchIndex* index, SearchItem* item);
+void search_evict_doc(SearchIndex* index);
+void search_evict(SearchIndex* index, time_t now);
+size_t search_intersect(unsigned long* ids, size_t count,
+        unsigned long* others, size_t noOfOthers);
+char* search_query(SearchIndex* index, const char* query);
+long search_docs(SearchIndex* index);
+
+#endif
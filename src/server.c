@@ -2,15 +2,69 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include "parser.h"
 #include "checkargs.h"
 #include "errors.h"
+#include "config.h"
+#include "history.h"
+#include "presence.h"
+#include "linereader.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "iobackend.h"
+#include "shmring.h"
+#include "mpscqueue.h"
+#include "fanout.h"
+#include "strmap.h"
+#include "compress.h"
+#include "capture.h"
+#include "mux.h"
+#include "bitset.h"
+#include "outbox.h"
+#include "auth.h"
+#include "searchindex.h"
+#include "chatlog.h"
+#include "bufpool.h"
+#include "idlepark.h"
+#include "msgformat.h"
+#include "memtrack.h"
+#include "admission.h"
 
-#define NO_OF_CLIENT_CMDS 4
-#define HUNDRED_MILLI_SECS 100000
+#define NO_OF_CLIENT_CMDS 11
+#define TOKEN_BYTES 16
+#define TOKEN_LEN (TOKEN_BYTES * 2)
+#define TOKEN_KEY_LEN TOKEN_BYTES // leading characters tokens are indexed by
+#define REAPER_INTERVAL_SECS 1
+#define TEN_MILLI_SECS 10000
+#define DRAIN_TIMEOUT_MILLI_SECS 5000
+#define LABEL_SIZE 64
+#define SEQUENCER_BATCH 64  // commands applied per hold of the global lock
+#define HISTORY_SPAN 3600   // seconds HISTORY: goes back without a number
+#define CLIENT_STACK_SIZE (256 << 10) // stack of each client thread
+#define RECEIVE_BUFFER_SIZE 1024 // pooled input buffer, long lines outgrow it
+#define BATCH_MAX_BYTES (64 << 10) // a BATCH: frame is sent once this full
+#define BATCH_HEADER_SIZE 32 // room for "BATCH:bytes\n"
+
+// Capabilities a client can announce with "CAPS:cap1,cap2" before it
+// answers the AUTH: challenge
+#define CAP_RESUME 0x1
+#define CAP_PRESENCE 0x2
+#define CAP_AUTONAME 0x4
+#define CAP_DEFLATE 0x8
+#define CAP_MUX 0x10       // a proxy carrying sessions, see mux.h
+#define CAP_BATCH 0x20     // takes broadcasts packed into BATCH: frames
+#define SESSION_CAPS (CAP_PRESENCE | CAP_AUTONAME) // caps a session can ask
+#define NAME_SUFFIX_DIGITS 21
+#define MAX_TOPICS 4096    // distinct topics subscribed to at once
+#define TOPIC_MAX_LEN 32
 
 // Structure to store each client's commands count
 typedef struct ClientCommandsCount {
@@ -29,33 +83,214 @@ typedef struct ServerCommandsCount {
     int leave;
 } ServerCommandsCount;
 
+// Code paths taking the global lock, each timed on its own. Commands the
+// sequencer applies within its hold are timed too, as holds without a wait
+// of their own.
+typedef enum LockSite {
+    LOCK_SETTLE_NAME,
+    LOCK_RESUME,
+    LOCK_SEQUENCER,
+    LOCK_SAY,             // compute_client_say, within the sequencer's hold
+    LOCK_LEFT,            // client_left, within the sequencer's hold
+    LOCK_CHATTERS_LIST,
+    LOCK_SEARCH,
+    LOCK_HISTORY,
+    LOCK_PRESENCE,
+    LOCK_REAPER,
+    LOCK_SESSION,         // proxied sessions opened, negotiated and closed
+    LOCK_HANDOFF,
+    LOCK_SIGHUP,
+    NO_OF_LOCK_SITES
+} LockSite;
+
+// Structure to store how long one code path waited for and held the
+// global lock
+typedef struct LockSiteStats {
+    Histogram wait;
+    Histogram hold;
+} LockSiteStats;
+
+// Broadcasts held back for clients with CAP_BATCH while the sequencer
+// applies a batch of commands, and sent to them as one "BATCH:bytes" frame
+// once it is done. Only frames every client gets are held; anything else
+// sent to clients during the batch goes out after them.
+typedef struct FrameBatch {
+    char* frames;            // the held frames, one after another
+    size_t len;
+    size_t capacity;
+    int count;
+    unsigned long lastSeq;   // sequence number of the last of them
+    bool open;               // set while the sequencer applies its batch
+} FrameBatch;
+
 // Structure to store the common variables that will be passed around
 // the client threads
 typedef struct CommonVars {
     pthread_mutex_t lock;
-    char* svrAuthVal;
+    AuthStore auth;
     ServerCommandsCount cmds;
+    ServerConfig config;
+    Metrics metrics;
+    unsigned long lockedAt;  // when the current lock holder acquired it
+    unsigned long lockWaited; // how long the holder waited for it
+    LockSite lockSite;       // where the holder took it
+    LockSiteStats lockSites[NO_OF_LOCK_SITES];
+    IoBackend io;
+    IoSend* sends;           // fan-out batch, reused under the lock
+    Outboxes outboxes;       // output queued while clients' sockets are full
+    int sendsCap;
+    Fanout fanout;           // fan-out workers, if sharded
+    CompressStats compress;  // broadcasts sent as "Z:" frames
+    Capture* capture;        // where client input is recorded, if anywhere
+    SearchIndex* search;     // recent chat by word, NULL if disabled
+    ChatLog* log;            // every message on disk, NULL if disabled
+    BufferPool receive;      // input buffers of the connections reading
+    IdleParker idle;         // sockets of quiet clients, without a thread
+    FrameBatch batch;        // broadcasts waiting for CAP_BATCH clients
+    CpuList cpus;            // CHAT_CPUS, empty if the threads float
+    MemCounters mem[NO_OF_MEM_SUBSYSTEMS]; // heap use, see memtrack.h
+    Admission admission;     // limits checked at accept, see admission.h
+    unsigned long nextConnId;
+    MuxCarrier* carriers;    // proxies' connections, broadcast to once each
+    History* history;
+    PresenceDelta* presence; // roster changes not yet sent to CAP_PRESENCE
+    StrMap* names;           // client list nodes by name
+    StrMap* nameSuffixes;    // NameSuffixes of each auto-named base in use
+    StrMap* tokens;          // client nodes by the key of their token
+    MpscQueue* ingress;      // SAY, KICK, DM and LEAVE commands to sequence
+    // Filters: clients get dense ids, and those that ignore somebody or
+    // subscribed to topics are listed, so a MSG: nobody filters costs one
+    // test of noOfFiltered
+    IdPool clientIds;
+    struct ClientList** filtered; // clients with a filter, by filterSlot
+    int noOfFiltered;
+    int filteredCap;
+    int noOfSubscribers;     // filtered clients with topics
+    StrMap* topics;          // topic ids plus one, by lowercase topic
+    IdPool topicIds;         // ids of topics with subscribers
+    struct Topic* topicList; // by topic id
+    int topicCap;
+    int noOfTopics;          // topics with subscribers
+    Bitset frameTopics;      // topics of the MSG: being filtered
+    Bitset frameSkip;        // ids of the clients it is not sent to
+    // Hot restart: client threads park while their sockets are handed over
+    pthread_mutex_t handoffLock;
+    pthread_cond_t handoffCond;
+    struct ClientIO* activeIo;   // every connection's ClientIO
+    int activeCount;
+    int parkedCount;             // threads parked plus idle connections
+    bool draining;
 } CommonVars;
 
 // ClientIO structure stores the necessary client details before assigning
 // them to a node in the client list upon sucessful entry of the client.
+// It stays with the client thread, since the node can be handed over to
+// another connection when a client resumes its session.
 typedef struct ClientIO {
-    char* rcvName;
-    FILE* rdEnd;
+    char* rcvName;            // settled name, owned by the connection
+    LineReader reader;
     FILE* wrEnd;
-    int* fdClient;
+    unsigned int caps;
+    unsigned long generation; // node generation this connection attached as
+    struct ClientList* resumed; // node taken over through RESUME:
+    pthread_t thread;
+    unsigned long connId;     // identifies the connection in a capture
+    Capture* capture;         // records every line read, if set
+    MuxSession* session;      // session a proxy carries, instead of a socket
+    Outbox* outbox;           // what wrEnd writes through, if a socket
+    struct ClientIO* nextActive;
+    struct ClientIO* prevActive;
+    time_t connectedAt;
+    char* statName;           // rcvName once entered, for the admin
+    bool idle;                // parked without a thread, see idlepark.h
+    struct ClientList* parked; // its client, for the thread that wakes it
+    bool idleWatched;         // socket known to the idle parker
+    bool admitted;            // counted by common->admission until closed
+    bool handshaking;         // and as a handshake until it enters
+    uint32_t peerAddr;        // IPv4 address admitted from, 0 if local
+    size_t nameBaseLen;       // base its name was allocated from, 0 if none
 } ClientIO;
 
+// A topic some client subscribed to, by its id. The id and its entry in
+// common->topics are given back once the last subscriber leaves.
+typedef struct Topic {
+    char* key;                // lowercase, as in common->topics
+    int subscribers;
+} Topic;
+
+// Suffixes handed out for one base name by allocate_name. Kept while any
+// client holds a name allocated from the base, given back suffixes being
+// reused first, so a crowd reconnecting under one base gets its old names
+// back rather than ever higher ones.
+typedef struct NameSuffixes {
+    unsigned long next;       // first suffix never handed out
+    int holders;              // clients holding a name allocated from it
+    unsigned long* spare;     // suffixes given back, a stack
+    int noOfSpare;
+    int spareCap;
+} NameSuffixes;
+
 // ClientList structure stores the client details
 typedef struct ClientList {  
     char* name;
-    FILE* rdEnd;
     FILE* wrEnd;
+    int fd;
+    Outbox* outbox;           // queues what the socket does not take
+    bool shm;                 // wrEnd writes to a shared memory ring
+    ShardMember* member;      // fan-out shard writing to it while attached
+    MuxSession* session;      // set if carried by a proxy, fd is then -1
+    ClientIO* owner;          // connection attached to the node, if any
     ClientCommandsCount cmds;
-    //bool active;  
+    unsigned int caps;
+    char token[TOKEN_LEN + 1];
+    bool detached;            // connection lost, name held for a resume
+    time_t detachedAt;
+    unsigned long generation; // bumped each time a connection attaches
+    int refs;                 // client threads still using this node
+    bool unlinked;            // no longer in the list, free once refs is 0
+    int id;                   // dense id, indexes the filter bitsets
+    Bitset ignores;           // ids of clients whose MSG: it does not get
+    Bitset topics;            // topic ids it subscribed to
+    int noOfIgnores;
+    int noOfTopics;
+    int filterSlot;           // index in common->filtered, -1 if none
     struct ClientList* next;   
+    size_t nameBaseLen;       // base the name was allocated from, 0 if none
+    size_t nameLen;
+    size_t msgPrefixLen;
+    char msgPrefix[];         // "MSG:name:", interned as the client enters,
+                              // followed by the name itself
 } ClientList;
 
+// Kinds of command applied by the sequencer thread
+typedef enum SeqCommandType {
+    SEQ_SAY,
+    SEQ_KICK,
+    SEQ_DM,
+    SEQ_LEFT,      // client sent LEAVE: or its connection went away
+    SEQ_IGNORE,
+    SEQ_UNIGNORE,
+    SEQ_SUB,
+    SEQ_UNSUB,
+    SEQ_BARRIER    // applies nothing, waited on to flush the queue
+} SeqCommandType;
+
+// Structure to store one command queued for the sequencer. Client threads
+// hand SAY: and KICK: over without waiting; a leaving client, an admin
+// kick and a handoff wait on done until theirs has been applied.
+typedef struct SeqCommand {
+    MpscNode link;          // must stay the first member
+    SeqCommandType type;
+    ClientList* client;     // sender, NULL for the admin
+    ClientIO* clntIo;       // sender's connection, alive until its SEQ_LEFT
+    char* line;             // received line arg points into, freed once
+                            // applied, NULL if the waiter owns it
+    char* arg;
+    bool leaving;           // SEQ_LEFT: client sent LEAVE:
+    bool found;             // SEQ_KICK: result for a waiter
+    unsigned int* done;     // set once applied, if someone waits
+} SeqCommand;
+
 // Structure to store the arguments to be sent to a sighup signal catching
 // thread
 typedef struct SighupThreadArgs {
@@ -71,110 +306,453 @@ typedef struct ClientThreadArguments {
     CommonVars* common;
 } ClientThreadArguments;
 
+// Structure to store the arguments to be sent to the threads that expire
+// detached clients, flush coalesced presence changes and serve the admin
+// socket
+typedef struct ReaperThreadArgs {
+    ClientList** listHeadNode;
+    CommonVars* common;
+} ReaperThreadArgs;
+
+// Structure to store the arguments to be sent to a thread accepting local
+// clients on a Unix domain socket, over the socket itself or over shared
+// memory set up through it
+typedef struct UnixListenerArgs {
+    int listenFd;
+    bool shm;
+    ClientList** listHeadNode;
+    CommonVars* common;
+} UnixListenerArgs;
+
+// Structure to store the arguments to be sent to the thread that hands the
+// server over to a successor process
+typedef struct HandoffThreadArgs {
+    int listenFd;
+    ClientList** listHeadNode;
+    CommonVars* common;
+} HandoffThreadArgs;
+
+// Structure to store what the admin endpoint reports about one connection
+typedef struct ConnSnapshot {
+    char* name;          // NULL while the connection is still negotiating
+    int fd;
+    unsigned int caps;
+    long age;
+    size_t buffered;     // input read from the socket but not processed
+    size_t bufferSize;
+    int inQueue;         // bytes waiting in the kernel receive queue
+    int outQueue;        // bytes waiting in the kernel send queue
+    long queued[OUTBOX_LANES]; // bytes waiting in its outbox, per lane
+    bool idle;           // parked without a thread
+    size_t memory;       // estimate of what the connection costs, in bytes
+} ConnSnapshot;
+
+// Structure to store what the admin endpoint reports about one fan-out
+// shard
+typedef struct ShardSnapshot {
+    int members;
+    unsigned long queued;  // frames published but not yet delivered
+} ShardSnapshot;
+
+// Structure to store one admin snapshot of the server, taken without the
+// global lock
+typedef struct AdminSnapshot {
+    ServerCommandsCount cmds;
+    long uptime;
+    unsigned long lastSeq;
+    size_t historyFrames;
+    size_t presencePending;
+    int rateLimit;
+    ConnSnapshot* conns;
+    int noOfConns;
+    size_t bufferBytes;  // line reader buffers of all connections
+    size_t connBytes;    // memory of all connections, see ConnSnapshot
+    int idleConns;
+    long receiveTaken;   // pooled input buffers in use
+    long receiveSpare;   // bytes of pooled input buffers kept for reuse
+    unsigned long receiveReused;
+    unsigned long receiveAllocated;
+    unsigned long idleParks;
+    unsigned long idleWakes;
+    struct mallinfo2 heap;
+    MemCounters mem[NO_OF_MEM_SUBSYSTEMS]; // tracked heap use
+    long admitted;       // connections counted against the limits
+    long handshaking;    // of those, not entered yet
+    long admittedAddrs;  // addresses they came from, if limited
+    unsigned long rejected[NO_OF_ADMIT_VERDICTS]; // BUSY: sent, by reason
+    unsigned long acceptBackoffs;
+    const char* ioBackend;
+    unsigned long sendSyscalls;
+    unsigned long sends;
+    ShardSnapshot* shards;
+    int noOfShards;
+    OutboxStats outbox;
+    size_t authCredentials;
+    long searchDocs;             // all 0 with search disabled
+    long searchTerms;
+    long searchBytes;
+    unsigned long searchEvicted;
+    unsigned long searchQueries;
+    long logBytes;               // all 0 without a message log
+    long logSegments;
+    unsigned long historyRequests;
+    unsigned long historyBytes;
+    unsigned long authReloads;
+    unsigned long authReloadFailures;
+    unsigned long authRejected;
+    LockSiteStats lockSites[NO_OF_LOCK_SITES];
+} AdminSnapshot;
+
+// Structure to store the admin socket's previous command counts, so that
+// JSON snapshots can report rates since the last one
+typedef struct AdminRates {
+    ServerCommandsCount cmds;
+    unsigned long allocs[NO_OF_MEM_SUBSYSTEMS];
+    unsigned long at;
+} AdminRates;
+
+ClientList* resume_client(ClientIO* clntIo, char* resumeArgs,
+        ClientList** headNode, CommonVars* common);
+void* client_thread(void* arg);
+pthread_t spawn_client_thread(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common);
+
+// GLOBAL LOCK---------------------------------------------------------------
+
+// Takes the common variables and the code path taking it as @param and
+// acquires the global lock, noting how long the caller waited for it.
+void lock_common(CommonVars* common, LockSite site) {
+    unsigned long start = now_nanos();
+    pthread_mutex_lock(&(common->lock));
+    common->lockedAt = now_nanos();
+    common->lockWaited = common->lockedAt - start;
+    common->lockSite = site;
+}
+
+// Takes the common variables as @param and releases the global lock, then
+// records how long it was waited for and held, in total and in the
+// histograms of the code path that took it.
+void unlock_common(CommonVars* common) {
+    LockSite site = common->lockSite;
+    unsigned long waited = common->lockWaited;
+    unsigned long held = now_nanos() - common->lockedAt;
+    pthread_mutex_unlock(&(common->lock));
+    metrics_add(&common->metrics.lockAcquired, 1);
+    metrics_add(&common->metrics.lockWaitNanos, waited);
+    metrics_max(&common->metrics.lockMaxWaitNanos, waited);
+    metrics_add(&common->metrics.lockHoldNanos, held);
+    histogram_record(&common->lockSites[site].wait, waited);
+    histogram_record(&common->lockSites[site].hold, held);
+}
+
+// Takes a code path taking the global lock as @param. Returns its name.
+const char* lock_site_name(LockSite site) {
+    const char* names[] = {"settle_name", "resume_client", "sequencer",
+            "compute_client_say", "client_left", "send_chatters_list",
+            "send_search_results", "send_history", "presence_flusher",
+            "detached_client_reaper", "mux_session", "handoff",
+            "sighup_dump"};
+    return names[site];
+}
+
+// Takes the common variables and where to copy them as @param and copies
+// every code path's lock histograms.
+void snapshot_lock_sites(CommonVars* common, LockSiteStats* sites) {
+    for (int site = 0; site < NO_OF_LOCK_SITES; site++) {
+        histogram_snapshot(&common->lockSites[site].wait, &sites[site].wait);
+        histogram_snapshot(&common->lockSites[site].hold, &sites[site].hold);
+    }
+}
+
+// Takes the output stream and copies of the lock histograms as @param and
+// writes one line per code path that took the lock: how often, and the
+// median, 99th percentile and longest wait and hold, in nanoseconds.
+void display_lock_sites(FILE* out, LockSiteStats* sites) {
+    for (int site = 0; site < NO_OF_LOCK_SITES; site++) {
+        Histogram* wait = &sites[site].wait;
+        Histogram* hold = &sites[site].hold;
+        if (hold->count == 0) {
+            continue;
+        }
+        fprintf(out, "%s:COUNT:%lu:WAIT_P50:%lu:WAIT_P99:%lu:WAIT_MAX:%lu:"
+                "HOLD_P50:%lu:HOLD_P99:%lu:HOLD_MAX:%lu\n",
+                lock_site_name(site), hold->count,
+                histogram_quantile(wait, 0.5), histogram_quantile(wait, 0.99),
+                wait->maxNanos, histogram_quantile(hold, 0.5),
+                histogram_quantile(hold, 0.99), hold->maxNanos);
+    }
+}
+
 // CLIENT AUTHENTICATION AND NAME NEGOTIATION--------------------------------
 
-// Takes ClientIO structure that stores the client details and the CommonVars
-// structure that stores the global variables for the program as @param.
-// Matches the authentication value sent by client on a "AUTH:" to the one 
-// stored in the server end. On a match, writes "OK:" back to client and
-// returns true, else returns false.
-bool do_client_auth(ClientIO* clntIo, CommonVars* common) {
+// Takes the comma separated capability list from a "CAPS:" line as @param
+// and returns the matching CAP_* flags. Unknown capabilities are ignored.
+unsigned int parse_client_caps(char* capsList) {
+    char* savePtr;
+    unsigned int caps = 0;
+    char* cap = strtok_r(capsList, ",", &savePtr);
+    while (cap != NULL) {
+        if (is_match(cap, "resume")) {
+            caps |= CAP_RESUME;
+        } else if (is_match(cap, "presence")) {
+            caps |= CAP_PRESENCE;
+        } else if (is_match(cap, "autoname")) {
+            caps |= CAP_AUTONAME;
+        } else if (is_match(cap, "deflate")) {
+            caps |= CAP_DEFLATE;
+        } else if (is_match(cap, "mux")) {
+            caps |= CAP_MUX;
+        } else if (is_match(cap, "batch")) {
+            caps |= CAP_BATCH;
+        }
+        cap = strtok_r(NULL, ",", &savePtr);
+    }
+    return caps;
+}
+
+// Takes ClientIO structure as @param and reads the next line the client
+// sent, recording it (or the connection closing) in the capture, if one
+// is being taken. Returns the line, else returns NULL as read_line does.
+char* read_client_line(ClientIO* clntIo) {
+    char* line = read_line(&clntIo->reader);
+    if (clntIo->capture != NULL && (line != NULL ||
+            !clntIo->reader.interrupted)) {
+        capture_line(clntIo->capture, clntIo->connId, line);
+    }
+    return line;
+}
+
+// Takes ClientIO structure and the common variables as @param. Reads the
+// client's answer to the AUTH: challenge, recording any "CAPS:" lines sent
+// ahead of it. Returns the answer, or NULL on EOF.
+char* get_auth_response(ClientIO* clntIo, CommonVars* common) {
+    char* response;
+    char* caps;
+    while ((response = read_client_line(clntIo)) != NULL &&
+            !strncmp(response, "CAPS:", strlen("CAPS:"))) {
+        strtok_r(response, COLON, &caps);
+        clntIo->caps |= parse_client_caps(caps);
+        mem_free(&common->mem[MEM_PARSER], response);
+    }
+    return response;
+}
+
+// Takes ClientIO structure that stores the client details, the headnode of
+// the client list and the CommonVars structure that stores the global
+// variables for the program as @param.
+// Looks the authentication value sent by client on a "AUTH:" up in the
+// authfile's secrets; an empty value only matches if the authfile holds
+// none. On a match, writes "OK:" back to client and returns true, else
+// returns false. A client may instead answer with
+// "RESUME:token:seq" once, which on success attaches it to its held node
+// (stored in clntIo->resumed) and returns true; an unknown token gets a
+// fresh AUTH: challenge.
+bool do_client_auth(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common) {
+    bool resumeTried = false;
     fprintf(clntIo->wrEnd, "AUTH:\n");
     fflush(clntIo->wrEnd);
-    char* clntResponse = get_line(clntIo->rdEnd);
-    char* authVal;
-    if (clntResponse != NULL) {
-        common->cmds.auth += 1;
+    char* clntResponse;
+    while ((clntResponse = get_auth_response(clntIo, common)) != NULL) {
+        char* authVal;
+        metrics_count(&common->cmds.auth);
         strtok_r(clntResponse, COLON, &authVal);
-        if (is_match(authVal, EMPTY_STR) || is_match(authVal,
-                common->svrAuthVal)) {
+        if (is_match(clntResponse, "RESUME") && !resumeTried) {
+            resumeTried = true;
+            clntIo->resumed = resume_client(clntIo, authVal, headNode,
+                    common);
+            mem_free(&common->mem[MEM_PARSER], clntResponse);
+            if (clntIo->resumed != NULL) {
+                return true;
+            }
+            fprintf(clntIo->wrEnd, "AUTH:\n");
+            fflush(clntIo->wrEnd);
+            continue;
+        }
+        bool authorized = auth_check(&common->auth, authVal);
+        mem_free(&common->mem[MEM_PARSER], clntResponse);
+        if (authorized) {
             fprintf(clntIo->wrEnd, "OK:\n");
             fflush(clntIo->wrEnd);
             return true;
         }
+        break;
     }
     return false;
 }
 
-// Reads the client name after a 'WHO:' call from server using get_line
-// function. Extracts the name from the client command (NAME:name) and 
-// returns the name, else if the 'NAME:' command is not received by the
-// server, returns NULL as the client name.
-char* get_client_name(FILE* rdEnd) {
-    char* response = get_line(rdEnd);
-    char* name;
+// Reads the client name after a 'WHO:' call from server using
+// read_client_line function. Extracts the name from the client command
+// (NAME:name) and returns a copy of it, owned by the connection, else if
+// the 'NAME:' command is not received by the server, returns NULL as the
+// client name. The line itself is freed either way.
+char* get_client_name(ClientIO* clntIo, CommonVars* common) {
+    char* response = read_client_line(clntIo);
+    char* name = NULL;
+    char* args;
     if (response != NULL) {
-        strtok_r(response, COLON, &name);
+        strtok_r(response, COLON, &args);
         if (is_match(response, "NAME")) {
-            return name;
+            name = mem_strdup(&common->mem[MEM_HANDSHAKE], args);
         }
+        mem_free(&common->mem[MEM_PARSER], response);
     }
-    return NULL;
+    return name;
 }
 
-// Takes current client name and the head node as @param and traverses
-// the whole client linked list. Returns true, if the client name is not
+// Takes current client name and the common variables as @param and looks
+// the name up in the name index. Returns true, if the client name is not
 // present in the list or the list is empty else returns false.
-bool is_valid_name(char* currClientName, ClientList* headNode) {
-    while (headNode != NULL) {
-        if (is_match(currClientName, headNode->name)) {
-            return false;
+bool is_valid_name(char* currClientName, CommonVars* common) {
+    return strmap_get(common->names, currClientName) == NULL;
+}
+
+// Takes a name that is taken, the connection it is for and the common
+// variables as @param. Finds a free name made of it followed by a number:
+// a suffix given back by a client that left, else the next one never
+// handed out, so that a crowd of clients sharing a name is settled without
+// retrying every suffix. The connection is counted as a holder of the base
+// until its client is removed. Caller holds the lock and has the client
+// enter before releasing it. Returns the free name, owned by the
+// connection.
+char* allocate_name(char* base, ClientIO* clntIo, CommonVars* common) {
+    NameSuffixes* suffixes = strmap_get(common->nameSuffixes, base);
+    if (suffixes == NULL) {
+        suffixes = mem_calloc(&common->mem[MEM_ROSTER], 1,
+                sizeof(NameSuffixes));
+        strmap_put(common->nameSuffixes, base, suffixes);
+    }
+    size_t size = strlen(base) + NAME_SUFFIX_DIGITS;
+    char* name = mem_alloc(&common->mem[MEM_HANDSHAKE], sizeof(char) * size);
+    do {
+        unsigned long suffix = suffixes->noOfSpare > 0 ?
+                suffixes->spare[--suffixes->noOfSpare] : suffixes->next++;
+        snprintf(name, size, "%s%lu", base, suffix);
+    } while (!is_valid_name(name, common));
+    suffixes->holders += 1;
+    clntIo->nameBaseLen = strlen(base);
+    return name;
+}
+
+// Takes a client node being removed and the common variables as @param. If
+// its name was allocated from a base, gives the suffix back to the base,
+// and forgets the base once no client holds a name allocated from it.
+// Caller holds the lock.
+void release_name_suffix(ClientList* node, CommonVars* common) {
+    if (node->nameBaseLen == 0) {
+        return;
+    }
+    char* base = strndup(node->name, node->nameBaseLen);
+    NameSuffixes* suffixes = strmap_get(common->nameSuffixes, base);
+    if (suffixes != NULL && --suffixes->holders == 0) {
+        strmap_remove(common->nameSuffixes, base);
+        mem_free(&common->mem[MEM_ROSTER], suffixes->spare);
+        mem_free(&common->mem[MEM_ROSTER], suffixes);
+    } else if (suffixes != NULL) {
+        if (suffixes->noOfSpare == suffixes->spareCap) {
+            suffixes->spareCap = suffixes->spareCap ?
+                    suffixes->spareCap * 2 : 4;
+            suffixes->spare = mem_realloc(&common->mem[MEM_ROSTER],
+                    suffixes->spare,
+                    sizeof(unsigned long) * suffixes->spareCap);
         }
-        headNode = headNode->next;
+        suffixes->spare[suffixes->noOfSpare++] =
+                strtoul(node->name + node->nameBaseLen, NULL, 10);
     }
-    return true;
+    free(base);
 }
 
 // Takes the pointer to teh ClientIO struct, the headnode of the client list
 // and the common variables across all clients as @param. Settles name with
 // the client, if succeeded, returns an OK: back to the client else sends
-// NAME_TAKEN if the name is taken by a client in the list. Returns the
-// settled name, else returns NULL for an EOF on client end.
+// NAME_TAKEN if the name is taken by a client in the list. A client with
+// CAP_AUTONAME whose name is taken is given the next free suffixed name
+// instead, and is told its final name as "OK:name". Names are read without
+// the lock; once one is accepted the lock stays held until
+// compute_client_enter has linked it, so nobody else can take it. Returns
+// the settled name, else returns NULL for an EOF on client end.
 char* settle_name(ClientIO* clntIo, ClientList** headNode,
         CommonVars* common) {
-    pthread_mutex_lock(&(common->lock));
-    ClientList* headNodeCopy = *headNode;
     while (1) {
         fprintf(clntIo->wrEnd, "WHO:\n");
         fflush(clntIo->wrEnd);
-        char* clientName = get_client_name(clntIo->rdEnd);
-        if (clientName != NULL) {
-            common->cmds.name += 1;
-            non_printable_check(clientName);
-            if (is_valid_name(clientName, headNodeCopy) &&
-                    !is_match(clientName, EMPTY_STR)) {
-                fprintf(clntIo->wrEnd, "OK:\n");
-                fflush(clntIo->wrEnd);
-                pthread_mutex_unlock(&(common->lock));
-                return clientName;
-            } else {
-                fprintf(clntIo->wrEnd, "NAME_TAKEN:\n");
-                fflush(clntIo->wrEnd);
-            }
-        } else {
-            pthread_mutex_unlock(&(common->lock));
+        char* clientName = get_client_name(clntIo, common);
+        if (clientName == NULL) {
             return NULL; // Client EOF or terminated unexpectedly
         }
+        metrics_count(&common->cmds.name);
+        non_printable_check(clientName);
+        if (is_match(clientName, EMPTY_STR)) {
+            mem_free(&common->mem[MEM_HANDSHAKE], clientName);
+            fprintf(clntIo->wrEnd, "NAME_TAKEN:\n");
+            fflush(clntIo->wrEnd);
+            continue;
+        }
+        lock_common(common, LOCK_SETTLE_NAME);
+        if ((clntIo->caps & CAP_AUTONAME) &&
+                !is_valid_name(clientName, common)) {
+            char* base = clientName;
+            clientName = allocate_name(base, clntIo, common);
+            mem_free(&common->mem[MEM_HANDSHAKE], base);
+        }
+        if (is_valid_name(clientName, common)) {
+            fprintf(clntIo->wrEnd, (clntIo->caps & CAP_AUTONAME) ?
+                    "OK:%s\n" : "OK:\n", clientName);
+            fflush(clntIo->wrEnd);
+            return clientName;
+        }
+        unlock_common(common);
+        mem_free(&common->mem[MEM_HANDSHAKE], clientName);
+        fprintf(clntIo->wrEnd, "NAME_TAKEN:\n");
+        fflush(clntIo->wrEnd);
     }
 }
 
 // CLIENT LIST OPERATIONS----------------------------------------------------
 
 // Takes a reference (ptr to ptr) to the head of the client linked list from
-// main and the ClientDetails to be added to the node as the @param.
-// Appends a new node at the end of the client list.
-ClientList* link_client_node(ClientIO* clntIo, ClientList** headNode) {
-    ClientList* newClientNode = (ClientList*) malloc(sizeof(ClientList));
+// main, the ClientDetails to be added to the node and the roster's memory
+// counters as the @param. Appends a new node at the end of the client
+// list, holding a copy of the client's name.
+ClientList* link_client_node(ClientIO* clntIo, ClientList** headNode,
+        MemCounters* counters) {
+    size_t nameLen = strlen(clntIo->rcvName);
+    ClientList* newClientNode = (ClientList*) mem_alloc(counters,
+            sizeof(ClientList) + 2 * nameLen + MSG_PREFIX_EXTRA + 1);
     ClientCommandsCount emptyStruct = {0};
     ClientList* last = *headNode;
 
     // Put client details
-    newClientNode->name = clntIo->rcvName;
-    newClientNode->rdEnd = clntIo->rdEnd;
     newClientNode->wrEnd = clntIo->wrEnd;
+    newClientNode->fd = clntIo->wrEnd ? clntIo->reader.fd : -1;
+    newClientNode->outbox = clntIo->outbox;
+    newClientNode->shm = clntIo->reader.shm != NULL;
+    newClientNode->member = NULL;
+    newClientNode->session = clntIo->session;
+    newClientNode->owner = clntIo;
     newClientNode->next = NULL;
     newClientNode->cmds = emptyStruct;
-    free(clntIo); // Free after storing details into a node
+    newClientNode->caps = clntIo->caps;
+    newClientNode->token[0] = NULL_CHAR;
+    newClientNode->detached = false;
+    newClientNode->detachedAt = 0;
+    newClientNode->generation = 1;
+    newClientNode->refs = 1; // owned by the client thread that entered it
+    newClientNode->unlinked = false;
+    newClientNode->id = -1;
+    init_bitset(&newClientNode->ignores);
+    init_bitset(&newClientNode->topics);
+    newClientNode->noOfIgnores = 0;
+    newClientNode->noOfTopics = 0;
+    newClientNode->filterSlot = -1;
+    newClientNode->nameBaseLen = clntIo->nameBaseLen;
+    newClientNode->nameLen = nameLen;
+    newClientNode->msgPrefixLen = build_msg_prefix(newClientNode->msgPrefix,
+            clntIo->rcvName, nameLen);
+    newClientNode->name = newClientNode->msgPrefix +
+            newClientNode->msgPrefixLen + 1;
+    memcpy(newClientNode->name, clntIo->rcvName, nameLen + 1);
+    clntIo->generation = newClientNode->generation;
 
     if (*headNode == NULL) {       // If for the first node
         *headNode = newClientNode;
@@ -187,16 +765,46 @@ ClientList* link_client_node(ClientIO* clntIo, ClientList** headNode) {
     return newClientNode;     
 }
 
+// Takes an attached client node and the common variables as @param and
+// gives the node to a fan-out shard, if fan-out is sharded. Sessions are
+// left to their proxy's carrier. Caller holds the lock.
+void attach_client_node(ClientList* node, CommonVars* common) {
+    if (node->session != NULL) {
+        return;
+    }
+    node->member = fanout_attach(&common->fanout, node->id, node->fd,
+            node->outbox, node->shm ? node->wrEnd : NULL, node->caps);
+}
+
+// Takes a client node as @param and takes the node away from its fan-out
+// shard, if it has one. Caller holds the lock.
+void detach_client_node(ClientList* node) {
+    if (node->member != NULL) {
+        fanout_detach(node->member);
+        node->member = NULL;
+    }
+}
+
+// Takes a client node and the roster's memory counters as @param. Marks a
+// node that has been unlinked from the list and deallocates it once no
+// client thread refers to it anymore.
+void discard_client_node(ClientList* node, MemCounters* counters) {
+    node->unlinked = true;
+    if (node->refs == 0) {
+        mem_free(counters, node);
+    }
+}
+
 // Takes a client name and a reference to head of the client list as @param
 // Traverses through the list searching for the client's name, if found
-// unlinks and deallocates the respective node from the list.
+// unlinks the respective node from the list. The node, and the name within
+// it, stay until the caller discards it.
 void unlink_client_node(char* name, ClientList** headNode) {
     ClientList* headNodeCopy = *headNode;
     ClientList* prevNode; // keep track of previous node for unlinking later
     // If the clientName is matched at the head node:
     if (headNodeCopy != NULL && is_match(headNodeCopy->name, name)) {
         *headNode = headNodeCopy->next; // Changed head
-        free(headNodeCopy); // free old head
         return;
     }
     // Traverse the whole list till a match
@@ -208,147 +816,779 @@ void unlink_client_node(char* name, ClientList** headNode) {
         return;
     }
     prevNode->next = headNodeCopy->next; // Unlink node from the linked list
-    free(headNodeCopy);                  // Free memory
 }
 
-// Takes the message to be broadcasted and the client list head node as 
-// @param. If message is NULL, returns. Else, broadcasts the message to all
-// client's present in the list.
-void broadcast_to_clients(char* msg, ClientList** headNode) {
+// Takes a frame, its length, where to store the compressed frame's length
+// and the common variables as @param. Returns the malloc'd "Z:" frame that
+// clients with CAP_DEFLATE get instead, compressed once for all of them,
+// else returns NULL if the frame is under CHAT_COMPRESS_MIN bytes, no such
+// client is in the chat or compressing does not shrink it.
+char* compress_broadcast(char* frame, size_t len, size_t* zLen,
+        CommonVars* common) {
+    if (common->config.compressMin == 0 ||
+            len < (size_t) common->config.compressMin ||
+            metrics_gauge_get(&common->compress.clients) == 0) {
+        return NULL;
+    }
+    return zframe_compress(frame, len, zLen, &common->compress);
+}
+
+// Takes a frame, its length, the CAP_* flags a recipient must have and
+// those it must not have, the ids of clients to skip (or NULL) and the
+// common variables as @param and writes the frame once to each proxy
+// carrying a matching session. Caller holds the lock.
+void fan_out_to_carriers(char* frame, size_t len, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip, CommonVars* common) {
+    for (MuxCarrier* carrier = common->carriers; carrier != NULL;
+            carrier = carrier->next) {
+        if (mux_broadcast(carrier, frame, len, needCaps, skipCaps, skip)) {
+            metrics_add(&common->metrics.muxFrames, 1);
+        }
+    }
+}
+
+// Takes a frame, the sequence number resuming clients get it under, the
+// CAP_* flags a recipient must have and those it must not have, the ids of
+// clients filtering it out (or NULL), the head node of the client list and
+// the common variables as @param. Writes the frame to every other matching
+// attached client as one batch through the I/O
+// backend, prefixed with "SEQ:seq:" for clients that can resume. Clients on
+// shared memory are written straight into their ring instead. Large frames
+// go to clients with CAP_DEFLATE compressed. Clients whose socket is full
+// get it queued on their outbox. With sharded fan-out the frame is just
+// handed to the shard workers. Sessions carried by a proxy get the frame
+// once per proxy. Caller holds the lock.
+void fan_out_frame(char* frame, unsigned long seq, unsigned int needCaps,
+        unsigned int skipCaps, const Bitset* skip, ClientList* headNode,
+        CommonVars* common) {
+    size_t len = strlen(frame);
+    size_t zLen = 0;
+    fan_out_to_carriers(frame, len, needCaps, skipCaps, skip, common);
+    char* zFrame = compress_broadcast(frame, len, &zLen, common);
+    if (common->fanout.noOfShards > 0) {
+        fanout_publish(&common->fanout, frame, zFrame, zLen, seq, needCaps,
+                skipCaps, skip);
+        return;
+    }
+    int noOfSends = 0;
+    int noOfQueued = 0;
+    int noOfRings = 0;
+    int noOfZipped = 0;
+    for (ClientList* node = headNode; node != NULL; node = node->next) {
+        if (node->detached || node->session != NULL ||
+                (node->caps & needCaps) != needCaps ||
+                (node->caps & skipCaps) ||
+                (skip != NULL && bitset_test(skip, node->id))) {
+            continue;
+        }
+        bool zipped = zFrame != NULL && (node->caps & CAP_DEFLATE);
+        noOfZipped += zipped;
+        if (node->shm) {
+            if (node->caps & CAP_RESUME) {
+                fprintf(node->wrEnd, "SEQ:%lu:", seq);
+            }
+            fwrite(zipped ? zFrame : frame, 1, zipped ? zLen : len,
+                    node->wrEnd);
+            fflush(node->wrEnd);
+            noOfRings++;
+            continue;
+        }
+        if (noOfSends == common->sendsCap) {
+            common->sendsCap = common->sendsCap ? common->sendsCap * 2 :
+                    BUFFER_SIZE;
+            common->sends = realloc(common->sends,
+                    sizeof(IoSend) * common->sendsCap);
+        }
+        IoSend* send = &common->sends[noOfSends];
+        send->fd = node->fd;
+        send->outbox = node->outbox;
+        send->prefixLen = 0;
+        if (node->caps & CAP_RESUME) {
+            send->prefixLen = snprintf(send->prefix, IO_PREFIX_SIZE,
+                    "SEQ:%lu:", seq);
+        }
+        send->data = zipped ? zFrame : frame;
+        send->len = zipped ? zLen : len;
+        if (send->outbox != NULL && outbox_defer(send->outbox, OUTBOX_BULK,
+                send->prefix, send->prefixLen, send->data, send->len)) {
+            noOfQueued++;
+            continue;
+        }
+        noOfSends++;
+    }
+    io_send_batch(&common->io, common->sends, noOfSends);
+    metrics_add(&common->metrics.frames, noOfSends + noOfQueued + noOfRings);
+    metrics_add(&common->compress.savedBytes, noOfZipped * (len - zLen));
+    free(zFrame);
+}
+
+// Takes the head node of the client list and the common variables as
+// @param and sends the frames held back for clients with CAP_BATCH. More
+// than one go as a single "BATCH:bytes" frame followed by the frames
+// themselves, under the sequence number of the last of them; a single
+// frame is sent as it is. Caller holds the lock.
+void flush_frame_batch(ClientList* headNode, CommonVars* common) {
+    FrameBatch* batch = &common->batch;
+    if (batch->count == 0) {
+        return;
+    }
+    if (batch->count == 1) {
+        fan_out_frame(batch->frames, batch->lastSeq, CAP_BATCH, 0, NULL,
+                headNode, common);
+    } else {
+        size_t size = batch->len + BATCH_HEADER_SIZE;
+        char* frame = mem_alloc(&common->mem[MEM_FANOUT], size);
+        int headerLen = snprintf(frame, size, "BATCH:%zu\n", batch->len);
+        memcpy(frame + headerLen, batch->frames, batch->len + 1);
+        fan_out_frame(frame, batch->lastSeq, CAP_BATCH, 0, NULL, headNode,
+                common);
+        mem_free(&common->mem[MEM_FANOUT], frame);
+        metrics_add(&common->metrics.batches, 1);
+        metrics_add(&common->metrics.batchedFrames, batch->count);
+    }
+    batch->len = 0;
+    batch->count = 0;
+}
+
+// Takes a broadcast frame, its sequence number, the head node of the client
+// list and the common variables as @param. Holds the frame back for the
+// clients with CAP_BATCH if the sequencer is applying a batch of commands,
+// sending what is held once it grows past BATCH_MAX_BYTES. Returns true if
+// it did, so that the frame only goes to the other clients now. Caller
+// holds the lock.
+bool batch_frame(char* frame, unsigned long seq, ClientList* headNode,
+        CommonVars* common) {
+    FrameBatch* batch = &common->batch;
+    if (!batch->open ||
+            metrics_gauge_get(&common->metrics.batchClients) == 0) {
+        return false;
+    }
+    size_t len = strlen(frame);
+    if (batch->len + len + 1 > batch->capacity) {
+        while (batch->len + len + 1 > batch->capacity) {
+            batch->capacity = batch->capacity ? batch->capacity * 2 :
+                    BATCH_MAX_BYTES;
+        }
+        batch->frames = mem_realloc(&common->mem[MEM_FANOUT], batch->frames,
+                batch->capacity);
+    }
+    memcpy(batch->frames + batch->len, frame, len + 1);
+    batch->len += len;
+    batch->count += 1;
+    batch->lastSeq = seq;
+    if (batch->len >= BATCH_MAX_BYTES) {
+        flush_frame_batch(headNode, common);
+    }
+    return true;
+}
+
+// Takes the message to be broadcasted, its presence sign (0 for chat), the
+// ids of clients filtering it out (or NULL), the client list head node and
+// the common variables as @param. If message is NULL, returns. Else,
+// records the message in the history under the next sequence number (the
+// history takes ownership of it) and broadcasts it to all other attached
+// clients in the list, except that presence frames skip the clients taking
+// coalesced PRESENCE: frames. Clients that can resume get it prefixed with
+// "SEQ:seq:".
+void broadcast_frame(char* msg, char presenceSign, const Bitset* skip,
+        ClientList** headNode, CommonVars* common) {
     ClientList* headNodeCopy = *headNode;
+    unsigned int skipCaps = 0;
     if (msg == NULL) {
         return;
     }
-    while (headNodeCopy != NULL) {
-        fprintf(headNodeCopy->wrEnd, msg);
-        fflush(headNodeCopy->wrEnd);
-        headNodeCopy = headNodeCopy->next;
+    if (presenceSign != 0 && common->config.presenceWindow > 0) {
+        skipCaps = CAP_PRESENCE;
+    }
+    unsigned long seq = history_append(common->history, msg, presenceSign);
+    if (skipCaps == 0 && skip == NULL &&
+            batch_frame(msg, seq, headNodeCopy, common)) {
+        fan_out_frame(msg, seq, 0, CAP_BATCH, NULL, headNodeCopy, common);
+    } else {
+        flush_frame_batch(headNodeCopy, common);
+        fan_out_frame(msg, seq, 0, skipCaps, skip, headNodeCopy, common);
+    }
+    metrics_add(&common->metrics.broadcasts, 1);
+}
+
+// Takes the message to be broadcasted, the client list head node and the
+// common variables as @param and broadcasts it to every attached client.
+void broadcast_to_clients(char* msg, ClientList** headNode,
+        CommonVars* common) {
+    broadcast_frame(msg, 0, NULL, headNode, common);
+}
+
+// Takes an "ENTER:"/"LEAVE:" frame, the name it is about, PRESENCE_ENTER or
+// PRESENCE_LEAVE, the client list head node and the common variables as
+// @param. Broadcasts the frame to clients without CAP_PRESENCE and queues
+// the change for the next coalesced "PRESENCE:" frame sent to the others.
+void broadcast_presence(char* frame, char* name, char sign,
+        ClientList** headNode, CommonVars* common) {
+    if (common->config.presenceWindow > 0) {
+        presence_add(common->presence, name, sign);
+    }
+    broadcast_frame(frame, sign, NULL, headNode, common);
+}
+
+// Presence thread function, takes a pointer to the ReaperThreadArgs struct
+// as @param. Every presence window, sends the roster changes collected
+// since the last window as one "PRESENCE:" frame to each attached client
+// with CAP_PRESENCE. Clients that can resume get it with the latest
+// sequence number, since it covers every presence change up to there.
+void* presence_flusher(void* arg) {
+    ReaperThreadArgs* rtArgs = arg;
+    CommonVars* common = rtArgs->common;
+    while (1) {
+        usleep(common->config.presenceWindow * 1000);
+        lock_common(common, LOCK_PRESENCE);
+        char* frame = presence_frame(common->presence);
+        if (frame != NULL) {
+            fan_out_frame(frame, common->history->lastSeq, CAP_PRESENCE, 0,
+                    NULL, *rtArgs->listHeadNode, common);
+        }
+        unlock_common(common);
+        free(frame);
     }
+    return NULL;
 }
 
 // CLIENT UNDERSTANDABLE FORMATS---------------------------------------------
 
-// Takes name and a message as @param and converts it to this format:
-// MSG:name:message and returns the format.
-char* convert_to_msg_format(char* name, char* msg) {
-    char* cmd = "MSG::\n";
-    int msgLen = strlen(cmd) + strlen(name) + strlen(msg);
-    char* format = malloc(sizeof(char) * msgLen); 
-    sprintf(format, "MSG:%s:%s\n", name, msg);
-    return format;
+// Takes a client node and a message as @param and converts it to this
+// format: MSG:name:message and returns the format, put together from the
+// client's interned prefix without any formatting.
+char* convert_to_msg_format(ClientList* client, char* msg) {
+    size_t len;
+    return msg_frame(client->msgPrefix, client->msgPrefixLen, msg, &len);
 }
 
-// Takes name as @param and converts it to this format:
+// Takes name and its length as @param and converts it to this format:
 // ENTER:name and returns the format.
-char* client_entry_format(char* name) {
-    char* cmd = "ENTER:\n";
-    int msgLen = strlen(cmd) + strlen(name);
-    char* format = malloc(sizeof(char) * msgLen); 
-    sprintf(format, "ENTER:%s\n", name);
-    return format;
+char* client_entry_format(char* name, size_t nameLen) {
+    size_t len;
+    return name_frame(ENTER_CMD, name, nameLen, &len);
 }
 
-// Takes name as @param and converts it to this format:
+// Takes name and its length as @param and converts it to this format:
 // LEAVE:name and returns the format.
-char* client_left_format(char* name) {
-    char* cmd = "LEAVE:\n";
-    int msgLen = strlen(cmd) + strlen(name);
-    char* format = malloc(sizeof(char) * msgLen); 
-    sprintf(format, "LEAVE:%s\n", name);
-    return format;
+char* client_left_format(char* name, size_t nameLen) {
+    size_t len;
+    return name_frame(LEAVE_CMD, name, nameLen, &len);
 }
 
 // SERVER STDOUT CONTENTS----------------------------------------------------
 
-// Takes the client's message and its name as @param and returns NULL if 
+// Takes the client's message and its node as @param and returns NULL if 
 // message is NULL, else displays its name and msg on stdout and returns a
 // string in a client understandable "MSG:" format.
-char* display_client_say(char* msg, char* clientName) {
+char* display_client_say(char* msg, ClientList* client) {
     if (msg != NULL) {
-        fprintf(stdout, "%s: %s\n", clientName, msg);
+        fprintf(stdout, "%s: %s\n", client->name, msg);
         fflush(stdout);
-        return convert_to_msg_format(clientName, msg);
+        return convert_to_msg_format(client, msg);
     }
     return NULL;
 }
 
-// Takes the client's name as @param and displays its entry. Returns a string
-// in a client understandable "ENTER:" format.
-char* display_client_entry(char* name) {
+// Takes the client's name and its length as @param and displays its entry.
+// Returns a string in a client understandable "ENTER:" format.
+char* display_client_entry(char* name, size_t nameLen) {
     fprintf(stdout, "(%s has entered the chat)\n", name);
     fflush(stdout);
-    return client_entry_format(name);  
+    return client_entry_format(name, nameLen);  
 }
 
-// Takes the client's name as @param and displays its leave on stdout.
-// Returns a string in client understandable "LEAVE:" format.
-char* display_client_left(char* name) {
+// Takes the client's name and its length as @param and displays its leave
+// on stdout. Returns a string in client understandable "LEAVE:" format.
+char* display_client_left(char* name, size_t nameLen) {
     fprintf(stdout, "(%s has left the chat)\n", name);
     fflush(stdout);
-    return client_left_format(name);  
+    return client_left_format(name, nameLen);  
+}
+
+// CLIENT SESSION RESUMPTION-------------------------------------------------
+
+// Takes where to store a token as @param and fills it with a random hex
+// string of TOKEN_LEN characters that a client can later present to resume
+// its session. Returns false, leaving it empty, if the kernel has no
+// randomness to give.
+bool generate_resume_token(char* token) {
+    unsigned char bytes[TOKEN_BYTES];
+    ssize_t got;
+    do {
+        got = getrandom(bytes, TOKEN_BYTES, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got != TOKEN_BYTES) {
+        token[0] = NULL_CHAR;
+        return false;
+    }
+    for (int idx = 0; idx < TOKEN_BYTES; idx++) {
+        sprintf(token + idx * 2, "%02x", bytes[idx]);
+    }
+    return true;
+}
+
+// Takes a token and where to store its key as @param and stores the key:
+// the token's first TOKEN_KEY_LEN characters, which the token index is
+// looked up by. The rest of the token is only ever compared in constant
+// time, so how long a lookup takes gives none of it away.
+void resume_token_key(const char* token, char* key) {
+    memcpy(key, token, TOKEN_KEY_LEN);
+    key[TOKEN_KEY_LEN] = NULL_CHAR;
+}
+
+// Takes two tokens of TOKEN_LEN characters as @param. Returns true if they
+// are the same, taking as long whichever characters differ.
+bool resume_token_equal(const char* token1, const char* token2) {
+    uint64_t words1[TOKEN_LEN / sizeof(uint64_t)];
+    uint64_t words2[TOKEN_LEN / sizeof(uint64_t)];
+    memcpy(words1, token1, TOKEN_LEN);
+    memcpy(words2, token2, TOKEN_LEN);
+    return auth_digest_equal(words1, words2) &
+            auth_digest_equal(words1 + 2, words2 + 2);
+}
+
+// Takes a client node that can resume and the common variables as @param.
+// Gives the node a token whose key no other node's has and puts it in the
+// token index. Returns false if no token could be generated. Caller holds
+// the lock.
+bool issue_resume_token(ClientList* node, CommonVars* common) {
+    char key[TOKEN_KEY_LEN + 1];
+    do {
+        if (!generate_resume_token(node->token)) {
+            return false;
+        }
+        resume_token_key(node->token, key);
+    } while (strmap_get(common->tokens, key) != NULL);
+    strmap_put(common->tokens, key, node);
+    return true;
+}
+
+// Takes a client node and the common variables as @param and takes its
+// token, if it has one, out of the token index. Caller holds the lock.
+void forget_resume_token(ClientList* node, CommonVars* common) {
+    char key[TOKEN_KEY_LEN + 1];
+    if (node->token[0] != NULL_CHAR) {
+        resume_token_key(node->token, key);
+        strmap_remove(common->tokens, key);
+    }
+}
+
+// Takes the resume token a connection presented and the common variables
+// as @param. Looks the token's key up in the token index, so an unknown
+// token costs one probe, not a walk of the roster, and compares the whole
+// token in constant time. Returns the node holding that token, else
+// returns NULL. Caller holds the lock.
+ClientList* find_resumable_client(char* token, CommonVars* common) {
+    char key[TOKEN_KEY_LEN + 1];
+    if (strlen(token) != TOKEN_LEN) {
+        return NULL;
+    }
+    resume_token_key(token, key);
+    ClientList* node = strmap_get(common->tokens, key);
+    if (node == NULL || !(node->caps & CAP_RESUME) ||
+            !resume_token_equal(node->token, token)) {
+        return NULL;
+    }
+    return node;
+}
+
+// Takes the ClientIO struct of a new connection, the "token:seq" arguments
+// of its RESUME: answer, the headnode of the client list and the common
+// variables as @param. Attaches the connection to the node holding the
+// token, cutting off the node's previous connection if the server has not
+// noticed it drop yet, replies "RESUMED:" and replays every broadcast after
+// seq. Returns the node, else returns NULL for an unknown token.
+ClientList* resume_client(ClientIO* clntIo, char* resumeArgs,
+        ClientList** headNode, CommonVars* common) {
+    char* seqStr;
+    char* token = strtok_r(resumeArgs, COLON, &seqStr);
+    if (token == NULL) {
+        return NULL;
+    }
+    unsigned long lastSeq = strtoul(seqStr, NULL, 10);
+    lock_common(common, LOCK_RESUME);
+    ClientList* node = find_resumable_client(token, common);
+    if (node != NULL) {
+        if (!node->detached) {
+            detach_client_node(node);
+            shutdown(node->fd, SHUT_RDWR);
+        } else {
+            metrics_gauge_add(&common->metrics.detached, -1);
+        }
+        metrics_add(&common->metrics.resumed, 1);
+        node->wrEnd = clntIo->wrEnd;
+        node->owner = clntIo;
+        node->fd = clntIo->reader.fd;
+        node->outbox = clntIo->outbox;
+        node->shm = clntIo->reader.shm != NULL;
+        node->detached = false;
+        node->generation += 1;
+        node->refs += 1;
+        clntIo->generation = node->generation;
+        fprintf(node->wrEnd, "RESUMED:\n");
+        history_replay(common->history, lastSeq, node->wrEnd,
+                (node->caps & CAP_PRESENCE) &&
+                common->config.presenceWindow > 0);
+        fflush(node->wrEnd);
+        attach_client_node(node, common);
+    }
+    unlock_common(common);
+    return node;
+}
+
+// CLIENT FILTERS------------------------------------------------------------
+
+// Takes a client node just linked and the common variables as @param, puts
+// it in the name index and gives it a dense id. Caller holds the lock.
+void index_client_node(ClientList* node, CommonVars* common) {
+    strmap_put(common->names, node->name, node);
+    node->id = id_pool_take(&common->clientIds);
+    if (node->session != NULL) {
+        node->session->clientId = node->id;
+    }
+}
+
+// Takes a client node and the common variables as @param. Lists the node
+// among the filtered clients if it ignores somebody or subscribed to a
+// topic, else takes it off the list. Caller holds the lock.
+void update_filter_slot(ClientList* node, CommonVars* common) {
+    bool filters = node->noOfIgnores > 0 || node->noOfTopics > 0;
+    if (filters && node->filterSlot < 0) {
+        if (common->noOfFiltered == common->filteredCap) {
+            common->filteredCap = common->filteredCap ?
+                    common->filteredCap * 2 : BUFFER_SIZE;
+            common->filtered = realloc(common->filtered,
+                    sizeof(ClientList*) * common->filteredCap);
+        }
+        node->filterSlot = common->noOfFiltered;
+        common->filtered[common->noOfFiltered++] = node;
+    } else if (!filters && node->filterSlot >= 0) {
+        ClientList* last = common->filtered[--common->noOfFiltered];
+        common->filtered[node->filterSlot] = last;
+        last->filterSlot = node->filterSlot;
+        node->filterSlot = -1;
+    }
+}
+
+// Takes text starting with a topic and a buffer of TOPIC_MAX_LEN + 1 chars
+// as @param. A topic is a word of letters, digits, '_' and '-'. Stores it
+// lowercased in the buffer, or an empty string if it is too long. Returns
+// the topic's length.
+size_t read_topic(const char* text, char* key) {
+    size_t len = 0;
+    while (isalnum((unsigned char) text[len]) || text[len] == '_' ||
+            text[len] == '-') {
+        if (len < TOPIC_MAX_LEN) {
+            key[len] = tolower((unsigned char) text[len]);
+        }
+        len++;
+    }
+    key[len <= TOPIC_MAX_LEN ? len : 0] = NULL_CHAR;
+    return len;
+}
+
+// Takes a lowercase topic, whether to give it an id if it has none yet and
+// the common variables as @param. Returns the topic's id, else returns -1
+// for a topic nobody subscribed to or while MAX_TOPICS have subscribers.
+// A new topic has no subscribers until the caller counts one. Caller holds
+// the lock.
+int find_topic(char* key, bool create, CommonVars* common) {
+    long id = (long) strmap_get(common->topics, key) - 1;
+    if (id < 0 && create && common->noOfTopics < MAX_TOPICS) {
+        id = id_pool_take(&common->topicIds);
+        if (id >= common->topicCap) {
+            common->topicCap = common->topicCap ?
+                    common->topicCap * 2 : BUFFER_SIZE;
+            common->topicList = realloc(common->topicList,
+                    sizeof(Topic) * common->topicCap);
+        }
+        common->topicList[id].key = mem_strdup(&common->mem[MEM_ROSTER],
+                key);
+        common->topicList[id].subscribers = 0;
+        common->noOfTopics += 1;
+        strmap_put(common->topics, key, (void*) (id + 1));
+    }
+    return id;
+}
+
+// Takes a topic's id and the common variables as @param and counts one
+// subscriber less. The last one gone, the topic is forgotten and its id
+// given back for the next new topic. Caller holds the lock.
+void release_topic(int id, CommonVars* common) {
+    Topic* topic = &common->topicList[id];
+    if (--topic->subscribers > 0) {
+        return;
+    }
+    strmap_remove(common->topics, topic->key);
+    mem_free(&common->mem[MEM_ROSTER], topic->key);
+    topic->key = NULL;
+    id_pool_give(&common->topicIds, id);
+    common->noOfTopics -= 1;
+}
+
+// Takes a client node leaving the chat and the common variables as @param.
+// Drops the node's filters, its topics' subscriptions and every other
+// client's ignore of it, then releases its id for the next client. Caller
+// holds the lock.
+void forget_client_filters(ClientList* node, CommonVars* common) {
+    if (node->noOfTopics > 0) {
+        common->noOfSubscribers -= 1;
+    }
+    size_t topicBits = node->topics.noOfWords * BITSET_WORD_BITS;
+    for (size_t id = 0; id < topicBits; id++) {
+        if (bitset_test(&node->topics, id)) {
+            release_topic(id, common);
+        }
+    }
+    node->noOfIgnores = 0;
+    node->noOfTopics = 0;
+    update_filter_slot(node, common);
+    free_bitset(&node->ignores);
+    free_bitset(&node->topics);
+    // Backwards, since a client dropping off the list swaps the last one in
+    for (int idx = common->noOfFiltered - 1; idx >= 0; idx--) {
+        ClientList* other = common->filtered[idx];
+        if (bitset_clear(&other->ignores, node->id)) {
+            other->noOfIgnores -= 1;
+            update_filter_slot(other, common);
+        }
+    }
+    id_pool_give(&common->clientIds, node->id);
+    node->id = -1;
+}
+
+// Takes a message and the common variables as @param and collects the ids
+// of the subscribed to topics it tags as "#topic" in common->frameTopics.
+// Returns true if it tags any. Caller holds the lock.
+bool collect_message_topics(char* message, CommonVars* common) {
+    char key[TOPIC_MAX_LEN + 1];
+    bool tagged = false;
+    bitset_clear_all(&common->frameTopics);
+    for (char* hash = strchr(message, '#'); hash != NULL;
+            hash = strchr(hash, '#')) {
+        hash += 1;
+        hash += read_topic(hash, key);
+        int id = key[0] != NULL_CHAR ? find_topic(key, false, common) : -1;
+        if (id >= 0) {
+            bitset_set(&common->frameTopics, id);
+            tagged = true;
+        }
+    }
+    return tagged;
+}
+
+// Takes the client saying a message, the message and the common variables
+// as @param. Returns the ids of the clients that do not get it: those
+// ignoring the sender, and those subscribed to topics of which it tags
+// none. Returns NULL if every client gets it, straight away when nobody
+// has a filter. Senders always get their own messages. Caller holds the
+// lock.
+const Bitset* filter_recipients(ClientList* sender, char* message,
+        CommonVars* common) {
+    if (common->noOfFiltered == 0) {
+        return NULL;
+    }
+    bool tagged = common->noOfSubscribers > 0 &&
+            collect_message_topics(message, common);
+    int skipped = 0;
+    bitset_clear_all(&common->frameSkip);
+    for (int idx = 0; idx < common->noOfFiltered; idx++) {
+        ClientList* node = common->filtered[idx];
+        if (node != sender && (bitset_test(&node->ignores, sender->id) ||
+                (node->noOfTopics > 0 && !(tagged &&
+                bitset_intersects(&node->topics, &common->frameTopics))))) {
+            bitset_set(&common->frameSkip, node->id);
+            skipped++;
+        }
+    }
+    metrics_add(&common->metrics.filtered, skipped);
+    return skipped > 0 ? &common->frameSkip : NULL;
 }
 
 // CLIENT INPUTS PROCESSING--------------------------------------------------
 
 // Takes the pointer to the ClientIO struct that contains client details, 
-// the headnode of the client list and a mutex lock as @param. Creates a new
-// node, stores the details of the client, links the node to list. Displays
-// client entry on stdout and broadcasts its entry to all clients in list.
-// Returns the client node. 
+// the headnode of the client list and the common variables as @param.
+// Creates a new node, stores the details of the client, links the node to
+// list. Sends a resume token to clients that can resume. Displays client
+// entry on stdout and broadcasts its entry to all clients in list. Caller
+// holds the lock, taken by settle_name, which this releases. Returns the
+// client node.
 ClientList* compute_client_enter(ClientIO* clntIo, ClientList** headNode,
-        pthread_mutex_t lock) {
-    pthread_mutex_lock(&lock);
-    ClientList* clientNode = link_client_node(clntIo, headNode);
-    char* (*enterMsg)(char*) = display_client_entry;
-    broadcast_to_clients(enterMsg(clientNode->name), headNode);
-    pthread_mutex_unlock(&lock);
+        CommonVars* common) {
+    ClientList* clientNode = link_client_node(clntIo, headNode,
+            &common->mem[MEM_ROSTER]);
+    index_client_node(clientNode, common);
+    attach_client_node(clientNode, common);
+    metrics_add(&common->metrics.entered, 1);
+    metrics_gauge_add(&common->metrics.roster, 1);
+    if (clientNode->caps & CAP_DEFLATE) {
+        metrics_gauge_add(&common->compress.clients, 1);
+    }
+    if (clientNode->caps & CAP_BATCH) {
+        metrics_gauge_add(&common->metrics.batchClients, 1);
+    }
+    if ((clientNode->caps & CAP_RESUME) &&
+            issue_resume_token(clientNode, common)) {
+        fprintf(clientNode->wrEnd, "TOKEN:%s\n", clientNode->token);
+        fflush(clientNode->wrEnd);
+    }
+    char* (*enterMsg)(char*, size_t) = display_client_entry;
+    broadcast_presence(enterMsg(clientNode->name, clientNode->nameLen),
+            clientNode->name,
+            PRESENCE_ENTER, headNode, common);
+    unlock_common(common);
     return clientNode;
 }
 
-// Takes the client's name, its message, the headnode of the client list,
-// and a mutex lock as @param. Prints the clients message on stdout and
-// broadcasts the message to all clients in the "MSG:" format.
-void compute_client_say(char* name, char* message, ClientList** headNode,
-        pthread_mutex_t lock) {
-    pthread_mutex_lock(&lock);
-    char* (*msg)(char*, char*) = display_client_say;
-    broadcast_to_clients(msg(message, name), headNode);
-    pthread_mutex_unlock(&lock);
+// Takes the client node, its message, the headnode of the client list,
+// and the common variables as @param. Prints the clients message on stdout
+// and broadcasts the message in the "MSG:" format to all clients that do
+// not filter it out. Caller holds the lock.
+void compute_client_say(ClientList* client, char* message,
+        ClientList** headNode, CommonVars* common) {
+    char* (*msg)(char*, ClientList*) = display_client_say;
+    char* frame = msg(message, client);
+    if (common->log != NULL && frame != NULL) {
+        chatlog_append(common->log, frame);
+    }
+    broadcast_frame(frame, 0, filter_recipients(client, message, common),
+            headNode, common);
+    if (common->search != NULL) {
+        search_submit(common->search, client->name, message);
+    }
 }
 
-// Takes the client's name and the client list node as @param. Check if the
-// client's name matches with any client in the list. Returns true if found,
-// else returns false.
-bool is_kicked(char* name, ClientList** headNode) {
-    ClientList* headNodeCopy = *headNode;
-    if (name == NULL) {
-        return false;
-    }
-    while (headNodeCopy != NULL) {
-        if (is_match(headNodeCopy->name, name)) {
-            fprintf(headNodeCopy->wrEnd, "KICK:\n");
-            fflush(headNodeCopy->wrEnd);
-            return true;
+// Takes a client node being kicked as @param. An attached client is sent
+// "KICK:" and its socket is shut for reading, so its thread sees EOF even
+// if the client ignores the kick. A proxy drops a kicked session itself.
+void send_kick(ClientList* node) {
+    if (!node->detached) {
+        fprintf(node->wrEnd, "KICK:\n");
+        fflush(node->wrEnd);
+        if (node->session == NULL) {
+            shutdown(node->fd, SHUT_RD);
         }
-        headNodeCopy = headNodeCopy->next;
     }
-    return false;
 }
 
-// Takes the current client name, the headnode of the client list and a mutex
-// lock as @param. If the client to be kicked is found in the list, unlinks
-// it from the list, sends a "KICK:" command to the client to be kicked,
-// displays its leave on server's stdout, and broadcasts its leave to all
-// other participating clients.
-void compute_client_kick(char* name, ClientList** headNode,
-        pthread_mutex_t lock) {
-    pthread_mutex_lock(&lock);
-    if (name != NULL && is_kicked(name, headNode)) {
+// Takes a client node about to be unlinked and the common variables as
+// @param, takes it away from its fan-out shard, the name index, the
+// filters and the roster gauges.
+void note_client_removed(ClientList* node, CommonVars* common) {
+    detach_client_node(node);
+    if (node->session != NULL) {
+        mux_session_left(node->session);
+    }
+    strmap_remove(common->names, node->name);
+    forget_resume_token(node, common);
+    release_name_suffix(node, common);
+    forget_client_filters(node, common);
+    metrics_gauge_add(&common->metrics.roster, -1);
+    if (node->caps & CAP_DEFLATE) {
+        metrics_gauge_add(&common->compress.clients, -1);
+    }
+    if (node->caps & CAP_BATCH) {
+        metrics_gauge_add(&common->metrics.batchClients, -1);
+    }
+    if (node->detached) {
+        metrics_gauge_add(&common->metrics.detached, -1);
+    }
+}
+
+// Takes a client's name and the common variables as @param and looks the
+// name up in the name index. Returns the client's node, else returns NULL.
+ClientList* find_client_node(char* name, CommonVars* common) {
+    return strmap_get(common->names, name);
+}
+
+// Takes the current client name, the headnode of the client list and the
+// common variables as @param. If the client to be kicked is found in the
+// list, unlinks it from the list, sends a "KICK:" command to the client to
+// be kicked, displays its leave on server's stdout, and broadcasts its
+// leave to all other participating clients. Caller holds the lock.
+// Returns true if the client was found.
+bool compute_client_kick(char* name, ClientList** headNode,
+        CommonVars* common) {
+    ClientList* node = name ? find_client_node(name, common) : NULL;
+    if (node != NULL) {
+        size_t nameLen = node->nameLen;
+        note_client_removed(node, common); // no frames after its KICK:
+        send_kick(node);
         unlink_client_node(name, headNode);
-        char* (*leftMsg)(char*) = display_client_left;
-        broadcast_to_clients(leftMsg(name), headNode);
+        char* (*leftMsg)(char*, size_t) = display_client_left;
+        broadcast_presence(leftMsg(name, nameLen), name, PRESENCE_LEAVE,
+                headNode, common);
+        discard_client_node(node, &common->mem[MEM_ROSTER]);
+    }
+    return node != NULL;
+}
+
+// Takes the sending client node, the "name:text" following its DM: and the
+// common variables as @param. Looks the recipient up in the name index
+// and, if it is attached and does not ignore the sender, writes it
+// "DM:sender:text"; nobody else sees the message, not even the server's
+// stdout. Caller holds the lock. Returns true if the message was
+// delivered.
+bool compute_client_dm(ClientList* sender, char* args, CommonVars* common) {
+    char* text = strchr(args, COLON_ASCII);
+    if (text == NULL) {
+        return false;
+    }
+    *text++ = NULL_CHAR;
+    ClientList* node = find_client_node(args, common);
+    if (node == NULL || node->detached ||
+            bitset_test(&node->ignores, sender->id)) {
+        return false;
+    }
+    fanout_lock_member(node->member);
+    fprintf(node->wrEnd, "DM:%s:%s\n", sender->name, text);
+    fflush(node->wrEnd);
+    fanout_unlock_member(node->member);
+    metrics_add(&common->metrics.directMessages, 1);
+    return true;
+}
+
+// Takes SEQ_IGNORE, SEQ_UNIGNORE, SEQ_SUB or SEQ_UNSUB, the client sending
+// it, the name or topic following the command and the common variables as
+// @param and updates the client's filters. Ignoring oneself or somebody
+// not in the chat, or an invalid topic, changes nothing. An ignore lasts
+// while the ignored client stays in the chat. Caller holds the lock.
+void compute_client_filter(SeqCommandType type, ClientList* client,
+        char* arg, CommonVars* common) {
+    char key[TOPIC_MAX_LEN + 1];
+    bool subscribed = client->noOfTopics > 0;
+    if (type == SEQ_IGNORE || type == SEQ_UNIGNORE) {
+        ClientList* node = find_client_node(arg, common);
+        if (node == NULL || node == client) {
+            return;
+        }
+        if (type == SEQ_IGNORE) {
+            client->noOfIgnores += bitset_set(&client->ignores, node->id);
+        } else {
+            client->noOfIgnores -= bitset_clear(&client->ignores, node->id);
+        }
+    } else {
+        char* topic = arg + (*arg == '#');
+        if (topic[read_topic(topic, key)] != NULL_CHAR ||
+                key[0] == NULL_CHAR) {
+            return;
+        }
+        int id = find_topic(key, type == SEQ_SUB, common);
+        if (id < 0) {
+            return;
+        }
+        if (type == SEQ_SUB && bitset_set(&client->topics, id)) {
+            client->noOfTopics += 1;
+            common->topicList[id].subscribers += 1;
+        } else if (type == SEQ_UNSUB && bitset_clear(&client->topics, id)) {
+            client->noOfTopics -= 1;
+            release_topic(id, common);
+        }
     }
-    pthread_mutex_unlock(&lock);
+    common->noOfSubscribers += (client->noOfTopics > 0) - subscribed;
+    update_filter_slot(client, common);
 }
 
 // Compare function for the qsort function
@@ -357,64 +1597,452 @@ int compare_str(const void* str1, const void* str2) {
 }
 
 // Takes read end of the client and the clients names array and its length as
-// @param and writes the LIST: response back to the client.
+// @param and writes the LIST: response back to the client. The line is put
+// together first, the client's stream is unbuffered.
 void send_names_to_client(FILE* wrEnd, char** namesArr, int len) {
     int idx;
-    fprintf(wrEnd, "LIST:");
+    char* line;
+    size_t lineLen;
+    FILE* out = open_memstream(&line, &lineLen);
+    fprintf(out, "LIST:");
     for (idx = 0; idx < len - 1; idx++) {
-        fprintf(wrEnd, "%s,", namesArr[idx]);
+        fprintf(out, "%s,", namesArr[idx]);
     }
-    fprintf(wrEnd, "%s\n", namesArr[idx]);
+    fprintf(out, "%s\n", namesArr[idx]);
+    fclose(out);
+    fwrite(line, 1, lineLen, wrEnd);
     fflush(wrEnd);
+    free(line);
 }
 
-// Takes the current client, the headnode of the client list and a mutex lock
-// as @param. Returns the list of client names in the list in a client
-// understandable format and in lexicographical order.
+// Takes the current client, the headnode of the client list and the common
+// variables as @param. Returns the list of client names in the list in a
+// client understandable format and in lexicographical order.
 void send_chatters_list(ClientList* client, ClientList** headNode,
-        pthread_mutex_t lock) {
-    pthread_mutex_lock(&lock);
+        CommonVars* common) {
+    lock_common(common, LOCK_CHATTERS_LIST);
     ClientList* headNodeCopy = *headNode;
     int idx = 0;
     int buf = BUFFER_SIZE;
-    char** namesArr = malloc(sizeof(char*) * buf);
+    char** namesArr = mem_alloc(&common->mem[MEM_PARSER],
+            sizeof(char*) * buf);
     while (headNodeCopy != NULL) {
-        namesArr[idx] = headNodeCopy->name;
-        if (idx == buf - 1) {
-            namesArr = realloc(namesArr, (sizeof(char*) * buf));
-        } else {
-            idx++;
+        if (idx == buf) {
+            buf *= 2;
+            namesArr = mem_realloc(&common->mem[MEM_PARSER], namesArr,
+                    sizeof(char*) * buf);
         }
+        namesArr[idx++] = headNodeCopy->name;
         headNodeCopy = headNodeCopy->next;
     }
     qsort(namesArr, idx, sizeof(char*), compare_str);
+    fanout_lock_member(client->member);
     send_names_to_client(client->wrEnd, namesArr, idx);
-    pthread_mutex_unlock(&lock);
-}
-
-// Takes the name of the client, the headnode of the client list and a
-// mutex lock as @param. Unlinks the client node with the matching name
-// displays its leave on stdout, and broadcasts to all current client nodes 
-// in the list about the client's leave. Ignores unlinking and broadcasting 
-// if name is NULL.
-void client_left(char* name, ClientList** headNode,
-        pthread_mutex_t lock) {
-    pthread_mutex_lock(&lock);
-    if (name != NULL) {
-        unlink_client_node(name, headNode);
-        char* (*leftMsg)(char*) = display_client_left;
-        broadcast_to_clients(leftMsg(name), headNode);
-    }
-    pthread_mutex_unlock(&lock);
+    fanout_unlock_member(client->member);
+    unlock_common(common);
+    mem_free(&common->mem[MEM_PARSER], namesArr);
 }
 
-// CLIENT COMMAND PROCESSING-------------------------------------------------
+// Takes the current client, the words it searches for and the common
+// variables as @param. Looks the words up in the search index, without
+// the lock, then sends the client the messages found.
+void send_search_results(ClientList* client, char* query,
+        CommonVars* common) {
+    char* reply = common->search != NULL ?
+            search_query(common->search, query) : strdup("FOUND:\n");
+    lock_common(common, LOCK_SEARCH);
+    fanout_lock_member(client->member);
+    fputs(reply, client->wrEnd);
+    fflush(client->wrEnd);
+    fanout_unlock_member(client->member);
+    unlock_common(common);
+    free(reply);
+}
 
-// Takes the input from the client as @param and for a matched token in
+// Takes the current client, how many seconds back it asks for and the
+// common variables as @param. Finds where that part of the message log
+// starts, without the lock, then sends the client "HISTORY:", the messages
+// themselves and "HISTORY_END:". Everything goes out in the order the
+// client's fan-out writes in, so no broadcast lands inside the reply: to a
+// socket as bulk frames, the messages straight from the log's files, that
+// control frames can only go ahead of between whole lines, else through
+// its stream. A client with a shard membership is only kept from its shard
+// while the reply is written, the global lock is let go of first.
+void send_history(ClientList* client, char* seconds, CommonVars* common) {
+    char* end;
+    long span = strtol(seconds, &end, 10);
+    if (*seconds == NULL_CHAR || *end != NULL_CHAR || span < 0) {
+        span = HISTORY_SPAN;
+    }
+    int noOfRanges = 0;
+    LogRange* ranges = common->log != NULL ?
+            chatlog_find(common->log, time(NULL) - span, &noOfRanges) : NULL;
+    lock_common(common, LOCK_HISTORY);
+    ShardMember* member = client->member;
+    Outbox* outbox = client->outbox;
+    FILE* out = client->wrEnd;
+    fanout_lock_member(member);
+    if (member != NULL) {
+        unlock_common(common); // detaching the member waits for its lock
+    }
+    if (outbox != NULL) {
+        outbox_write(outbox, OUTBOX_BULK, NULL, 0, "HISTORY:\n", 9);
+    } else {
+        fputs("HISTORY:\n", out);
+    }
+    for (int idx = 0; idx < noOfRanges; idx++) {
+        if (outbox != NULL) {
+            outbox_send_file(outbox, OUTBOX_BULK, ranges[idx].fd,
+                    ranges[idx].cuts, ranges[idx].noOfCuts);
+        } else {
+            chatlog_copy_range(&ranges[idx], out);
+        }
+    }
+    if (outbox != NULL) {
+        outbox_write(outbox, OUTBOX_BULK, NULL, 0, "HISTORY_END:\n", 13);
+    } else {
+        fputs("HISTORY_END:\n", out);
+        fflush(out);
+    }
+    fanout_unlock_member(member);
+    if (member == NULL) {
+        unlock_common(common);
+    }
+    free_log_ranges(ranges, noOfRanges);
+}
+
+// Takes the client node, the ClientIO of the connection that is going away,
+// whether the client sent LEAVE:, the headnode of the client list and the
+// common variables as @param. If the connection still owns the node, a
+// client that can resume and did not leave is detached and its name held
+// for the resume grace period. Otherwise the node is unlinked, its leave
+// displayed on stdout and broadcast to all current client nodes in the
+// list. A node that was kicked or taken over by a newer connection is just
+// released. Caller holds the lock.
+void client_left(ClientList* client, ClientIO* clntIo, bool leaving,
+        ClientList** headNode, CommonVars* common) {
+    client->refs -= 1;
+    if (client->unlinked || client->generation != clntIo->generation) {
+        if (client->unlinked && client->refs == 0) {
+            mem_free(&common->mem[MEM_ROSTER], client);
+        }
+    } else if (!leaving && (client->caps & CAP_RESUME)) {
+        client->detached = true;
+        detach_client_node(client);
+        client->detachedAt = time(NULL);
+        client->owner = NULL;
+        metrics_gauge_add(&common->metrics.detached, 1);
+    } else {
+        char* name = client->name;
+        size_t nameLen = client->nameLen;
+        note_client_removed(client, common);
+        unlink_client_node(name, headNode);
+        char* (*leftMsg)(char*, size_t) = display_client_left;
+        broadcast_presence(leftMsg(name, nameLen), name, PRESENCE_LEAVE,
+                headNode, common);
+        discard_client_node(client, &common->mem[MEM_ROSTER]);
+    }
+}
+
+// Reaper thread function, takes a pointer to the ReaperThreadArgs struct as
+// @param. Once a second, unlinks detached clients whose resume grace period
+// has run out, displays their leave on stdout and broadcasts it. Also
+// writes out the records buffered by a capture.
+void* detached_client_reaper(void* arg) {
+    ReaperThreadArgs* rtArgs = arg;
+    CommonVars* common = rtArgs->common;
+    while (1) {
+        sleep(REAPER_INTERVAL_SECS);
+        lock_common(common, LOCK_REAPER);
+        time_t now = time(NULL);
+        ClientList* node = *rtArgs->listHeadNode;
+        while (node != NULL) {
+            ClientList* next = node->next;
+            if (node->detached &&
+                    now - node->detachedAt >= common->config.resumeGrace) {
+                char* name = node->name;
+                size_t nameLen = node->nameLen;
+                note_client_removed(node, common);
+                unlink_client_node(name, rtArgs->listHeadNode);
+                char* (*leftMsg)(char*, size_t) = display_client_left;
+                broadcast_presence(leftMsg(name, nameLen), name,
+                        PRESENCE_LEAVE, rtArgs->listHeadNode, common);
+                discard_client_node(node, &common->mem[MEM_ROSTER]);
+            }
+            node = next;
+        }
+        unlock_common(common);
+        flush_capture(common->capture);
+    }
+    return NULL;
+}
+
+// SEQUENCER-----------------------------------------------------------------
+
+// Takes a command, the headnode of the client list and the common
+// variables as @param and applies the command. Caller holds the lock. The
+// command is freed, or its waiter woken, and must not be used afterwards.
+void apply_command(SeqCommand* cmd, ClientList** headNode,
+        CommonVars* common) {
+    unsigned long start = now_nanos();
+    if (cmd->type != SEQ_SAY) {
+        // What the command sends must not overtake held broadcasts
+        flush_frame_batch(*headNode, common);
+    }
+    switch (cmd->type) {
+        case SEQ_SAY:
+            // Lines still buffered from a kicked or superseded connection
+            // are dropped, nothing is said after the kick is sequenced
+            if (!cmd->client->unlinked &&
+                    cmd->client->generation == cmd->clntIo->generation) {
+                compute_client_say(cmd->client, cmd->arg, headNode, common);
+            }
+            break;
+        case SEQ_KICK:
+            cmd->found = compute_client_kick(cmd->arg, headNode, common);
+            break;
+        case SEQ_DM:
+            if (!cmd->client->unlinked &&
+                    cmd->client->generation == cmd->clntIo->generation) {
+                compute_client_dm(cmd->client, cmd->arg, common);
+            }
+            break;
+        case SEQ_IGNORE:
+        case SEQ_UNIGNORE:
+        case SEQ_SUB:
+        case SEQ_UNSUB:
+            if (!cmd->client->unlinked &&
+                    cmd->client->generation == cmd->clntIo->generation) {
+                compute_client_filter(cmd->type, cmd->client, cmd->arg,
+                        common);
+            }
+            break;
+        case SEQ_LEFT:
+            client_left(cmd->client, cmd->clntIo, cmd->leaving, headNode,
+                    common);
+            break;
+        case SEQ_BARRIER:
+            break;
+    }
+    if (cmd->type == SEQ_SAY || cmd->type == SEQ_LEFT) {
+        histogram_record(&common->lockSites[cmd->type == SEQ_SAY ?
+                LOCK_SAY : LOCK_LEFT].hold, now_nanos() - start);
+    }
+    metrics_add(&common->metrics.sequenced, 1);
+    metrics_gauge_add(&common->metrics.ingressDepth, -1);
+    if (cmd->done != NULL) {
+        futex_set_wake(cmd->done);
+    } else {
+        mem_free(&common->mem[MEM_PARSER], cmd->line);
+        mem_free(&common->mem[MEM_PARSER], cmd);
+    }
+}
+
+// Sequencer thread function, takes a pointer to the ReaperThreadArgs
+// struct as @param. Applies the commands client threads queue, one at a
+// time in the order they were queued, so every client sees the same order
+// of broadcasts under consecutive sequence numbers. Commands that queue up
+// while it is busy are applied in batches under one hold of the lock.
+void* sequencer_thread(void* arg) {
+    ReaperThreadArgs* rtArgs = arg;
+    CommonVars* common = rtArgs->common;
+    while (1) {
+        MpscNode* node = mpsc_pop_wait(common->ingress);
+        lock_common(common, LOCK_SEQUENCER);
+        int applied = 0;
+        common->batch.open = true;
+        do {
+            apply_command((SeqCommand*) node, rtArgs->listHeadNode, common);
+        } while (++applied < SEQUENCER_BATCH &&
+                (node = mpsc_pop(common->ingress)) != NULL);
+        flush_frame_batch(*rtArgs->listHeadNode, common);
+        common->batch.open = false;
+        unlock_common(common);
+        metrics_add(&common->metrics.sequencerBatches, 1);
+    }
+    return NULL;
+}
+
+// Takes a command and the common variables as @param and queues the
+// command for the sequencer. Without a done flag the sequencer owns and
+// frees the command; with one, this waits until it has been applied.
+void sequence_command(SeqCommand* cmd, CommonVars* common) {
+    unsigned int* done = cmd->done; // cmd may be freed once it is pushed
+    metrics_gauge_add(&common->metrics.ingressDepth, 1);
+    mpsc_push(common->ingress, &cmd->link);
+    if (done != NULL) {
+        futex_wait_set(done);
+    }
+}
+
+// Takes the type of command, the client and connection it came from, the
+// received line, the argument within it and the common variables as
+// @param. Queues the command for the sequencer without waiting for it; the
+// line now belongs to the sequencer.
+void submit_client_command(SeqCommandType type, ClientList* client,
+        ClientIO* clntIo, char* line, char* arg, CommonVars* common) {
+    SeqCommand* cmd = mem_calloc(&common->mem[MEM_PARSER], 1,
+            sizeof(SeqCommand));
+    cmd->type = type;
+    cmd->client = client;
+    cmd->clntIo = clntIo;
+    cmd->line = line;
+    cmd->arg = arg;
+    sequence_command(cmd, common);
+}
+
+// Takes the type of command, its client, connection and argument (any of
+// them may be unused) and the common variables as @param. Queues the
+// command and waits until the sequencer has applied it, and so every
+// command queued before it. Returns the kick result for SEQ_KICK.
+bool run_sequenced(SeqCommandType type, ClientList* client, ClientIO* clntIo,
+        char* arg, bool leaving, CommonVars* common) {
+    unsigned int done = 0;
+    SeqCommand cmd = {{NULL}, type, client, clntIo, NULL, arg, leaving, false,
+            &done};
+    sequence_command(&cmd, common);
+    return cmd.found;
+}
+
+// CLIENT THREAD REGISTRY----------------------------------------------------
+
+// Takes a connection's ClientIO and the common variables as @param. Called
+// once the connection's client entered the chat, or its proxy started
+// carrying sessions, after which it no longer counts as a handshake.
+void end_handshake(ClientIO* clntIo, CommonVars* common) {
+    if (clntIo->handshaking) {
+        clntIo->handshaking = false;
+        admission_entered(&common->admission);
+    }
+}
+
+// Takes a connection's ClientIO that nothing refers to any more and the
+// common variables as @param and deallocates it along with its name. A
+// connection that was admitted stops counting against the limits.
+void free_client_io(ClientIO* clntIo, CommonVars* common) {
+    if (clntIo->admitted) {
+        release_admission(&common->admission, clntIo->peerAddr,
+                clntIo->handshaking);
+    }
+    mem_free(&common->mem[MEM_HANDSHAKE], clntIo->rcvName);
+    mem_free(&common->mem[MEM_HANDSHAKE], clntIo);
+}
+
+// Takes the ClientIO of a starting client thread and the common variables
+// as @param and records the thread, so that a hot restart can reach it.
+void register_client_io(ClientIO* clntIo, CommonVars* common) {
+    pthread_mutex_lock(&(common->handoffLock));
+    clntIo->thread = pthread_self();
+    clntIo->prevActive = NULL;
+    clntIo->nextActive = common->activeIo;
+    if (common->activeIo != NULL) {
+        common->activeIo->prevActive = clntIo;
+    }
+    common->activeIo = clntIo;
+    common->activeCount += 1;
+    pthread_cond_broadcast(&(common->handoffCond));
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// Takes the ClientIO of a finishing client thread and the common variables
+// as @param and removes the thread from the registry.
+void unregister_client_io(ClientIO* clntIo, CommonVars* common) {
+    pthread_mutex_lock(&(common->handoffLock));
+    if (clntIo->prevActive != NULL) {
+        clntIo->prevActive->nextActive = clntIo->nextActive;
+    } else {
+        common->activeIo = clntIo->nextActive;
+    }
+    if (clntIo->nextActive != NULL) {
+        clntIo->nextActive->prevActive = clntIo->prevActive;
+    }
+    common->activeCount -= 1;
+    pthread_cond_broadcast(&(common->handoffCond));
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// Takes the common variables as @param. Called by a client thread between
+// commands while the server is being handed over. Blocks until the handoff
+// is abandoned; on success the process exits with the thread parked here.
+void park_for_handoff(CommonVars* common) {
+    pthread_mutex_lock(&(common->handoffLock));
+    common->parkedCount += 1;
+    pthread_cond_broadcast(&(common->handoffCond));
+    while (common->draining) {
+        pthread_cond_wait(&(common->handoffCond), &(common->handoffLock));
+    }
+    common->parkedCount -= 1;
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// Takes the ClientIO of an entered client and the common variables as
+// @param. Polls for CHAT_SPIN microseconds, if set, then waits up to the
+// idle timeout for the client to send something. Returns true if it sent
+// nothing, so that its connection can park. Only socket clients spin and
+// park; a signal cuts the wait short with the reader's interrupted flag
+// set.
+bool wait_client_input(ClientIO* clntIo, CommonVars* common) {
+    clntIo->reader.interrupted = false;
+    if (clntIo->outbox == NULL || line_reader_has_line(&clntIo->reader)) {
+        return false;
+    }
+    struct pollfd pollFd = {clntIo->reader.fd, POLLIN, 0};
+    int ready = 0;
+    long until = 0;
+    while (ready == 0 &&
+            keep_spinning(&until, common->config.spin * 1000L)) {
+        ready = poll(&pollFd, 1, 0);
+    }
+    if (ready == 0 && common->config.idleAfter > 0) {
+        ready = poll(&pollFd, 1, common->config.idleAfter * 1000);
+    } else if (ready == 0) {
+        return false; // the read blocks instead
+    }
+    clntIo->reader.interrupted = ready < 0 && errno == EINTR;
+    return ready == 0;
+}
+
+// Takes a quiet client, the ClientIO of its connection and the common
+// variables as @param. Gives the connection's input buffer back and hands
+// its socket to the idle parker, which starts a thread for it again once
+// the client sends something. Until then the connection counts as parked
+// for a handoff. The calling thread must leave the connection alone after.
+void park_idle_client(ClientList* client, ClientIO* clntIo,
+        CommonVars* common) {
+    line_reader_release(&clntIo->reader);
+    pthread_mutex_lock(&(common->handoffLock));
+    clntIo->idle = true;
+    clntIo->parked = client;
+    common->parkedCount += 1;
+    pthread_cond_broadcast(&(common->handoffCond));
+    pthread_mutex_unlock(&(common->handoffLock));
+    idle_park(&common->idle, clntIo->reader.fd, clntIo,
+            &clntIo->idleWatched);
+}
+
+// Idle parker callback, takes a parked connection's ClientIO and a pointer
+// to the ReaperThreadArgs struct as @param. Starts a client thread that
+// carries on with the connection's input.
+void wake_idle_client(void* conn, void* arg) {
+    ReaperThreadArgs* rtArgs = arg;
+    ClientIO* clntIo = conn;
+    CommonVars* common = rtArgs->common;
+    pthread_mutex_lock(&(common->handoffLock));
+    clntIo->idle = false;
+    common->parkedCount -= 1;
+    clntIo->thread = spawn_client_thread(clntIo, rtArgs->listHeadNode,
+            common);
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// CLIENT COMMAND PROCESSING-------------------------------------------------
+
+// Takes the input from the client as @param and for a matched token in
 // clientCommands[], returns the index for a switch case input in another
 // function.
 int evaluate_client_command(char* inputStr) {
-    char* clientCommands[] = {"SAY", "KICK", "LIST", "LEAVE"};
+    char* clientCommands[] = {"SAY", "KICK", "LIST", "LEAVE", "DM",
+            "IGNORE", "UNIGNORE", "SUB", "UNSUB", "SEARCH", "HISTORY"};
     int index = 0;
     while (index < NO_OF_CLIENT_CMDS) {
         if (is_match(inputStr, clientCommands[index])) {
@@ -425,113 +2053,515 @@ int evaluate_client_command(char* inputStr) {
     return index;
 }
 
-// Takes the current client being processed, the client list headnode, and
-// the common variables across all clients as @param. Processes valid 
-// cleint commands and ignores invalid ones. On a leave or a EOF on the
-// client's read end, assumes client has left and unlinks the current client 
-// from the list.
-void process_client_input(ClientList* currClient, ClientList** headNode,
+// Takes the current client, the ClientIO of its connection, the line it
+// sent, the command within the line, the client list headnode and the
+// common variables as @param. Runs a valid client command and ignores
+// invalid ones; SAY:, KICK:, DM: and the filter commands are queued for
+// the sequencer, which takes the line over; the line of any other command
+// is freed here once it is answered. On a LEAVE: has the sequencer
+// unlink the client and returns false, else returns true.
+bool run_client_command(ClientList* currClient, ClientIO* clntIo,
+        char* line, char* clientCmd, ClientList** headNode,
         CommonVars* common) {
+    char* strAfterCmd = NULL;
+    if (!strchr(clientCmd, COLON_ASCII)) {
+        mem_free(&common->mem[MEM_PARSER], line);
+        return true;
+    }
+    strtok_r(clientCmd, COLON, &strAfterCmd);
+    non_printable_check(strAfterCmd);
+    int cmdIdx = evaluate_client_command(clientCmd);
+    switch (cmdIdx) {
+        case 0: // SAY
+            metrics_count(&common->cmds.say);
+            currClient->cmds.say += 1;
+            submit_client_command(SEQ_SAY, currClient, clntIo, line,
+                    strAfterCmd, common);
+            break;
+        case 1: // KICK
+            metrics_count(&common->cmds.kick);
+            currClient->cmds.kick += 1;
+            submit_client_command(SEQ_KICK, currClient, clntIo, line,
+                    strAfterCmd, common);
+            break;
+        case 2: // LIST
+            metrics_count(&common->cmds.list);
+            currClient->cmds.list += 1;
+            send_chatters_list(currClient, headNode, common);
+            mem_free(&common->mem[MEM_PARSER], line);
+            break;
+        case 3: { // LEAVE
+            bool leaving = is_match(strAfterCmd, EMPTY_STR);
+            mem_free(&common->mem[MEM_PARSER], line);
+            if (leaving) {
+                metrics_count(&common->cmds.leave);
+                run_sequenced(SEQ_LEFT, currClient, clntIo, NULL, true,
+                        common);
+                return false;
+            }
+            break;
+        }
+        case 4: // DM
+            submit_client_command(SEQ_DM, currClient, clntIo, line,
+                    strAfterCmd, common);
+            break;
+        case 5: // IGNORE
+        case 6: // UNIGNORE
+        case 7: // SUB
+        case 8: { // UNSUB
+            SeqCommandType filterCmds[] = {SEQ_IGNORE, SEQ_UNIGNORE, SEQ_SUB,
+                    SEQ_UNSUB};
+            submit_client_command(filterCmds[cmdIdx - 5], currClient,
+                    clntIo, line, strAfterCmd, common);
+            break;
+        }
+        case 9: // SEARCH
+            send_search_results(currClient, strAfterCmd, common);
+            mem_free(&common->mem[MEM_PARSER], line);
+            break;
+        case 10: // HISTORY
+            send_history(currClient, strAfterCmd, common);
+            mem_free(&common->mem[MEM_PARSER], line);
+            break;
+        default: // not a client command
+            mem_free(&common->mem[MEM_PARSER], line);
+            break;
+    }
+    return true;
+}
+
+// Takes the current client being processed, the ClientIO of its connection,
+// the client list headnode, and the common variables across all clients as
+// @param. Processes the client's commands until it leaves. On a EOF on the
+// client's read end, assumes client has left and has the sequencer unlink
+// (or, for clients that can resume, detach) the current client.
+// While the server is handed over to a successor the thread parks instead.
+// Returns true if the client went quiet and its connection was parked, in
+// which case the thread must end without closing it.
+bool process_client_input(ClientList* currClient, ClientIO* clntIo,
+        ClientList** headNode, CommonVars* common) {
     char* clientCmd = NULL;
-    while ((clientCmd = get_line(currClient->rdEnd)) != NULL &&
-            !ferror(currClient->rdEnd)) {
-        char* strAfterCmd = NULL;
-        if (!strchr(clientCmd, COLON_ASCII)) {
+    while (1) {
+        if (__atomic_load_n(&common->draining, __ATOMIC_ACQUIRE)) {
+            park_for_handoff(common);
+        }
+        if (wait_client_input(clntIo, common)) {
+            park_idle_client(currClient, clntIo, common);
+            return true;
+        }
+        if (clntIo->reader.interrupted) {
             continue;
         }
-        strtok_r(clientCmd, COLON, &strAfterCmd);
-        non_printable_check(strAfterCmd);
-        switch (evaluate_client_command(clientCmd)) {
-            case 0: // SAY
-                common->cmds.say += 1;
-                currClient->cmds.say += 1;
-                compute_client_say(currClient->name, strAfterCmd, headNode,
-                        common->lock);
-                break;
-            case 1: // KICK
-                common->cmds.kick += 1;
-                currClient->cmds.kick += 1;
-                compute_client_kick(strAfterCmd, headNode, common->lock);
-                if (ferror(currClient->rdEnd) || ferror(currClient->wrEnd)) {
-                    return;
-                }
-                break;
-            case 2: // LIST
-                common->cmds.list += 1;
-                currClient->cmds.list += 1;
-                send_chatters_list(currClient, headNode, common->lock);
-                break;
-            case 3: { // LEAVE
-                if (is_match(strAfterCmd, EMPTY_STR)) {
-                    common->cmds.leave += 1;
-                    client_left(currClient->name, headNode, common->lock);
-                    return;
-                }
-                break;
+        if ((clientCmd = read_client_line(clntIo)) == NULL) {
+            if (clntIo->reader.interrupted) {
+                continue;
             }
+            break;
         }
-        usleep(HUNDRED_MILLI_SECS);
+        if (!run_client_command(currClient, clntIo, clientCmd, clientCmd,
+                headNode, common)) {
+            return false;
+        }
+        usleep(__atomic_load_n(&common->config.rateLimit, __ATOMIC_RELAXED)
+                * 1000);
     }
     // Client unexpectedly left the chat
-    client_left(currClient->name, headNode, common->lock);
+    run_sequenced(SEQ_LEFT, currClient, clntIo, NULL, false, common);
+    return false;
+}
+
+// PROXY SESSIONS------------------------------------------------------------
+
+// Takes a carrier and a session id as @param and opens the session with a
+// ClientIO of its own, which writes to the carrier rather than to a
+// socket. Opened under the lock, the broadcasts walk the session table.
+MuxSession* open_session(MuxCarrier* carrier, unsigned int sid,
+        CommonVars* common) {
+    lock_common(common, LOCK_SESSION);
+    MuxSession* session = mux_open_session(carrier, sid);
+    unlock_common(common);
+    ClientIO* clntIo = mem_calloc(&common->mem[MEM_HANDSHAKE], 1,
+            sizeof(ClientIO));
+    clntIo->wrEnd = session->wrEnd;
+    clntIo->reader.fd = -1;
+    clntIo->session = session;
+    clntIo->connectedAt = time(NULL);
+    session->io = clntIo;
+    return session;
+}
+
+// Takes a session whose client has left the chat, or never entered it,
+// and the common variables as @param and closes the session.
+void close_session(MuxSession* session, CommonVars* common) {
+    ClientIO* clntIo = session->io;
+    if (session->node != NULL) {
+        metrics_gauge_add(&common->metrics.muxSessions, -1);
+    }
+    lock_common(common, LOCK_SESSION);
+    mux_close_session(session);
+    unlock_common(common);
+    free_client_io(clntIo, common);
+}
+
+// Takes a session its proxy has sent LEAVE: for and the common variables
+// as @param. Confirms with "CLOSED:", after which the proxy may give the
+// session id to another user, and closes the session.
+void end_session(MuxSession* session, CommonVars* common) {
+    fprintf(session->wrEnd, "CLOSED:\n");
+    fflush(session->wrEnd);
+    close_session(session, common);
+}
+
+// Takes a session that has not entered the chat yet, the line its proxy
+// sent, the command within it, the headnode of the client list and the
+// common variables as @param. Does for the session what do_client_auth and
+// settle_name do for a connection, without blocking the carrier: the proxy
+// has authenticated the user, "CAPS:" lines set the session's caps and a
+// "NAME:" line is answered with "OK:", or with "NAME_TAKEN:" and "WHO:".
+// "LEAVE:" ends the session and anything else is ignored.
+void negotiate_session(MuxSession* session, char* line, char* cmd,
+        ClientList** headNode, CommonVars* common) {
+    ClientIO* clntIo = session->io;
+    char* args;
+    strtok_r(cmd, COLON, &args);
+    if (is_match(cmd, "CAPS")) {
+        clntIo->caps |= parse_client_caps(args) & SESSION_CAPS;
+        session->caps = clntIo->caps;
+        mem_free(&common->mem[MEM_PARSER], line);
+        return;
+    }
+    if (!is_match(cmd, "NAME")) {
+        if (is_match(cmd, "LEAVE")) {
+            end_session(session, common);
+        }
+        mem_free(&common->mem[MEM_PARSER], line);
+        return;
+    }
+    metrics_count(&common->cmds.name);
+    non_printable_check(args);
+    if (!is_match(args, EMPTY_STR)) {
+        lock_common(common, LOCK_SESSION);
+        char* name = args;
+        if ((clntIo->caps & CAP_AUTONAME) && !is_valid_name(name, common)) {
+            name = allocate_name(name, clntIo, common);
+        }
+        if (is_valid_name(name, common)) {
+            fprintf(clntIo->wrEnd, (clntIo->caps & CAP_AUTONAME) ?
+                    "OK:%s\n" : "OK:\n", name);
+            fflush(clntIo->wrEnd);
+            clntIo->rcvName = name != args ? name :
+                    mem_strdup(&common->mem[MEM_HANDSHAKE], args);
+            mux_session_entered(session);
+            session->node = compute_client_enter(clntIo, headNode, common);
+            metrics_gauge_add(&common->metrics.muxSessions, 1);
+            mem_free(&common->mem[MEM_PARSER], line);
+            return;
+        }
+        unlock_common(common);
+    }
+    mem_free(&common->mem[MEM_PARSER], line);
+    fprintf(clntIo->wrEnd, "NAME_TAKEN:\nWHO:\n");
+    fflush(clntIo->wrEnd);
+}
+
+// Takes a carrier, a line its proxy sent, the headnode of the client list
+// and the common variables as @param. Hands the "S:sid:line" to its
+// session, opening the session on its first line. Entered sessions run
+// client commands; their LEAVE: ends the session once applied. Every
+// LEAVE: is answered with one "CLOSED:", even for a session not open.
+void run_session_line(MuxCarrier* carrier, char* line,
+        ClientList** headNode, CommonVars* common) {
+    unsigned int sid;
+    char* cmd;
+    if (!mux_parse_session(line, &sid, &cmd)) {
+        mem_free(&common->mem[MEM_PARSER], line);
+        return;
+    }
+    MuxSession* session = sid < carrier->capacity ? carrier->sessions[sid] :
+            NULL;
+    if (session == NULL) {
+        session = open_session(carrier, sid, common);
+    }
+    if (session->node == NULL) {
+        negotiate_session(session, line, cmd, headNode, common);
+    } else if (!run_client_command(session->node, session->io, line, cmd,
+            headNode, common)) {
+        end_session(session, common);
+    }
+}
+
+// Takes a carrier, the ClientIO of its connection, whose reader gave up on
+// a line over CHAT_MAX_LINE, and the common variables as @param. Skips the
+// line and closes just the session it was for, which leaves the chat; the
+// proxy drops that user alone on "CLOSED:".
+void drop_overlong_session(MuxCarrier* carrier, ClientIO* clntIo,
+        CommonVars* common) {
+    LineReader* reader = &clntIo->reader;
+    char head[MUX_SID_SIZE + 4]; // enough for "S:sid:"
+    size_t len = reader->end - reader->start;
+    len = len < sizeof(head) - 1 ? len : sizeof(head) - 1;
+    memcpy(head, reader->buf + reader->start, len);
+    head[len] = NULL_CHAR;
+    line_reader_skip_line(reader);
+    unsigned int sid;
+    char* rest;
+    if (!mux_parse_session(head, &sid, &rest) || sid >= carrier->capacity ||
+            carrier->sessions[sid] == NULL) {
+        return;
+    }
+    MuxSession* session = carrier->sessions[sid];
+    if (session->node != NULL) {
+        run_sequenced(SEQ_LEFT, session->node, session->io, NULL, false,
+                common);
+    }
+    end_session(session, common);
+}
+
+// Takes the ClientIO of a proxy's connection that announced CAPS:mux and
+// passed authentication, the headnode of the client list and the common
+// variables as @param. Serves the sessions the proxy carries until the
+// connection closes, then has every session still in the chat leave. A
+// line over CHAT_MAX_LINE only ends its own session. Broadcasts reach the
+// proxy once, through its carrier, however many sessions it carries.
+void serve_carrier(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common) {
+    MuxCarrier* carrier = new_mux_carrier(clntIo->reader.fd);
+    char* line;
+    lock_common(common, LOCK_SESSION);
+    carrier->next = common->carriers;
+    common->carriers = carrier;
+    unlock_common(common);
+    metrics_gauge_add(&common->metrics.carriers, 1);
+    while (1) {
+        if (__atomic_load_n(&common->draining, __ATOMIC_ACQUIRE)) {
+            park_for_handoff(common);
+        }
+        if ((line = read_client_line(clntIo)) == NULL) {
+            if (clntIo->reader.interrupted) {
+                continue;
+            }
+            if (clntIo->reader.overlong) {
+                drop_overlong_session(carrier, clntIo, common);
+                continue;
+            }
+            break;
+        }
+        run_session_line(carrier, line, headNode, common);
+    }
+    lock_common(common, LOCK_SESSION);
+    MuxCarrier** link = &common->carriers;
+    while (*link != carrier) {
+        link = &(*link)->next;
+    }
+    *link = carrier->next;
+    unlock_common(common);
+    for (unsigned int sid = 0; sid < carrier->capacity; sid++) {
+        MuxSession* session = carrier->sessions[sid];
+        if (session != NULL) {
+            if (session->node != NULL) {
+                run_sequenced(SEQ_LEFT, session->node, session->io, NULL,
+                        false, common);
+            }
+            close_session(session, common);
+        }
+    }
+    metrics_gauge_add(&common->metrics.carriers, -1);
+    free_mux_carrier(carrier);
 }
 
 // CLIENT THREAD ------------------------------------------------------------
 
+// Takes a new connection's ClientIO, the client list's head node and the
+// common variables as @param. Performs authentication and name negotiation.
+// Returns the client's node if it entered the chat, else NULL. A client
+// adopted from a predecessor process arrives with its node in
+// clntIo->resumed and goes straight to its input. A proxy that announced
+// CAPS:mux skips naming and serves its sessions, then NULL is returned.
+ClientList* enter_client(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common) {
+    if (clntIo->resumed != NULL) {
+        return clntIo->resumed;
+    }
+    if (!do_client_auth(clntIo, headNode, common)) {
+        return NULL;
+    }
+    if (clntIo->resumed != NULL) {
+        return clntIo->resumed;
+    }
+    if (clntIo->caps & CAP_MUX) {
+        end_handshake(clntIo, common);
+        serve_carrier(clntIo, headNode, common);
+        return NULL;
+    }
+    if ((clntIo->rcvName = settle_name(clntIo, headNode, common)) == NULL) {
+        return NULL;
+    }
+    return compute_client_enter(clntIo, headNode, common);
+}
+
 // Client thread function, takes pointer to a ClientIO struct that stores the
 // client details, the Client list and the common variables across all
-// clients as input. Performs authentication and name negotiation, if 
-// sucessful, then processes input from the client. Else, closes the IO ends
-// and the thread terminates.
+// clients as input. Has the client enter the chat, if sucessful, then
+// processes input from the client. Else, closes the IO ends and the thread
+// terminates. A connection woken by the idle parker arrives with its node
+// in clntIo->parked, already registered; when it goes quiet again the
+// thread ends and leaves it open.
 void* client_thread(void* arg) {
-    ClientThreadArguments* ctArgs = malloc(sizeof(ClientThreadArguments));
-    ClientIO* clntIo = malloc(sizeof(ClientIO));
-    ClientList** headNode = malloc(sizeof(ClientList*));
-    CommonVars* common = malloc(sizeof(CommonVars));
-    ctArgs = arg; 
-    clntIo = ctArgs->clntIo;
-    headNode = ctArgs->listHeadNode;
-    common = ctArgs->common;
-    
-    int fd[2];
-    fd[0] = *(int*)clntIo->fdClient;
-    fd[1] = dup(fd[0]);
-    free(clntIo->fdClient);
-
-    clntIo->wrEnd = fdopen(fd[0], "w");
-    clntIo->rdEnd = fdopen(fd[1], "r");
-
-    ClientList* clientNode;
-    if (do_client_auth(clntIo, common) && ((clntIo->rcvName = settle_name(
-            clntIo, headNode, common)) != NULL)) {
-        clientNode = compute_client_enter(clntIo, headNode, common->lock);
-        process_client_input(clientNode, headNode, common);
-    } else {
-        fclose(clntIo->wrEnd);
-        fclose(clntIo->rdEnd);
+    ClientThreadArguments* ctArgs = arg;
+    ClientIO* clntIo = ctArgs->clntIo;
+    ClientList** headNode = ctArgs->listHeadNode;
+    CommonVars* common = ctArgs->common;
+    ClientList* clientNode = clntIo->parked;
+    clntIo->parked = NULL;
+    if (clientNode == NULL) {
+        register_client_io(clntIo, common);
+        clientNode = enter_client(clntIo, headNode, common);
     }
+    if (clientNode != NULL) {
+        end_handshake(clntIo, common);
+        if (clntIo->rcvName == NULL) { // resumed, nothing was settled
+            clntIo->rcvName = mem_strdup(&common->mem[MEM_HANDSHAKE],
+                    clientNode->name);
+        }
+        __atomic_store_n(&clntIo->statName, clntIo->rcvName,
+                __ATOMIC_RELEASE);
+        if (process_client_input(clientNode, clntIo, headNode, common)) {
+            mem_free(&common->mem[MEM_HANDSHAKE], ctArgs);
+            pthread_exit(NULL);
+        }
+    }
+    unregister_client_io(clntIo, common);
+    fclose(clntIo->wrEnd);
+    free_line_reader(&clntIo->reader);
+    free_client_io(clntIo, common);
+    mem_free(&common->mem[MEM_HANDSHAKE], ctArgs);
     pthread_exit(NULL);
 }
 
 // STRUCTS INITS-------------------------------------------------------------
 
+// Takes the common variables, with the config loaded, as @param. With
+// CHAT_CPUS set, keeps the first CPU listed for the sequencer and one each
+// for the fan-out shards, and confines the calling thread to the others,
+// or to all of them if none are left, so that every thread it starts
+// from now on runs there. Memory is then preferably allocated on the NUMA
+// node of the sequencer's CPU. Called before any thread is started.
+void place_server_threads(CommonVars* common) {
+    memset(&common->cpus, 0, sizeof(CpuList));
+    if (common->config.cpus == NULL ||
+            !parse_cpu_list(common->config.cpus, &common->cpus)) {
+        return; // a malformed list is ignored, the list is left empty
+    }
+    pin_thread_to_rest(pthread_self(), &common->cpus,
+            1 + common->config.fanoutShards);
+    prefer_numa_node(cpu_numa_node(common->cpus.cpus[0]));
+}
+
 // Takes the authentication path from the command line as @param, initializes
 // the CommonVars struct variable and returns it.
 CommonVars init_common_vars(char* authPath) {
     CommonVars common;
     ServerCommandsCount emptyStruct = {0};
     pthread_mutex_init(&common.lock, NULL);
-    common.svrAuthVal = get_auth_string(authPath);
+    if (!init_auth_store(&common.auth, authPath)) {
+        server_usage_error();
+    }
     common.cmds = emptyStruct;
+    common.config = init_server_config();
+    place_server_threads(&common);
+    init_mem_counters(common.mem, NO_OF_MEM_SUBSYSTEMS);
+    init_admission(&common.admission, common.config.maxConnections,
+            common.config.maxHandshakes, common.config.maxPerIp);
+    common.history = init_history(common.config.historyLen);
+    common.presence = init_presence_delta();
+    common.names = strmap_new(STRMAP_MIN_CAPACITY);
+    common.nameSuffixes = strmap_new(STRMAP_MIN_CAPACITY);
+    common.tokens = strmap_new(STRMAP_MIN_CAPACITY);
+    init_id_pool(&common.clientIds);
+    common.filtered = NULL;
+    common.noOfFiltered = 0;
+    common.filteredCap = 0;
+    common.noOfSubscribers = 0;
+    common.topics = strmap_new(STRMAP_MIN_CAPACITY);
+    init_id_pool(&common.topicIds);
+    common.topicList = NULL;
+    common.topicCap = 0;
+    common.noOfTopics = 0;
+    init_bitset(&common.frameTopics);
+    init_bitset(&common.frameSkip);
+    common.ingress = malloc(sizeof(MpscQueue));
+    init_mpsc_queue(common.ingress);
+    common.ingress->spinNanos = common.config.spin * 1000L;
+    init_metrics(&common.metrics);
+    memset(&common.compress, 0, sizeof(CompressStats));
+    memset(&common.batch, 0, sizeof(FrameBatch));
+    common.capture = common.config.capturePath != NULL ?
+            open_capture(common.config.capturePath) : NULL;
+    common.search = NULL;
+    common.log = NULL;
+    common.nextConnId = 0;
+    common.carriers = NULL;
+    common.lockedAt = 0;
+    memset(common.lockSites, 0, sizeof(common.lockSites));
+    init_io_backend(&common.io, common.config.ioBackend);
+    common.sends = NULL;
+    common.sendsCap = 0;
+    pthread_mutex_init(&common.handoffLock, NULL);
+    pthread_cond_init(&common.handoffCond, NULL);
+    common.activeIo = NULL;
+    common.activeCount = 0;
+    common.parkedCount = 0;
+    common.draining = false;
     return common;
 }
 
-// Takes the client file descripter as param. Initializes the ClientIO* struct 
-// variable and returns it.
-ClientIO* init_client_io(int clientFd) {
+// Takes the client file descripter and the stream writing to the client as
+// param. Initializes the ClientIO* struct variable and returns it.
+ClientIO* init_client_io_over(int clientFd, FILE* wrEnd) {
     ClientIO* clntIo = malloc(sizeof(ClientIO));
-    clntIo->fdClient = malloc(sizeof(int));
-    *(clntIo->fdClient) = clientFd;
+    clntIo->wrEnd = wrEnd;
+    init_line_reader(&clntIo->reader, clientFd);
+    clntIo->caps = 0;
+    clntIo->generation = 0;
+    clntIo->resumed = NULL;
+    clntIo->rcvName = NULL;
+    clntIo->statName = NULL;
+    clntIo->connectedAt = time(NULL);
+    clntIo->connId = 0;
+    clntIo->capture = NULL;
+    clntIo->session = NULL;
+    clntIo->outbox = NULL;
+    clntIo->idle = false;
+    clntIo->parked = NULL;
+    clntIo->idleWatched = false;
+    clntIo->admitted = false;
+    clntIo->handshaking = false;
+    clntIo->peerAddr = 0;
+    clntIo->nameBaseLen = 0;
+    return clntIo;
+}
+
+// Takes the client file descripter and the outboxes as param. Initializes
+// the ClientIO* struct variable, writing to the socket through an outbox,
+// and returns it.
+ClientIO* init_client_io(int clientFd, Outboxes* boxes) {
+    Outbox* outbox = new_outbox(boxes, clientFd);
+    FILE* wrEnd = outbox_fopen(outbox);
+    // Every write is flushed at once anyway, and a stdio buffer would cost
+    // each connection a page for as long as it lives
+    setvbuf(wrEnd, NULL, _IONBF, 0);
+    ClientIO* clntIo = init_client_io_over(clientFd, wrEnd);
+    clntIo->outbox = outbox;
+    return clntIo;
+}
+
+// Takes a shared memory channel set up by a local client as @param.
+// Initializes a ClientIO* struct variable that writes to and reads from
+// the channel's rings and returns it.
+ClientIO* init_shm_client_io(ShmChannel* ch) {
+    ClientIO* clntIo = init_client_io_over(ch->sock,
+            shm_channel_fopen(ch, "w"));
+    clntIo->reader.shm = ch;
     return clntIo;
 }
 
@@ -580,48 +2610,1394 @@ int open_listen(const char* port) {
     return listenFd;
 }
 
+// Takes the path of a Unix domain socket as @param. Replaces any stale
+// socket file at the path and listens on it. Returns the listening socket,
+// else returns -1.
+int open_unix_listen(const char* path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || !handoff_address(path, &addr)) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+            listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Takes a connection's ClientIO, the client list's head node and the common
+// variables as @param and starts a detached client thread for it, on a
+// stack of CLIENT_STACK_SIZE. Returns the thread. The arguments are owned
+// (and freed) by the thread, a reconnect storm would otherwise overwrite
+// them before the thread reads them.
+pthread_t spawn_client_thread(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common) {
+    ClientThreadArguments* ctArgs = mem_alloc(&common->mem[MEM_HANDSHAKE],
+            sizeof(ClientThreadArguments));
+    ctArgs->clntIo = clntIo;
+    ctArgs->listHeadNode = headNode;
+    ctArgs->common = common;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t threadId;
+    pthread_create(&threadId, &attr, client_thread, ctArgs);
+    pthread_attr_destroy(&attr);
+    return threadId;
+}
+
+// Takes a new connection's ClientIO, the client list's head node and the
+// common variables as @param and starts a client thread for it. Its input
+// buffers come from the shared pool, its lines are cut off at
+// CHAT_MAX_LINE, the ClientIO and the lines read are counted from here on.
+void start_client_thread(ClientIO* clntIo, ClientList** headNode,
+        CommonVars* common) {
+    clntIo->connId = __atomic_add_fetch(&common->nextConnId, 1,
+            __ATOMIC_RELAXED);
+    clntIo->capture = common->capture;
+    clntIo->reader.pool = &common->receive;
+    clntIo->reader.counters = &common->mem[MEM_PARSER];
+    clntIo->reader.maxLine = common->config.maxLine;
+    mem_count_alloc(&common->mem[MEM_HANDSHAKE], clntIo);
+    spawn_client_thread(clntIo, headNode, common);
+}
+
+// Takes a connection just accepted, the IPv4 address it came from (0 for a
+// local socket) and the common variables as @param. Returns true if the
+// connection is admitted, else it has been sent "BUSY:reason" and closed
+// before any memory or thread was spent on it.
+bool admit_client(int fd, uint32_t addr, CommonVars* common) {
+    AdmitVerdict verdict = admit_connection(&common->admission, addr);
+    if (verdict != ADMIT_OK) {
+        reject_connection(fd, verdict);
+        return false;
+    }
+    return true;
+}
+
+// Takes an admitted connection's ClientIO, the address it was admitted from,
+// the client list's head node and the common variables as @param and
+// starts its client thread. The connection counts as a handshake until its
+// client enters and against the limits until it closes.
+void start_admitted_client(ClientIO* clntIo, uint32_t addr,
+        ClientList** headNode, CommonVars* common) {
+    clntIo->admitted = true;
+    clntIo->handshaking = true;
+    clntIo->peerAddr = addr;
+    start_client_thread(clntIo, headNode, common);
+}
+
 // Takes the server's file descripter, the client list's head node and the
 // common variables across all clients as @param. Accepts connections to the
-// port and starts a client thread at each new sucessful connection. If 
-// connection is unsuccessful, then terminates the server generating a 
+// port and starts a client thread at each new sucessful connection that is
+// admitted. Out of descriptors or memory, backs off and leaves connections
+// in the backlog; other errors about a single connection are skipped. If
+// the listener itself fails, then terminates the server generating a
 // communications error.
 void process_connections(int fdServer, ClientList** headNode,
         CommonVars* common) {
     int fd;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
+    int backoff = 0;
 
     // Repeatedly accept connections and process data (capitalise)
     while (1) {
         fromAddrSize = sizeof(struct sockaddr_in);
 	// Block, waiting for a new connection. (fromAddr will be populated
 	// with address of client)
-        fd = accept(fdServer, (struct sockaddr*) &fromAddr, &fromAddrSize);
+        fd = io_accept(&common->io, fdServer, (struct sockaddr*) &fromAddr,
+                &fromAddrSize);
         if (fd < 0) {
-            communications_error();
+            int error = errno;
+            if (!accept_error_transient(error)) {
+                communications_error();
+            }
+            backoff = accept_backoff(&common->admission, error, backoff);
+            continue;
         }
-     
-	// Turn our client address into a hostname and print out both 
-        // the address and hostname as well as the port number
-        char hostname[NI_MAXHOST];
-        int error = getnameinfo((struct sockaddr*)&fromAddr, 
-                fromAddrSize, hostname, NI_MAXHOST, NULL, 0, 0);
-        if (error) {
-            communications_error();
+        backoff = 0;
+        metrics_add(&common->metrics.accepted, 1);
+        uint32_t addr = fromAddr.sin_addr.s_addr;
+        if (!admit_client(fd, addr, common)) {
+            continue;
+        }
+        // Frames are small and latency bound: without this, a frame written
+        // while the previous one is unacknowledged waits for the client's
+        // delayed ACK or its next command
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        if (common->config.busyPoll > 0) {
+            // Blocking reads poll the device queue before they sleep
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                    &common->config.busyPoll, sizeof(int));
         }
     
 	// Start a child thread
-        ClientIO* clntIo = init_client_io(fd);
-        ClientThreadArguments ctArgs;
-        ctArgs.clntIo = clntIo;
-        ctArgs.listHeadNode = headNode;
-        ctArgs.common = common;
-	pthread_t threadId;
-	pthread_create(&threadId, NULL, client_thread, &ctArgs);
-	pthread_detach(threadId);
+        start_admitted_client(init_client_io(fd, &common->outboxes), addr,
+                headNode, common);
+    }
+}
+
+// Unix listener thread function, takes a pointer to the UnixListenerArgs
+// struct as @param. Accepts local clients and starts a client thread for
+// each, over the socket itself or, for the shared memory listener, over
+// the rings the client sets up through it. Failed setups are dropped.
+// Local clients count against the connection and handshake limits, not the
+// per address one.
+void* unix_listener_thread(void* arg) {
+    UnixListenerArgs* ulArgs = arg;
+    CommonVars* common = ulArgs->common;
+    int backoff = 0;
+    while (1) {
+        int fd = accept(ulArgs->listenFd, NULL, NULL);
+        if (fd < 0) {
+            backoff = accept_backoff(&common->admission, errno, backoff);
+            continue;
+        }
+        backoff = 0;
+        metrics_add(&common->metrics.accepted, 1);
+        if (!admit_client(fd, 0, common)) {
+            continue;
+        }
+        if (!ulArgs->shm) {
+            start_admitted_client(init_client_io(fd, &common->outboxes), 0,
+                    ulArgs->listHeadNode, common);
+            continue;
+        }
+        ShmChannel* ch = shm_channel_accept(fd); // closes fd on failure
+        if (ch == NULL) {
+            release_admission(&common->admission, 0, true);
+            continue;
+        }
+        start_admitted_client(init_shm_client_io(ch), 0,
+                ulArgs->listHeadNode, common);
+    }
+    return NULL;
+}
+
+// Takes the path of a Unix domain listener (or NULL), whether it sets up
+// shared memory, the client list's head node and the common variables as
+// @param. Listens on the path and starts a thread accepting clients on it.
+// Terminates the server with a communications error if it cannot listen.
+void start_unix_listener(const char* path, bool shm, ClientList** headNode,
+        CommonVars* common) {
+    if (path == NULL) {
+        return;
+    }
+    UnixListenerArgs* ulArgs = malloc(sizeof(UnixListenerArgs));
+    ulArgs->listenFd = open_unix_listen(path);
+    if (ulArgs->listenFd < 0) {
+        communications_error();
+    }
+    ulArgs->shm = shm;
+    ulArgs->listHeadNode = headNode;
+    ulArgs->common = common;
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, unix_listener_thread, ulArgs);
+    pthread_detach(threadId);
+}
+
+// HOT RESTART---------------------------------------------------------------
+
+// Empty handler for the signal that knocks client threads out of a blocking
+// read, installed without SA_RESTART so the read fails with EINTR.
+void handoff_signal_handler(int sigNum) {
+}
+
+// Takes the common variables as @param. Stops every client thread between
+// commands: threads in the middle of a command finish it, threads waiting
+// for input are interrupted and park, threads still negotiating their
+// entry see EOF and drop their connection. Returns true once all threads
+// have parked, else undoes the drain and returns false.
+bool drain_client_threads(CommonVars* common) {
+    pthread_mutex_lock(&(common->handoffLock));
+    __atomic_store_n(&common->draining, true, __ATOMIC_RELEASE);
+    int waited = 0;
+    while (common->parkedCount < common->activeCount &&
+            waited < DRAIN_TIMEOUT_MILLI_SECS) {
+        for (ClientIO* io = common->activeIo; io != NULL;
+                io = io->nextActive) {
+            if (!io->idle) { // an idle connection has no thread to poke
+                pthread_kill(io->thread, SIGUSR1);
+            }
+        }
+        // A signal that lands just before a thread blocks is lost, so the
+        // threads are poked again until they have all parked
+        pthread_mutex_unlock(&(common->handoffLock));
+        usleep(TEN_MILLI_SECS);
+        waited += TEN_MILLI_SECS / 1000;
+        pthread_mutex_lock(&(common->handoffLock));
+    }
+    bool drained = common->parkedCount >= common->activeCount;
+    pthread_mutex_unlock(&(common->handoffLock));
+    return drained;
+}
+
+// Takes the common variables as @param and lets parked client threads carry
+// on after an abandoned handoff.
+void release_client_threads(CommonVars* common) {
+    pthread_mutex_lock(&(common->handoffLock));
+    __atomic_store_n(&common->draining, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&(common->handoffCond));
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// Takes the handoff socket and the outbox of a client about to be handed
+// over as @param. Holds the outbox and sends its backlog as HANDOFF_OUTPUT
+// records ahead of the client's own, so that the successor queues it
+// before anything else. Returns true if every record was sent.
+bool send_client_output(int sock, Outbox* outbox) {
+    size_t len;
+    char* output = outbox_hold(outbox, &len);
+    HandoffRecord rec;
+    HandoffPayload payload = {NULL, NULL, output};
+    bool sent = true;
+    memset(&rec, 0, sizeof(HandoffRecord));
+    rec.type = HANDOFF_OUTPUT;
+    for (size_t at = 0; sent && at < len; at += rec.dataLen) {
+        rec.dataLen = len - at < HANDOFF_OUTPUT_CHUNK ? len - at :
+                HANDOFF_OUTPUT_CHUNK;
+        payload.data = output + at;
+        sent &= handoff_send(sock, &rec, &payload, -1);
+    }
+    free(output);
+    return sent;
+}
+
+// Takes the head of the client list as @param and lets the outboxes held
+// by an abandoned handoff write to their sockets again. Caller holds the
+// lock.
+void release_client_outboxes(ClientList* headNode) {
+    for (ClientList* node = headNode; node != NULL; node = node->next) {
+        if (node->session == NULL && !node->detached && !node->shm &&
+                node->owner != NULL && node->outbox != NULL) {
+            outbox_release(node->outbox);
+        }
     }
 }
 
+// Takes the handoff socket, the listening socket, the head of the client
+// list and the common variables as @param. Sends the whole server state to
+// a successor: the listening socket, the command counts, the history, the
+// pending presence changes and every client node with its socket, any
+// input it sent that has not been processed yet and any output its outbox
+// still holds. Caller holds the lock. Returns true if every record was
+// sent.
+bool send_server_state(int sock, int listenFd, ClientList* headNode,
+        CommonVars* common) {
+    HandoffRecord rec;
+    HandoffPayload payload = {NULL, NULL, NULL};
+    bool sent = true;
+    memset(&rec, 0, sizeof(HandoffRecord));
+    rec.type = HANDOFF_HELLO;
+    rec.counts[0] = HANDOFF_VERSION;
+    sent &= handoff_send(sock, &rec, &payload, -1);
+    rec.type = HANDOFF_LISTEN;
+    sent &= handoff_send(sock, &rec, &payload, listenFd);
+
+    ServerCommandsCount* cmds = &common->cmds;
+    int counts[6] = {cmds->auth, cmds->name, cmds->say, cmds->kick,
+            cmds->list, cmds->leave};
+    rec.type = HANDOFF_COUNTS;
+    memcpy(rec.counts, counts, sizeof(counts));
+    rec.seq = common->history->lastSeq;
+    sent &= handoff_send(sock, &rec, &payload, -1);
+
+    History* history = common->history;
+    unsigned long seq = history->lastSeq >= history->capacity ?
+            history->lastSeq - history->capacity + 1 : 1;
+    for (; sent && seq <= history->lastSeq; seq++) {
+        HistoryEntry* entry = &history->entries[seq % history->capacity];
+        if (entry->seq == seq && entry->frame != NULL) {
+            memset(&rec, 0, sizeof(HandoffRecord));
+            rec.type = HANDOFF_HISTORY;
+            rec.seq = seq;
+            rec.sign = entry->presenceSign;
+            rec.dataLen = strlen(entry->frame);
+            payload.data = entry->frame;
+            sent &= handoff_send(sock, &rec, &payload, -1);
+        }
+    }
+    PresenceDelta* delta = common->presence;
+    for (size_t idx = 0; sent && idx < delta->len; idx++) {
+        memset(&rec, 0, sizeof(HandoffRecord));
+        rec.type = HANDOFF_PRESENCE;
+        rec.sign = delta->changes[idx].sign;
+        rec.nameLen = strlen(delta->changes[idx].name);
+        payload.name = delta->changes[idx].name;
+        payload.data = NULL;
+        sent &= handoff_send(sock, &rec, &payload, -1);
+    }
+
+    time_t now = time(NULL);
+    for (ClientList* node = headNode; sent && node != NULL;
+            node = node->next) {
+        if (node->session != NULL) {
+            continue; // its proxy reconnects and brings it back
+        }
+        memset(&rec, 0, sizeof(HandoffRecord));
+        rec.type = HANDOFF_CLIENT;
+        rec.counts[0] = node->cmds.say;
+        rec.counts[1] = node->cmds.kick;
+        rec.counts[2] = node->cmds.list;
+        rec.caps = node->caps;
+        // A shared memory mapping cannot follow its socket, such clients
+        // are handed over as just dropped and come back through RESUME:
+        bool detached = node->detached || node->shm;
+        rec.age = node->detached ? now - node->detachedAt : (detached ? 0 : -1);
+        rec.nameLen = strlen(node->name);
+        rec.tokenLen = strlen(node->token);
+        payload.name = node->name;
+        payload.token = node->token;
+        payload.data = NULL;
+        if (!detached && node->owner != NULL) {
+            LineReader* reader = &node->owner->reader;
+            if (node->outbox != NULL) {
+                sent &= send_client_output(sock, node->outbox);
+            }
+            if (reader->buf != NULL) { // NULL while the client is idle
+                payload.data = reader->buf + reader->start;
+                rec.dataLen = reader->end - reader->start;
+            }
+        }
+        sent &= handoff_send(sock, &rec, &payload,
+                detached ? -1 : node->fd);
+    }
+    memset(&rec, 0, sizeof(HandoffRecord));
+    rec.type = HANDOFF_END;
+    payload.name = payload.token = payload.data = NULL;
+    sent &= handoff_send(sock, &rec, &payload, -1);
+    return sent;
+}
+
+// Handoff thread function, takes a pointer to the HandoffThreadArgs struct
+// as @param. Waits for a successor process on the handoff socket, parks the
+// client threads and sends it the server state. Once the successor confirms
+// it has everything, this process exits without a word to the clients,
+// which carry on talking to the successor over the same sockets.
+void* handoff_thread(void* arg) {
+    HandoffThreadArgs* htArgs = arg;
+    CommonVars* common = htArgs->common;
+    int handoffFd = handoff_listen(common->config.handoffPath);
+    if (handoffFd < 0) {
+        return NULL;
+    }
+    while (1) {
+        int sock = accept(handoffFd, NULL, NULL);
+        if (sock < 0) {
+            continue;
+        }
+        char ack;
+        if (drain_client_threads(common)) {
+            // Parked threads queue nothing more, let the sequencer catch up
+            run_sequenced(SEQ_BARRIER, NULL, NULL, NULL, false, common);
+            lock_common(common, LOCK_HANDOFF);
+            fanout_flush(&common->fanout);
+            if (send_server_state(sock, htArgs->listenFd,
+                    *htArgs->listHeadNode, common) &&
+                    recv(sock, &ack, 1, 0) == 1) {
+                close(handoffFd);
+                _exit(NORMAL_EXIT);
+            }
+            release_client_outboxes(*htArgs->listHeadNode);
+            unlock_common(common);
+        }
+        release_client_threads(common);
+        close(sock);
+    }
+    return NULL;
+}
+
+// Takes a received client record, its payload, its socket (or -1), the
+// output the predecessor had not sent it yet and its length, the reference
+// to the head of the client list and the common variables as @param.
+// Appends an equivalent node to the client list; an attached node gets its
+// output queued and a client thread that carries on with the input left
+// over by the predecessor.
+void adopt_client_node(HandoffRecord* rec, HandoffPayload* payload, int fd,
+        const char* output, size_t outputLen, ClientList** headNode,
+        CommonVars* common) {
+    ClientIO detachedIo = {0}; // a detached node has no streams or thread
+    ClientIO* clntIo = (fd >= 0) ? init_client_io(fd, &common->outboxes) :
+            &detachedIo;
+    clntIo->rcvName = mem_strdup(&common->mem[MEM_HANDSHAKE], payload->name);
+    clntIo->caps = rec->caps;
+    ClientList* node = link_client_node(clntIo, headNode,
+            &common->mem[MEM_ROSTER]);
+    index_client_node(node, common);
+    if (fd >= 0) {
+        attach_client_node(node, common);
+    }
+    metrics_gauge_add(&common->metrics.roster, 1);
+    if (node->caps & CAP_DEFLATE) {
+        metrics_gauge_add(&common->compress.clients, 1);
+    }
+    if (node->caps & CAP_BATCH) {
+        metrics_gauge_add(&common->metrics.batchClients, 1);
+    }
+    node->cmds.say = rec->counts[0];
+    node->cmds.kick = rec->counts[1];
+    node->cmds.list = rec->counts[2];
+    strncpy(node->token, payload->token, TOKEN_LEN);
+    node->token[TOKEN_LEN] = NULL_CHAR;
+    if (strlen(node->token) == TOKEN_LEN) {
+        char key[TOKEN_KEY_LEN + 1];
+        resume_token_key(node->token, key);
+        strmap_put(common->tokens, key, node);
+    }
+    if (fd < 0) {
+        node->detached = true;
+        node->detachedAt = time(NULL) - rec->age;
+        node->owner = NULL;
+        node->refs = 0;
+        metrics_gauge_add(&common->metrics.detached, 1);
+        mem_free(&common->mem[MEM_HANDSHAKE], detachedIo.rcvName);
+        return;
+    }
+    if (outputLen > 0) {
+        outbox_write(clntIo->outbox, OUTBOX_CONTROL, NULL, 0, output,
+                outputLen);
+    }
+    line_reader_prefill(&clntIo->reader, payload->data, rec->dataLen);
+    clntIo->resumed = node;
+    start_client_thread(clntIo, headNode, common);
+}
+
+// Takes the handoff socket path, the reference to the head of the client
+// list and the common variables as @param. Connects to the running server,
+// rebuilds its state in this process and confirms the handoff. Returns the
+// inherited listening socket, or exits with a communications error if the
+// handoff fails.
+int take_over_server(const char* path, ClientList** headNode,
+        CommonVars* common) {
+    int sock = handoff_connect(path);
+    HandoffRecord rec;
+    HandoffPayload payload;
+    int fd;
+    int listenFd = -1;
+    unsigned long lastSeq = 0;
+    char* output = NULL; // unsent output of the next client
+    size_t outputLen = 0;
+    if (sock < 0 || !handoff_recv(sock, &rec, &payload, &fd) ||
+            rec.type != HANDOFF_HELLO || rec.counts[0] != HANDOFF_VERSION) {
+        communications_error();
+    }
+    free_handoff_payload(&payload);
+    lock_common(common, LOCK_HANDOFF);
+    while (handoff_recv(sock, &rec, &payload, &fd) &&
+            rec.type != HANDOFF_END) {
+        switch (rec.type) {
+            case HANDOFF_LISTEN:
+                listenFd = fd;
+                break;
+            case HANDOFF_COUNTS: {
+                ServerCommandsCount cmds = {rec.counts[0], rec.counts[1],
+                        rec.counts[2], rec.counts[3], rec.counts[4],
+                        rec.counts[5]};
+                common->cmds = cmds;
+                lastSeq = rec.seq;
+                break;
+            }
+            case HANDOFF_HISTORY:
+                common->history->lastSeq = rec.seq - 1;
+                history_append(common->history, strdup(payload.data),
+                        rec.sign);
+                break;
+            case HANDOFF_PRESENCE:
+                presence_add(common->presence, payload.name, rec.sign);
+                break;
+            case HANDOFF_OUTPUT:
+                output = realloc(output, outputLen + rec.dataLen);
+                memcpy(output + outputLen, payload.data, rec.dataLen);
+                outputLen += rec.dataLen;
+                break;
+            case HANDOFF_CLIENT:
+                adopt_client_node(&rec, &payload, fd, output, outputLen,
+                        headNode, common);
+                outputLen = 0;
+                break;
+        }
+        free_handoff_payload(&payload);
+    }
+    common->history->lastSeq = lastSeq;
+    unlock_common(common);
+    free(output);
+    if (rec.type != HANDOFF_END || listenFd < 0 || send(sock, "!", 1, 0) != 1) {
+        communications_error();
+    }
+    char eof;
+    recv(sock, &eof, 1, 0); // Predecessor exits, releasing the handoff path
+    close(sock);
+    return listenFd;
+}
+
+// Takes the listening socket as @param and emits its port number on
+// stderr.
+void print_listen_port(int listenFd) {
+    struct sockaddr_in ad;
+    memset(&ad, 0, sizeof(struct sockaddr_in));
+    socklen_t len = sizeof(struct sockaddr_in);
+    if (getsockname(listenFd, (struct sockaddr*) &ad, &len)) {
+        communications_error();
+    }
+    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
+}
+
+// ADMIN ENDPOINT------------------------------------------------------------
+
+// Takes a connection's ClientIO and its snapshot so far as @param. Returns
+// an estimate of the memory the connection costs: its structs and stream,
+// its input buffer, the output its outbox holds and, unless it is idle,
+// the stack of its thread.
+size_t connection_memory(ClientIO* io, ConnSnapshot* conn) {
+    size_t bytes = sizeof(ClientIO) + sizeof(FILE) + conn->bufferSize +
+            conn->queued[OUTBOX_CONTROL] + conn->queued[OUTBOX_BULK];
+    if (io->outbox != NULL) {
+        bytes += sizeof(Outbox);
+    }
+    if (conn->name != NULL) {
+        // The node's prefix and copy of the name, and the connection's
+        bytes += sizeof(ClientList) + 3 * strlen(conn->name) +
+                MSG_PREFIX_EXTRA + 2;
+    }
+    if (!conn->idle) {
+        bytes += CLIENT_STACK_SIZE;
+    }
+    return bytes;
+}
+
+// Takes the common variables and a snapshot to fill as @param. Copies the
+// counters and walks the registry of client threads, which is guarded by
+// the handoff lock rather than the global lock, so a snapshot never waits
+// behind a broadcast.
+void take_admin_snapshot(CommonVars* common, AdminSnapshot* snap) {
+    ServerCommandsCount* cmds = &common->cmds;
+    ServerCommandsCount copy = {metrics_count_get(&cmds->auth),
+            metrics_count_get(&cmds->name), metrics_count_get(&cmds->say),
+            metrics_count_get(&cmds->kick), metrics_count_get(&cmds->list),
+            metrics_count_get(&cmds->leave)};
+    snap->cmds = copy;
+    snap->uptime = time(NULL) - common->metrics.startedAt;
+    snap->lastSeq = __atomic_load_n(&common->history->lastSeq,
+            __ATOMIC_RELAXED);
+    snap->historyFrames = snap->lastSeq < common->history->capacity ?
+            snap->lastSeq : common->history->capacity;
+    snap->presencePending = __atomic_load_n(&common->presence->len,
+            __ATOMIC_RELAXED);
+    snap->rateLimit = __atomic_load_n(&common->config.rateLimit,
+            __ATOMIC_RELAXED);
+    snap->heap = mallinfo2();
+    mem_snapshot(common->mem, snap->mem, NO_OF_MEM_SUBSYSTEMS);
+    Admission* adm = &common->admission;
+    snap->admitted = metrics_gauge_get(&adm->connections);
+    snap->handshaking = metrics_gauge_get(&adm->handshakes);
+    snap->admittedAddrs = metrics_gauge_get(&adm->addresses);
+    for (int verdict = 0; verdict < NO_OF_ADMIT_VERDICTS; verdict++) {
+        snap->rejected[verdict] = metrics_get(&adm->rejected[verdict]);
+    }
+    snap->acceptBackoffs = metrics_get(&adm->backoffs);
+    snap->ioBackend = io_backend_name(&common->io);
+    snap->sendSyscalls = metrics_get(&common->io.sendSyscalls);
+    snap->sends = metrics_get(&common->io.sends);
+    fanout_send_counts(&common->fanout, &snap->sendSyscalls, &snap->sends);
+    snap->noOfShards = common->fanout.noOfShards;
+    snap->shards = malloc(sizeof(ShardSnapshot) * (snap->noOfShards + 1));
+    for (int idx = 0; idx < snap->noOfShards; idx++) {
+        FanoutShard* shard = &common->fanout.shards[idx];
+        snap->shards[idx].members = __atomic_load_n(&shard->noOfMembers,
+                __ATOMIC_RELAXED);
+        snap->shards[idx].queued = spsc_depth(&shard->queue);
+    }
+    snap->bufferBytes = 0;
+    snap->connBytes = 0;
+    snap->idleConns = 0;
+    snap->receiveTaken = metrics_gauge_get(&common->receive.taken);
+    snap->receiveSpare = metrics_gauge_get(&common->receive.spareBytes);
+    snap->receiveReused = metrics_get(&common->receive.reused);
+    snap->receiveAllocated = metrics_get(&common->receive.allocated);
+    snap->idleParks = metrics_get(&common->idle.parks);
+    snap->idleWakes = metrics_get(&common->idle.wakes);
+    OutboxStats* outbox = &common->outboxes.stats;
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        snap->outbox.frames[lane] = metrics_gauge_get(&outbox->frames[lane]);
+        snap->outbox.bytes[lane] = metrics_gauge_get(&outbox->bytes[lane]);
+        snap->outbox.queued[lane] = metrics_get(&outbox->queued[lane]);
+    }
+    snap->outbox.backlogged = metrics_gauge_get(&outbox->backlogged);
+    snap->outbox.preempted = metrics_get(&outbox->preempted);
+    snap->outbox.overflows = metrics_get(&outbox->overflows);
+    snap->authCredentials = auth_credentials(&common->auth);
+    snapshot_lock_sites(common, snap->lockSites);
+    snap->authReloads = metrics_get(&common->auth.reloads);
+    snap->authReloadFailures = metrics_get(&common->auth.reloadFailures);
+    snap->authRejected = metrics_get(&common->auth.rejected);
+    SearchIndex* search = common->search;
+    snap->searchDocs = search != NULL ? search_docs(search) : 0;
+    snap->searchTerms = search != NULL ?
+            metrics_gauge_get(&search->noOfTerms) : 0;
+    snap->searchBytes = search != NULL ? metrics_gauge_get(&search->bytes) : 0;
+    snap->searchEvicted = search != NULL ? metrics_get(&search->evicted) : 0;
+    snap->searchQueries = search != NULL ? metrics_get(&search->queries) : 0;
+    ChatLog* log = common->log;
+    snap->logBytes = log != NULL ? metrics_gauge_get(&log->bytes) : 0;
+    snap->logSegments = log != NULL ? metrics_gauge_get(&log->noOfFiles) : 0;
+    snap->historyRequests = log != NULL ? metrics_get(&log->requests) : 0;
+    snap->historyBytes = log != NULL ? metrics_get(&log->sentBytes) : 0;
+
+    pthread_mutex_lock(&(common->handoffLock));
+    snap->conns = malloc(sizeof(ConnSnapshot) * (common->activeCount + 1));
+    snap->noOfConns = 0;
+    time_t now = time(NULL);
+    for (ClientIO* io = common->activeIo; io != NULL; io = io->nextActive) {
+        ConnSnapshot* conn = &snap->conns[snap->noOfConns++];
+        LineReader* reader = &io->reader;
+        // Copied, the connection frees its name once it is unregistered
+        conn->name = __atomic_load_n(&io->statName, __ATOMIC_ACQUIRE);
+        conn->name = conn->name != NULL ? strdup(conn->name) : NULL;
+        conn->fd = reader->fd;
+        conn->caps = io->caps;
+        conn->age = now - io->connectedAt;
+        conn->buffered = __atomic_load_n(&reader->end, __ATOMIC_RELAXED) -
+                __atomic_load_n(&reader->start, __ATOMIC_RELAXED);
+        conn->bufferSize = __atomic_load_n(&reader->capacity,
+                __ATOMIC_RELAXED);
+        conn->inQueue = conn->outQueue = 0;
+        ioctl(conn->fd, SIOCINQ, &conn->inQueue);
+        ioctl(conn->fd, SIOCOUTQ, &conn->outQueue);
+        for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+            conn->queued[lane] = io->outbox != NULL ?
+                    outbox_lane_bytes(io->outbox, lane) : 0;
+        }
+        conn->idle = io->idle;
+        conn->memory = connection_memory(io, conn);
+        snap->bufferBytes += conn->bufferSize;
+        snap->connBytes += conn->memory;
+        snap->idleConns += conn->idle;
+    }
+    pthread_mutex_unlock(&(common->handoffLock));
+}
+
+// Takes the output stream, a metric name, its help text and one value per
+// connection of the snapshot as @param and writes a gauge labelled with
+// each connection's descriptor and name.
+void write_connection_gauge(FILE* out, const char* name, const char* help,
+        AdminSnapshot* snap, double* values) {
+    prometheus_header(out, name, "gauge", help);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        fprintf(out, "%s{fd=\"%d\",name=\"", name, snap->conns[idx].fd);
+        write_escaped(out, snap->conns[idx].name);
+        fprintf(out, "\"} %.17g\n", values[idx]);
+    }
+}
+
+// Takes the output stream and a snapshot of the outbox stats as @param and
+// writes how much output waits in each priority lane, in the Prometheus
+// text exposition format.
+void write_outbox_metrics(FILE* out, OutboxStats* stats) {
+    const char* lanes[] = {"lane=\"control\"", "lane=\"bulk\""};
+    prometheus_header(out, "chat_outbox_frames", "gauge",
+            "Frames queued for clients with a full socket, per lane.");
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        prometheus_value(out, "chat_outbox_frames", lanes[lane],
+                stats->frames[lane]);
+    }
+    prometheus_header(out, "chat_outbox_bytes", "gauge",
+            "Bytes queued for clients with a full socket, per lane.");
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        prometheus_value(out, "chat_outbox_bytes", lanes[lane],
+                stats->bytes[lane]);
+    }
+    prometheus_header(out, "chat_outbox_queued_total", "counter",
+            "Frames that had to wait for socket space, per lane.");
+    for (int lane = 0; lane < OUTBOX_LANES; lane++) {
+        prometheus_value(out, "chat_outbox_queued_total", lanes[lane],
+                stats->queued[lane]);
+    }
+    prometheus_header(out, "chat_outbox_backlogged", "gauge",
+            "Clients with output queued.");
+    prometheus_value(out, "chat_outbox_backlogged", NULL,
+            stats->backlogged);
+    prometheus_header(out, "chat_outbox_preempted_total", "counter",
+            "Control frames queued ahead of waiting chat.");
+    prometheus_value(out, "chat_outbox_preempted_total", NULL,
+            stats->preempted);
+    prometheus_header(out, "chat_outbox_overflows_total", "counter",
+            "Clients cut off for queueing more than CHAT_OUTBOX_MAX bytes.");
+    prometheus_value(out, "chat_outbox_overflows_total", NULL,
+            stats->overflows);
+}
+
+// Takes the output stream and a snapshot as @param and writes the size of
+// the credential table and how it was used, in the Prometheus text
+// exposition format.
+void write_auth_metrics(FILE* out, AdminSnapshot* snap) {
+    prometheus_header(out, "chat_auth_credentials", "gauge",
+            "Secrets in the authfile loaded last.");
+    prometheus_value(out, "chat_auth_credentials", NULL,
+            snap->authCredentials);
+    prometheus_header(out, "chat_auth_reloads_total", "counter",
+            "Authfile reloads, by outcome.");
+    prometheus_value(out, "chat_auth_reloads_total", "result=\"ok\"",
+            snap->authReloads);
+    prometheus_value(out, "chat_auth_reloads_total", "result=\"failed\"",
+            snap->authReloadFailures);
+    prometheus_header(out, "chat_auth_rejected_total", "counter",
+            "AUTH: answers matching no secret.");
+    prometheus_value(out, "chat_auth_rejected_total", NULL,
+            snap->authRejected);
+}
+
+// Takes the output stream and a snapshot of the tracked heap use as @param
+// and writes what each subsystem holds, its peak and its allocations in
+// the Prometheus text exposition format.
+void write_mem_metrics(FILE* out, MemCounters* mem) {
+    char labels[NO_OF_MEM_SUBSYSTEMS][LABEL_SIZE];
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        snprintf(labels[idx], LABEL_SIZE, "subsystem=\"%s\"",
+                mem_subsystem_name(idx));
+    }
+    prometheus_header(out, "chat_tracked_bytes", "gauge",
+            "Heap memory held, by subsystem.");
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        prometheus_value(out, "chat_tracked_bytes", labels[idx],
+                mem[idx].live);
+    }
+    prometheus_header(out, "chat_tracked_peak_bytes", "gauge",
+            "Most heap memory held at once, by subsystem.");
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        prometheus_value(out, "chat_tracked_peak_bytes", labels[idx],
+                mem[idx].peak);
+    }
+    prometheus_header(out, "chat_tracked_blocks", "gauge",
+            "Heap allocations held, by subsystem.");
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        prometheus_value(out, "chat_tracked_blocks", labels[idx],
+                mem[idx].blocks);
+    }
+    prometheus_header(out, "chat_allocations_total", "counter",
+            "Heap allocations made, by subsystem.");
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        prometheus_value(out, "chat_allocations_total", labels[idx],
+                mem[idx].allocs);
+    }
+}
+
+// Takes the output stream, a snapshot of the tracked heap use and the
+// previous allocation counts as @param and writes a JSON member per
+// subsystem, with its allocations per second since the previous snapshot.
+void write_json_mem(FILE* out, MemCounters* mem, AdminRates* rates,
+        double elapsed) {
+    for (int idx = 0; idx < NO_OF_MEM_SUBSYSTEMS; idx++) {
+        fprintf(out, "%s\"%s\":{\"live\":%ld,\"peak\":%ld,\"blocks\":%ld,"
+                "\"allocs\":%lu,\"allocs_per_sec\":%.3f}", idx ? "," : "",
+                mem_subsystem_name(idx), mem[idx].live, mem[idx].peak,
+                mem[idx].blocks, mem[idx].allocs, elapsed > 0 ?
+                (mem[idx].allocs - rates->allocs[idx]) / elapsed : 0.0);
+        rates->allocs[idx] = mem[idx].allocs;
+    }
+}
+
+// Takes the output stream and copies of the lock histograms as @param and
+// writes, for every code path that takes the global lock, histograms of
+// its waits for the lock and its holds, in the Prometheus text exposition
+// format.
+void write_lock_metrics(FILE* out, LockSiteStats* sites) {
+    char labels[LABEL_SIZE];
+    prometheus_header(out, "chat_lock_site_wait_seconds", "histogram",
+            "Waits for the global lock, by code path.");
+    for (int site = 0; site < NO_OF_LOCK_SITES; site++) {
+        snprintf(labels, LABEL_SIZE, "site=\"%s\"", lock_site_name(site));
+        write_prometheus_histogram(out, "chat_lock_site_wait_seconds", labels,
+                &sites[site].wait);
+    }
+    prometheus_header(out, "chat_lock_site_hold_seconds", "histogram",
+            "Holds of the global lock, by code path.");
+    for (int site = 0; site < NO_OF_LOCK_SITES; site++) {
+        snprintf(labels, LABEL_SIZE, "site=\"%s\"", lock_site_name(site));
+        write_prometheus_histogram(out, "chat_lock_site_hold_seconds", labels,
+                &sites[site].hold);
+    }
+}
+
+// Takes the output stream and copies of the lock histograms as @param and
+// writes a JSON member per code path that took the global lock, with the
+// median, 99th percentile and longest wait and hold in nanoseconds.
+void write_json_lock_sites(FILE* out, LockSiteStats* sites) {
+    bool first = true;
+    for (int site = 0; site < NO_OF_LOCK_SITES; site++) {
+        Histogram* wait = &sites[site].wait;
+        Histogram* hold = &sites[site].hold;
+        if (hold->count == 0) {
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"wait_p50_ns\":%lu,"
+                "\"wait_p99_ns\":%lu,\"wait_max_ns\":%lu,"
+                "\"hold_p50_ns\":%lu,\"hold_p99_ns\":%lu,"
+                "\"hold_max_ns\":%lu}", first ? "" : ",",
+                lock_site_name(site), hold->count,
+                histogram_quantile(wait, 0.5), histogram_quantile(wait, 0.99),
+                wait->maxNanos, histogram_quantile(hold, 0.5),
+                histogram_quantile(hold, 0.99), hold->maxNanos);
+        first = false;
+    }
+}
+
+// Takes the output stream and a snapshot as @param and writes the size of
+// the search index and its use, in the Prometheus text exposition format.
+void write_search_metrics(FILE* out, AdminSnapshot* snap) {
+    prometheus_header(out, "chat_search_documents", "gauge",
+            "Messages in the search index.");
+    prometheus_value(out, "chat_search_documents", NULL, snap->searchDocs);
+    prometheus_header(out, "chat_search_terms", "gauge",
+            "Distinct words in the search index.");
+    prometheus_value(out, "chat_search_terms", NULL, snap->searchTerms);
+    prometheus_header(out, "chat_search_bytes", "gauge",
+            "Memory taken up by the search index.");
+    prometheus_value(out, "chat_search_bytes", NULL, snap->searchBytes);
+    prometheus_header(out, "chat_search_evicted_total", "counter",
+            "Messages dropped from the search index for age or space.");
+    prometheus_value(out, "chat_search_evicted_total", NULL,
+            snap->searchEvicted);
+    prometheus_header(out, "chat_search_queries_total", "counter",
+            "SEARCH: commands answered.");
+    prometheus_value(out, "chat_search_queries_total", NULL,
+            snap->searchQueries);
+}
+
+// Takes the output stream and a snapshot as @param and writes the size of
+// the message log and the history sent from it, in the Prometheus text
+// exposition format.
+void write_log_metrics(FILE* out, AdminSnapshot* snap) {
+    prometheus_header(out, "chat_log_bytes", "gauge",
+            "Messages kept in the on-disk log.");
+    prometheus_value(out, "chat_log_bytes", NULL, snap->logBytes);
+    prometheus_header(out, "chat_log_segments", "gauge",
+            "Files of the on-disk log.");
+    prometheus_value(out, "chat_log_segments", NULL, snap->logSegments);
+    prometheus_header(out, "chat_history_requests_total", "counter",
+            "HISTORY: commands answered.");
+    prometheus_value(out, "chat_history_requests_total", NULL,
+            snap->historyRequests);
+    prometheus_header(out, "chat_history_bytes_total", "counter",
+            "Bytes of the log sent in answer to HISTORY:.");
+    prometheus_value(out, "chat_history_bytes_total", NULL,
+            snap->historyBytes);
+}
+
+// Takes the output stream and the compression stats as @param and writes
+// the CPU spent compressing broadcasts next to the bytes it saved, in the
+// Prometheus text exposition format.
+void write_compress_metrics(FILE* out, CompressStats* compress) {
+    prometheus_header(out, "chat_compress_clients", "gauge",
+            "Clients in the chat that take compressed frames.");
+    prometheus_value(out, "chat_compress_clients", NULL,
+            metrics_gauge_get(&compress->clients));
+    prometheus_header(out, "chat_compress_frames_total", "counter",
+            "Broadcasts compressed.");
+    prometheus_value(out, "chat_compress_frames_total", NULL,
+            metrics_get(&compress->frames));
+    prometheus_header(out, "chat_compress_cpu_seconds_total", "counter",
+            "CPU time spent compressing broadcasts.");
+    prometheus_value(out, "chat_compress_cpu_seconds_total", NULL,
+            metrics_get(&compress->nanos) / 1e9);
+    prometheus_header(out, "chat_compress_bytes_total", "counter",
+            "Size of the compressed broadcasts before and after.");
+    prometheus_value(out, "chat_compress_bytes_total", "stage=\"raw\"",
+            metrics_get(&compress->rawBytes));
+    prometheus_value(out, "chat_compress_bytes_total",
+            "stage=\"compressed\"", metrics_get(&compress->zBytes));
+    prometheus_header(out, "chat_compress_saved_bytes_total", "counter",
+            "Bytes not written to clients thanks to compression.");
+    prometheus_value(out, "chat_compress_saved_bytes_total", NULL,
+            metrics_get(&compress->savedBytes));
+}
+
+// Takes the output stream and a snapshot as @param and writes the admission
+// gauges, the connections turned away by reason and the accept backoffs in
+// the Prometheus text exposition format.
+void write_admission_metrics(FILE* out, AdminSnapshot* snap) {
+    char labels[LABEL_SIZE];
+    prometheus_header(out, "chat_connections_admitted", "gauge",
+            "Connections admitted and still open.");
+    prometheus_value(out, "chat_connections_admitted", NULL,
+            snap->admitted);
+    prometheus_header(out, "chat_handshakes_in_flight", "gauge",
+            "Admitted connections whose client has not entered yet.");
+    prometheus_value(out, "chat_handshakes_in_flight", NULL,
+            snap->handshaking);
+    prometheus_header(out, "chat_admitted_addresses", "gauge",
+            "Addresses with connections open, if CHAT_MAX_PER_IP is set.");
+    prometheus_value(out, "chat_admitted_addresses", NULL,
+            snap->admittedAddrs);
+    prometheus_header(out, "chat_connections_rejected_total", "counter",
+            "Connections turned away with BUSY:, by reason.");
+    for (int verdict = ADMIT_OK + 1; verdict < NO_OF_ADMIT_VERDICTS;
+            verdict++) {
+        snprintf(labels, LABEL_SIZE, "reason=\"%s\"",
+                admit_verdict_name(verdict));
+        prometheus_value(out, "chat_connections_rejected_total", labels,
+                snap->rejected[verdict]);
+    }
+    prometheus_header(out, "chat_accept_backoffs_total", "counter",
+            "Waits after accept ran out of descriptors or memory.");
+    prometheus_value(out, "chat_accept_backoffs_total", NULL,
+            snap->acceptBackoffs);
+}
+
+// Takes the output stream, a snapshot, the metrics and the compression
+// stats as @param and writes them in the Prometheus text exposition format.
+void write_prometheus_metrics(FILE* out, AdminSnapshot* snap,
+        Metrics* metrics, CompressStats* compress) {
+    const char* cmdNames[] = {"auth", "name", "say", "kick", "list",
+            "leave"};
+    int cmdCounts[] = {snap->cmds.auth, snap->cmds.name, snap->cmds.say,
+            snap->cmds.kick, snap->cmds.list, snap->cmds.leave};
+    char labels[LABEL_SIZE];
+    prometheus_header(out, "chat_uptime_seconds", "gauge",
+            "Seconds since the server started.");
+    prometheus_value(out, "chat_uptime_seconds", NULL, snap->uptime);
+    prometheus_header(out, "chat_commands_total", "counter",
+            "Commands received, by command.");
+    for (int idx = 0; idx < 6; idx++) {
+        snprintf(labels, LABEL_SIZE, "command=\"%s\"", cmdNames[idx]);
+        prometheus_value(out, "chat_commands_total", labels,
+                cmdCounts[idx]);
+    }
+    prometheus_header(out, "chat_connections_accepted_total", "counter",
+            "Connections accepted.");
+    prometheus_value(out, "chat_connections_accepted_total", NULL,
+            metrics_get(&metrics->accepted));
+    write_admission_metrics(out, snap);
+    prometheus_header(out, "chat_connections", "gauge",
+            "Open client connections.");
+    prometheus_value(out, "chat_connections", NULL, snap->noOfConns);
+    prometheus_header(out, "chat_clients", "gauge",
+            "Clients in the chat, detached ones included.");
+    prometheus_value(out, "chat_clients", NULL,
+            metrics_gauge_get(&metrics->roster));
+    prometheus_header(out, "chat_clients_detached", "gauge",
+            "Clients held for a resume.");
+    prometheus_value(out, "chat_clients_detached", NULL,
+            metrics_gauge_get(&metrics->detached));
+    prometheus_header(out, "chat_entered_total", "counter",
+            "Clients that entered the chat.");
+    prometheus_value(out, "chat_entered_total", NULL,
+            metrics_get(&metrics->entered));
+    prometheus_header(out, "chat_resumed_total", "counter",
+            "Sessions resumed.");
+    prometheus_value(out, "chat_resumed_total", NULL,
+            metrics_get(&metrics->resumed));
+    prometheus_header(out, "chat_broadcasts_total", "counter",
+            "Frames broadcast.");
+    prometheus_value(out, "chat_broadcasts_total", NULL,
+            metrics_get(&metrics->broadcasts));
+    prometheus_header(out, "chat_batch_clients", "gauge",
+            "Clients taking broadcasts in BATCH: frames.");
+    prometheus_value(out, "chat_batch_clients", NULL,
+            metrics_gauge_get(&metrics->batchClients));
+    prometheus_header(out, "chat_batches_total", "counter",
+            "BATCH: frames broadcast.");
+    prometheus_value(out, "chat_batches_total", NULL,
+            metrics_get(&metrics->batches));
+    prometheus_header(out, "chat_batched_frames_total", "counter",
+            "Broadcasts sent inside BATCH: frames.");
+    prometheus_value(out, "chat_batched_frames_total", NULL,
+            metrics_get(&metrics->batchedFrames));
+    prometheus_header(out, "chat_sequenced_commands_total", "counter",
+            "SAY, KICK, DM and LEAVE commands applied by the sequencer.");
+    prometheus_value(out, "chat_sequenced_commands_total", NULL,
+            metrics_get(&metrics->sequenced));
+    prometheus_header(out, "chat_sequencer_batches_total", "counter",
+            "Batches of commands applied under one hold of the lock.");
+    prometheus_value(out, "chat_sequencer_batches_total", NULL,
+            metrics_get(&metrics->sequencerBatches));
+    prometheus_header(out, "chat_sequencer_queue_depth", "gauge",
+            "Commands waiting for the sequencer.");
+    prometheus_value(out, "chat_sequencer_queue_depth", NULL,
+            metrics_gauge_get(&metrics->ingressDepth));
+    prometheus_header(out, "chat_direct_messages_total", "counter",
+            "Direct messages delivered.");
+    prometheus_value(out, "chat_direct_messages_total", NULL,
+            metrics_get(&metrics->directMessages));
+    prometheus_header(out, "chat_filtered_total", "counter",
+            "Messages not sent to clients ignoring the sender or its "
+            "topics.");
+    prometheus_value(out, "chat_filtered_total", NULL,
+            metrics_get(&metrics->filtered));
+    prometheus_header(out, "chat_frames_sent_total", "counter",
+            "Broadcast frames written to clients.");
+    prometheus_value(out, "chat_frames_sent_total", NULL,
+            metrics_get(&metrics->frames));
+    prometheus_header(out, "chat_mux_carriers", "gauge",
+            "Proxy connections carrying sessions.");
+    prometheus_value(out, "chat_mux_carriers", NULL,
+            metrics_gauge_get(&metrics->carriers));
+    prometheus_header(out, "chat_mux_sessions", "gauge",
+            "Clients in the chat through a proxy.");
+    prometheus_value(out, "chat_mux_sessions", NULL,
+            metrics_gauge_get(&metrics->muxSessions));
+    prometheus_header(out, "chat_mux_frames_sent_total", "counter",
+            "Broadcast frames written once per proxy.");
+    prometheus_value(out, "chat_mux_frames_sent_total", NULL,
+            metrics_get(&metrics->muxFrames));
+    write_compress_metrics(out, compress);
+    write_outbox_metrics(out, &snap->outbox);
+    write_auth_metrics(out, snap);
+    write_search_metrics(out, snap);
+    write_log_metrics(out, snap);
+    snprintf(labels, LABEL_SIZE, "backend=\"%s\"", snap->ioBackend);
+    prometheus_header(out, "chat_io_backend", "gauge",
+            "I/O backend in use.");
+    prometheus_value(out, "chat_io_backend", labels, 1);
+    prometheus_header(out, "chat_fanout_syscalls_total", "counter",
+            "System calls made writing broadcast frames.");
+    prometheus_value(out, "chat_fanout_syscalls_total", NULL,
+            snap->sendSyscalls);
+    prometheus_header(out, "chat_fanout_sends_total", "counter",
+            "Broadcast frames handed to the I/O backend.");
+    prometheus_value(out, "chat_fanout_sends_total", NULL, snap->sends);
+    if (snap->noOfShards > 0) {
+        prometheus_header(out, "chat_fanout_shard_members", "gauge",
+                "Attached clients owned by each fan-out shard.");
+        for (int idx = 0; idx < snap->noOfShards; idx++) {
+            snprintf(labels, LABEL_SIZE, "shard=\"%d\"", idx);
+            prometheus_value(out, "chat_fanout_shard_members", labels,
+                    snap->shards[idx].members);
+        }
+        prometheus_header(out, "chat_fanout_shard_queue_depth", "gauge",
+                "Frames waiting for each fan-out shard.");
+        for (int idx = 0; idx < snap->noOfShards; idx++) {
+            snprintf(labels, LABEL_SIZE, "shard=\"%d\"", idx);
+            prometheus_value(out, "chat_fanout_shard_queue_depth", labels,
+                    snap->shards[idx].queued);
+        }
+    }
+    prometheus_header(out, "chat_lock_acquired_total", "counter",
+            "Acquisitions of the global lock.");
+    prometheus_value(out, "chat_lock_acquired_total", NULL,
+            metrics_get(&metrics->lockAcquired));
+    prometheus_header(out, "chat_lock_wait_seconds_total", "counter",
+            "Time spent waiting for the global lock.");
+    prometheus_value(out, "chat_lock_wait_seconds_total", NULL,
+            metrics_get(&metrics->lockWaitNanos) / 1e9);
+    prometheus_header(out, "chat_lock_hold_seconds_total", "counter",
+            "Time the global lock was held.");
+    prometheus_value(out, "chat_lock_hold_seconds_total", NULL,
+            metrics_get(&metrics->lockHoldNanos) / 1e9);
+    prometheus_header(out, "chat_lock_wait_max_seconds", "gauge",
+            "Longest single wait for the global lock.");
+    prometheus_value(out, "chat_lock_wait_max_seconds", NULL,
+            metrics_get(&metrics->lockMaxWaitNanos) / 1e9);
+    write_lock_metrics(out, snap->lockSites);
+    prometheus_header(out, "chat_history_frames", "gauge",
+            "Frames held in the resume history.");
+    prometheus_value(out, "chat_history_frames", NULL,
+            snap->historyFrames);
+    prometheus_header(out, "chat_presence_pending", "gauge",
+            "Presence changes waiting for the next PRESENCE: frame.");
+    prometheus_value(out, "chat_presence_pending", NULL,
+            snap->presencePending);
+    prometheus_header(out, "chat_rate_limit_milliseconds", "gauge",
+            "Pause after each client command.");
+    prometheus_value(out, "chat_rate_limit_milliseconds", NULL,
+            snap->rateLimit);
+    prometheus_header(out, "chat_heap_bytes", "gauge",
+            "Heap memory by pool.");
+    prometheus_value(out, "chat_heap_bytes", "pool=\"in_use\"",
+            snap->heap.uordblks);
+    prometheus_value(out, "chat_heap_bytes", "pool=\"free\"",
+            snap->heap.fordblks);
+    prometheus_value(out, "chat_heap_bytes", "pool=\"mmapped\"",
+            snap->heap.hblkhd);
+    prometheus_value(out, "chat_heap_bytes", "pool=\"input_buffers\"",
+            snap->bufferBytes);
+    prometheus_value(out, "chat_heap_bytes", "pool=\"spare_buffers\"",
+            snap->receiveSpare);
+    prometheus_value(out, "chat_heap_bytes", "pool=\"connections\"",
+            snap->connBytes);
+    write_mem_metrics(out, snap->mem);
+    prometheus_header(out, "chat_connections_idle", "gauge",
+            "Quiet connections parked without a thread.");
+    prometheus_value(out, "chat_connections_idle", NULL, snap->idleConns);
+    prometheus_header(out, "chat_idle_parks_total", "counter",
+            "Times a quiet connection gave up its thread.");
+    prometheus_value(out, "chat_idle_parks_total", NULL, snap->idleParks);
+    prometheus_header(out, "chat_idle_wakes_total", "counter",
+            "Times a parked connection got a thread back.");
+    prometheus_value(out, "chat_idle_wakes_total", NULL, snap->idleWakes);
+    prometheus_header(out, "chat_receive_buffers", "gauge",
+            "Pooled input buffers held by connections.");
+    prometheus_value(out, "chat_receive_buffers", NULL, snap->receiveTaken);
+    prometheus_header(out, "chat_receive_buffer_takes_total", "counter",
+            "Input buffers taken from the pool, by where they came from.");
+    prometheus_value(out, "chat_receive_buffer_takes_total",
+            "from=\"spare\"", snap->receiveReused);
+    prometheus_value(out, "chat_receive_buffer_takes_total",
+            "from=\"heap\"", snap->receiveAllocated);
+
+    double* values = malloc(sizeof(double) * (snap->noOfConns + 1));
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].buffered;
+    }
+    write_connection_gauge(out, "chat_connection_input_buffered_bytes",
+            "Input read but not yet processed.", snap, values);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].inQueue;
+    }
+    write_connection_gauge(out, "chat_connection_receive_queue_bytes",
+            "Bytes waiting in the kernel receive queue.", snap, values);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].outQueue;
+    }
+    write_connection_gauge(out, "chat_connection_send_queue_bytes",
+            "Bytes waiting in the kernel send queue.", snap, values);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].queued[OUTBOX_CONTROL];
+    }
+    write_connection_gauge(out, "chat_connection_outbox_control_bytes",
+            "Control frames waiting in the outbox.", snap, values);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].queued[OUTBOX_BULK];
+    }
+    write_connection_gauge(out, "chat_connection_outbox_bulk_bytes",
+            "Chat frames waiting in the outbox.", snap, values);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        values[idx] = snap->conns[idx].memory;
+    }
+    write_connection_gauge(out, "chat_connection_memory_bytes",
+            "Estimated memory the connection costs.", snap, values);
+    free(values);
+    fprintf(out, "# EOF\n");
+}
+
+// Takes the output stream, a snapshot, the metrics, the compression stats
+// and the previous command counts as @param and writes the snapshot as one
+// line of JSON. Command rates are per second since the previous JSON
+// snapshot.
+void write_json_metrics(FILE* out, AdminSnapshot* snap, Metrics* metrics,
+        CompressStats* compress, AdminRates* rates) {
+    const char* cmdNames[] = {"auth", "name", "say", "kick", "list",
+            "leave"};
+    int cmdCounts[] = {snap->cmds.auth, snap->cmds.name, snap->cmds.say,
+            snap->cmds.kick, snap->cmds.list, snap->cmds.leave};
+    int lastCounts[] = {rates->cmds.auth, rates->cmds.name,
+            rates->cmds.say, rates->cmds.kick, rates->cmds.list,
+            rates->cmds.leave};
+    unsigned long now = now_nanos();
+    double elapsed = (now - rates->at) / 1e9;
+    fprintf(out, "{\"uptime\":%ld,\"commands\":{", snap->uptime);
+    for (int idx = 0; idx < 6; idx++) {
+        fprintf(out, "%s\"%s\":{\"total\":%d,\"per_sec\":%.3f}",
+                idx ? "," : "", cmdNames[idx], cmdCounts[idx],
+                elapsed > 0 ? (cmdCounts[idx] - lastCounts[idx]) / elapsed
+                : 0.0);
+    }
+    rates->cmds = snap->cmds;
+    rates->at = now;
+    fprintf(out, "},\"accepted\":%lu,\"clients\":%ld,\"detached\":%ld,"
+            "\"entered\":%lu,\"resumed\":%lu,\"broadcasts\":%lu,"
+            "\"frames_sent\":%lu,\"direct_messages\":%lu,"
+            "\"filtered\":%lu,",
+            metrics_get(&metrics->accepted),
+            metrics_gauge_get(&metrics->roster),
+            metrics_gauge_get(&metrics->detached),
+            metrics_get(&metrics->entered), metrics_get(&metrics->resumed),
+            metrics_get(&metrics->broadcasts),
+            metrics_get(&metrics->frames),
+            metrics_get(&metrics->directMessages),
+            metrics_get(&metrics->filtered));
+    fprintf(out, "\"admission\":{\"connections\":%ld,\"handshakes\":%ld,"
+            "\"addresses\":%ld,\"rejected\":{", snap->admitted,
+            snap->handshaking, snap->admittedAddrs);
+    for (int verdict = ADMIT_OK + 1; verdict < NO_OF_ADMIT_VERDICTS;
+            verdict++) {
+        fprintf(out, "%s\"%s\":%lu", verdict > ADMIT_OK + 1 ? "," : "",
+                admit_verdict_name(verdict), snap->rejected[verdict]);
+    }
+    fprintf(out, "},\"backoffs\":%lu},", snap->acceptBackoffs);
+    fprintf(out, "\"sequencer\":{\"applied\":%lu,\"batches\":%lu,"
+            "\"queued\":%ld},", metrics_get(&metrics->sequenced),
+            metrics_get(&metrics->sequencerBatches),
+            metrics_gauge_get(&metrics->ingressDepth));
+    fprintf(out, "\"batch\":{\"clients\":%ld,\"frames\":%lu,"
+            "\"batched\":%lu},", metrics_gauge_get(&metrics->batchClients),
+            metrics_get(&metrics->batches),
+            metrics_get(&metrics->batchedFrames));
+    fprintf(out, "\"mux\":{\"carriers\":%ld,\"sessions\":%ld,"
+            "\"frames_sent\":%lu},", metrics_gauge_get(&metrics->carriers),
+            metrics_gauge_get(&metrics->muxSessions),
+            metrics_get(&metrics->muxFrames));
+    fprintf(out, "\"io\":{\"backend\":\"%s\",\"fanout_syscalls\":%lu,"
+            "\"fanout_sends\":%lu,\"shards\":[", snap->ioBackend,
+            snap->sendSyscalls, snap->sends);
+    for (int idx = 0; idx < snap->noOfShards; idx++) {
+        fprintf(out, "%s{\"members\":%d,\"queued\":%lu}", idx ? "," : "",
+                snap->shards[idx].members, snap->shards[idx].queued);
+    }
+    fprintf(out, "]},");
+    unsigned long zNanos = metrics_get(&compress->nanos);
+    unsigned long zSaved = metrics_get(&compress->savedBytes);
+    fprintf(out, "\"compression\":{\"clients\":%ld,\"frames\":%lu,"
+            "\"cpu_ns\":%lu,\"raw_bytes\":%lu,\"compressed_bytes\":%lu,"
+            "\"saved_bytes\":%lu,\"saved_bytes_per_cpu_ms\":%.1f},",
+            metrics_gauge_get(&compress->clients),
+            metrics_get(&compress->frames), zNanos,
+            metrics_get(&compress->rawBytes), metrics_get(&compress->zBytes),
+            zSaved, zNanos ? zSaved / (zNanos / 1e6) : 0.0);
+    fprintf(out, "\"lock\":{\"acquired\":%lu,\"wait_ns\":%lu,"
+            "\"hold_ns\":%lu,\"max_wait_ns\":%lu,\"sites\":{",
+            metrics_get(&metrics->lockAcquired),
+            metrics_get(&metrics->lockWaitNanos),
+            metrics_get(&metrics->lockHoldNanos),
+            metrics_get(&metrics->lockMaxWaitNanos));
+    write_json_lock_sites(out, snap->lockSites);
+    fprintf(out, "}},");
+    OutboxStats* outbox = &snap->outbox;
+    fprintf(out, "\"outbox\":{\"backlogged\":%ld,\"control\":{\"frames\":%ld,"
+            "\"bytes\":%ld,\"queued\":%lu},\"bulk\":{\"frames\":%ld,"
+            "\"bytes\":%ld,\"queued\":%lu},\"preempted\":%lu,"
+            "\"overflows\":%lu},", outbox->backlogged,
+            outbox->frames[OUTBOX_CONTROL], outbox->bytes[OUTBOX_CONTROL],
+            outbox->queued[OUTBOX_CONTROL], outbox->frames[OUTBOX_BULK],
+            outbox->bytes[OUTBOX_BULK], outbox->queued[OUTBOX_BULK],
+            outbox->preempted, outbox->overflows);
+    fprintf(out, "\"auth\":{\"credentials\":%zu,\"reloads\":%lu,"
+            "\"reload_failures\":%lu,\"rejected\":%lu},",
+            snap->authCredentials, snap->authReloads,
+            snap->authReloadFailures, snap->authRejected);
+    fprintf(out, "\"search\":{\"documents\":%ld,\"terms\":%ld,"
+            "\"bytes\":%ld,\"evicted\":%lu,\"queries\":%lu},",
+            snap->searchDocs, snap->searchTerms, snap->searchBytes,
+            snap->searchEvicted, snap->searchQueries);
+    fprintf(out, "\"log\":{\"bytes\":%ld,\"segments\":%ld,"
+            "\"history_requests\":%lu,\"history_bytes\":%lu},",
+            snap->logBytes, snap->logSegments, snap->historyRequests,
+            snap->historyBytes);
+    fprintf(out, "\"queues\":{\"history_frames\":%zu,"
+            "\"presence_pending\":%zu},\"rate_limit_ms\":%d,",
+            snap->historyFrames, snap->presencePending, snap->rateLimit);
+    fprintf(out, "\"memory\":{\"in_use\":%zu,\"free\":%zu,"
+            "\"mmapped\":%zu,\"input_buffers\":%zu,\"spare_buffers\":%ld,"
+            "\"connections\":%zu},", snap->heap.uordblks,
+            snap->heap.fordblks, snap->heap.hblkhd, snap->bufferBytes,
+            snap->receiveSpare, snap->connBytes);
+    fprintf(out, "\"tracked\":{");
+    write_json_mem(out, snap->mem, rates, elapsed);
+    fprintf(out, "},");
+    fprintf(out, "\"idle\":{\"connections\":%d,\"parks\":%lu,"
+            "\"wakes\":%lu,\"buffers_taken\":%ld,\"buffers_reused\":%lu,"
+            "\"buffers_allocated\":%lu},\"connections\":[",
+            snap->idleConns, snap->idleParks, snap->idleWakes,
+            snap->receiveTaken, snap->receiveReused, snap->receiveAllocated);
+    for (int idx = 0; idx < snap->noOfConns; idx++) {
+        ConnSnapshot* conn = &snap->conns[idx];
+        fprintf(out, "%s{\"fd\":%d,\"name\":", idx ? "," : "", conn->fd);
+        if (conn->name != NULL) {
+            fputc('"', out);
+            write_escaped(out, conn->name);
+            fputc('"', out);
+        } else {
+            fputs("null", out);
+        }
+        fprintf(out, ",\"caps\":%u,\"age\":%ld,\"buffered\":%zu,"
+                "\"buffer_size\":%zu,\"recv_queue\":%d,"
+                "\"send_queue\":%d,\"outbox_control\":%ld,"
+                "\"outbox_bulk\":%ld,\"idle\":%s,\"memory\":%zu}",
+                conn->caps, conn->age, conn->buffered, conn->bufferSize,
+                conn->inQueue, conn->outQueue, conn->queued[OUTBOX_CONTROL],
+                conn->queued[OUTBOX_BULK], conn->idle ? "true" : "false",
+                conn->memory);
+    }
+    fprintf(out, "]}\n");
+}
+
+// Takes one command line read from the admin socket, the output stream,
+// the admin thread's arguments and the previous command counts as @param
+// and runs the command: "metrics" (Prometheus text), "json", "rate_limit
+// milliseconds", "kick name", "reload_auth" or "search words". Only kicking
+// takes the global lock.
+void run_admin_command(char* line, FILE* out, ReaperThreadArgs* rtArgs,
+        AdminRates* rates) {
+    CommonVars* common = rtArgs->common;
+    char* arg;
+    char* cmd = strtok_r(line, " ", &arg);
+    if (cmd == NULL) {
+        return;
+    }
+    if (is_match(cmd, "metrics") || is_match(cmd, "json")) {
+        AdminSnapshot snap;
+        take_admin_snapshot(common, &snap);
+        if (is_match(cmd, "metrics")) {
+            write_prometheus_metrics(out, &snap, &common->metrics,
+                    &common->compress);
+        } else {
+            write_json_metrics(out, &snap, &common->metrics,
+                    &common->compress, rates);
+        }
+        for (int idx = 0; idx < snap.noOfConns; idx++) {
+            free(snap.conns[idx].name);
+        }
+        free(snap.conns);
+        free(snap.shards);
+    } else if (is_match(cmd, "rate_limit") && *arg != NULL_CHAR &&
+            strspn(arg, "0123456789") == strlen(arg)) {
+        __atomic_store_n(&common->config.rateLimit, atoi(arg),
+                __ATOMIC_RELAXED);
+        fprintf(out, "OK\n");
+    } else if (is_match(cmd, "reload_auth")) {
+        fprintf(out, auth_reload(&common->auth) ? "OK\n" :
+                "ERROR:cannot read authfile\n");
+    } else if (is_match(cmd, "search") && common->search != NULL) {
+        char* reply = search_query(common->search, arg);
+        fputs(reply, out);
+        free(reply);
+    } else if (is_match(cmd, "kick") && *arg != NULL_CHAR) {
+        bool found = run_sequenced(SEQ_KICK, NULL, NULL, arg, false,
+                common);
+        fprintf(out, found ? "OK\n" : "ERROR:no such client\n");
+    } else {
+        fprintf(out, "ERROR:unknown command\n");
+    }
+    fflush(out);
+}
+
+// Admin thread function, takes a pointer to the ReaperThreadArgs struct as
+// @param. Serves the admin socket one connection at a time, running each
+// line received as a command.
+void* admin_thread(void* arg) {
+    ReaperThreadArgs* rtArgs = arg;
+    CommonVars* common = rtArgs->common;
+    AdminRates rates = {common->cmds, {0}, now_nanos()};
+    int adminFd = open_unix_listen(common->config.adminPath);
+    if (adminFd < 0) {
+        return NULL;
+    }
+    while (1) {
+        int fd = accept(adminFd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        LineReader reader;
+        init_line_reader(&reader, fd);
+        FILE* out = fdopen(fd, "w");
+        char* line;
+        while ((line = read_line(&reader)) != NULL || reader.interrupted) {
+            if (line != NULL) {
+                run_admin_command(line, out, rtArgs, &rates);
+                free(line);
+            }
+        }
+        fclose(out);
+        free_line_reader(&reader);
+    }
+    return NULL;
+}
+
 // SIGHUP HANDLING-----------------------------------------------------------
 
 // Takes the pointer to the ClientList as argument and displays each client's
@@ -642,21 +4018,29 @@ void display_server_command_counts(ServerCommandsCount cmds) {
             cmds.leave);
 }
 
-// SIGHUP thread function, waits for a SIGHUP signal on the server. Displays
-// client and server statistics when found one.
+// SIGHUP thread function, waits for a SIGHUP signal on the server. Reloads
+// the authfile and displays client and server statistics when found one.
 void* sighup_signal_waiter(void* arg) {
-    SighupThreadArgs* stArgs = malloc(sizeof(SighupThreadArgs));
-    stArgs = arg;
+    SighupThreadArgs* stArgs = arg;
     int sigNum;
     while (1) {
         sigwait(&stArgs->sigSet, &sigNum);
         if (sigNum == SIGHUP) {
-            pthread_mutex_lock(&(stArgs->common.lock));
+            auth_reload(&stArgs->common.auth);
+            lock_common(&stArgs->common, LOCK_SIGHUP);
             fprintf(stderr, "@CLIENTS@\n");
             display_currclient_command_counts(stArgs->headNode);
             fprintf(stderr, "@SERVER@\n");
             display_server_command_counts(stArgs->common.cmds);
-            pthread_mutex_unlock(&(stArgs->common.lock));
+            unlock_common(&stArgs->common);
+            LockSiteStats sites[NO_OF_LOCK_SITES];
+            snapshot_lock_sites(&stArgs->common, sites);
+            fprintf(stderr, "@LOCKS@\n");
+            display_lock_sites(stderr, sites);
+            MemCounters mem[NO_OF_MEM_SUBSYSTEMS];
+            mem_snapshot(stArgs->common.mem, mem, NO_OF_MEM_SUBSYSTEMS);
+            fprintf(stderr, "@MEMORY@\n");
+            display_mem_counters(stderr, mem);
         }
     }
     return NULL;
@@ -683,8 +4067,80 @@ int main(int argc, char* argv[]) {
     pthread_sigmask(SIG_BLOCK, &(stArgs.sigSet), NULL);
     pthread_create(&sighupThreadId, NULL, sighup_signal_waiter, &stArgs);
 
+    // Expiring clients that dropped without resuming
+    pthread_t reaperThreadId;
+    ReaperThreadArgs rtArgs;
+    rtArgs.listHeadNode = &stArgs.headNode;
+    rtArgs.common = &stArgs.common;
+    pthread_create(&reaperThreadId, NULL, detached_client_reaper, &rtArgs);
+    // Shards count into the metrics, so they start once common is in place
+    init_outboxes(&stArgs.common.outboxes, stArgs.common.config.outboxMax,
+            stArgs.common.config.sendBuffer);
+    if (stArgs.common.config.searchMax > 0) {
+        stArgs.common.search = malloc(sizeof(SearchIndex));
+        init_search_index(stArgs.common.search,
+                stArgs.common.config.searchMax,
+                stArgs.common.config.searchRetention);
+    }
+    init_buffer_pool(&stArgs.common.receive, RECEIVE_BUFFER_SIZE,
+            stArgs.common.config.spareBuffers);
+    init_idle_parker(&stArgs.common.idle, wake_idle_client, &rtArgs);
+    if (stArgs.common.config.logDir != NULL) {
+        stArgs.common.log = open_chat_log(stArgs.common.config.logDir,
+                stArgs.common.config.logSegmentSize,
+                stArgs.common.config.logSegments);
+    }
+    if (stArgs.common.log != NULL) {
+        pthread_create(&stArgs.common.log->thread, NULL, chatlog_writer,
+                stArgs.common.log);
+        pthread_detach(stArgs.common.log->thread);
+    }
+    stArgs.common.history->counters = &stArgs.common.mem[MEM_FANOUT];
+    init_fanout(&stArgs.common.fanout, stArgs.common.config.fanoutShards,
+            stArgs.common.config.ioBackend, CAP_RESUME, CAP_DEFLATE,
+            &stArgs.common.metrics.frames, &stArgs.common.compress,
+            &stArgs.common.mem[MEM_FANOUT], &stArgs.common.cpus,
+            stArgs.common.config.spin * 1000L);
+    pthread_t sequencerThreadId;
+    pthread_create(&sequencerThreadId, NULL, sequencer_thread, &rtArgs);
+    pin_thread_to_cpu(sequencerThreadId, &stArgs.common.cpus, 0);
+    if (rtArgs.common->config.presenceWindow > 0) {
+        pthread_t presenceThreadId;
+        pthread_create(&presenceThreadId, NULL, presence_flusher, &rtArgs);
+    }
+
+    if (rtArgs.common->config.adminPath != NULL) {
+        pthread_t adminThreadId;
+        pthread_create(&adminThreadId, NULL, admin_thread, &rtArgs);
+    }
+
+    // Hot restart: an empty handler so that a drain interrupts reads
+    struct sigaction sa2;
+    memset(&sa2, 0, sizeof(struct sigaction));
+    sa2.sa_handler = handoff_signal_handler;
+    sigaction(SIGUSR1, &sa2, NULL);
+
     // Processing connections
-    fdServer = open_listen(port);
+    ServerConfig* config = &stArgs.common.config;
+    if (config->takeover) {
+        fdServer = take_over_server(config->handoffPath, &stArgs.headNode,
+                &stArgs.common);
+        print_listen_port(fdServer);
+    } else {
+        fdServer = open_listen(port);
+    }
+    HandoffThreadArgs htArgs; // the thread reads it for as long as it runs
+    if (config->handoffPath != NULL) {
+        pthread_t handoffThreadId;
+        htArgs.listenFd = fdServer;
+        htArgs.listHeadNode = &stArgs.headNode;
+        htArgs.common = &stArgs.common;
+        pthread_create(&handoffThreadId, NULL, handoff_thread, &htArgs);
+    }
+    start_unix_listener(config->unixPath, false, &stArgs.headNode,
+            &stArgs.common);
+    start_unix_listener(config->shmPath, true, &stArgs.headNode,
+            &stArgs.common);
     process_connections(fdServer, &stArgs.headNode, &stArgs.common);
 
     return 0;
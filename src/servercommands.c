@@ -3,31 +3,37 @@
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 // Takes the server input and returns the index at which a specific command is
-// recognized to a switch case.
+// recognized to a switch case. Only the command before the first colon is
+// compared, the input is left as it is.
 int evaluate_server_input(char* svrInput) {
     int idx;
-    char* savePtr;
-    char* prefix = strdup(svrInput);
-    strtok_r(prefix, COLON, &savePtr);
+    size_t len = strcspn(svrInput, COLON);
     ServerCommands svrCommands[NO_OF_SVR_CMDS] = { {"AUTH", 0}, {"WHO", 1},
             {"NAME_TAKEN", 2}, {"OK", 3}, {"ENTER", 4}, {"MSG", 4}, 
-            {"LEAVE", 4}, {"LIST", 4}, {"KICK", 5}};
+            {"LEAVE", 4}, {"LIST", 4}, {"KICK", 5}, {"TOKEN", 6},
+            {"SEQ", 7}, {"RESUMED", 8}, {"PRESENCE", 4}, {"DM", 4},
+            {"Z", 9}, {"FOUND", 4}, {"BATCH", 10}, {"BUSY", 11}};
     
     for (idx = 0; idx < NO_OF_SVR_CMDS; idx++) {
-        if (!strcmp(prefix, svrCommands[idx].command)) {
-            free(prefix);
+        if (strlen(svrCommands[idx].command) == len &&
+                !strncmp(svrInput, svrCommands[idx].command, len)) {
             return svrCommands[idx].switchCaseNo;
         }
     }
-    free(prefix);
     return idx;
 }
 
 // Takes the pointer to a ServerIO struct as @param and if the authentication
 // string in ServerIO is not NULL then writes the string in a server readable
 // format to the server's write end and flushes the write end after writing.
+// A client holding a resume token answers the first challenge on a
+// connection with "RESUME:token:lastSeq" instead.
 void return_authorization_value(ServerIO* svr) {
-    if (svr->authStr != NULL) {
+    if (svr->token != NULL && !svr->resumeTried) {
+        svr->resumeTried = true;
+        fprintf(svr->wrEnd, "RESUME:%s:%lu\n", svr->token, svr->lastSeq);
+        fflush(svr->wrEnd);
+    } else if (svr->authStr != NULL) {
         fprintf(svr->wrEnd, "AUTH:%s\n", svr->authStr);
         fflush(svr->wrEnd);
     } else {
@@ -56,10 +62,11 @@ void compute_server_who(ServerIO* svr) {
 
 // Takes the server command input as parameter and checks if it matches with
 // any server command that issues message to client's stdout (ENTER:,LEAVE:,
-// LIST:, MSG:). If match is found returns the switchNo i.e used to switch
-// to the corresponding case.
+// LIST:, MSG:, PRESENCE:, DM:, FOUND:). If match is found returns the
+// switchNo i.e used to switch to the corresponding case.
 int stdout_type(char* inputCmd) {
-    char* svrCommands[] = {"ENTER", "LEAVE", "LIST", "MSG"};
+    char* svrCommands[] = {"ENTER", "LEAVE", "LIST", "MSG", "PRESENCE",
+            "DM", "FOUND"};
     int switchNo = 0;
     while (switchNo < NO_OF_SVR_CMDS_STDOUT_EMIT) {
         if (!strcmp(inputCmd, svrCommands[switchNo])) {
@@ -70,44 +77,151 @@ int stdout_type(char* inputCmd) {
     return switchNo;
 }
 
-// Takes the name and message received from the server's "MSG:name:message" 
-// command as @param and returns the msg to stdout if bith are not NULL.
-void compute_server_msg(char* strAfterCommand) {
+// Takes the output stream and the name and message received from the
+// server's "MSG:name:message" command as @param and writes the msg to the
+// stream if both are not NULL.
+void compute_server_msg(FILE* out, char* strAfterCommand) {
     if (after_colon(strAfterCommand)) {
         char* message = NULL;
         strtok_r(strAfterCommand, COLON, &message);
         if (message != NULL) {
-            fprintf(stdout, "%s: %s\n", strAfterCommand, message);
-            fflush(stdout);
+            fprintf(out, "%s: %s\n", strAfterCommand, message);
         }
     }
 }
 
+// Takes the output stream and the changes from the server's
+// "PRESENCE:+name,-name" command as @param and shows each of them like an
+// ENTER: or LEAVE: would.
+void compute_server_presence(FILE* out, char* strAfterCommand) {
+    char* savePtr;
+    char* change = strtok_r(strAfterCommand, ",", &savePtr);
+    while (change != NULL) {
+        if (change[0] == '+' && change[1] != NULL_CHAR) {
+            fprintf(out, "(%s has entered the chat)\n", change + 1);
+        } else if (change[0] == '-' && change[1] != NULL_CHAR) {
+            fprintf(out, "(%s has left the chat)\n", change + 1);
+        }
+        change = strtok_r(NULL, ",", &savePtr);
+    }
+}
+
+// Takes the output stream and the sender and message received from the
+// server's "DM:name:message" command as @param and shows the message marked
+// as direct.
+void compute_server_dm(FILE* out, char* strAfterCommand) {
+    if (after_colon(strAfterCommand)) {
+        char* message = NULL;
+        strtok_r(strAfterCommand, COLON, &message);
+        if (message != NULL) {
+            fprintf(out, "%s (direct): %s\n", strAfterCommand, message);
+        }
+    }
+}
+
+// Takes the output stream and a search result from the server's
+// "FOUND:time:name:message" command as @param and shows the message with
+// the time it was said.
+void compute_server_found(FILE* out, char* strAfterCommand) {
+    char* name;
+    char* message = NULL;
+    time_t at = strtol(strAfterCommand, &name, 10);
+    if (*name != ':' || (message = strchr(++name, ':')) == NULL) {
+        return;
+    }
+    *message++ = NULL_CHAR;
+    char stamp[sizeof("yyyy-mm-dd hh:mm:ss")];
+    strftime(stamp, sizeof(stamp), "%F %T", localtime(&at));
+    fprintf(out, "[%s] %s: %s\n", stamp, name, message);
+}
+
 // Takes a pointer to the ClientId struct and the input received from the
 // server as @param. Checks the type of command received from the server
 // and returns the appropriate stdout message. Ignores if command is not any
 // of "ENTER:", "LEAVE:", "LIST:" or "MSG:" from the server in correct syntax.
 void display_to_stdout(ClientId* client, char* svrInput) {
+    display_frame(stdout, svrInput);
+    fflush(stdout);
+}
+
+// Takes the output stream and a frame received from the server as @param
+// and writes what the frame shows, as display_to_stdout describes.
+void display_frame(FILE* out, char* svrInput) {
     if (after_colon(svrInput)) {
         char* strAfterCommand;
         strtok_r(svrInput, COLON, &strAfterCommand);
         switch (stdout_type(svrInput)) {
             case 0: // ENTER:
-                fprintf(stdout, "(%s has entered the chat)\n",
-                        strAfterCommand);
-                fflush(stdout);
+                fprintf(out, "(%s has entered the chat)\n", strAfterCommand);
                 break;
             case 1: // LEAVE:
-                fprintf(stdout, "(%s has left the chat)\n", strAfterCommand);
-                fflush(stdout);
+                fprintf(out, "(%s has left the chat)\n", strAfterCommand);
                 break;
             case 2: // LIST:
-                fprintf(stdout, "(current chatters: %s)\n", strAfterCommand);
-                fflush(stdout);
+                fprintf(out, "(current chatters: %s)\n", strAfterCommand);
                 break;
             case 3: // MSG:
-                compute_server_msg(strAfterCommand);
+                compute_server_msg(out, strAfterCommand);
+                break;
+            case 4: // PRESENCE:
+                compute_server_presence(out, strAfterCommand);
                 break;
+            case 5: // DM:
+                compute_server_dm(out, strAfterCommand);
+                break;
+            case 6: // FOUND:
+                compute_server_found(out, strAfterCommand);
+                break;
+        }
+    }
+}
+
+// Takes the stream a "BATCH:bytes" header line was read from and that line
+// as @param. Returns the malloc'd frames the header announces: the bytes
+// after it in the line itself, as in an inflated "Z:" frame, else the next
+// bytes read from the stream. Returns NULL if the header is malformed or
+// the stream ends early.
+char* read_batch(FILE* stream, char* header) {
+    char* end;
+    unsigned long len = strtoul(header + strlen("BATCH:"), &end, 10);
+    if (*end == NEXT_LINE_CHAR) {
+        return strdup(end + 1);
+    }
+    if (*end != NULL_CHAR || len > BATCH_MAX_LEN) {
+        return NULL;
+    }
+    char* frames = malloc(len + 1);
+    if (fread(frames, 1, len, stream) != len) {
+        free(frames);
+        return NULL;
+    }
+    frames[len] = NULL_CHAR;
+    return frames;
+}
+
+// Takes the frames of a batch from the server as @param, one per line.
+// Renders every frame that shows something into one buffer and writes it
+// to stdout at once. A batch only holds broadcasts, anything else in it is
+// ignored.
+void display_batch(char* frames) {
+    char* shown;
+    size_t shownLen;
+    FILE* out = open_memstream(&shown, &shownLen);
+    char* frame = frames;
+    while (*frame != NULL_CHAR) {
+        char* next = strchr(frame, NEXT_LINE_CHAR);
+        if (next != NULL) {
+            *next++ = NULL_CHAR;
+        } else {
+            next = frame + strlen(frame);
+        }
+        if (evaluate_server_input(frame) == 4) {
+            display_frame(out, frame);
         }
+        frame = next;
     }
+    fclose(out);
+    fwrite(shown, 1, shownLen, stdout);
+    fflush(stdout);
+    free(shown);
 }
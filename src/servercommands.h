@@ -1,11 +1,14 @@
 #ifndef SERVERCOMMANDS_H
 #define SERVERCOMMANDS_H
 
+#include <pthread.h>
+#include <time.h>
 #include "errors.h"
 #include "parser.h"
 
-#define NO_OF_SVR_CMDS 9
-#define NO_OF_SVR_CMDS_STDOUT_EMIT 4
+#define NO_OF_SVR_CMDS 18
+#define NO_OF_SVR_CMDS_STDOUT_EMIT 7
+#define BATCH_MAX_LEN (16 << 20)   // largest BATCH: frame accepted
 
 
 typedef struct ServerCommands {
@@ -23,9 +26,14 @@ typedef struct ClientId {
 typedef struct ServerIO {
     FILE* rdEnd;
     FILE* wrEnd;
+    pthread_mutex_t wrLock; // held while writing or replacing the connection
     char* authStr;
     int noOfOk; // no. of OK: sent by server
     ClientId* client;
+    const char* port;
+    char* token;            // resume token from TOKEN:, NULL until entered
+    unsigned long lastSeq;  // sequence number of the last SEQ: frame seen
+    bool resumeTried;       // RESUME: already sent on this connection
 } ServerIO;
 
 int evaluate_server_input(char* svrInput);
@@ -33,7 +41,13 @@ void return_authorization_value(ServerIO* svr);
 char* is_authorized(FILE* svrRdEnd);
 void compute_server_who(ServerIO* svr);
 int stdout_type(char* inputCmd);
-void compute_server_msg(char* strAfterCommand);
+void compute_server_msg(FILE* out, char* strAfterCommand);
+void compute_server_presence(FILE* out, char* strAfterCommand);
+void compute_server_dm(FILE* out, char* strAfterCommand);
+void compute_server_found(FILE* out, char* strAfterCommand);
 void display_to_stdout(ClientId* client, char* svrInput);
+void display_frame(FILE* out, char* svrInput);
+char* read_batch(FILE* stream, char* header);
+void display_batch(char* frames);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include "shmring.h"
+
+// Takes a channel as @param and maps the shared rings. The memfd is closed
+// once mapped. Returns false on failure.
+bool shm_channel_map(ShmChannel* ch, int memFd) {
+    ch->shared = mmap(NULL, sizeof(ShmShared), PROT_READ | PROT_WRITE,
+            MAP_SHARED, memFd, 0);
+    close(memFd);
+    return ch->shared != MAP_FAILED;
+}
+
+// Takes the path of the server's shared memory socket as @param. Creates
+// the shared rings, sealed at their size, and their eventfds, connects to
+// the server and passes them over. Returns the client's end of the
+// channel, else returns NULL.
+ShmChannel* shm_channel_connect(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return NULL;
+    }
+    int fds[SHM_FD_COUNT];
+    fds[0] = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_CLOEXEC);  // wakes the server
+    fds[2] = eventfd(0, EFD_CLOEXEC);  // wakes this client
+    if (fds[0] < 0 || ftruncate(fds[0], sizeof(ShmShared)) < 0 ||
+            fcntl(fds[0], F_ADD_SEALS, SHM_SEALS) < 0) {
+        close(sock);
+        return NULL;
+    }
+
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ShmChannel* ch = calloc(1, sizeof(ShmChannel));
+    ch->sock = sock;
+    ch->inEvent = fds[2];
+    ch->outEvent = fds[1];
+    bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+    if (!shm_channel_map(ch, fds[0]) || !sent) {
+        shm_channel_close(ch);
+        return NULL;
+    }
+    ch->in = &ch->shared->toClient;
+    ch->out = &ch->shared->toServer;
+    return ch;
+}
+
+// Takes a connection accepted on the shared memory socket as @param and
+// receives the client's rings and eventfds. The memfd must be sealed at
+// the rings' size, else the client could shrink it under the server's
+// mapping and have it die of SIGBUS. Returns the server's end of the
+// channel, else closes the connection and returns NULL.
+ShmChannel* shm_channel_accept(int sock) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    int fds[SHM_FD_COUNT];
+    struct cmsghdr* cmsg;
+    struct stat st;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+            (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+            cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(sock);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    ShmChannel* ch = calloc(1, sizeof(ShmChannel));
+    ch->sock = sock;
+    ch->inEvent = fds[1];
+    ch->outEvent = fds[2];
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_SEALS) != SHM_SEALS ||
+            fstat(fds[0], &st) < 0 || st.st_size != sizeof(ShmShared) ||
+            !shm_channel_map(ch, fds[0])) {
+        ch->shared = NULL;
+        shm_channel_close(ch);
+        return NULL;
+    }
+    ch->in = &ch->shared->toServer;
+    ch->out = &ch->shared->toClient;
+    return ch;
+}
+
+// Takes a channel as @param and returns true if the other side has closed
+// its end or died, which shows as EOF on the setup socket.
+bool shm_peer_gone(ShmChannel* ch) {
+    char byte;
+    if (__atomic_load_n(&ch->in->closed, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&ch->out->closed, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    ssize_t got = recv(ch->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+// Takes a channel, some bytes and their length as @param and appends the
+// bytes to the outgoing ring, waiting on a futex while it is full. Wakes
+// the consumer through its eventfd only if it is asleep. Returns the
+// number of bytes written, else returns -1 with errno EPIPE if the peer
+// has gone or broke the ring.
+ssize_t shm_ring_write(ShmChannel* ch, const char* data, size_t len) {
+    ShmRing* ring = ch->out;
+    size_t done = 0;
+    while (done < len) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+        if (tail - head > SHM_RING_BYTES) {
+            errno = EPIPE;
+            return -1;
+        }
+        size_t space = SHM_RING_BYTES - (tail - head);
+        if (space == 0) {
+            unsigned int seq = __atomic_load_n(&ring->headSeq,
+                    __ATOMIC_ACQUIRE);
+            __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == head) {
+                struct timespec timeout = {0,
+                        SHM_FULL_WAIT_MILLI_SECS * 1000000L};
+                syscall(SYS_futex, &ring->headSeq, FUTEX_WAIT, seq,
+                        &timeout, NULL, 0);
+            }
+            __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+            if (shm_peer_gone(ch)) {
+                errno = EPIPE;
+                return -1;
+            }
+            continue;
+        }
+        size_t chunk = len - done < space ? len - done : space;
+        size_t offset = tail & (SHM_RING_BYTES - 1);
+        size_t first = SHM_RING_BYTES - offset < chunk ?
+                SHM_RING_BYTES - offset : chunk;
+        memcpy(ring->data + offset, data + done, first);
+        memcpy(ring->data, data + done + first, chunk - first);
+        __atomic_store_n(&ring->tail, tail + chunk, __ATOMIC_SEQ_CST);
+        done += chunk;
+        if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            if (write(ch->outEvent, &one, sizeof(one)) < 0) {
+                // The counter only saturates if nobody reads it, ignore
+            }
+        }
+    }
+    return done;
+}
+
+// Takes a channel, a buffer and its size as @param and reads whatever the
+// incoming ring holds, spinning briefly and then sleeping on the eventfd
+// and the setup socket while it is empty. Returns the number of bytes
+// read, 0 once the peer has gone or broke the ring, or -1 with errno
+// EINTR if a signal cut the wait short.
+ssize_t shm_ring_read(ShmChannel* ch, char* buf, size_t len) {
+    ShmRing* ring = ch->in;
+    int spins = 0;
+    while (1) {
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        unsigned long head = ring->head;
+        if (tail - head > SHM_RING_BYTES) {
+            return 0;
+        }
+        if (tail != head) {
+            size_t chunk = tail - head < len ? tail - head : len;
+            size_t offset = head & (SHM_RING_BYTES - 1);
+            size_t first = SHM_RING_BYTES - offset < chunk ?
+                    SHM_RING_BYTES - offset : chunk;
+            memcpy(buf, ring->data + offset, first);
+            memcpy(buf + first, ring->data, chunk - first);
+            __atomic_store_n(&ring->head, head + chunk, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&ring->headSeq, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_SEQ_CST)) {
+                syscall(SYS_futex, &ring->headSeq, FUTEX_WAKE, 1, NULL,
+                        NULL, 0);
+            }
+            return chunk;
+        }
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        if (spins++ < SHM_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+        __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != head) {
+            __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct pollfd fds[2] = {{ch->inEvent, POLLIN, 0},
+                {ch->sock, POLLIN, 0}};
+        int ready = poll(fds, 2, -1);
+        __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+        if (ready < 0 && errno == EINTR) {
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(ch->inEvent, &count, sizeof(count)) < 0) {
+                // Another wakeup already drained it
+            }
+        }
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                shm_peer_gone(ch) &&
+                __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+            return 0;
+        }
+        spins = 0;
+    }
+}
+
+// Takes a channel as @param and drops one reference to it; a channel no
+// stream has been opened on yet has none. The last one marks both rings
+// closed, wakes the peer, and unmaps and closes everything.
+void shm_channel_close(ShmChannel* ch) {
+    if (__atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (ch->shared != NULL && ch->shared != MAP_FAILED) {
+        uint64_t one = 1;
+        __atomic_store_n(&ch->out->closed, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&ch->in->closed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&ch->in->headSeq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &ch->in->headSeq, FUTEX_WAKE, 1, NULL, NULL, 0);
+        if (write(ch->outEvent, &one, sizeof(one)) < 0) {
+            // Peer may already be gone
+        }
+        munmap(ch->shared, sizeof(ShmShared));
+    }
+    close(ch->inEvent);
+    close(ch->outEvent);
+    close(ch->sock);
+    free(ch);
+}
+
+// Stdio write hook for a channel stream.
+ssize_t shm_cookie_write(void* cookie, const char* buf, size_t size) {
+    ssize_t done = shm_ring_write(cookie, buf, size);
+    return done < 0 ? 0 : done; // 0 marks the stream as failed
+}
+
+// Stdio read hook for a channel stream, retrying reads cut short by a
+// signal since stdio would take -1 for an error.
+ssize_t shm_cookie_read(void* cookie, char* buf, size_t size) {
+    ssize_t got;
+    while ((got = shm_ring_read(cookie, buf, size)) < 0 && errno == EINTR) {
+    }
+    return got;
+}
+
+// Stdio close hook for a channel stream.
+int shm_cookie_close(void* cookie) {
+    shm_channel_close(cookie);
+    return 0;
+}
+
+// Takes a channel and a stdio mode ("r" or "w") as @param and returns a
+// stream reading from or writing to it, so code written against FILE*
+// runs unchanged over shared memory. Each stream holds a reference to the
+// channel.
+FILE* shm_channel_fopen(ShmChannel* ch, const char* mode) {
+    cookie_io_functions_t funcs;
+    memset(&funcs, 0, sizeof(funcs));
+    funcs.close = shm_cookie_close;
+    if (mode[0] == 'r') {
+        funcs.read = shm_cookie_read;
+    } else {
+        funcs.write = shm_cookie_write;
+    }
+    FILE* stream = fopencookie(ch, mode, funcs);
+    if (stream != NULL) {
+        __atomic_add_fetch(&ch->refs, 1, __ATOMIC_RELAXED);
+    }
+    return stream;
+}
@@ -0,0 +1,77 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SHM_RING_BYTES (256 * 1024)   // power of two
+#define SHM_SPINS 200                 // polls of an empty ring before sleeping
+#define SHM_FULL_WAIT_MILLI_SECS 100  // re-checks the peer while the ring is full
+#define SHM_FD_COUNT 3                // memfd, then the two eventfds
+// Seals the memfd must carry, so that its size is fixed for good
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+// Single producer, single consumer byte ring in shared memory. The
+// producer only writes tail, the consumer only writes head; each side
+// flags when it is about to sleep so the other only makes a wakeup system
+// call when someone is actually waiting. Either side can write anything
+// to the mapping, so a ring whose tail is more than SHM_RING_BYTES ahead
+// of its head is taken for a broken peer.
+typedef struct ShmRing {
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned int consumerWaiting;     // consumer sleeps on the ring's eventfd
+    unsigned long head __attribute__((aligned(64)));
+    unsigned int headSeq;             // futex word, bumped as space frees up
+    unsigned int producerWaiting;     // producer sleeps on headSeq
+    unsigned int closed;              // either side hung up
+    char data[SHM_RING_BYTES] __attribute__((aligned(64)));
+} ShmRing;
+
+// The shared mapping: one ring in each direction
+typedef struct ShmShared {
+    ShmRing toServer;
+    ShmRing toClient;
+} ShmShared;
+
+// One end of a shared memory connection. The Unix socket it was set up
+// over stays open so that each side notices when the other dies.
+typedef struct ShmChannel {
+    ShmShared* shared;
+    ShmRing* in;
+    ShmRing* out;
+    int inEvent;
+    int outEvent;
+    int sock;
+    int refs;                         // streams open on the channel
+} ShmChannel;
+
+bool shm_channel_map(ShmChannel* ch, int memFd);
+ShmChannel* shm_channel_connect(const char* path);
+ShmChannel* shm_channel_accept(int sock);
+ssize_t shm_ring_write(ShmChannel* ch, const char* data, size_t len);
+ssize_t shm_ring_read(ShmChannel* ch, char* buf, size_t len);
+bool shm_peer_gone(ShmChannel* ch);
+void shm_channel_close(ShmChannel* ch);
+ssize_t shm_cookie_write(void* cookie, const char* buf, size_t size);
+ssize_t shm_cookie_read(void* cookie, char* buf, size_t size);
+int shm_cookie_close(void* cookie);
+FILE* shm_channel_fopen(ShmChannel* ch, const char* mode);
+
+#endif
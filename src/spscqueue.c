@@ -0,0 +1,73 @@
+#include "spscqueue.h"
+
+// Takes a queue and its capacity, a power of two, as @param and
+// initializes the queue empty.
+void init_spsc_queue(SpscQueue* queue, unsigned long capacity) {
+    queue->head = 0;
+    queue->tail = 0;
+    queue->capacity = capacity;
+    queue->slots = calloc(capacity, sizeof(void*));
+    queue->sleeping = 0;
+    queue->spinNanos = 0;
+}
+
+// Takes a queue and an item as @param and appends the item, yielding while
+// the queue is full. Producer only. Wakes the consumer if it is asleep.
+void spsc_push(SpscQueue* queue, void* item) {
+    unsigned long tail = queue->tail;
+    while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+            queue->capacity) {
+        sched_yield();
+    }
+    queue->slots[tail & (queue->capacity - 1)] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &queue->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL,
+                NULL, 0);
+    }
+}
+
+// Takes a queue as @param and removes its oldest item. Consumer only.
+// Returns the item, else returns NULL if the queue is empty.
+void* spsc_pop(SpscQueue* queue) {
+    unsigned long head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void* item = queue->slots[head & (queue->capacity - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+// Takes a queue as @param and removes its oldest item, spinning briefly,
+// or for spinNanos if set, and then sleeping while there is none. Consumer
+// only. Returns the item.
+void* spsc_pop_wait(SpscQueue* queue) {
+    int spins = 0;
+    long until = 0;
+    while (1) {
+        void* item = spsc_pop(queue);
+        if (item != NULL) {
+            return item;
+        }
+        if (spins++ < SPSC_SPINS || keep_spinning(&until, queue->spinNanos)) {
+            continue;
+        }
+        __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (queue->head == __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST)) {
+            syscall(SYS_futex, &queue->sleeping, FUTEX_WAIT_PRIVATE, 1,
+                    NULL, NULL, 0);
+        }
+        __atomic_store_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST);
+        spins = 0;
+        until = 0;
+    }
+}
+
+// Takes a queue as @param and returns the number of items in it. Safe to
+// call from any thread, the answer may be stale.
+unsigned long spsc_depth(SpscQueue* queue) {
+    return __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,33 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "affinity.h"
+
+#define SPSC_SPINS 100  // polls of an empty queue before the consumer sleeps
+
+// Bounded lock-free queue of pointers with a single producer and a single
+// consumer. Each side owns one index and only reads the other's; the
+// consumer sleeps on a futex once it runs dry and the producer only wakes
+// it when it says it is asleep.
+typedef struct SpscQueue {
+    unsigned long head __attribute__((aligned(64)));  // next to pop
+    unsigned long tail __attribute__((aligned(64)));  // next to push
+    void** slots;
+    unsigned long capacity;                           // power of two
+    unsigned int sleeping;                            // futex word
+    long spinNanos;          // polls this long before sleeping, if set
+} SpscQueue;
+
+void init_spsc_queue(SpscQueue* queue, unsigned long capacity);
+void spsc_push(SpscQueue* queue, void* item);
+void* spsc_pop(SpscQueue* queue);
+void* spsc_pop_wait(SpscQueue* queue);
+unsigned long spsc_depth(SpscQueue* queue);
+
+#endif
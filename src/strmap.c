@@ -0,0 +1,119 @@
+#include "strmap.h"
+
+// Takes a string as @param and returns its 64 bit FNV-1a hash.
+unsigned long str_hash(const char* str) {
+    unsigned long hash = 14695981039346656037UL;
+    while (*str) {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Takes the expected number of keys as @param, allocates an empty map
+// that can hold them without growing and returns it.
+StrMap* strmap_new(size_t capacity) {
+    StrMap* map = malloc(sizeof(StrMap));
+    map->capacity = STRMAP_MIN_CAPACITY;
+    while (map->capacity < capacity * 2) {
+        map->capacity *= 2;
+    }
+    map->slots = calloc(map->capacity, sizeof(StrMapSlot));
+    map->count = 0;
+    map->used = 0;
+    return map;
+}
+
+// Takes a map as @param and deallocates it along with its copies of the
+// keys. Values are left to the caller.
+void strmap_free(StrMap* map) {
+    strmap_clear(map);
+    free(map->slots);
+    free(map);
+}
+
+// Takes a map and a key as @param. Returns the slot holding the key, or
+// the slot the key would be inserted into if it is not in the map.
+StrMapSlot* strmap_find(StrMap* map, const char* key) {
+    size_t mask = map->capacity - 1;
+    size_t idx = str_hash(key) & mask;
+    StrMapSlot* firstDeleted = NULL;
+    while (map->slots[idx].key != NULL || map->slots[idx].deleted) {
+        StrMapSlot* slot = &map->slots[idx];
+        if (slot->deleted) {
+            if (firstDeleted == NULL) {
+                firstDeleted = slot;
+            }
+        } else if (!strcmp(slot->key, key)) {
+            return slot;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return firstDeleted != NULL ? firstDeleted : &map->slots[idx];
+}
+
+// Takes a map as @param and doubles its capacity, dropping deleted slots.
+void strmap_grow(StrMap* map) {
+    StrMapSlot* oldSlots = map->slots;
+    size_t oldCapacity = map->capacity;
+    map->capacity *= 2;
+    map->slots = calloc(map->capacity, sizeof(StrMapSlot));
+    map->used = map->count;
+    for (size_t idx = 0; idx < oldCapacity; idx++) {
+        if (oldSlots[idx].key != NULL) {
+            *strmap_find(map, oldSlots[idx].key) = oldSlots[idx];
+        }
+    }
+    free(oldSlots);
+}
+
+// Takes a map and a key as @param and returns the value stored under the
+// key, else returns NULL.
+void* strmap_get(StrMap* map, const char* key) {
+    StrMapSlot* slot = strmap_find(map, key);
+    return slot->key != NULL ? slot->value : NULL;
+}
+
+// Takes a map, a key and a value as @param and stores the value under the
+// key, replacing any previous value.
+void strmap_put(StrMap* map, const char* key, void* value) {
+    if ((map->used + 1) * 4 > map->capacity * 3) {
+        strmap_grow(map);
+    }
+    StrMapSlot* slot = strmap_find(map, key);
+    if (slot->key == NULL) {
+        if (!slot->deleted) {
+            map->used++;
+        }
+        slot->key = strdup(key);
+        slot->deleted = false;
+        map->count++;
+    }
+    slot->value = value;
+}
+
+// Takes a map and a key as @param. Removes the key and returns the value
+// it had, else returns NULL if the key was not in the map.
+void* strmap_remove(StrMap* map, const char* key) {
+    StrMapSlot* slot = strmap_find(map, key);
+    if (slot->key == NULL) {
+        return NULL;
+    }
+    void* value = slot->value;
+    free(slot->key);
+    slot->key = NULL;
+    slot->value = NULL;
+    slot->deleted = true;
+    map->count--;
+    return value;
+}
+
+// Takes a map as @param and removes every key from it.
+void strmap_clear(StrMap* map) {
+    for (size_t idx = 0; idx < map->capacity; idx++) {
+        free(map->slots[idx].key);
+    }
+    memset(map->slots, 0, sizeof(StrMapSlot) * map->capacity);
+    map->count = 0;
+    map->used = 0;
+}
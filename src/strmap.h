@@ -0,0 +1,37 @@
+#ifndef STRMAP_H
+#define STRMAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define STRMAP_MIN_CAPACITY 16
+
+// One slot of the open addressing table. A slot whose key is NULL is
+// empty, a slot marked deleted keeps probe chains intact after a removal.
+typedef struct StrMapSlot {
+    char* key;
+    void* value;
+    bool deleted;
+} StrMapSlot;
+
+// Hash table from strings to pointers using linear probing. Keys are
+// copied into the table, values are owned by the caller.
+typedef struct StrMap {
+    StrMapSlot* slots;
+    size_t capacity;  // always a power of two
+    size_t count;     // live keys
+    size_t used;      // live keys plus deleted slots
+} StrMap;
+
+unsigned long str_hash(const char* str);
+StrMap* strmap_new(size_t capacity);
+void strmap_free(StrMap* map);
+StrMapSlot* strmap_find(StrMap* map, const char* key);
+void strmap_grow(StrMap* map);
+void* strmap_get(StrMap* map, const char* key);
+void strmap_put(StrMap* map, const char* key, void* value);
+void* strmap_remove(StrMap* map, const char* key);
+void strmap_clear(StrMap* map);
+
+#endif
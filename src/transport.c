@@ -0,0 +1,65 @@
+#include "transport.h"
+
+// Takes the server address as @param and connects to it: a path (anything
+// containing a '/') is a Unix domain socket, else it is a port on
+// localhost. Returns the file descriptor on sucessful connection, else
+// returns -1.
+int open_server_socket(const char* address) {
+    if (strchr(address, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        strcpy(addr.sun_path, address);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    struct addrinfo* addrInfo = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET; // IPv4
+    hints.ai_socktype = SOCK_STREAM;
+    int err;
+    if ((err = getaddrinfo("localhost", address, &hints, &addrInfo))) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
+    if (connect(fd, (struct sockaddr*)addrInfo->ai_addr, sizeof(struct sockaddr))) {
+        close(fd);
+        freeaddrinfo(addrInfo);
+        return -1;
+    }
+    freeaddrinfo(addrInfo);
+    return fd;
+}
+
+// Takes the server address and where to store the read and write ends of
+// the connection as @param. Connects over a socket, or sets up a shared
+// memory channel for an address starting with SHM_ADDRESS_PREFIX; either
+// way the caller gets a pair of streams speaking the same protocol.
+// Returns true on success, else returns false.
+bool open_server_streams(const char* address, FILE** rdEnd, FILE** wrEnd) {
+    if (!strncmp(address, SHM_ADDRESS_PREFIX, strlen(SHM_ADDRESS_PREFIX))) {
+        ShmChannel* ch = shm_channel_connect(address +
+                strlen(SHM_ADDRESS_PREFIX));
+        if (ch == NULL) {
+            return false;
+        }
+        *wrEnd = shm_channel_fopen(ch, "w");
+        *rdEnd = shm_channel_fopen(ch, "r");
+        return true;
+    }
+    int fd = open_server_socket(address);
+    if (fd < 0) {
+        return false;
+    }
+    *wrEnd = fdopen(fd, "w");
+    *rdEnd = fdopen(dup(fd), "r");
+    return true;
+}
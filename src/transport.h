@@ -0,0 +1,23 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "shmring.h"
+
+// A server address is a TCP port on localhost, the path of the server's
+// Unix domain socket, or this prefix and the path of its shared memory
+// socket
+#define SHM_ADDRESS_PREFIX "shm:"
+
+int open_server_socket(const char* address);
+bool open_server_streams(const char* address, FILE** rdEnd, FILE** wrEnd);
+
+#endif
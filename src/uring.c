@@ -0,0 +1,140 @@
+#include "uring.h"
+
+// Takes a ring and the number of submission entries as @param, sets the
+// ring up and maps its queues. Returns false if io_uring is unavailable,
+// e.g. on an old kernel or when it is disabled by policy.
+bool uring_init(Uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ?
+            ring->sqRing : mmap(NULL, ring->cqRingSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+            ring->sqes == MAP_FAILED) {
+        // Unmap whatever did get mapped before giving the ring up
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqesSize);
+        }
+        if (ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        if (ring->sqRing != MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+        }
+        close(ring->fd);
+        ring->fd = -1;
+        return false;
+    }
+    char* sq = ring->sqRing;
+    char* cq = ring->cqRing;
+    ring->sqHead = (unsigned*) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned*) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+}
+
+// Takes a ring and an IORING_OP_ opcode as @param. Returns true if the
+// kernel supports the opcode, asked through IORING_REGISTER_PROBE; kernels
+// too old to answer (before 5.6) are taken to support none.
+bool uring_supports(Uring* ring, unsigned opcode) {
+    size_t size = sizeof(struct io_uring_probe) +
+            URING_PROBE_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    int ret = syscall(__NR_io_uring_register, ring->fd,
+            IORING_REGISTER_PROBE, probe, URING_PROBE_OPS);
+    bool supported = ret >= 0 && opcode <= probe->last_op &&
+            (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+// Takes a ring as @param, unmaps its queues and closes it.
+void uring_free(Uring* ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Takes a ring as @param and returns the next free submission entry,
+// zeroed, else returns NULL if the submission queue is full.
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sqTail + ring->sqPending;
+    if (tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned idx = tail & *ring->sqMask;
+    ring->sqArray[idx] = idx;
+    ring->sqPending += 1;
+    memset(&ring->sqes[idx], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[idx];
+}
+
+// Takes a ring and a number of completions to wait for as @param. Submits
+// the prepared entries and waits, in one system call. Returns the number
+// of entries submitted, else a negative errno.
+int uring_submit(Uring* ring, unsigned waitNr) {
+    unsigned toSubmit = ring->sqPending;
+    __atomic_store_n(ring->sqTail, *ring->sqTail + toSubmit,
+            __ATOMIC_RELEASE);
+    ring->sqPending = 0;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr,
+                waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            toSubmit -= ret;
+        }
+    } while ((ret < 0 && errno == EINTR) || (ret > 0 && toSubmit > 0));
+    return ret < 0 ? -errno : ret;
+}
+
+// Takes a ring as @param and returns the oldest completion, else returns
+// NULL if there is none yet.
+struct io_uring_cqe* uring_peek_cqe(Uring* ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+// Takes a ring as @param and releases the completion returned by the last
+// uring_peek_cqe.
+void uring_cqe_seen(Uring* ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define URING_PROBE_OPS 256      // opcodes asked about by uring_supports
+
+// Minimal io_uring ring, set up with the raw system calls so the server
+// needs no library beyond the kernel headers. A ring is not thread safe;
+// each one belongs to a single thread or is used under a lock.
+typedef struct Uring {
+    int fd;
+    unsigned entries;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqPending;      // SQEs prepared but not yet submitted
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} Uring;
+
+bool uring_init(Uring* ring, unsigned entries);
+bool uring_supports(Uring* ring, unsigned opcode);
+void uring_free(Uring* ring);
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+int uring_submit(Uring* ring, unsigned waitNr);
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);
+void uring_cqe_seen(Uring* ring);
+
+#endif